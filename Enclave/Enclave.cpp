@@ -4,16 +4,22 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <vector>
 
+#include "sgx_tcrypto.h"
 #include "sgx_trts.h"
 #include "sgx_tseal.h"
 
 
 #include "Enclave_t.h"
+#include "../utils/block_cache.hpp"
+#include "../utils/encrypted_block.hpp"
 #include "../utils/filesystem.hpp"
+#include "../utils/journal_record.hpp"
+#include "../utils/lock.hpp"
 
 static FileSystem* FILE_SYSTEM;
 
@@ -25,137 +31,1186 @@ static std::string strip_leading_slash(std::string filename) {
 }
 
 int enclave_is_file(const char* filename) {
-  std::string cleaned_path = FileSystem::clean_path(filename);
-  if (FILE_SYSTEM->is_file(cleaned_path)) {
+  uint64_t inode = FILE_SYSTEM->lookup(filename);
+  if (FILE_SYSTEM->is_file(inode)) {
     return EEXIST;
   }
-  if (FILE_SYSTEM->is_directory(cleaned_path)) {
+  if (FILE_SYSTEM->is_directory(inode)) {
     return -EISDIR;
   }
   return -ENOENT;
 }
 
+static int copy_attributes(int ret, const FileAttributes &attributes, struct enclave_stat_t* stat) {
+  if (ret < 0) {
+    return ret;
+  }
+  stat->generation = attributes.generation;
+  stat->inode = attributes.number;
+  stat->directory = attributes.directory;
+  stat->size = attributes.size;
+  stat->mode = attributes.mode;
+  stat->nlink = attributes.nlink;
+  stat->mtime = attributes.mtime;
+  stat->ctime = attributes.ctime;
+  return 0;
+}
+
+int enclave_stat(const char* pathname, struct enclave_stat_t* stat) {
+  FileAttributes attributes;
+  int ret = FILE_SYSTEM->stat(pathname, &attributes);
+  return copy_attributes(ret, attributes, stat);
+}
+
+int enclave_fstat(uint64_t inode, struct enclave_stat_t* stat) {
+  FileAttributes attributes;
+  int ret = FILE_SYSTEM->stat(inode, &attributes);
+  return copy_attributes(ret, attributes, stat);
+}
+
+int enclave_open(const char* filename, uint64_t* inode) {
+  uint64_t number = FILE_SYSTEM->lookup(filename);
+  if (FILE_SYSTEM->is_directory(number)) {
+    return -EISDIR;
+  }
+  if (!FILE_SYSTEM->is_file(number)) {
+    return -ENOENT;
+  }
+  *inode = number;
+  return 0;
+}
+
+int ramfs_get_inode(uint64_t inode,
+                    int64_t offset,
+                    size_t size,
+                    char* buffer) {
+  return FILE_SYSTEM->read(inode, buffer, offset, size);
+}
+
+int ramfs_put_inode(uint64_t inode,
+                    int64_t offset,
+                    size_t size,
+                    const char *data,
+                    uint64_t time,
+                    uint64_t* generation) {
+  int ret = FILE_SYSTEM->write(inode, data, offset, size, time);
+  *generation = FILE_SYSTEM->get_generation();
+  return ret;
+}
+
+int ramfs_truncate_inode(uint64_t inode, size_t length, uint64_t time, uint64_t* generation) {
+  int ret = FILE_SYSTEM->truncate(inode, length, time);
+  *generation = FILE_SYSTEM->get_generation();
+  return ret;
+}
+
 int ramfs_get(const char* filename,
               int64_t offset,
               size_t size,
               char* buffer) {
-  std::string cleaned_path = FileSystem::clean_path(filename);
-  return FILE_SYSTEM->read(cleaned_path, buffer, offset, size);
+  return FILE_SYSTEM->read(filename, buffer, offset, size);
 }
 
 int ramfs_put(const char *filename,
               int64_t offset,
               size_t size,
-              const char *data) {
-  std::string cleaned_path = FileSystem::clean_path(filename);
-  return FILE_SYSTEM->write(cleaned_path, data, offset, size);
+              const char *data,
+              uint64_t time,
+              uint64_t* generation) {
+  int ret = FILE_SYSTEM->write(filename, data, offset, size, time);
+  *generation = FILE_SYSTEM->get_generation();
+  return ret;
 }
 
 int ramfs_get_size(const char *pathname) {
-  if (!FILE_SYSTEM->is_file(pathname)) {
+  uint64_t inode = FILE_SYSTEM->lookup(pathname);
+  if (!FILE_SYSTEM->is_file(inode)) {
     return -ENOENT;
   }
-  return FILE_SYSTEM->get_file_size(pathname);
+  return FILE_SYSTEM->get_file_size(inode);
 }
 
-int ramfs_trunkate(const char* path, size_t length) {
-  if (!FILE_SYSTEM->is_file(path)) {
-    return -ENOENT;
-  }
-  return FILE_SYSTEM->truncate(path, length);
-}
-
-int ramfs_get_number_of_entries() {
-  return FILE_SYSTEM->get_number_of_entries("/");
+int ramfs_trunkate(const char* path, size_t length, uint64_t time, uint64_t* generation) {
+  int ret = FILE_SYSTEM->truncate(path, length, time);
+  *generation = FILE_SYSTEM->get_generation();
+  return ret;
 }
 
-int enclave_readdir(const char* path, char* entries, size_t length) {
+/**
+ * Copies the entries of a directory that follow after into a buffer, as null-terminated names.
+ * Entries that do not fit are left for the next call, which resumes after the last name copied.
+ * @return The number of names copied, -ENOTDIR or -ENOENT if path is not a directory
+ */
+int enclave_readdir(const char* path,
+                    const char* after,
+                    char* entries,
+                    size_t length,
+                    int* end,
+                    uint64_t* generation) {
   std::string directory = FileSystem::clean_path(path);
+  *end = 1;
+  *generation = FILE_SYSTEM->get_generation();
+  if (FILE_SYSTEM->is_file(directory)) {
+    return -ENOTDIR;
+  }
+  // Every name takes at least two bytes, so no more than length / 2 of them can fit
+  size_t max_entries = length / 2;
   std::vector<std::string> files;
   try {
-    files = FILE_SYSTEM->readdir(directory);
+    files = FILE_SYSTEM->readdir(directory, after, max_entries);
   } catch (const std::exception&) {
     return -ENOENT;
   }
-  size_t i = 0;
-  size_t number_of_entries = 0;
-  for (auto it = files.begin();
-       it != files.end() && i < length;
-       it++, number_of_entries++) {
-    std::string name = (*it);
-    memcpy(entries + i, name.c_str(), name.length());
-    entries[i + name.length()] = 0x1C;
-    i += name.length() + 1;
+  size_t position = 0;
+  int number_of_entries = 0;
+  for (auto it = files.begin(); it != files.end(); it++, number_of_entries++) {
+    if (length - position < it->length() + 1) {
+      if (number_of_entries == 0) {
+        return -ENAMETOOLONG;
+      }
+      *end = 0;
+      return number_of_entries;
+    }
+    memcpy(entries + position, it->c_str(), it->length() + 1);
+    position += it->length() + 1;
   }
+  *end = files.size() < max_entries;
   return number_of_entries;
 }
 
-int ramfs_create_file(const char *path) {
+int ramfs_create_file(const char *path, uint32_t mode, uint64_t time, uint64_t* generation) {
   std::string pathname = FileSystem::clean_path(path);
-  return FILE_SYSTEM->create(pathname);
+  int ret = FILE_SYSTEM->create(pathname, mode, time);
+  *generation = FILE_SYSTEM->get_generation();
+  return ret;
+}
+
+int ramfs_delete_file(const char *pathname, uint64_t time, uint64_t* generation) {
+  int ret = FILE_SYSTEM->unlink(FileSystem::clean_path(pathname), time);
+  *generation = FILE_SYSTEM->get_generation();
+  return ret;
+}
+
+// Key encrypting the blocks of sgx-ramfs, sealed when the volume is created
+static sgx_aes_gcm_128bit_key_t VOLUME_KEY;
+static bool HAS_VOLUME_KEY = false;
+// Whether blocks encrypted before they were bound to their file and index are still accepted
+static bool ACCEPT_UNBOUND = false;
+
+int ramfs_key_init(const uint8_t* sealed_key, size_t sealed_size) {
+  if (HAS_VOLUME_KEY) {
+    return -EBUSY;
+  }
+  if (sealed_size == 0) {
+    if (sgx_read_rand(VOLUME_KEY, sizeof(VOLUME_KEY)) != SGX_SUCCESS) {
+      return -EIO;
+    }
+  } else {
+    const sgx_sealed_data_t* sealed = reinterpret_cast<const sgx_sealed_data_t*>(sealed_key);
+    uint32_t key_size = sizeof(VOLUME_KEY);
+    uint8_t tag[sizeof(BOUND_KEY_TAG)];
+    uint32_t tag_size = sealed_size == SEALED_KEY_SIZE ? sizeof(tag) : 0;
+    if ((sealed_size != SEALED_KEY_SIZE && sealed_size != UNBOUND_SEALED_KEY_SIZE) ||
+        sgx_get_encrypt_txt_len(sealed) != key_size || sgx_get_add_mac_txt_len(sealed) != tag_size) {
+      return -EINVAL;
+    }
+    if (sgx_unseal_data(sealed, tag_size > 0 ? tag : NULL, tag_size > 0 ? &tag_size : NULL,
+                        VOLUME_KEY, &key_size) != SGX_SUCCESS) {
+      return -EIO;
+    }
+    if (tag_size > 0 && memcmp(tag, BOUND_KEY_TAG, sizeof(tag)) != 0) {
+      return -EINVAL;
+    }
+    ACCEPT_UNBOUND = tag_size == 0;
+  }
+  HAS_VOLUME_KEY = true;
+  return ACCEPT_UNBOUND ? 0 : 1;
+}
+
+int ramfs_key_seal(uint8_t* sealed_key, size_t sealed_size) {
+  if (!HAS_VOLUME_KEY || sealed_size != sgx_calc_sealed_data_size(sizeof(BOUND_KEY_TAG), sizeof(VOLUME_KEY))) {
+    return -EINVAL;
+  }
+  sgx_status_t status = sgx_seal_data(sizeof(BOUND_KEY_TAG), BOUND_KEY_TAG, sizeof(VOLUME_KEY), VOLUME_KEY,
+                                      sealed_size, reinterpret_cast<sgx_sealed_data_t*>(sealed_key));
+  if (status != SGX_SUCCESS) {
+    return -EIO;
+  }
+  // The key is only sealed with its tag once every block is bound
+  ACCEPT_UNBOUND = false;
+  return 0;
+}
+
+/**
+ * Additional authenticated data of the blocks of a file, the index of a block followed by the name of the
+ * file, so that blocks cannot be moved within a file or to another file
+ */
+class BlockTag {
+  public:
+    explicit BlockTag(const char* filename): data(sizeof(uint64_t) + strlen(filename)) {
+      memcpy(data.data() + sizeof(uint64_t), filename, data.size() - sizeof(uint64_t));
+    }
+
+    const uint8_t* get(uint64_t index) {
+      memcpy(data.data(), &index, sizeof(index));
+      return data.data();
+    }
+
+    uint32_t size() const {
+      return data.size();
+    }
+
+  private:
+    std::vector<uint8_t> data;
+};
+
+/**
+ * Encrypts a block of a file with the volume key under a random IV
+ */
+static sgx_status_t encrypt_block(BlockTag &tag, uint64_t index, const uint8_t* plaintext, uint32_t length,
+                                  encrypted_block_t* block) {
+  if (!HAS_VOLUME_KEY) {
+    return SGX_ERROR_INVALID_STATE;
+  }
+  block->payload_size = length;
+  sgx_status_t status = sgx_read_rand(block->iv, sizeof(block->iv));
+  if (status != SGX_SUCCESS) {
+    return status;
+  }
+  return sgx_rijndael128GCM_encrypt(&VOLUME_KEY, plaintext, length, block->payload,
+                                    block->iv, sizeof(block->iv), tag.get(index), tag.size(), &block->mac);
 }
 
-int ramfs_delete_file(const char *pathname) {
-  return FILE_SYSTEM->unlink(FileSystem::clean_path(pathname));
+/**
+ * Decrypts a block encrypted with encrypt_block, plaintext must hold payload_size bytes
+ */
+static sgx_status_t decrypt_block(BlockTag &tag, uint64_t index, const encrypted_block_t* block,
+                                  uint8_t* plaintext) {
+  if (!HAS_VOLUME_KEY) {
+    return SGX_ERROR_INVALID_STATE;
+  }
+  sgx_status_t status = sgx_rijndael128GCM_decrypt(&VOLUME_KEY, block->payload, block->payload_size, plaintext,
+                                                   block->iv, sizeof(block->iv), tag.get(index), tag.size(),
+                                                   &block->mac);
+  if (status == SGX_ERROR_MAC_MISMATCH && ACCEPT_UNBOUND) {
+    status = sgx_rijndael128GCM_decrypt(&VOLUME_KEY, block->payload, block->payload_size, plaintext,
+                                        block->iv, sizeof(block->iv), NULL, 0, &block->mac);
+  }
+  return status;
 }
 
 sgx_status_t ramfs_encrypt(const char* filename,
+                  uint64_t index,
                   uint8_t* plaintext,
                   size_t size,
-                  sgx_sealed_data_t* encrypted,
-                  size_t sealed_size) {
-  sgx_status_t status = sgx_seal_data(0, NULL, size, plaintext, sealed_size, encrypted);
-  return status;
+                  uint8_t* encrypted,
+                  size_t encrypted_size) {
+  if (encrypted_size != sizeof(encrypted_block_t) + size) {
+    return SGX_ERROR_INVALID_PARAMETER;
+  }
+  BlockTag tag(filename);
+  return encrypt_block(tag, index, plaintext, size, reinterpret_cast<encrypted_block_t*>(encrypted));
 }
 
 sgx_status_t ramfs_decrypt(const char* filename,
-                  sgx_sealed_data_t* encrypted,
-                  size_t sealed_size,
+                  uint64_t index,
+                  const uint8_t* encrypted,
+                  size_t encrypted_size,
                   uint8_t* plaintext,
                   size_t size) {
-  uint32_t data_size = size;
-  sgx_status_t status = sgx_unseal_data(encrypted, NULL, NULL, reinterpret_cast<uint8_t*>(plaintext), &data_size);
+  const encrypted_block_t* block = reinterpret_cast<const encrypted_block_t*>(encrypted);
+  if (encrypted_size < sizeof(encrypted_block_t) ||
+      encrypted_size != sizeof(encrypted_block_t) + block->payload_size || block->payload_size > size) {
+    return SGX_ERROR_INVALID_PARAMETER;
+  }
+  BlockTag tag(filename);
+  return decrypt_block(tag, index, block, plaintext);
+}
+
+/**
+ * Converts blocks sealed with sgx_seal_data, as dumped before blocks were encrypted with the volume key,
+ * into encrypted blocks of the same payload
+ */
+sgx_status_t ramfs_import_sealed_blocks(const char* filename,
+                                       const uint8_t* sealed_blocks,
+                                       size_t sealed_size,
+                                       const size_t* sizes,
+                                       size_t count,
+                                       uint8_t* encrypted_blocks,
+                                       size_t encrypted_size) {
+  size_t position = 0;
+  size_t encrypted_position = 0;
+  std::vector<uint8_t> plaintext;
+  BlockTag tag(filename);
+  for (size_t i = 0; i < count; i++) {
+    if (sizes[i] < sizeof(sgx_sealed_data_t) || sealed_size - position < sizes[i]) {
+      return SGX_ERROR_INVALID_PARAMETER;
+    }
+    const sgx_sealed_data_t* block = reinterpret_cast<const sgx_sealed_data_t*>(sealed_blocks + position);
+    uint32_t payload = sgx_get_encrypt_txt_len(block);
+    if (sgx_calc_sealed_data_size(0, payload) != sizes[i] ||
+        encrypted_size - encrypted_position < sizeof(encrypted_block_t) + payload) {
+      return SGX_ERROR_INVALID_PARAMETER;
+    }
+    plaintext.resize(payload);
+    sgx_status_t status = sgx_unseal_data(block, NULL, NULL, plaintext.data(), &payload);
+    if (status == SGX_SUCCESS) {
+      status = encrypt_block(tag, i, plaintext.data(), payload,
+                             reinterpret_cast<encrypted_block_t*>(encrypted_blocks + encrypted_position));
+    }
+    if (status != SGX_SUCCESS) {
+      return status;
+    }
+    position += sizes[i];
+    encrypted_position += sizeof(encrypted_block_t) + payload;
+  }
+  if (position != sealed_size || encrypted_position != encrypted_size) {
+    return SGX_ERROR_INVALID_PARAMETER;
+  }
+  return SGX_SUCCESS;
+}
+
+
+/**
+ * Checks that a buffer of concatenated encrypted blocks is consistent with the sizes given by the caller.
+ * @param blocks Buffer holding the encrypted blocks one after the other
+ * @param length Size of the buffer in bytes
+ * @param sizes Size of every encrypted block in the buffer
+ * @param count Number of encrypted blocks
+ * @param payload Set to the total size of the plaintext held by the encrypted blocks
+ * @return SGX_SUCCESS if the buffer is consistent, SGX_ERROR_INVALID_PARAMETER otherwise
+ */
+static sgx_status_t check_sealed_blocks(const uint8_t* blocks,
+                                        size_t length,
+                                        const size_t* sizes,
+                                        size_t count,
+                                        size_t* payload) {
+  size_t position = 0;
+  *payload = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (sizes[i] < sizeof(encrypted_block_t) || length - position < sizes[i]) {
+      return SGX_ERROR_INVALID_PARAMETER;
+    }
+    const encrypted_block_t* block = reinterpret_cast<const encrypted_block_t*>(blocks + position);
+    uint32_t block_payload = block->payload_size;
+    if (sizeof(encrypted_block_t) + block_payload != sizes[i]) {
+      return SGX_ERROR_INVALID_PARAMETER;
+    }
+    *payload += block_payload;
+    position += sizes[i];
+  }
+  if (position != length) {
+    return SGX_ERROR_INVALID_PARAMETER;
+  }
+  return SGX_SUCCESS;
+}
+
+sgx_status_t ramfs_seal_blocks(const char* filename,
+                               uint64_t first,
+                               const uint8_t* current_blocks,
+                               size_t current_size,
+                               const size_t* current_sizes,
+                               size_t count,
+                               size_t offset,
+                               const uint8_t* data,
+                               size_t size,
+                               size_t block_size,
+                               uint8_t* sealed_blocks,
+                               size_t sealed_size) {
+  // Payload sizes are stored on 32 bits
+  if (block_size == 0 || block_size > UINT32_MAX || offset + size < offset) {
+    return SGX_ERROR_INVALID_PARAMETER;
+  }
+  size_t current_payload;
+  sgx_status_t status = check_sealed_blocks(current_blocks, current_size, current_sizes, count, &current_payload);
+  if (status != SGX_SUCCESS) {
+    return status;
+  }
+  // The data overwrites the current blocks or directly follows them, holes are passed as zeros
+  if (offset > current_payload) {
+    return SGX_ERROR_INVALID_PARAMETER;
+  }
+  size_t length = std::max(current_payload, offset + size);
+  size_t number_of_blocks = (length + block_size - 1) / block_size;
+  size_t required_size = number_of_blocks * (sizeof(encrypted_block_t) + block_size);
+  if (length % block_size != 0) {
+    required_size -= block_size - length % block_size;
+  }
+  if (required_size != sealed_size) {
+    return SGX_ERROR_INVALID_PARAMETER;
+  }
+  uint8_t* plaintext = new uint8_t[length]();
+  BlockTag tag(filename);
+  size_t position = 0;
+  size_t plaintext_position = 0;
+  for (size_t i = 0; i < count; i++) {
+    const encrypted_block_t* block = reinterpret_cast<const encrypted_block_t*>(current_blocks + position);
+    uint32_t block_payload = block->payload_size;
+    // Blocks entirely overwritten by the new data do not need to be decrypted
+    bool overwritten = offset <= plaintext_position &&
+                       plaintext_position + block_payload <= offset + size;
+    if (!overwritten) {
+      status = decrypt_block(tag, first + i, block, plaintext + plaintext_position);
+      if (status != SGX_SUCCESS) {
+        delete [] plaintext;
+        return status;
+      }
+    }
+    position += current_sizes[i];
+    plaintext_position += block_payload;
+  }
+  memcpy(plaintext + offset, data, size);
+  position = 0;
+  for (size_t start = 0; start < length; start += block_size) {
+    uint32_t payload = std::min(block_size, length - start);
+    status = encrypt_block(tag, first + start / block_size, plaintext + start, payload,
+                           reinterpret_cast<encrypted_block_t*>(sealed_blocks + position));
+    if (status != SGX_SUCCESS) {
+      break;
+    }
+    position += sizeof(encrypted_block_t) + payload;
+  }
+  delete [] plaintext;
   return status;
 }
 
+sgx_status_t ramfs_unseal_blocks(const char* filename,
+                                 uint64_t first,
+                                 const uint8_t* sealed_blocks,
+                                 size_t sealed_size,
+                                 const size_t* sizes,
+                                 size_t count,
+                                 uint8_t* plaintext,
+                                 size_t size) {
+  size_t payload;
+  sgx_status_t status = check_sealed_blocks(sealed_blocks, sealed_size, sizes, count, &payload);
+  if (status != SGX_SUCCESS) {
+    return status;
+  }
+  if (payload > size) {
+    return SGX_ERROR_INVALID_PARAMETER;
+  }
+  BlockTag tag(filename);
+  size_t position = 0;
+  size_t plaintext_position = 0;
+  for (size_t i = 0; i < count; i++) {
+    const encrypted_block_t* block = reinterpret_cast<const encrypted_block_t*>(sealed_blocks + position);
+    uint32_t block_payload = block->payload_size;
+    status = decrypt_block(tag, first + i, block, plaintext + plaintext_position);
+    if (status != SGX_SUCCESS) {
+      return status;
+    }
+    position += sizes[i];
+    plaintext_position += block_payload;
+  }
+  return SGX_SUCCESS;
+}
 
-int sgxfs_dump(const char* pathname,
-               sgx_sealed_data_t* sealed_data,
-               size_t sealed_size) {
-  std::string path = FileSystem::clean_path(pathname);
-  if (!FILE_SYSTEM->is_file(path)) {
+/**
+ * Largest block cache accepted by ramfs_cache_init, half of the HeapMaxSize of Enclave.config.xml so that
+ * the file system and the buffers of the edge routines keep room in the enclave heap
+ */
+static const size_t MAX_CACHE_SIZE = 0x8000000 / 2;
+static BlockCache* BLOCK_CACHE = NULL;
+
+int ramfs_cache_init(size_t cache_size, size_t block_size) {
+  if (block_size == 0 || cache_size > MAX_CACHE_SIZE) {
+    return -EINVAL;
+  }
+  if (BLOCK_CACHE != NULL) {
+    return -EBUSY;
+  }
+  BLOCK_CACHE = new BlockCache(cache_size / block_size, block_size);
+  return 0;
+}
+
+/**
+ * Decrypts a single block checked with check_sealed_blocks
+ * @return The size of the plaintext, -EIO if the block could not be decrypted
+ */
+static int unseal_block(BlockTag &tag, uint64_t index, const uint8_t* sealed, uint8_t* plaintext) {
+  const encrypted_block_t* block = reinterpret_cast<const encrypted_block_t*>(sealed);
+  if (decrypt_block(tag, index, block, plaintext) != SGX_SUCCESS) {
+    return -EIO;
+  }
+  return block->payload_size;
+}
+
+/**
+ * Reads a range of blocks of a file, from the cache when they are cached and from their sealed copy
+ * otherwise. Unsealed blocks are added to the cache.
+ * @param sealed_blocks Sealed copies of the first count blocks of the range, the following blocks must be
+ *                      cached
+ * @param plaintext Receives the blocks, each one at a multiple of the block size
+ * @return The size of the data read, -EINVAL or -EIO on failure
+ */
+static int read_blocks(uint64_t file,
+                       const char* filename,
+                       uint64_t first,
+                       size_t number_of_blocks,
+                       size_t block_size,
+                       const uint8_t* sealed_blocks,
+                       size_t sealed_size,
+                       const size_t* sizes,
+                       size_t count,
+                       uint8_t* plaintext) {
+  size_t payload;
+  if (BLOCK_CACHE == NULL || block_size != BLOCK_CACHE->get_block_size() || number_of_blocks == 0 ||
+      count > number_of_blocks ||
+      check_sealed_blocks(sealed_blocks, sealed_size, sizes, count, &payload) != SGX_SUCCESS) {
+    return -EINVAL;
+  }
+  std::vector<size_t> lengths(number_of_blocks);
+  std::vector<bool> cached(number_of_blocks);
+  {
+    ScopedLock lock(BLOCK_CACHE->get_lock());
+    for (size_t i = 0; i < number_of_blocks; i++) {
+      CachedBlock* block = BLOCK_CACHE->find(file, first + i);
+      if (block != NULL) {
+        memcpy(plaintext + i * block_size, block->data, block->length);
+        lengths[i] = block->length;
+        cached[i] = true;
+      }
+    }
+  }
+  BlockTag tag(filename);
+  size_t position = 0;
+  for (size_t i = 0; i < number_of_blocks; i++) {
+    if (!cached[i]) {
+      if (i >= count ||
+          reinterpret_cast<const encrypted_block_t*>(sealed_blocks + position)->payload_size > block_size) {
+        return -EIO;
+      }
+      int length = unseal_block(tag, first + i, sealed_blocks + position, plaintext + i * block_size);
+      if (length < 0) {
+        return length;
+      }
+      lengths[i] = length;
+    }
+    if (i + 1 < number_of_blocks && lengths[i] != block_size) {
+      return -EIO;
+    }
+    position += i < count ? sizes[i] : 0;
+  }
+  ScopedLock lock(BLOCK_CACHE->get_lock());
+  for (size_t i = 0; i < number_of_blocks; i++) {
+    // Another reader may have cached the block in the meantime
+    if (cached[i] || BLOCK_CACHE->find(file, first + i) != NULL) {
+      continue;
+    }
+    CachedBlock* block = BLOCK_CACHE->insert(file, first + i);
+    if (block == NULL) {
+      break;
+    }
+    memcpy(block->data, plaintext + i * block_size, lengths[i]);
+    block->length = lengths[i];
+  }
+  return (number_of_blocks - 1) * block_size + lengths[number_of_blocks - 1];
+}
+
+int ramfs_cache_read(uint64_t file,
+                     const char* filename,
+                     uint64_t first,
+                     size_t number_of_blocks,
+                     size_t block_size,
+                     const uint8_t* sealed_blocks,
+                     size_t sealed_size,
+                     const size_t* sizes,
+                     size_t count,
+                     uint8_t* plaintext,
+                     size_t size) {
+  if (block_size == 0 || number_of_blocks > size / block_size) {
+    return -EINVAL;
+  }
+  return read_blocks(file, filename, first, number_of_blocks, block_size, sealed_blocks, sealed_size, sizes, count,
+                     plaintext);
+}
+
+/**
+ * Unseals a range of blocks of a file into the cache ahead of the reads that need them
+ * @return 0 on success, -EINVAL or -EIO on failure
+ */
+int ramfs_cache_prefetch(uint64_t file,
+                         const char* filename,
+                         uint64_t first,
+                         size_t number_of_blocks,
+                         size_t block_size,
+                         const uint8_t* sealed_blocks,
+                         size_t sealed_size,
+                         const size_t* sizes,
+                         size_t count) {
+  if (BLOCK_CACHE == NULL || block_size != BLOCK_CACHE->get_block_size() ||
+      number_of_blocks > BLOCK_CACHE->get_capacity()) {
+    return -EINVAL;
+  }
+  std::vector<uint8_t> plaintext(number_of_blocks * block_size);
+  int ret = read_blocks(file, filename, first, number_of_blocks, block_size, sealed_blocks, sealed_size, sizes,
+                        count, plaintext.data());
+  return ret < 0 ? ret : 0;
+}
+
+/**
+ * Writes data to a range of blocks of a file in the cache, where the blocks stay dirty until they are
+ * flushed. Every block of the range but the last one ends up full, padded with zeros if needed.
+ * @param sealed_blocks Sealed copies of the blocks given by indices, which are only partially overwritten
+ *                      and must be loaded unless they are already cached
+ * @param offset Offset of the data from the start of the first block
+ * @return 0 on success, -ENOSPC if the cache is too full of dirty blocks, -EINVAL or -EIO on failure
+ */
+int ramfs_cache_write(uint64_t file,
+                      const char* filename,
+                      uint64_t first,
+                      size_t number_of_blocks,
+                      size_t block_size,
+                      const uint8_t* sealed_blocks,
+                      size_t sealed_size,
+                      const size_t* sizes,
+                      const uint64_t* indices,
+                      size_t count,
+                      size_t offset,
+                      const uint8_t* data,
+                      size_t size) {
+  size_t payload;
+  if (BLOCK_CACHE == NULL || block_size != BLOCK_CACHE->get_block_size() || size == 0 ||
+      offset + size < offset || (offset + size + block_size - 1) / block_size != number_of_blocks ||
+      check_sealed_blocks(sealed_blocks, sealed_size, sizes, count, &payload) != SGX_SUCCESS) {
+    return -EINVAL;
+  }
+  // Partially overwritten blocks are unsealed before taking the lock of the cache
+  std::vector<std::vector<uint8_t>> loaded(count, std::vector<uint8_t>(block_size));
+  BlockTag tag(filename);
+  size_t position = 0;
+  for (size_t i = 0; i < count; i++) {
+    const encrypted_block_t* block = reinterpret_cast<const encrypted_block_t*>(sealed_blocks + position);
+    if (indices[i] < first || indices[i] - first >= number_of_blocks || block->payload_size > block_size) {
+      return -EINVAL;
+    }
+    int length = unseal_block(tag, indices[i], sealed_blocks + position, loaded[i].data());
+    if (length < 0) {
+      return length;
+    }
+    loaded[i].resize(length);
+    position += sizes[i];
+  }
+  ScopedLock lock(BLOCK_CACHE->get_lock());
+  // Blocks already cached are marked dirty first so that making room for the others does not evict them
+  std::vector<CachedBlock*> cleaned;
+  size_t missing = 0;
+  for (size_t i = 0; i < number_of_blocks; i++) {
+    CachedBlock* block = BLOCK_CACHE->find(file, first + i);
+    if (block == NULL) {
+      missing++;
+    } else if (!block->dirty) {
+      BLOCK_CACHE->set_dirty(block, true);
+      cleaned.push_back(block);
+    }
+  }
+  if (!BLOCK_CACHE->reserve(missing)) {
+    for (auto it = cleaned.begin(); it != cleaned.end(); it++) {
+      BLOCK_CACHE->set_dirty(*it, false);
+    }
+    return -ENOSPC;
+  }
+  for (size_t i = 0; i < number_of_blocks; i++) {
+    size_t start = i * block_size;
+    CachedBlock* block = BLOCK_CACHE->find(file, first + i);
+    if (block == NULL) {
+      block = BLOCK_CACHE->insert(file, first + i);
+      for (size_t j = 0; j < count; j++) {
+        if (indices[j] == first + i) {
+          memcpy(block->data, loaded[j].data(), loaded[j].size());
+          block->length = loaded[j].size();
+        }
+      }
+      BLOCK_CACHE->set_dirty(block, true);
+    }
+    size_t write_start = std::max(offset, start);
+    size_t write_end = std::min(offset + size, start + block_size);
+    if (write_start < write_end) {
+      memcpy(block->data + write_start - start, data + write_start - offset, write_end - write_start);
+    }
+    if (i + 1 < number_of_blocks) {
+      block->length = block_size;
+    } else {
+      block->length = std::max(block->length, write_end - start);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Seals dirty blocks of a file, which stay dirty until ramfs_cache_clean is called for them
+ * @param indices Indices of the blocks to seal, their sealed copies are stored in that order
+ * @return 0 on success, -ENOENT if a block is not dirty, -EINVAL or -EIO on failure
+ */
+int ramfs_cache_flush(uint64_t file,
+                      const char* filename,
+                      const uint64_t* indices,
+                      size_t count,
+                      uint8_t* sealed_blocks,
+                      size_t sealed_size) {
+  if (BLOCK_CACHE == NULL) {
+    return -EINVAL;
+  }
+  std::vector<CachedBlock*> blocks;
+  size_t required_size = 0;
+  {
+    ScopedLock lock(BLOCK_CACHE->get_lock());
+    for (size_t i = 0; i < count; i++) {
+      CachedBlock* block = BLOCK_CACHE->find(file, indices[i]);
+      if (block == NULL || !block->dirty) {
+        return -ENOENT;
+      }
+      blocks.push_back(block);
+      required_size += sizeof(encrypted_block_t) + block->length;
+    }
+  }
+  if (required_size != sealed_size) {
+    return -EINVAL;
+  }
+  // Dirty blocks are never evicted, and the caller holds the write lock of the file, so the blocks can be
+  // sealed without the lock of the cache
+  BlockTag tag(filename);
+  size_t position = 0;
+  for (size_t i = 0; i < count; i++) {
+    sgx_status_t status = encrypt_block(tag, indices[i], reinterpret_cast<uint8_t*>(blocks[i]->data),
+                                        blocks[i]->length,
+                                        reinterpret_cast<encrypted_block_t*>(sealed_blocks + position));
+    if (status != SGX_SUCCESS) {
+      return -EIO;
+    }
+    position += sizeof(encrypted_block_t) + blocks[i]->length;
+  }
+  return 0;
+}
+
+/**
+ * Marks blocks of a file as clean once their sealed copies are stored
+ * @param evict Also drops every block of the file from the cache
+ * @return 0 on success, -EINVAL if the cache is not initialized
+ */
+int ramfs_cache_clean(uint64_t file, const uint64_t* indices, size_t count, int evict) {
+  if (BLOCK_CACHE == NULL) {
+    return -EINVAL;
+  }
+  ScopedLock lock(BLOCK_CACHE->get_lock());
+  for (size_t i = 0; i < count; i++) {
+    CachedBlock* block = BLOCK_CACHE->find(file, indices[i]);
+    if (block != NULL) {
+      BLOCK_CACHE->set_dirty(block, false);
+    }
+  }
+  if (evict) {
+    BLOCK_CACHE->remove(file);
+  }
+  return 0;
+}
+
+int ramfs_cache_discard(uint64_t file) {
+  if (BLOCK_CACHE == NULL) {
+    return -EINVAL;
+  }
+  ScopedLock lock(BLOCK_CACHE->get_lock());
+  BLOCK_CACHE->remove(file);
+  return 0;
+}
+
+
+// Files are dumped as a sealed manifest followed by sealed chunks of SGXFS_CHUNK_SIZE bytes, so that dumping
+// or restoring a file takes the same enclave memory whatever its size. Chunks leave the enclave through the
+// untrusted stack, which bounds their size.
+static const size_t SGXFS_CHUNK_SIZE = 256 << 10;
+static const size_t MAX_SGXFS_CHUNK_SIZE = 1 << 20;
+
+/**
+ * Additional MAC text of a manifest, which tells it apart from a file sealed whole before chunks
+ */
+static const uint8_t SGXFS_MANIFEST_TAG[8] = {'S', 'G', 'X', 'F', 'S', 'M', 'F', '1'};
+
+struct sgxfs_manifest_t {
+  // Random identifier of the dump, which the chunks are bound to
+  uint8_t dump[16];
+  uint64_t size;
+  uint64_t chunk_size;
+};
+
+/**
+ * Additional MAC text of a chunk, so that chunks cannot be dropped, reordered or moved to another dump
+ */
+struct sgxfs_chunk_tag_t {
+  uint8_t dump[16];
+  uint64_t index;
+};
+
+static int append_to_pack(void* append, const uint8_t* data, size_t size) {
+  int ret;
+  sgx_status_t status = ocall_pack_append(&ret, append, data, size);
+  return status != SGX_SUCCESS ? -EIO : ret;
+}
+
+/**
+ * Seals a file chunk by chunk and appends it to the pack being written
+ * @param append Untrusted PackAppend of the file
+ * @return 0 on success, -ENOENT if there is no file at pathname, -EIO if the file could not be sealed or
+ *         written
+ */
+int sgxfs_dump(const char* pathname, void* append) {
+  uint64_t inode = FILE_SYSTEM->lookup(FileSystem::clean_path(pathname));
+  if (!FILE_SYSTEM->is_file(inode)) {
     return -ENOENT;
   }
-  size_t data_size = FILE_SYSTEM->get_file_size(path);
-  uint8_t* buffer = new uint8_t[data_size];
-  FILE_SYSTEM->read(pathname, reinterpret_cast<char*>(buffer), 0, data_size);
-  sealed_size = sizeof(sgx_sealed_data_t) + data_size;
-  sgx_status_t ret = sgx_seal_data(0, NULL, data_size, buffer, sealed_size, sealed_data);
-  delete [] buffer;
-  return ret;
+  sgxfs_manifest_t manifest;
+  if (sgx_read_rand(manifest.dump, sizeof(manifest.dump)) != SGX_SUCCESS) {
+    return -EIO;
+  }
+  manifest.size = FILE_SYSTEM->get_file_size(inode);
+  manifest.chunk_size = SGXFS_CHUNK_SIZE;
+  std::vector<uint8_t> sealed(sgx_calc_sealed_data_size(sizeof(sgxfs_chunk_tag_t), SGXFS_CHUNK_SIZE));
+  uint32_t sealed_size = sgx_calc_sealed_data_size(sizeof(SGXFS_MANIFEST_TAG), sizeof(manifest));
+  if (sgx_seal_data(sizeof(SGXFS_MANIFEST_TAG), SGXFS_MANIFEST_TAG,
+                    sizeof(manifest), reinterpret_cast<const uint8_t*>(&manifest),
+                    sealed_size, reinterpret_cast<sgx_sealed_data_t*>(sealed.data())) != SGX_SUCCESS ||
+      append_to_pack(append, sealed.data(), sealed_size) < 0) {
+    return -EIO;
+  }
+  std::vector<char> chunk(SGXFS_CHUNK_SIZE);
+  sgxfs_chunk_tag_t tag;
+  memcpy(tag.dump, manifest.dump, sizeof(tag.dump));
+  tag.index = 0;
+  for (uint64_t offset = 0; offset < manifest.size; offset += SGXFS_CHUNK_SIZE, tag.index++) {
+    size_t length = std::min((uint64_t) SGXFS_CHUNK_SIZE, manifest.size - offset);
+    if (FILE_SYSTEM->read(inode, chunk.data(), offset, length) != (int) length) {
+      return -EIO;
+    }
+    sealed_size = sgx_calc_sealed_data_size(sizeof(tag), length);
+    if (sgx_seal_data(sizeof(tag), reinterpret_cast<const uint8_t*>(&tag),
+                      length, reinterpret_cast<const uint8_t*>(chunk.data()),
+                      sealed_size, reinterpret_cast<sgx_sealed_data_t*>(sealed.data())) != SGX_SUCCESS ||
+        append_to_pack(append, sealed.data(), sealed_size) < 0) {
+      return -EIO;
+    }
+  }
+  return 0;
 }
 
-int sgxfs_restore(const char* pathname,
-                  const sgx_sealed_data_t* sealed_data,
-                  size_t sealed_size) {
+/**
+ * Copies the sealed blob content starts with into the enclave
+ * @param expected_size Size the blob must have, 0 for any size
+ * @return The size of the blob, 0 if content does not start with a complete blob of the expected size
+ */
+static size_t copy_sealed(const uint8_t* content, size_t size, size_t expected_size, std::vector<uint8_t>* sealed) {
+  sgx_sealed_data_t header;
+  if (size < sizeof(header)) {
+    return 0;
+  }
+  memcpy(&header, content, sizeof(header));
+  size_t sealed_size = sizeof(header) + header.aes_data.payload_size;
+  if (sealed_size > size || (expected_size > 0 && sealed_size != expected_size)) {
+    return 0;
+  }
+  sealed->assign(content, content + sealed_size);
+  // The header is checked again on the copy, the untrusted one may have changed meanwhile
+  memcpy(&header, sealed->data(), sizeof(header));
+  return sizeof(header) + header.aes_data.payload_size == sealed_size ? sealed_size : 0;
+}
+
+/**
+ * Unseals the chunks following a manifest into a file
+ * @return 0 on success, -EINVAL if the chunks do not match the manifest, -EIO if the file could not be written
+ */
+static int restore_chunks(const std::string &path,
+                          const std::vector<uint8_t> &sealed_manifest,
+                          const uint8_t* content,
+                          size_t size,
+                          uint64_t time) {
+  uint8_t manifest_tag[sizeof(SGXFS_MANIFEST_TAG)];
+  uint32_t tag_size = sizeof(manifest_tag);
+  sgxfs_manifest_t manifest;
+  uint32_t manifest_size = sizeof(manifest);
+  if (sgx_unseal_data(reinterpret_cast<const sgx_sealed_data_t*>(sealed_manifest.data()),
+                      manifest_tag, &tag_size,
+                      reinterpret_cast<uint8_t*>(&manifest), &manifest_size) != SGX_SUCCESS ||
+      tag_size != sizeof(manifest_tag) || memcmp(manifest_tag, SGXFS_MANIFEST_TAG, tag_size) != 0 ||
+      manifest_size != sizeof(manifest) || manifest.chunk_size == 0 || manifest.chunk_size > MAX_SGXFS_CHUNK_SIZE) {
+    return -EINVAL;
+  }
+  std::vector<uint8_t> sealed;
+  std::vector<char> chunk(manifest.chunk_size);
+  size_t position = 0;
+  uint64_t index = 0;
+  for (uint64_t offset = 0; offset < manifest.size; offset += manifest.chunk_size, index++) {
+    uint32_t length = std::min(manifest.chunk_size, manifest.size - offset);
+    size_t sealed_size = copy_sealed(content + position, size - position,
+                                     sgx_calc_sealed_data_size(sizeof(sgxfs_chunk_tag_t), length), &sealed);
+    if (sealed_size == 0) {
+      return -EINVAL;
+    }
+    position += sealed_size;
+    sgxfs_chunk_tag_t tag;
+    tag_size = sizeof(tag);
+    if (sgx_unseal_data(reinterpret_cast<const sgx_sealed_data_t*>(sealed.data()),
+                        reinterpret_cast<uint8_t*>(&tag), &tag_size,
+                        reinterpret_cast<uint8_t*>(chunk.data()), &length) != SGX_SUCCESS ||
+        tag_size != sizeof(tag) || memcmp(tag.dump, manifest.dump, sizeof(tag.dump)) != 0 || tag.index != index) {
+      return -EINVAL;
+    }
+    if (FILE_SYSTEM->write(path, chunk.data(), offset, length, time) < 0) {
+      return -EIO;
+    }
+  }
+  return position == size ? 0 : -EINVAL;
+}
+
+/**
+ * Restores a file from its dump, read from untrusted memory one sealed chunk at a time. Dumps from before
+ * chunks hold the file sealed whole.
+ * @return 0 on success, -EEXIST if the file exists, -EINVAL if the dump is not valid, -EIO if the file
+ *         could not be written
+ */
+int sgxfs_restore(const char* pathname, const uint8_t* content, size_t size, uint64_t time) {
   std::string path = FileSystem::clean_path(pathname);
-  if (!FILE_SYSTEM->is_file(path)) {
+  if (content == NULL || !sgx_is_outside_enclave(content, size)) {
+    return -EINVAL;
+  }
+  if (FILE_SYSTEM->exists(path)) {
+    return -EEXIST;
+  }
+  std::vector<uint8_t> sealed;
+  size_t sealed_size = copy_sealed(content, size, 0, &sealed);
+  if (sealed_size == 0) {
+    return -EINVAL;
+  }
+  // Dumps only hold files, the directories leading to them are created along with them
+  std::vector<std::string>* tokens = FileSystem::split_path(path);
+  std::string directory;
+  for (size_t i = 0; i + 1 < tokens->size(); i++) {
+    directory += tokens->at(i) + "/";
+    FILE_SYSTEM->mkdir(directory, FileSystem::DEFAULT_MODE, time);
+  }
+  delete tokens;
+  FILE_SYSTEM->create(path, FileSystem::DEFAULT_MODE, time);
+  const sgx_sealed_data_t* header = reinterpret_cast<const sgx_sealed_data_t*>(sealed.data());
+  int ret;
+  if (sgx_get_add_mac_txt_len(header) > 0) {
+    ret = restore_chunks(path, sealed, content + sealed_size, size - sealed_size, time);
+  } else {
+    uint32_t data_size = sgx_get_encrypt_txt_len(header);
+    std::vector<char> plaintext(data_size);
+    ret = sealed_size != size ||
+          sgx_unseal_data(header, NULL, NULL, reinterpret_cast<uint8_t*>(plaintext.data()), &data_size) != SGX_SUCCESS
+        ? -EINVAL : FILE_SYSTEM->write(path, plaintext.data(), 0, data_size, time);
+  }
+  if (ret < 0) {
+    FILE_SYSTEM->unlink(path, time);
+    return ret;
+  }
+  return 0;
+}
+
+/**
+ * Gives the size of the records sealed in a batch of a journal
+ * @return The size of the records, UINT32_MAX if the batch is not a sealed blob of sealed_size bytes
+ */
+static uint32_t get_records_size(const uint8_t* sealed, size_t sealed_size) {
+  if (sealed_size < sizeof(sgx_sealed_data_t)) {
+    return UINT32_MAX;
+  }
+  uint32_t size = sgx_get_encrypt_txt_len(reinterpret_cast<const sgx_sealed_data_t*>(sealed));
+  if (size == UINT32_MAX || sgx_calc_sealed_data_size(0, size) != sealed_size) {
+    return UINT32_MAX;
+  }
+  return size;
+}
+
+/**
+ * Seals a batch of the journal of sgx-ramfs, whose records are made outside of the enclave
+ */
+int journal_seal(const uint8_t* records, size_t size, uint8_t* sealed, size_t sealed_size) {
+  if (size >= UINT32_MAX || sealed_size != sgx_calc_sealed_data_size(0, size)) {
+    return -EINVAL;
+  }
+  sgx_status_t status = sgx_seal_data(0, NULL, size, records, sealed_size,
+                                      reinterpret_cast<sgx_sealed_data_t*>(sealed));
+  return status != SGX_SUCCESS ? -EIO : 0;
+}
+
+int journal_unseal(const uint8_t* sealed, size_t sealed_size, uint8_t* records, size_t size) {
+  uint32_t records_size = get_records_size(sealed, sealed_size);
+  if (records_size != size) {
+    return -EINVAL;
+  }
+  sgx_status_t status = sgx_unseal_data(reinterpret_cast<const sgx_sealed_data_t*>(sealed), NULL, NULL,
+                                        records, &records_size);
+  return status != SGX_SUCCESS ? -EIO : 0;
+}
+
+// Changes made to the file system of sgxfs since its journal last collected them
+static std::vector<char> JOURNAL_RECORDS;
+static Mutex JOURNAL_LOCK;
+
+static void record_change(const uint8_t type,
+                          const std::string &path,
+                          const uint64_t value,
+                          const FileSystem::Segments &data) {
+  size_t size = 0;
+  for (auto it = data.begin(); it != data.end(); it++) {
+    size += it->second;
+  }
+  ScopedLock lock(JOURNAL_LOCK);
+  char* position = append_journal_record(&JOURNAL_RECORDS, type, path, value, size);
+  for (auto it = data.begin(); it != data.end(); it++) {
+    memcpy(position, it->first, it->second);
+    position += it->second;
+  }
+}
+
+int enclave_journal_start() {
+  FILE_SYSTEM->set_listener(record_change);
+  return 0;
+}
+
+/**
+ * Seals the changes recorded since the previous call into a batch of the journal
+ * @param needed Set to the size of the sealed batch
+ * @return The size of the sealed batch, 0 if there are no changes, -E2BIG if it does not fit in capacity bytes
+ */
+int enclave_journal_collect(uint8_t* batch, size_t capacity, size_t* needed) {
+  std::vector<char> records;
+  {
+    ScopedLock lock(JOURNAL_LOCK);
+    *needed = JOURNAL_RECORDS.empty() ? 0 : sgx_calc_sealed_data_size(0, JOURNAL_RECORDS.size());
+    if (*needed > capacity) {
+      return -E2BIG;
+    }
+    records.swap(JOURNAL_RECORDS);
+  }
+  if (records.empty()) {
     return 0;
   }
-  FILE_SYSTEM->create(path);
-  uint32_t data_size = sealed_data->aes_data.payload_size;
-  uint8_t* plaintext = new uint8_t[data_size];
-  sgx_status_t ret = sgx_unseal_data(sealed_data, NULL, NULL, plaintext, &data_size);
-  FILE_SYSTEM->write(path, (const char*) plaintext, 0, data_size);
+  sgx_status_t status = sgx_seal_data(0, NULL, records.size(), reinterpret_cast<const uint8_t*>(records.data()),
+                                      *needed, reinterpret_cast<sgx_sealed_data_t*>(batch));
+  return status != SGX_SUCCESS ? -EIO : *needed;
+}
+
+/**
+ * Applies a batch read back from the journal of sgxfs, the changes taking the time of the mount
+ */
+int enclave_journal_replay(const uint8_t* batch, size_t size, uint64_t time) {
+  uint32_t records_size = get_records_size(batch, size);
+  if (records_size == UINT32_MAX) {
+    return -EINVAL;
+  }
+  std::vector<char> records(records_size);
+  sgx_status_t status = sgx_unseal_data(reinterpret_cast<const sgx_sealed_data_t*>(batch), NULL, NULL,
+                                        reinterpret_cast<uint8_t*>(records.data()), &records_size);
+  if (status != SGX_SUCCESS) {
+    return -EIO;
+  }
+  size_t position = 0;
+  JournalRecord record;
+  while (read_journal_record(records, &position, &record)) {
+    switch (record.type) {
+      case JOURNAL_CREATE:
+        FILE_SYSTEM->create(record.path, record.value, time);
+        break;
+      case JOURNAL_MKDIR:
+        FILE_SYSTEM->mkdir(record.path, record.value, time);
+        break;
+      case JOURNAL_UNLINK:
+        FILE_SYSTEM->unlink(record.path, time);
+        break;
+      case JOURNAL_RMDIR:
+        FILE_SYSTEM->rmdir(record.path, time);
+        break;
+      case JOURNAL_WRITE:
+        FILE_SYSTEM->write(record.path, record.data, record.value, record.size, time);
+        break;
+      case JOURNAL_TRUNCATE:
+        FILE_SYSTEM->truncate(record.path, record.value, time);
+        break;
+    }
+  }
+  return 0;
+}
+
+int enclave_mkdir(const char* pathname, uint32_t mode, uint64_t time, uint64_t* generation) {
+  int ret = FILE_SYSTEM->mkdir(std::string(pathname), mode, time);
+  *generation = FILE_SYSTEM->get_generation();
   return ret;
 }
 
-int enclave_mkdir(const char* pathname) {
-  return FILE_SYSTEM->mkdir(std::string(pathname));
+int enclave_lookup(uint64_t parent, const char* name, struct enclave_stat_t* stat) {
+  FileAttributes attributes;
+  int ret = FILE_SYSTEM->lookup(parent, name, &attributes);
+  return copy_attributes(ret, attributes, stat);
+}
+
+int enclave_forget(uint64_t inode, uint64_t count) {
+  FILE_SYSTEM->forget(inode, count);
+  return 0;
+}
+
+int enclave_create_at(uint64_t parent, const char* name, uint32_t mode, uint64_t time, struct enclave_stat_t* stat) {
+  FileAttributes attributes;
+  int ret = FILE_SYSTEM->create(parent, name, mode, time, &attributes);
+  return copy_attributes(ret, attributes, stat);
+}
+
+int enclave_mkdir_at(uint64_t parent, const char* name, uint32_t mode, uint64_t time, struct enclave_stat_t* stat) {
+  FileAttributes attributes;
+  int ret = FILE_SYSTEM->mkdir(parent, name, mode, time, &attributes);
+  return copy_attributes(ret, attributes, stat);
+}
+
+int enclave_unlink_at(uint64_t parent, const char* name, uint64_t time) {
+  return FILE_SYSTEM->unlink(parent, name, time);
+}
+
+int enclave_rmdir_at(uint64_t parent, const char* name, uint64_t time) {
+  return FILE_SYSTEM->rmdir(parent, name, time);
+}
+
+/**
+ * Lists the entries of a directory that follow after, with their inode numbers
+ * @return The number of entries copied, -ENOTDIR or -ENOENT if directory is not a directory
+ */
+int enclave_list(uint64_t directory,
+                 const char* after,
+                 struct enclave_dirent_t* entries,
+                 size_t count,
+                 int* end) {
+  *end = 1;
+  std::vector<DirectoryEntry> listed;
+  int ret = FILE_SYSTEM->readdir(directory, after, count, &listed);
+  if (ret < 0) {
+    return ret;
+  }
+  for (size_t i = 0; i < listed.size(); i++) {
+    if (listed[i].name.length() >= sizeof(entries[i].name)) {
+      return -ENAMETOOLONG;
+    }
+    entries[i].inode = listed[i].number;
+    entries[i].directory = listed[i].directory;
+    memcpy(entries[i].name, listed[i].name.c_str(), listed[i].name.length() + 1);
+  }
+  *end = listed.size() < count;
+  return listed.size();
+}
+
+int enclave_get_pool_statistics(size_t* block_size,
+                                uint64_t* blocks_in_use,
+                                uint64_t* blocks_free,
+                                uint64_t* high_water_mark) {
+  BlockPoolStatistics statistics = FILE_SYSTEM->get_pool_statistics();
+  *block_size = statistics.block_size;
+  *blocks_in_use = statistics.blocks_in_use;
+  *blocks_free = statistics.blocks_free;
+  *high_water_mark = statistics.high_water_mark;
+  return 0;
 }
 
-int init_filesystem() {
-  FILE_SYSTEM = new FileSystem(FileSystem::DEFAULT_BLOCK_SIZE);
+int init_filesystem(uint64_t time) {
+  FILE_SYSTEM = new FileSystem(FileSystem::DEFAULT_BLOCK_SIZE, time);
   return 0;
 }
 
@@ -0,0 +1,136 @@
+#include <cerrno>
+#include <cstring>
+
+#include "sgx_trts.h"
+
+#include "Enclave_t.h"
+#include "../utils/switchless.hpp"
+
+/**
+ * Number of empty polls of the ring after which a worker briefly leaves the enclave to sleep
+ */
+static const size_t IDLE_SPINS = 1 << 16;
+
+static int64_t dispatch(const SwitchlessArguments &arguments, char** inputs, char* output) {
+  const size_t* sizes = arguments.input_sizes;
+  switch (arguments.call) {
+    case SWITCHLESS_STAT:
+      if (arguments.output_size != sizeof(struct enclave_stat_t)) {
+        return -EINVAL;
+      }
+      return enclave_stat(inputs[0], reinterpret_cast<struct enclave_stat_t*>(output));
+    case SWITCHLESS_FSTAT:
+      if (arguments.output_size != sizeof(struct enclave_stat_t)) {
+        return -EINVAL;
+      }
+      return enclave_fstat(arguments.arguments[0], reinterpret_cast<struct enclave_stat_t*>(output));
+    case SWITCHLESS_GET_INODE:
+      return ramfs_get_inode(arguments.arguments[0], (long) arguments.arguments[1],
+                             arguments.output_size, output);
+    case SWITCHLESS_PUT_INODE:
+      if (arguments.output_size != sizeof(uint64_t)) {
+        return -EINVAL;
+      }
+      return ramfs_put_inode(arguments.arguments[0], (long) arguments.arguments[1], sizes[0], inputs[0],
+                             arguments.arguments[2], reinterpret_cast<uint64_t*>(output));
+    case SWITCHLESS_SEAL_BLOCKS:
+      return ramfs_seal_blocks(inputs[3], arguments.arguments[2],
+                               reinterpret_cast<uint8_t*>(inputs[0]), sizes[0],
+                               reinterpret_cast<size_t*>(inputs[1]), sizes[1] / sizeof(size_t),
+                               arguments.arguments[0],
+                               reinterpret_cast<uint8_t*>(inputs[2]), sizes[2],
+                               arguments.arguments[1],
+                               reinterpret_cast<uint8_t*>(output), arguments.output_size);
+    case SWITCHLESS_CACHE_READ:
+      return ramfs_cache_read(arguments.arguments[0], inputs[2], arguments.arguments[1], arguments.arguments[2],
+                              arguments.arguments[3],
+                              reinterpret_cast<uint8_t*>(inputs[0]), sizes[0],
+                              reinterpret_cast<size_t*>(inputs[1]), sizes[1] / sizeof(size_t),
+                              reinterpret_cast<uint8_t*>(output), arguments.output_size);
+    case SWITCHLESS_CACHE_WRITE:
+      if (sizes[1] / sizeof(size_t) != sizes[2] / sizeof(uint64_t)) {
+        return -EINVAL;
+      }
+      return ramfs_cache_write(arguments.arguments[0], inputs[4], arguments.arguments[1], arguments.arguments[2],
+                               arguments.arguments[3],
+                               reinterpret_cast<uint8_t*>(inputs[0]), sizes[0],
+                               reinterpret_cast<size_t*>(inputs[1]),
+                               reinterpret_cast<uint64_t*>(inputs[2]), sizes[2] / sizeof(uint64_t),
+                               arguments.arguments[4],
+                               reinterpret_cast<uint8_t*>(inputs[3]), sizes[3]);
+    default:
+      return -EINVAL;
+  }
+}
+
+/**
+ * Executes a request with its buffers copied into the enclave, the same way the edge routines do it
+ * for a regular ECALL.
+ */
+static int64_t execute(SwitchlessRequest* request) {
+  // Read the arguments once so that the untrusted side cannot change them during the call
+  SwitchlessArguments arguments = request->arguments;
+  char* inputs[SWITCHLESS_INPUTS] = {NULL};
+  char* output = NULL;
+  int64_t result = -EINVAL;
+  for (size_t i = 0; i < SWITCHLESS_INPUTS; i++) {
+    size_t size = arguments.input_sizes[i];
+    if (size > 0 && (arguments.inputs[i] == NULL || !sgx_is_outside_enclave(arguments.inputs[i], size))) {
+      goto cleanup;
+    }
+    // The extra null byte terminates paths even if the caller omitted it
+    inputs[i] = new char[size + 1];
+    if (size > 0) {
+      memcpy(inputs[i], arguments.inputs[i], size);
+    }
+    inputs[i][size] = 0;
+  }
+  if (arguments.output_size > 0) {
+    if (arguments.output == NULL || !sgx_is_outside_enclave(arguments.output, arguments.output_size)) {
+      goto cleanup;
+    }
+    output = new char[arguments.output_size]();
+  }
+  result = dispatch(arguments, inputs, output);
+  if (output != NULL) {
+    memcpy(arguments.output, output, arguments.output_size);
+  }
+
+cleanup:
+  for (size_t i = 0; i < SWITCHLESS_INPUTS; i++) {
+    delete [] inputs[i];
+  }
+  delete [] output;
+  return result;
+}
+
+int enclave_switchless_worker(void* untrusted_ring) {
+  if (untrusted_ring == NULL || !sgx_is_outside_enclave(untrusted_ring, sizeof(SwitchlessRing))) {
+    return -EINVAL;
+  }
+  SwitchlessRing* ring = static_cast<SwitchlessRing*>(untrusted_ring);
+  size_t idle = 0;
+  while (ring->running.load(std::memory_order_acquire)) {
+    if (ring->pending.load(std::memory_order_acquire) == 0) {
+      if (++idle < IDLE_SPINS) {
+        __builtin_ia32_pause();
+      } else {
+        ocall_switchless_idle();
+        idle = 0;
+      }
+      continue;
+    }
+    idle = 0;
+    for (size_t i = 0; i < SWITCHLESS_RING_SIZE; i++) {
+      SwitchlessRequest* request = &ring->requests[i];
+      uint32_t expected = SWITCHLESS_PENDING;
+      if (!request->state.compare_exchange_strong(expected, SWITCHLESS_RUNNING, std::memory_order_acquire)) {
+        continue;
+      }
+      ring->pending.fetch_sub(1, std::memory_order_relaxed);
+      request->result = execute(request);
+      request->state.store(SWITCHLESS_DONE, std::memory_order_release);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+#! /usr/bin/env python3
+import argparse
+import json
+import os
+import subprocess
+import time
+
+DEFAULT_BLOCKSIZE = 1024 * 1024
+DEFAULT_BINARY = os.path.join(os.path.dirname(os.path.abspath(__file__)), "sgx-ramfs.bin")
+
+
+def mount(binary, mountpoint, crypto_threads):
+    options = "crypto_threads={:d},cache_size=0,big_writes,max_write={:d}".format(crypto_threads,
+                                                                                DEFAULT_BLOCKSIZE)
+    subprocess.check_call([binary, "-o", options, mountpoint])
+    while not os.path.ismount(mountpoint):
+        time.sleep(0.1)
+
+
+def unmount(mountpoint):
+    subprocess.check_call(["fusermount", "-u", mountpoint])
+    while os.path.ismount(mountpoint):
+        time.sleep(0.1)
+
+
+def measure(path, size):
+    data = os.urandom(DEFAULT_BLOCKSIZE)
+    start = time.time()
+    with open(path, "wb") as handle:
+        for offset in range(0, size, DEFAULT_BLOCKSIZE):
+            handle.write(data[:min(size - offset, DEFAULT_BLOCKSIZE)])
+        handle.flush()
+        os.fsync(handle.fileno())
+    write_time = time.time() - start
+    start = time.time()
+    with open(path, "rb") as handle:
+        while handle.read(DEFAULT_BLOCKSIZE):
+            pass
+    read_time = time.time() - start
+    os.remove(path)
+    return {
+        "size": size,
+        "blocksize": DEFAULT_BLOCKSIZE,
+        "write_time": write_time,
+        "read_time": read_time,
+        "write_throughput": size / write_time,
+        "read_throughput": size / read_time
+    }
+
+
+if __name__ == "__main__":
+    PARSER = argparse.ArgumentParser(__file__, description="A script to measure the sequential throughput of sgx-ramfs with an increasing number of crypto threads")
+    PARSER.add_argument("path", help="Path to the mount point", type=str)
+    PARSER.add_argument("threads", help="Maximum number of crypto threads", type=int)
+    PARSER.add_argument("size", help="Size of the file to write and read back (in bytes)", type=int)
+    PARSER.add_argument("--binary", help="Path to sgx-ramfs.bin", type=str, default=DEFAULT_BINARY)
+    ARGS = PARSER.parse_args()
+    if not os.path.isdir(ARGS.path):
+        raise ValueError("{:s} mount point is not a valid directory".format(ARGS.path))
+    RESULTS = {}
+    for crypto_threads in range(1, ARGS.threads + 1):
+        mount(ARGS.binary, ARGS.path, crypto_threads)
+        try:
+            RESULTS[crypto_threads] = measure(os.path.join(ARGS.path, "benchmark.bin"), ARGS.size)
+        finally:
+            unmount(ARGS.path)
+    print(json.dumps(RESULTS, indent=4, sort_keys=True))
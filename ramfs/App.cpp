@@ -6,14 +6,18 @@
 #include <cassert>
 #include <cerrno>
 #include <cmath>
+#include <cstddef>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <chrono>
 #include <iostream>
 #include <map>
 #include <string>
+#include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <vector>
 
@@ -22,40 +26,66 @@
 
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_opt.h>
 
 using namespace std;
 
 #include "../utils/filesystem.hpp"
 #include "../utils/fs.hpp"
 #include "../utils/logging.h"
+#include "../utils/lowlevel.hpp"
+#include "../utils/preloader.hpp"
 #include "../utils/serialization.hpp"
 
 static FileSystem* FILE_SYSTEM;
+static const string DUMP_PATH = "ramfs_dump";
+// Pack the files were restored from, mapped until their content is loaded
+static Pack PACK;
+static Preloader PRELOADER([](const string &path) {
+    FILE_SYSTEM->load(path);
+});
 
-static Logger LOGGER("./ramfs.log");
+/**
+ * Mount options specific to ramfs
+ */
+struct ramfs_options {
+    int lowlevel;
+    int lazy_restore;
+    int direct_checkpoint;
+};
 
-static int ramfs_getattr(const char *path, struct stat *stbuf) {
-    string filename = FileSystem::clean_path(path);
+static struct ramfs_options OPTIONS = {0, 0, 0};
+
+static const struct fuse_opt RAMFS_OPTIONS[] = {
+    {"lowlevel", offsetof(struct ramfs_options, lowlevel), 1},
+    {"lazy_restore", offsetof(struct ramfs_options, lazy_restore), 1},
+    {"direct_checkpoint", offsetof(struct ramfs_options, direct_checkpoint), 1},
+    FUSE_OPT_END
+};
+
+static Logger LOGGER("./ramfs.log");
 
+static void fill_stat(const FileAttributes &attributes, struct stat *stbuf) {
     memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = attributes.number;
     stbuf->st_uid = getuid();
     stbuf->st_gid = getgid();
-    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
-
-    if (FILE_SYSTEM->is_directory(filename)) {
-        stbuf->st_mode = S_IFDIR | 0777;
-        stbuf->st_nlink = 2;
-        stbuf->st_size = FILE_SYSTEM->get_block_size();
-        return 0;
-    }
+    // Reads do not update the access time, which follows the modification time
+    stbuf->st_atim = stbuf->st_mtim = to_timespec(attributes.mtime);
+    stbuf->st_ctim = to_timespec(attributes.ctime);
+    stbuf->st_mode = (attributes.directory ? S_IFDIR : S_IFREG) | attributes.mode;
+    stbuf->st_nlink = attributes.nlink;
+    stbuf->st_size = attributes.size;
+}
 
-    if (FILE_SYSTEM->is_file(filename)) {
-        stbuf->st_size = FILE_SYSTEM->get_file_size(filename);
-        stbuf->st_mode = S_IFREG | 0777;
-        stbuf->st_nlink = 1;
-        return 0;
+static int ramfs_getattr(const char *path, struct stat *stbuf) {
+    FileAttributes attributes;
+    int ret = FILE_SYSTEM->stat(path, &attributes);
+    if (ret < 0) {
+        return ret;
     }
-    return -ENOENT;
+    fill_stat(attributes, stbuf);
+    return 0;
 }
 
 static int ramfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
@@ -77,10 +107,14 @@ static int ramfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 }
 
 static int ramfs_open(const char *path, struct fuse_file_info *fi) {
-    string filename = FileSystem::clean_path(path);
-    if (!FILE_SYSTEM->is_file(filename)) {
+    uint64_t inode = FILE_SYSTEM->lookup(path);
+    if (FILE_SYSTEM->is_directory(inode)) {
+        return -EISDIR;
+    }
+    if (!FILE_SYSTEM->is_file(inode)) {
         return -ENOENT;
     }
+    fi->fh = inode;
     return 0;
 }
 
@@ -91,10 +125,7 @@ static int ramfs_read(const char *path, char *buf, size_t size, off_t offset,
                               ", offset=" + to_string(offset) + \
                               ", size=" + to_string(size) + ")";
     auto start = chrono::high_resolution_clock::now();
-    if (!FILE_SYSTEM->is_file(filename)) {
-      return -ENOENT;
-    }
-    int read = FILE_SYSTEM->read(filename, buf, offset, size);
+    int read = FILE_SYSTEM->read(fi->fh, buf, offset, size);
     auto end = chrono::high_resolution_clock::now();
     auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start);
     //LOGGER.info(log_line_header + " Exiting with " + to_string(read) + " after " + to_string(elapsed.count()) + " microseconds");
@@ -102,28 +133,194 @@ static int ramfs_read(const char *path, char *buf, size_t size, off_t offset,
 }
 
 int ramfs_write(const char *path, const char *data, size_t size, off_t offset,
-                struct fuse_file_info *) {
+                struct fuse_file_info *fi) {
     string filename = FileSystem::clean_path(path);
     const string header = "ramfs_write(" + filename + ", offset=" + to_string(offset) + ", size=" + to_string(size) + ")";
     auto start = chrono::high_resolution_clock::now();
-    size_t written = FILE_SYSTEM->write(filename, data, offset, size);
+    size_t written = FILE_SYSTEM->write(fi->fh, data, offset, size, get_current_time());
     auto end = chrono::high_resolution_clock::now();
     auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start);
     //LOGGER.info(header + ": Exiting " + to_string(written) + " after " + to_string(elapsed.count()) + " microseconds");
     return written;
 }
 
+/**
+ * Size requested for the pipes of ramfs_read_buf, enough for the largest FUSE read over unaligned segments
+ */
+static const int SPLICE_PIPE_SIZE = 1 << 20;
+
+/**
+ * A pipe owned by a FUSE thread, through which ramfs_read_buf hands the content of a file to the kernel
+ */
+struct SplicePipe {
+    int fds[2];
+
+    SplicePipe() {
+        if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+            fds[0] = fds[1] = -1;
+            return;
+        }
+        // A smaller pipe only makes large reads fall back to a copy
+        fcntl(fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    }
+
+    ~SplicePipe() {
+        if (fds[0] >= 0) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+};
+
+static thread_local SplicePipe SPLICE_PIPE;
+
+/**
+ * Copies segments of the file system into the pipe of the calling thread. The pipe owns the copy, so its
+ * pages stay valid once the extents are released, whatever happens to the file before the reply is sent.
+ * @return The number of bytes copied, which stops short when the pipe is full
+ */
+static size_t copy_to_pipe(const FileSystem::Segments &segments) {
+    vector<struct iovec> vectors;
+    vectors.reserve(segments.size());
+    for (auto it = segments.begin(); it != segments.end(); it++) {
+        vectors.push_back(iovec{const_cast<char*>(it->first), it->second});
+    }
+    size_t copied = 0;
+    size_t index = 0;
+    while (index < vectors.size()) {
+        ssize_t ret = writev(SPLICE_PIPE.fds[1], vectors.data() + index, vectors.size() - index);
+        if (ret <= 0) {
+            break;
+        }
+        copied += ret;
+        // Skip the vectors fully copied and move into the one copied in part
+        for (size_t remaining = ret; remaining > 0;) {
+            size_t step = min(remaining, vectors[index].iov_len);
+            vectors[index].iov_base = static_cast<char*>(vectors[index].iov_base) + step;
+            vectors[index].iov_len -= step;
+            remaining -= step;
+            if (vectors[index].iov_len == 0) {
+                index++;
+            }
+        }
+    }
+    return copied;
+}
+
+/**
+ * Serves reads from the extents of the file system. Their content is copied into a pipe that FUSE splices
+ * to the kernel, the only copy of the reply. The pipe must not reference the extents themselves: FUSE
+ * sends the reply after the file is unlocked, when a truncate or unlink may have handed them to another
+ * file. Reads that do not fit in the pipe are copied to a buffer instead.
+ */
+static int ramfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                          struct fuse_file_info *fi) {
+    struct fuse_bufvec *buffer = static_cast<struct fuse_bufvec*>(malloc(sizeof(struct fuse_bufvec)));
+    if (buffer == NULL) {
+        return -ENOMEM;
+    }
+    *buffer = FUSE_BUFVEC_INIT(0);
+    // FUSE frees the vector and its memory buffer once the reply is sent, or on error
+    *bufp = buffer;
+    int ret = FILE_SYSTEM->read_in_place(fi->fh, offset, size, [buffer](const FileSystem::Segments &segments) {
+        size_t total = 0;
+        for (auto it = segments.begin(); it != segments.end(); it++) {
+            total += it->second;
+        }
+        buffer->buf[0].size = total;
+        if (total == 0) {
+            return 0;
+        }
+        int available = 0;
+        // A reply that failed to be sent leaves its bytes in the pipe, which is then drained first
+        if (SPLICE_PIPE.fds[0] >= 0 && ioctl(SPLICE_PIPE.fds[0], FIONREAD, &available) == 0 && available == 0) {
+            size_t copied = copy_to_pipe(segments);
+            if (copied == total) {
+                buffer->buf[0].flags = FUSE_BUF_IS_FD;
+                buffer->buf[0].fd = SPLICE_PIPE.fds[0];
+                return static_cast<int>(total);
+            }
+            available = copied;
+        }
+        char *copy = static_cast<char*>(malloc(total));
+        if (copy == NULL) {
+            return -ENOMEM;
+        }
+        buffer->buf[0].mem = copy;
+        while (available > 0) {
+            ssize_t drained = read(SPLICE_PIPE.fds[0], copy, min<size_t>(available, total));
+            if (drained <= 0) {
+                break;
+            }
+            available -= drained;
+        }
+        size_t copied = 0;
+        for (auto it = segments.begin(); it != segments.end(); it++) {
+            memcpy(copy + copied, it->first, it->second);
+            copied += it->second;
+        }
+        return static_cast<int>(total);
+    });
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Copies the content of a FUSE buffer vector into segments of the file system, in order
+ * @return The number of bytes copied or a negative error code
+ */
+static int copy_to_segments(struct fuse_bufvec *buf, const FileSystem::WritableSegments &segments) {
+    int written = 0;
+    for (auto it = segments.begin(); it != segments.end(); it++) {
+        struct fuse_bufvec destination = FUSE_BUFVEC_INIT(it->second);
+        destination.buf[0].mem = it->first;
+        // Both vectors move forward as bytes are copied
+        ssize_t copied = fuse_buf_copy(&destination, buf, static_cast<enum fuse_buf_copy_flags>(0));
+        if (copied < 0) {
+            return written > 0 ? written : static_cast<int>(copied);
+        }
+        written += copied;
+        if (static_cast<size_t>(copied) < it->second) {
+            break;
+        }
+    }
+    return written;
+}
+
+/**
+ * Serves writes straight into the extents of the file system. When FUSE splices requests from the kernel,
+ * the data goes from the pipe it was spliced into to the extents with a single copy.
+ */
+static int ramfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                           struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(buf);
+    return FILE_SYSTEM->write_in_place(fi->fh, offset, size, get_current_time(),
+                                       [buf](const FileSystem::WritableSegments &segments) {
+        return copy_to_segments(buf, segments);
+    });
+}
+
 int ramfs_unlink(const char *pathname) {
-    return FILE_SYSTEM->unlink(pathname);
+    return FILE_SYSTEM->unlink(pathname, get_current_time());
 }
 
-int ramfs_create(const char *path, mode_t mode, struct fuse_file_info *) {
-    return FILE_SYSTEM->create(path);
+int ramfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    int ret = FILE_SYSTEM->create(path, mode, get_current_time());
+    if (ret < 0) {
+        return ret;
+    }
+    fi->fh = FILE_SYSTEM->lookup(path);
+    return 0;
 }
 
 int ramfs_fgetattr(const char *path, struct stat *stbuf,
-                   struct fuse_file_info *) {
-    return ramfs_getattr(path, stbuf);
+                   struct fuse_file_info *fi) {
+    FileAttributes attributes;
+    int ret = FILE_SYSTEM->stat(fi->fh, &attributes);
+    if (ret < 0) {
+        return ret;
+    }
+    fill_stat(attributes, stbuf);
+    return 0;
 }
 
 int ramfs_opendir(const char *path, struct fuse_file_info *) {
@@ -135,7 +332,11 @@ int ramfs_access(const char *path, int) {
 }
 
 int ramfs_truncate(const char *path, off_t length) {
-  return FILE_SYSTEM->truncate(path, length);
+  return FILE_SYSTEM->truncate(path, length, get_current_time());
+}
+
+int ramfs_ftruncate(const char *path, off_t length, struct fuse_file_info *fi) {
+  return FILE_SYSTEM->truncate(fi->fh, length, get_current_time());
 }
 
 int ramfs_mknod(const char *path, mode_t mode, dev_t dev) {
@@ -144,11 +345,11 @@ int ramfs_mknod(const char *path, mode_t mode, dev_t dev) {
 }
 
 int ramfs_mkdir(const char *dir_path, mode_t mode) {
-  return FILE_SYSTEM->mkdir(dir_path);
+  return FILE_SYSTEM->mkdir(dir_path, mode, get_current_time());
 }
 
 int ramfs_rmdir(const char *path) {
-  return FILE_SYSTEM->rmdir(path);
+  return FILE_SYSTEM->rmdir(path, get_current_time());
 }
 
 int ramfs_symlink(const char *, const char *) {
@@ -208,10 +409,52 @@ int ramfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
     return 0;
 }
 
+/**
+ * Copies the content of a file from the pack it was restored from
+ */
+static int load_from_pack(const string &path, const FileSystem::WritableSegments &segments) {
+  auto entry = PACK.get_files().find(path);
+  if (entry == PACK.get_files().end()) {
+    return -ENOENT;
+  }
+  const char* position = entry->second.first;
+  for (auto segment = segments.begin(); segment != segments.end(); segment++) {
+    memcpy(segment->first, position, segment->second);
+    position += segment->second;
+  }
+  return 0;
+}
+
 void* init(struct fuse_conn_info *conn) {
   Logger init_log("ramfs-mount.log");
   chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-  FILE_SYSTEM = new FileSystem(restore_map("ramfs_dump"));
+  // Replies are spliced from the pipes of ramfs_read_buf, and requests spliced for ramfs_write_buf
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ);
+  int ret = PACK.open(DUMP_PATH + "/" + PACK_NAME);
+  if (ret == -ENOENT) {
+    // Dumps from before packs hold a host file per file, the next dump writes a pack
+    FILE_SYSTEM = new FileSystem(restore_map(DUMP_PATH), get_current_time());
+  } else if (ret < 0) {
+    init_log.error("Could not read the pack of " + DUMP_PATH);
+    exit(1);
+  } else {
+    // Files are created from the index, their content is copied from the pack when loaded
+    map<string, size_t> sizes;
+    vector<string> paths;
+    for (auto it = PACK.get_files().begin(); it != PACK.get_files().end(); it++) {
+      sizes[it->first] = it->second.second;
+      paths.push_back(it->first);
+    }
+    FILE_SYSTEM = new FileSystem(sizes, load_from_pack, get_current_time());
+    if (OPTIONS.lazy_restore) {
+      PRELOADER.start(paths);
+    } else {
+      for (auto it = paths.begin(); it != paths.end(); it++) {
+        FILE_SYSTEM->load(*it);
+      }
+      PACK.close();
+    }
+  }
   chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
   auto duration = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
   init_log.info("Mounted in " + to_string(duration) + " nanoseconds");
@@ -221,13 +464,207 @@ void* init(struct fuse_conn_info *conn) {
 void destroy(void* unused_private_data) {
   Logger init_log("ramfs-mount.log");
   chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-  dump_map(FILE_SYSTEM->get_files(), "ramfs_dump");
+  PRELOADER.stop();
+  // The new pack replaces the one the files left were to be loaded from, which is kept if any of them
+  // cannot be loaded rather than replaced by a pack missing them
+  if (FILE_SYSTEM->load_all() < 0) {
+    init_log.error("Could not load every file of " + DUMP_PATH + ", which is left unchanged");
+    PACK.close();
+  } else {
+    PACK.close();
+    auto files = FILE_SYSTEM->get_files();
+    if (dump_map(files, DUMP_PATH, OPTIONS.direct_checkpoint) < 0) {
+      init_log.error("Could not dump the files to " + DUMP_PATH);
+    }
+    delete files;
+  }
+  BlockPoolStatistics statistics = FILE_SYSTEM->get_pool_statistics();
+  init_log.info("Block pool of " + to_string(statistics.block_size) + " bytes blocks: " +
+                to_string(statistics.blocks_in_use) + " in use, " +
+                to_string(statistics.blocks_free) + " free, " +
+                to_string(statistics.high_water_mark) + " at most");
   delete FILE_SYSTEM;
   chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
   auto duration = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
   init_log.info("Unmounted in " + to_string(duration) + " nanoseconds");
 }
 
+/**
+ * Low-level frontend: requests carry inode numbers, which the file system uses as they are.
+ */
+
+static void ramfs_ll_init(void* userdata, struct fuse_conn_info* conn) {
+    init(conn);
+}
+
+static void ramfs_ll_destroy(void* userdata) {
+    destroy(userdata);
+}
+
+/**
+ * Replies to a request creating or looking up an entry with the outcome of the file system
+ */
+static void reply_lookup(fuse_req_t req, const int ret, const FileAttributes &attributes) {
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    struct stat stbuf;
+    fill_stat(attributes, &stbuf);
+    reply_entry(req, stbuf);
+}
+
+static void ramfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    FileAttributes attributes;
+    int ret = FILE_SYSTEM->lookup(parent, name, &attributes);
+    reply_lookup(req, ret, attributes);
+}
+
+static void ramfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    FILE_SYSTEM->forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ramfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        FILE_SYSTEM->forget(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void ramfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    FileAttributes attributes;
+    int ret = FILE_SYSTEM->stat(ino, &attributes);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    struct stat stbuf;
+    fill_stat(attributes, &stbuf);
+    fuse_reply_attr(req, &stbuf, LOWLEVEL_TIMEOUT);
+}
+
+static void ramfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                             struct fuse_file_info *fi) {
+    // Like chmod and chown, changing the owner or the mode is not supported, new times are ignored like utimens
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        int ret = FILE_SYSTEM->truncate(ino, attr->st_size, get_current_time());
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+    }
+    ramfs_ll_getattr(req, ino, fi);
+}
+
+static void ramfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (FILE_SYSTEM->is_directory(ino)) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+    if (!FILE_SYSTEM->is_file(ino)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_open(req, fi);
+}
+
+/**
+ * Replies with the segments of the extents while the inode is locked, so that FUSE writes the content
+ * of the file to the kernel straight from them, without an intermediate buffer.
+ */
+static void ramfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    int ret = FILE_SYSTEM->read_in_place(ino, offset, size, [req](const FileSystem::Segments &segments) {
+        vector<struct iovec> vectors;
+        vectors.reserve(segments.size());
+        for (auto it = segments.begin(); it != segments.end(); it++) {
+            vectors.push_back(iovec{const_cast<char*>(it->first), it->second});
+        }
+        // A reply that fails to be sent is not answered again
+        fuse_reply_iov(req, vectors.data(), vectors.size());
+        return 0;
+    });
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    }
+}
+
+static void ramfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset,
+                               struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(bufv);
+    int ret = FILE_SYSTEM->write_in_place(ino, offset, size, get_current_time(),
+                                          [bufv](const FileSystem::WritableSegments &segments) {
+        return copy_to_segments(bufv, segments);
+    });
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_write(req, ret);
+}
+
+static void ramfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                            struct fuse_file_info *fi) {
+    FileAttributes attributes;
+    int ret = FILE_SYSTEM->create(parent, name, mode, get_current_time(), &attributes);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    struct stat stbuf;
+    fill_stat(attributes, &stbuf);
+    struct fuse_entry_param entry = get_entry(stbuf);
+    fuse_reply_create(req, &entry, fi);
+}
+
+static void ramfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    FileAttributes attributes;
+    int ret = FILE_SYSTEM->mkdir(parent, name, mode, get_current_time(), &attributes);
+    reply_lookup(req, ret, attributes);
+}
+
+static void ramfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse_reply_err(req, -FILE_SYSTEM->unlink(parent, name, get_current_time()));
+}
+
+static void ramfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse_reply_err(req, -FILE_SYSTEM->rmdir(parent, name, get_current_time()));
+}
+
+static void ramfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (FILE_SYSTEM->is_file(ino)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if (!FILE_SYSTEM->is_directory(ino)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fi->fh = reinterpret_cast<uint64_t>(new DirectoryStream{0, ""});
+    fuse_reply_open(req, fi);
+}
+
+static void ramfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                             struct fuse_file_info *fi) {
+    reply_directory(req, ino, size, offset, reinterpret_cast<DirectoryStream*>(fi->fh),
+                    [ino](const string &after, vector<DirectoryEntry> *entries, bool *end) {
+        int ret = FILE_SYSTEM->readdir(ino, after, LOWLEVEL_LIST_ENTRIES, entries);
+        *end = entries->size() < LOWLEVEL_LIST_ENTRIES;
+        return ret;
+    });
+}
+
+static void ramfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    delete reinterpret_cast<DirectoryStream*>(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops ramfs_ll_oper;
+
 static struct fuse_operations ramfs_oper;
 
 int main(int argc, char **argv) {
@@ -235,8 +672,10 @@ int main(int argc, char **argv) {
     ramfs_oper.readdir = ramfs_readdir;
     ramfs_oper.open = ramfs_open;
     ramfs_oper.read = ramfs_read;
+    ramfs_oper.read_buf = ramfs_read_buf;
     ramfs_oper.mknod = ramfs_mknod;
     ramfs_oper.write = ramfs_write;
+    ramfs_oper.write_buf = ramfs_write_buf;
     ramfs_oper.unlink = ramfs_unlink;
 
     ramfs_oper.setxattr = ramfs_setxattr;
@@ -248,6 +687,7 @@ int main(int argc, char **argv) {
     ramfs_oper.chmod = ramfs_chmod;
     ramfs_oper.chown = ramfs_chown;
     ramfs_oper.truncate = ramfs_truncate;
+    ramfs_oper.ftruncate = ramfs_ftruncate;
     ramfs_oper.utime = ramfs_utime;
     ramfs_oper.opendir = ramfs_opendir;
     ramfs_oper.access = ramfs_access;
@@ -262,5 +702,33 @@ int main(int argc, char **argv) {
     ramfs_oper.init = init;
     ramfs_oper.destroy = destroy;
 
-    return fuse_main(argc, argv, &ramfs_oper, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &OPTIONS, RAMFS_OPTIONS, NULL) == -1) {
+        return 1;
+    }
+    int ret;
+    if (OPTIONS.lowlevel) {
+        ramfs_ll_oper.init = ramfs_ll_init;
+        ramfs_ll_oper.destroy = ramfs_ll_destroy;
+        ramfs_ll_oper.lookup = ramfs_ll_lookup;
+        ramfs_ll_oper.forget = ramfs_ll_forget;
+        ramfs_ll_oper.forget_multi = ramfs_ll_forget_multi;
+        ramfs_ll_oper.getattr = ramfs_ll_getattr;
+        ramfs_ll_oper.setattr = ramfs_ll_setattr;
+        ramfs_ll_oper.open = ramfs_ll_open;
+        ramfs_ll_oper.read = ramfs_ll_read;
+        ramfs_ll_oper.write_buf = ramfs_ll_write_buf;
+        ramfs_ll_oper.create = ramfs_ll_create;
+        ramfs_ll_oper.mkdir = ramfs_ll_mkdir;
+        ramfs_ll_oper.unlink = ramfs_ll_unlink;
+        ramfs_ll_oper.rmdir = ramfs_ll_rmdir;
+        ramfs_ll_oper.opendir = ramfs_ll_opendir;
+        ramfs_ll_oper.readdir = ramfs_ll_readdir;
+        ramfs_ll_oper.releasedir = ramfs_ll_releasedir;
+        ret = run_lowlevel_session(&args, &ramfs_ll_oper, sizeof(ramfs_ll_oper), NULL);
+    } else {
+        ret = fuse_main(args.argc, args.argv, &ramfs_oper, NULL);
+    }
+    fuse_opt_free_args(&args);
+    return ret;
 }
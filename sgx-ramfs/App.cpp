@@ -8,53 +8,397 @@
 
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_opt.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <cassert>
 #include <cerrno>
 #include <cmath>
+#include <cstddef>
 #include <cstdio>
 #include <cstring>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 
 #include "Enclave_u.h"
 #include "./sgx_urts.h"
 #include "sgx_utils/sgx_utils.h"
+#include "../utils/encrypted_block.hpp"
+#include "../utils/encrypted_file.hpp"
 #include "../utils/fs.hpp"
+#include "../utils/journal.hpp"
+#include "../utils/journal_record.hpp"
+#include "../utils/lock.hpp"
 #include "../utils/logging.h"
+#include "../utils/lowlevel.hpp"
+#include "../utils/preloader.hpp"
+#include "../utils/read_ahead.hpp"
 #include "../utils/serialization.hpp"
+#include "../utils/switchless.hpp"
+#include "../utils/thread_pool.hpp"
 
 using namespace std;
 
 static char* BINARY_NAME;
 
 static const size_t BLOCK_SIZE = 4096;
+/**
+ * Largest sealing unit accepted by the sealing_unit option
+ */
+static const size_t MAX_SEALING_UNIT = 1 << 20;
+// Amount of plaintext sealed in each block, every block of a file but the last one is full
+static size_t SEALING_UNIT = BLOCK_SIZE;
+/**
+ * Largest block cache accepted by the cache_size option, in MiB, bounded by the HeapMaxSize of the enclave
+ */
+static const unsigned int MAX_CACHE_SIZE = 64;
+// Number of blocks the enclave can cache in plaintext
+static size_t CACHE_CAPACITY = 0;
+/**
+ * Largest number of threads accepted by the crypto_threads option, which must leave thread control
+ * structures of the enclave to the FUSE threads
+ */
+static const unsigned int MAX_CRYPTO_THREADS = 8;
+/**
+ * Thread control structures of the enclave (TCSNum in Enclave.config.xml), each one letting a single thread
+ * in at a time; calls finding none left fail with SGX_ERROR_OUT_OF_TCS
+ */
+static const unsigned int ENCLAVE_THREADS = 24;
+// Threads entering the enclave besides the FUSE, switchless and crypto threads: the journal, read-ahead and
+// preloader threads
+static const unsigned int BACKGROUND_THREADS = 3;
+// Thread control structures left to the FUSE threads, as many as the workers of fuse_loop_mt in libfuse 2.9,
+// each one keeping its own for as long as it lives
+static const unsigned int FUSE_THREADS = 10;
+/**
+ * Amount of plaintext below which splitting the sealing or unsealing of blocks across threads does not pay
+ * for the extra ECALLs
+ */
+static const size_t MIN_BYTES_PER_TASK = 64 * 1024;
+// Seals and unseals large ranges of blocks with concurrent ECALLs
+static ThreadPool CRYPTO_POOL;
+
+static map<string, EncryptedFile*>* FILES;
+// The volume key encrypting the blocks is sealed to this file when the volume is created
+static const char* KEY_PATH = "sgx_ramfs_key";
+// The files are checkpointed to DUMP_PATH, and the changes made since are appended to JOURNAL_PATH
+static const char* DUMP_PATH = "sgx_ramfs_dump";
+static const char* JOURNAL_PATH = "sgx_ramfs_journal";
+// Journal superseded by the checkpoint being written, replayed as well until the checkpoint is installed
+static const char* OLD_JOURNAL_PATH = "sgx_ramfs_journal.old";
+// Maps every directory to the names of its direct children
+static map<string, set<string>> DIRECTORIES;
+
+/**
+ * Attributes of a file or directory besides its size, timestamps being in nanoseconds since the epoch
+ */
+struct Metadata {
+    mode_t mode;
+    nlink_t nlink;
+    uint64_t mtime;
+    uint64_t ctime;
+};
+
+// Metadata of every file and directory. The entry of a directory only changes under the write lock of
+// NAMESPACE_LOCK, the entry of a file also changes under the write lock of the file
+static map<string, Metadata> METADATA;
+
+// Protects the structure of FILES, DIRECTORIES and METADATA
+static RWLock NAMESPACE_LOCK;
+// Protect the blocks of the files, each file being assigned a lock by the hash of its path
+static const size_t NUMBER_OF_FILE_LOCKS = 64;
+static RWLock FILE_LOCKS[NUMBER_OF_FILE_LOCKS];
+// Serialize the restoration of the files assigned the same lock, which readers share
+static Mutex RESTORE_LOCKS[NUMBER_OF_FILE_LOCKS];
+
+// Size of the dump of every file restored lazily whose blocks are still in the pack
+static map<const EncryptedFile*, size_t> PENDING;
+static Mutex PENDING_LOCK;
+static atomic<size_t> PENDING_FILES(0);
+// Pack the files were restored from, mapped until every file is restored
+static Pack PACK;
+
+/**
+ * Blocks of a file written in the cache of the enclave but not sealed back yet
+ */
+struct DirtyBlocks {
+    size_t file_size;
+    set<size_t> indices;
+};
 
-static map<string, vector < sgx_sealed_data_t * >*>* FILES;
-static map<string, bool> DIRECTORIES;
+// Dirty blocks by file. An entry only changes under the write lock of its file
+static map<const EncryptedFile*, DirtyBlocks> DIRTY_BLOCKS;
+static Mutex DIRTY_BLOCKS_LOCK;
 
 sgx_enclave_id_t ENCLAVE_ID;
 
 static Logger LOGGER("./sgx-ramfs.log");
 
+/**
+ * Mount options specific to sgx-ramfs
+ */
+struct sgx_ramfs_options {
+    int switchless;
+    unsigned int switchless_workers;
+    unsigned int sealing_unit;
+    unsigned int cache_size;
+    unsigned int read_ahead;
+    unsigned int crypto_threads;
+    int lowlevel;
+    unsigned int checkpoint_size;
+    int lazy_restore;
+    int direct_checkpoint;
+};
+
+static struct sgx_ramfs_options OPTIONS = {0, 2, BLOCK_SIZE, 32, 1024, 4, 0, 64, 0, 0};
+
+static const struct fuse_opt SGX_RAMFS_OPTIONS[] = {
+    {"switchless", offsetof(struct sgx_ramfs_options, switchless), 1},
+    {"switchless_workers=%u", offsetof(struct sgx_ramfs_options, switchless_workers), 0},
+    {"sealing_unit=%u", offsetof(struct sgx_ramfs_options, sealing_unit), 0},
+    {"cache_size=%u", offsetof(struct sgx_ramfs_options, cache_size), 0},
+    {"read_ahead=%u", offsetof(struct sgx_ramfs_options, read_ahead), 0},
+    {"crypto_threads=%u", offsetof(struct sgx_ramfs_options, crypto_threads), 0},
+    {"lowlevel", offsetof(struct sgx_ramfs_options, lowlevel), 1},
+    {"checkpoint_size=%u", offsetof(struct sgx_ramfs_options, checkpoint_size), 0},
+    {"lazy_restore", offsetof(struct sgx_ramfs_options, lazy_restore), 1},
+    {"direct_checkpoint", offsetof(struct sgx_ramfs_options, direct_checkpoint), 1},
+    FUSE_OPT_END
+};
+
+static void switchless_worker(SwitchlessRing* ring) {
+    int ret;
+    enclave_switchless_worker(ENCLAVE_ID, &ret, ring);
+}
+
+static SwitchlessClient SWITCHLESS(switchless_worker);
+
+static void prefetch_blocks(const string &filename, size_t first, size_t count);
+
+static ReadAhead READ_AHEAD(prefetch_blocks);
+
+// Changes recorded since the journal last collected them
+static vector<char> JOURNAL_RECORDS;
+static Mutex JOURNAL_RECORDS_LOCK;
+// Changes are only recorded once the files are restored and the journal replayed
+static bool JOURNALING = false;
 
-static size_t compute_file_size(vector<sgx_sealed_data_t *>* data) {
-    size_t size = 0;
-    size_t counter = 0;
-    for (auto it = data->begin(); it != data->end(); it++) {
-        sgx_sealed_data_t* block = (*it);
-        size += block->aes_data.payload_size;
+static int collect_changes(vector<char>* batch);
+
+static Journal JOURNAL(collect_changes);
+
+// Size of the blocks written by the last checkpoint
+static atomic<size_t> CHECKPOINT_SIZE(0);
+
+static int restore_file(const string &filename, EncryptedFile* blocks);
+static void preload_file(const string &filename);
+
+static Preloader PRELOADER(preload_file);
+
+static string get_parent(const string &path) {
+    size_t pos = path.rfind('/');
+    if (pos == string::npos) {
+        return "";
     }
+    return path.substr(0, pos);
+}
+
+static string get_name(const string &path) {
+    return path.substr(path.rfind('/') + 1);
+}
+
+static RWLock &get_file_lock(const string &filename) {
+    return FILE_LOCKS[hash<string>()(filename) % NUMBER_OF_FILE_LOCKS];
+}
+
+static Mutex &get_restore_lock(const string &filename) {
+    return RESTORE_LOCKS[hash<string>()(filename) % NUMBER_OF_FILE_LOCKS];
+}
+
+/**
+ * Records a change to the content of a file or directory
+ */
+static void touch(const string &path, uint64_t time) {
+    Metadata &metadata = METADATA.at(path);
+    metadata.mtime = time;
+    metadata.ctime = time;
+}
+
+static void add_metadata(const string &path, mode_t mode, bool directory, uint64_t time) {
+    // A directory is linked from its parent and from its own ".", then from the ".." of every subdirectory
+    METADATA[path] = Metadata{mode & 07777, static_cast<nlink_t>(directory ? 2 : 1), time, time};
+    if (!path.empty()) {
+        touch(get_parent(path), time);
+        METADATA.at(get_parent(path)).nlink += directory ? 1 : 0;
+    }
+}
+
+static void remove_metadata(const string &path, bool directory, uint64_t time) {
+    METADATA.erase(path);
+    touch(get_parent(path), time);
+    METADATA.at(get_parent(path)).nlink -= directory ? 1 : 0;
+}
+
+/**
+ * Records a change in the journal, which commits it along with the other changes of its batch.
+ * The caller holds the locks that order the change with the other changes made to path.
+ * @param data Encrypted blocks stored by the change, if any
+ */
+static void journal_change(uint8_t type, const string &path, uint64_t value,
+                           const uint8_t* data = NULL, size_t size = 0) {
+    if (!JOURNALING) {
+        return;
+    }
+    {
+        ScopedLock lock(JOURNAL_RECORDS_LOCK);
+        char* room = append_journal_record(&JOURNAL_RECORDS, type, path, value, size);
+        if (size > 0) {
+            memcpy(room, data, size);
+        }
+    }
+    JOURNAL.add_pending(size);
+}
+
+/**
+ * Stores sealed blocks into a file and records them in the journal
+ * @return The size of the blocks stored
+ */
+static size_t store_blocks(const string &filename, EncryptedFile* blocks, size_t first,
+                           const uint8_t* sealed, size_t count) {
+    size_t size = blocks->store(first, sealed, count);
+    journal_change(JOURNAL_STORE, filename, first, sealed, size);
     return size;
 }
 
+static uint64_t get_file_id(const EncryptedFile* blocks) {
+    return reinterpret_cast<uint64_t>(blocks);
+}
+
+static bool get_dirty_blocks(const EncryptedFile* blocks, DirtyBlocks* dirty) {
+    ScopedLock lock(DIRTY_BLOCKS_LOCK);
+    auto entry = DIRTY_BLOCKS.find(blocks);
+    if (entry == DIRTY_BLOCKS.end()) {
+        return false;
+    }
+    *dirty = entry->second;
+    return true;
+}
+
+static void set_dirty_blocks(const EncryptedFile* blocks, const DirtyBlocks &dirty) {
+    ScopedLock lock(DIRTY_BLOCKS_LOCK);
+    DIRTY_BLOCKS[blocks] = dirty;
+}
+
+static void clear_dirty_blocks(const EncryptedFile* blocks) {
+    ScopedLock lock(DIRTY_BLOCKS_LOCK);
+    DIRTY_BLOCKS.erase(blocks);
+}
+
+/**
+ * Gives the size of a file, including the blocks not sealed back yet
+ */
+static size_t get_file_size(EncryptedFile* blocks) {
+    DirtyBlocks dirty;
+    if (get_dirty_blocks(blocks, &dirty)) {
+        return dirty.file_size;
+    }
+    if (PENDING_FILES > 0) {
+        ScopedLock lock(PENDING_LOCK);
+        auto entry = PENDING.find(blocks);
+        if (entry != PENDING.end()) {
+            // Every block of the dump but the last one holds a full unit
+            size_t dump_size = entry->second;
+            size_t block_size = sizeof(encrypted_block_t) + SEALING_UNIT;
+            return dump_size - (dump_size + block_size - 1) / block_size * sizeof(encrypted_block_t);
+        }
+    }
+    return blocks->get_size();
+}
+
+/**
+ * Splits a range of blocks into as many parts as the crypto threads can process at the same time, as long
+ * as every part holds at least MIN_BYTES_PER_TASK of plaintext
+ * @return The boundaries of the parts, from first to last
+ */
+static vector<size_t> split_blocks(size_t first, size_t last) {
+    size_t min_blocks = max<size_t>(1, MIN_BYTES_PER_TASK / SEALING_UNIT);
+    size_t parts = max<size_t>(1, min(CRYPTO_POOL.get_parallelism(), (last - first) / min_blocks));
+    vector<size_t> bounds;
+    for (size_t part = 0; part <= parts; part++) {
+        bounds.push_back(first + (last - first) * part / parts);
+    }
+    return bounds;
+}
+
+/**
+ * Seals the dirty blocks of a file cached in the enclave back into the blocks of the file.
+ * The caller must hold the write lock of the file.
+ * @param evict Also drops the clean blocks of the file from the cache
+ * @return 0 on success, -EIO if the blocks could not be sealed
+ */
+static int write_back(const string &filename, EncryptedFile* blocks, bool evict) {
+    DirtyBlocks dirty;
+    if (!get_dirty_blocks(blocks, &dirty) && !evict) {
+        return 0;
+    }
+    uint64_t file = get_file_id(blocks);
+    vector<uint64_t> indices(dirty.indices.begin(), dirty.indices.end());
+    vector<size_t> bounds = split_blocks(0, indices.size());
+    size_t parts = bounds.size() - 1;
+    vector<vector<uint8_t>> sealed(parts);
+    vector<int> results(parts);
+    vector<function<void()>> tasks;
+    for (size_t part = 0; part < parts; part++) {
+        tasks.push_back([&, part] {
+            size_t sealed_size = 0;
+            for (size_t i = bounds[part]; i < bounds[part + 1]; i++) {
+                sealed_size += sizeof(encrypted_block_t) +
+                               min(SEALING_UNIT, dirty.file_size - indices[i] * SEALING_UNIT);
+            }
+            sealed[part].resize(sealed_size);
+            int ret;
+            sgx_status_t status = ramfs_cache_flush(ENCLAVE_ID, &ret, file, filename.c_str(),
+                                                    indices.data() + bounds[part], bounds[part + 1] - bounds[part],
+                                                    sealed[part].data(), sealed[part].size());
+            results[part] = status != SGX_SUCCESS ? -EIO : ret;
+        });
+    }
+    if (!indices.empty()) {
+        CRYPTO_POOL.run(tasks);
+    }
+    for (size_t part = 0; part < parts; part++) {
+        if (results[part] < 0) {
+            return -EIO;
+        }
+    }
+    // Indices are sorted and new blocks directly follow the sealed ones, so they can be appended in order.
+    // Runs of consecutive blocks are stored and journaled together.
+    for (size_t part = 0; part < parts; part++) {
+        size_t position = 0;
+        for (size_t i = bounds[part], count; i < bounds[part + 1]; i += count) {
+            for (count = 1; i + count < bounds[part + 1] && indices[i + count] == indices[i] + count; count++) {
+            }
+            position += store_blocks(filename, blocks, indices[i], sealed[part].data() + position, count);
+        }
+    }
+    clear_dirty_blocks(blocks);
+    // The blocks only become evictable once their sealed copies are stored
+    int ret;
+    sgx_status_t status = ramfs_cache_clean(ENCLAVE_ID, &ret, file, indices.data(), indices.size(), evict);
+    return status != SGX_SUCCESS || ret < 0 ? -EIO : 0;
+}
+
 void ocall_print(const char *str) {
     printf("[ocall_print] %s\n", str);
 }
@@ -65,22 +409,28 @@ int ramfs_getattr(const char *path, struct stat *stbuf) {
     memset(stbuf, 0, sizeof(struct stat));
     stbuf->st_uid = getuid();
     stbuf->st_gid = getgid();
-    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
 
-    if (DIRECTORIES.find(filename) != DIRECTORIES.end() ||
-        string(path).compare("/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0777;
-        stbuf->st_nlink = 2;
+    ReadLock lock(NAMESPACE_LOCK);
+    if (DIRECTORIES.find(filename) != DIRECTORIES.end()) {
+        const Metadata &metadata = METADATA.at(filename);
+        stbuf->st_mode = S_IFDIR | metadata.mode;
+        stbuf->st_nlink = metadata.nlink;
         stbuf->st_size = BLOCK_SIZE;
-
+        // Reads do not update the access time, which follows the modification time
+        stbuf->st_atim = stbuf->st_mtim = to_timespec(metadata.mtime);
+        stbuf->st_ctim = to_timespec(metadata.ctime);
         return 0;
     }
     auto entry = FILES->find(filename);
     if (entry != FILES->end()) {
         auto blocks = entry->second;
-        stbuf->st_size = compute_file_size(blocks);
-        stbuf->st_mode = S_IFREG | 0777;
-        stbuf->st_nlink = 1;
+        ReadLock file_lock(get_file_lock(filename));
+        const Metadata &metadata = METADATA.at(filename);
+        stbuf->st_size = get_file_size(blocks);
+        stbuf->st_mode = S_IFREG | metadata.mode;
+        stbuf->st_nlink = metadata.nlink;
+        stbuf->st_atim = stbuf->st_mtim = to_timespec(metadata.mtime);
+        stbuf->st_ctim = to_timespec(metadata.ctime);
         return 0;
     }
     //LOGGER.error("ramfs_getattr(" + filename + "): Could not find entry");
@@ -90,25 +440,17 @@ int ramfs_getattr(const char *path, struct stat *stbuf) {
 int ramfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi) {
     string pathname = clean_path(path);
+    ReadLock lock(NAMESPACE_LOCK);
     if (FILES->find(pathname) != FILES->end()) {
         return -ENOTDIR;
     }
-    if (!pathname.empty() && DIRECTORIES.find(pathname) == DIRECTORIES.end()) {
+    auto directory = DIRECTORIES.find(pathname);
+    if (directory == DIRECTORIES.end()) {
         return -ENOENT;
     }
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
-    vector <string> entries;
-    for (auto it = DIRECTORIES.begin(); it != DIRECTORIES.end(); it++) {
-        if (is_in_directory(pathname, it->first)) {
-            entries.push_back(get_relative_path(pathname, it->first));
-        }
-    }
-    for (auto it = FILES->begin(); it != FILES->end(); it++) {
-        if (is_in_directory(pathname, it->first)) {
-            entries.push_back(get_relative_path(pathname, it->first));
-        }
-    }
+    const set<string> &entries = directory->second;
     for (auto it = entries.begin(); it != entries.end(); it++) {
         filler(buf, it->c_str(), NULL, 0);
     }
@@ -118,72 +460,445 @@ int ramfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 int ramfs_open(const char *path, struct fuse_file_info *fi) {
     string filename = clean_path(path);
+    ReadLock lock(NAMESPACE_LOCK);
     if (FILES->find(filename) == FILES->end()) {
         //LOGGER.error("ramfs_open(" + filename + "): Not found");
         return -ENOENT;
     }
-
+    fi->fh = reinterpret_cast<uint64_t>(new ReadAheadState());
     return 0;
 }
 
-static sgx_status_t decrypt_block(sgx_sealed_data_t *sealed,
-                                  char *decrypted,
+static int call_ramfs_cache_read(uint64_t file,
+                                 const string &filename,
+                                 size_t first,
+                                 size_t number_of_blocks,
+                                 const vector<uint8_t> &sealed,
+                                 const vector<size_t> &sizes,
+                                 uint8_t *plaintext,
+                                 size_t size) {
+    SwitchlessArguments arguments = {};
+    arguments.call = SWITCHLESS_CACHE_READ;
+    arguments.arguments[0] = file;
+    arguments.arguments[1] = first;
+    arguments.arguments[2] = number_of_blocks;
+    arguments.arguments[3] = SEALING_UNIT;
+    arguments.inputs[0] = sealed.data();
+    arguments.input_sizes[0] = sealed.size();
+    arguments.inputs[1] = sizes.data();
+    arguments.input_sizes[1] = sizes.size() * sizeof(size_t);
+    arguments.inputs[2] = filename.c_str();
+    arguments.input_sizes[2] = filename.size() + 1;
+    arguments.output = plaintext;
+    arguments.output_size = size;
+    int64_t result;
+    if (SWITCHLESS.call(arguments, &result)) {
+        return result;
+    }
+    int ret;
+    sgx_status_t status = ramfs_cache_read(ENCLAVE_ID, &ret, file, filename.c_str(),
+                                           first, number_of_blocks, SEALING_UNIT,
+                                           sealed.data(), sealed.size(),
+                                           sizes.data(), sizes.size(),
+                                           plaintext, size);
+    return status != SGX_SUCCESS ? -EIO : ret;
+}
+
+/**
+ * Reads a range of blocks of a file through the cache of the enclave, splitting large ranges across the
+ * crypto threads. The caller must hold the read lock of the file.
+ * @param plaintext Receives the blocks, each one at a multiple of the sealing unit
+ * @return The size of the data read, -EIO on failure
+ */
+static int read_blocks(const string &filename,
+                       EncryptedFile* blocks,
+                       size_t first,
+                       size_t last,
+                       vector<uint8_t> &plaintext) {
+    vector<size_t> bounds = split_blocks(first, last);
+    size_t parts = bounds.size() - 1;
+    vector<int> results(parts);
+    vector<function<void()>> tasks;
+    for (size_t part = 0; part < parts; part++) {
+        tasks.push_back([&, part] {
+            size_t part_first = bounds[part];
+            size_t part_last = bounds[part + 1];
+            // Blocks past the sealed ones are dirty, the enclave serves them from its cache
+            vector<uint8_t> sealed;
+            vector<size_t> sizes;
+            blocks->gather(part_first, max(part_first, min(part_last, blocks->get_number_of_blocks())), sealed, sizes);
+            results[part] = call_ramfs_cache_read(get_file_id(blocks), filename,
+                                                  part_first, part_last - part_first,
+                                                  sealed, sizes,
+                                                  plaintext.data() + (part_first - first) * SEALING_UNIT,
+                                                  (part_last - part_first) * SEALING_UNIT);
+        });
+    }
+    CRYPTO_POOL.run(tasks);
+    for (size_t part = 0; part + 1 < parts; part++) {
+        if (results[part] != (int) ((bounds[part + 1] - bounds[part]) * SEALING_UNIT)) {
+            return -EIO;
+        }
+    }
+    if (results.back() < 0) {
+        return -EIO;
+    }
+    return (bounds[parts - 1] - first) * SEALING_UNIT + results.back();
+}
+
+static sgx_status_t call_ramfs_seal_blocks(const string &filename,
+                                           size_t first,
+                                           const vector<uint8_t> &current,
+                                           const vector<size_t> &sizes,
+                                           size_t offset,
+                                           const char *data,
+                                           size_t size,
+                                           vector<uint8_t> &sealed) {
+    SwitchlessArguments arguments = {};
+    arguments.call = SWITCHLESS_SEAL_BLOCKS;
+    arguments.arguments[0] = offset;
+    arguments.arguments[1] = SEALING_UNIT;
+    arguments.arguments[2] = first;
+    arguments.inputs[0] = current.data();
+    arguments.input_sizes[0] = current.size();
+    arguments.inputs[1] = sizes.data();
+    arguments.input_sizes[1] = sizes.size() * sizeof(size_t);
+    arguments.inputs[2] = data;
+    arguments.input_sizes[2] = size;
+    arguments.inputs[3] = filename.c_str();
+    arguments.input_sizes[3] = filename.size() + 1;
+    arguments.output = sealed.data();
+    arguments.output_size = sealed.size();
+    int64_t result;
+    if (SWITCHLESS.call(arguments, &result)) {
+        return (sgx_status_t) result;
+    }
+    sgx_status_t ret;
+    sgx_status_t status = ramfs_seal_blocks(ENCLAVE_ID, &ret,
+                                            filename.c_str(), first,
+                                            current.data(), current.size(),
+                                            sizes.data(), sizes.size(),
+                                            offset,
+                                            reinterpret_cast<const uint8_t*>(data), size,
+                                            SEALING_UNIT,
+                                            sealed.data(), sealed.size());
+    return status != SGX_SUCCESS ? status : ret;
+}
+
+static int call_ramfs_cache_write(uint64_t file,
+                                  const string &filename,
+                                  size_t first,
+                                  size_t number_of_blocks,
+                                  const vector<uint8_t> &sealed,
+                                  const vector<size_t> &sizes,
+                                  const vector<uint64_t> &indices,
                                   size_t offset,
+                                  const char *data,
                                   size_t size) {
-  auto payload_size = sealed->aes_data.payload_size;
-  auto sealed_size = sizeof(sgx_sealed_data_t) + payload_size;
-  uint8_t* buffer = new uint8_t[payload_size];
-
-  sgx_status_t read;
-  ramfs_decrypt(ENCLAVE_ID, &read,
-                "",
-                sealed, sealed_size,
-                buffer, payload_size);
-  switch (read) {
-      case SGX_ERROR_INVALID_PARAMETER:
-          //LOGGER.error("[ramfs_read] Invalid parameter");
-          break;
-      case SGX_ERROR_INVALID_CPUSVN:
-          //LOGGER.error("[ramfs_read] The CPUSVN in the sealed data blob is beyond the CPUSVN value of the platform.");
-          break;
-      case SGX_ERROR_INVALID_ISVSVN:
-          //LOGGER.error( "[ramfs_read] The ISVSVN in the sealed data blob is greater than the ISVSVN value of the enclave.");
-          break;
-      case SGX_ERROR_MAC_MISMATCH:
-          //LOGGER.error( "[ramfs_read] The tag verification failed during unsealing. The error may be caused by a platform update, software update, or sealed data blob corruption. This error is also reported if other corruption of the sealed data structure is detected.");
-          break;
-      case SGX_ERROR_OUT_OF_MEMORY:
-          //LOGGER.error("[ramfs_read] The enclave is out of memory.");
-          break;
-      case SGX_ERROR_UNEXPECTED:
-          //LOGGER.error("[ramfs_read] Indicates a cryptography library failure.");
-          break;
-      default:
-          break;
-  }
-  auto size_to_copy = size;
-  if ((size_to_copy + offset) > payload_size) {
-    size_to_copy = payload_size - offset;
-  }
-  memcpy(decrypted + offset, buffer, size_to_copy);
-  delete [] buffer;
-  return (sgx_status_t) size_to_copy;
-}
-
-static int read_data(vector<sgx_sealed_data_t*> *blocks,
-                     char *buffer,
-                     size_t block_index,
-                     size_t offset,
-                     size_t size) {
-  int read = 0;
-  size_t offset_in_block = offset % BLOCK_SIZE;
-  for (size_t index = block_index;
-       index < blocks->size() && read < (int) size;
-       index++, offset_in_block = 0) {
-    sgx_sealed_data_t *block = blocks->at(index);
-    read += decrypt_block(block, buffer + read, offset_in_block, BLOCK_SIZE);
-  }
-  return read;
+    SwitchlessArguments arguments = {};
+    arguments.call = SWITCHLESS_CACHE_WRITE;
+    arguments.arguments[0] = file;
+    arguments.arguments[1] = first;
+    arguments.arguments[2] = number_of_blocks;
+    arguments.arguments[3] = SEALING_UNIT;
+    arguments.arguments[4] = offset;
+    arguments.inputs[0] = sealed.data();
+    arguments.input_sizes[0] = sealed.size();
+    arguments.inputs[1] = sizes.data();
+    arguments.input_sizes[1] = sizes.size() * sizeof(size_t);
+    arguments.inputs[2] = indices.data();
+    arguments.input_sizes[2] = indices.size() * sizeof(uint64_t);
+    arguments.inputs[3] = data;
+    arguments.input_sizes[3] = size;
+    arguments.inputs[4] = filename.c_str();
+    arguments.input_sizes[4] = filename.size() + 1;
+    int64_t result;
+    if (SWITCHLESS.call(arguments, &result)) {
+        return result;
+    }
+    int ret;
+    sgx_status_t status = ramfs_cache_write(ENCLAVE_ID, &ret, file, filename.c_str(),
+                                            first, number_of_blocks, SEALING_UNIT,
+                                            sealed.data(), sealed.size(),
+                                            sizes.data(), indices.data(), indices.size(),
+                                            offset,
+                                            reinterpret_cast<const uint8_t*>(data), size);
+    return status != SGX_SUCCESS ? -EIO : ret;
+}
+
+/**
+ * Applies a write to the plaintext blocks of a file cached in the enclave.
+ * The caller must hold the write lock of the file.
+ * @return 0 on success, -ENOSPC if the cache has no room left for the blocks written, -E2BIG if the write
+ *         spans more blocks than the cache can hold, -EIO on failure
+ */
+static int cache_write(const string &filename,
+                       EncryptedFile* blocks,
+                       size_t offset,
+                       const char *data,
+                       size_t size) {
+    DirtyBlocks dirty;
+    if (!get_dirty_blocks(blocks, &dirty)) {
+        dirty.file_size = blocks->get_size();
+    }
+    // Every block but the last one is full, so writing past the end of the file also pads the last block
+    // with zeros
+    size_t first_block = min<size_t>(offset, dirty.file_size) / SEALING_UNIT;
+    size_t last_block = (offset + size + SEALING_UNIT - 1) / SEALING_UNIT;
+    if (last_block - first_block > CACHE_CAPACITY) {
+        return -E2BIG;
+    }
+    // Blocks that are only partially overwritten are loaded from their sealed copy, unless they are dirty
+    // and therefore cached
+    vector<uint64_t> indices;
+    vector<uint8_t> sealed;
+    vector<size_t> sizes;
+    for (size_t index : {first_block, last_block - 1}) {
+        bool overwritten = offset <= index * SEALING_UNIT && (index + 1) * SEALING_UNIT <= offset + size;
+        if (overwritten || index >= blocks->get_number_of_blocks() || dirty.indices.count(index) > 0 ||
+            (!indices.empty() && indices.back() == index)) {
+            continue;
+        }
+        vector<uint8_t> block;
+        blocks->gather(index, index + 1, block, sizes);
+        sealed.insert(sealed.end(), block.begin(), block.end());
+        indices.push_back(index);
+    }
+    int ret = call_ramfs_cache_write(get_file_id(blocks), filename, first_block, last_block - first_block,
+                                     sealed, sizes, indices,
+                                     offset - first_block * SEALING_UNIT, data, size);
+    if (ret < 0) {
+        return ret == -ENOSPC ? ret : -EIO;
+    }
+    dirty.file_size = max(dirty.file_size, offset + size);
+    for (size_t index = first_block; index < last_block; index++) {
+        dirty.indices.insert(index);
+    }
+    set_dirty_blocks(blocks, dirty);
+    return 0;
+}
+
+/**
+ * Seals a write directly into the blocks of a file, splitting large writes across the crypto threads.
+ * The caller must hold the write lock of the file, which must not have dirty blocks in the cache.
+ * @return 0 on success, -EIO if the blocks could not be sealed
+ */
+static int seal_write(const string &filename, EncryptedFile* blocks, size_t offset, const char *data, size_t size) {
+    // Every block but the last one is full, so writing past the end of the file also rewrites the last
+    // block in order to pad it with zeros
+    auto first_block = min(blocks->get_number_of_blocks(), size_t(offset / SEALING_UNIT));
+    if (first_block == blocks->get_number_of_blocks() && blocks->get_size() % SEALING_UNIT != 0) {
+        first_block--;
+    }
+    auto last_block = min(blocks->get_number_of_blocks(), (offset + size + SEALING_UNIT - 1) / SEALING_UNIT);
+    // Parts are split within the blocks written to, so that every part but the last one ends with data
+    // written and fills all of its blocks
+    vector<size_t> bounds = split_blocks(offset / SEALING_UNIT, (offset + size + SEALING_UNIT - 1) / SEALING_UNIT);
+    bounds.front() = first_block;
+    size_t parts = bounds.size() - 1;
+    vector<vector<uint8_t>> sealed(parts);
+    vector<size_t> counts(parts);
+    vector<sgx_status_t> results(parts);
+    vector<function<void()>> tasks;
+    for (size_t part = 0; part < parts; part++) {
+        tasks.push_back([&, part] {
+            size_t part_first = bounds[part];
+            size_t data_start = max(offset, part_first * SEALING_UNIT);
+            size_t data_end = part + 1 < parts ? bounds[part + 1] * SEALING_UNIT : offset + size;
+            vector<uint8_t> current;
+            vector<size_t> sizes;
+            size_t current_payload = blocks->gather(part_first,
+                                                   max(part_first, min(bounds[part + 1], last_block)),
+                                                   current, sizes);
+            size_t offset_in_part = data_start - part_first * SEALING_UNIT;
+            const char *part_data = data + (data_start - offset);
+            size_t part_size = data_end - data_start;
+            // The enclave only takes data that overwrites the current blocks or directly follows them, the
+            // hole left past the end of the file is written as zeros
+            vector<char> padded;
+            if (offset_in_part > current_payload) {
+                padded.resize(offset_in_part - current_payload);
+                padded.insert(padded.end(), part_data, part_data + part_size);
+                offset_in_part = current_payload;
+                part_data = padded.data();
+                part_size = padded.size();
+            }
+            size_t length = max(current_payload, offset_in_part + part_size);
+            size_t number_of_blocks = (length + SEALING_UNIT - 1) / SEALING_UNIT;
+            counts[part] = number_of_blocks;
+            sealed[part].resize(sizeof(encrypted_block_t) * number_of_blocks + length);
+            results[part] = call_ramfs_seal_blocks(filename, part_first, current, sizes, offset_in_part,
+                                                   part_data, part_size, sealed[part]);
+        });
+    }
+    CRYPTO_POOL.run(tasks);
+    for (size_t part = 0; part < parts; part++) {
+        if (results[part] != SGX_SUCCESS) {
+            return -EIO;
+        }
+    }
+    size_t block_index = first_block;
+    for (size_t part = 0; part < parts; part++) {
+        store_blocks(filename, blocks, block_index, sealed[part].data(), counts[part]);
+        block_index += counts[part];
+    }
+    return 0;
+}
+
+/**
+ * Unseals blocks of a file into the cache of the enclave ahead of the reads that need them.
+ * Called from the read-ahead thread.
+ */
+static void prefetch_blocks(const string &filename, size_t first, size_t count) {
+    ReadLock lock(NAMESPACE_LOCK);
+    auto entry = FILES->find(filename);
+    if (entry == FILES->end()) {
+        return;
+    }
+    auto blocks = entry->second;
+    // The lock is held until the blocks are cached, so that a write cannot make them stale in between
+    ReadLock file_lock(get_file_lock(filename));
+    if (restore_file(filename, blocks) < 0) {
+        return;
+    }
+    size_t number_of_blocks = (get_file_size(blocks) + SEALING_UNIT - 1) / SEALING_UNIT;
+    if (first >= number_of_blocks) {
+        return;
+    }
+    count = min(count, number_of_blocks - first);
+    vector<uint8_t> sealed;
+    vector<size_t> sizes;
+    blocks->gather(first, max(first, min(first + count, blocks->get_number_of_blocks())), sealed, sizes);
+    int ret;
+    ramfs_cache_prefetch(ENCLAVE_ID, &ret, get_file_id(blocks), filename.c_str(), first, count, SEALING_UNIT,
+                         sealed.data(), sealed.size(), sizes.data(), sizes.size());
+}
+
+/**
+ * Splits the content of a dumped file into its blocks, walked by the payload size in their header since the
+ * sealing unit may have changed
+ * @param sealed Whether the blocks are sealed with sgx_seal_data rather than encrypted with the volume key
+ * @return The size of every block, trailing bytes that do not form a block are left out
+ */
+static vector<size_t> get_block_sizes(const char* content, size_t size, bool sealed) {
+    size_t header_size = sealed ? sizeof(sgx_sealed_data_t) : sizeof(encrypted_block_t);
+    vector<size_t> sizes;
+    for (size_t position = 0; size - position >= header_size; position += sizes.back()) {
+        const char *header = content + position;
+        size_t payload = sealed ? reinterpret_cast<const sgx_sealed_data_t*>(header)->aes_data.payload_size
+                                : reinterpret_cast<const encrypted_block_t*>(header)->payload_size;
+        if (header_size + payload > size - position) {
+            break;
+        }
+        sizes.push_back(header_size + payload);
+    }
+    return sizes;
+}
+
+/**
+ * Converts blocks dumped when every block was sealed with sgx_seal_data into blocks encrypted with the
+ * volume key, in place
+ * @return 0 on success, -EIO if the blocks could not be converted
+ */
+static int import_blocks(const string &filename, vector<uint8_t> &blocks, vector<size_t> &sizes) {
+    size_t payload = blocks.size() - sizes.size() * sizeof(sgx_sealed_data_t);
+    vector<uint8_t> encrypted(sizeof(encrypted_block_t) * sizes.size() + payload);
+    sgx_status_t ret;
+    sgx_status_t status = ramfs_import_sealed_blocks(ENCLAVE_ID, &ret,
+                                                     filename.c_str(),
+                                                     blocks.data(), blocks.size(),
+                                                     sizes.data(), sizes.size(),
+                                                     encrypted.data(), encrypted.size());
+    if (status != SGX_SUCCESS || ret != SGX_SUCCESS) {
+        return -EIO;
+    }
+    for (auto it = sizes.begin(); it != sizes.end(); it++) {
+        *it += sizeof(encrypted_block_t) - sizeof(sgx_sealed_data_t);
+    }
+    blocks.swap(encrypted);
+    return 0;
+}
+
+/**
+ * Loads the blocks of a dumped file, resealing them if their sealing unit differs from the current one
+ * @param sealed Whether the blocks are sealed with sgx_seal_data rather than encrypted with the volume key
+ * @param reseal Whether to reseal the blocks even if they are in the current sealing unit
+ * @return 0 on success, -EIO if the content is not made of whole blocks or if the blocks could not be
+ *         converted or resealed
+ */
+static int load_blocks(const string &filename, const char* content, size_t size, bool sealed, bool reseal,
+                       EncryptedFile* blocks) {
+    vector<size_t> sizes = get_block_sizes(content, size, sealed);
+    size_t length = 0;
+    for (auto it = sizes.begin(); it != sizes.end(); it++) {
+        length += *it;
+    }
+    // Every byte dumped belongs to a block, a file cut short must not be restored as a shorter one
+    if (length != size) {
+        return -EIO;
+    }
+    vector<uint8_t> current(content, content + length);
+    if (sealed && import_blocks(filename, current, sizes) < 0) {
+        return -EIO;
+    }
+    bool uniform = true;
+    for (size_t index = 0; index < sizes.size() && uniform; index++) {
+        size_t payload = sizes[index] - sizeof(encrypted_block_t);
+        uniform = index + 1 < sizes.size() ? payload == SEALING_UNIT : payload <= SEALING_UNIT;
+    }
+    size_t number_of_blocks = sizes.size();
+    if (!uniform || reseal) {
+        size_t payload = current.size() - number_of_blocks * sizeof(encrypted_block_t);
+        number_of_blocks = (payload + SEALING_UNIT - 1) / SEALING_UNIT;
+        vector<uint8_t> resealed(sizeof(encrypted_block_t) * number_of_blocks + payload);
+        if (call_ramfs_seal_blocks(filename, 0, current, sizes, 0, NULL, 0, resealed) != SGX_SUCCESS) {
+            return -EIO;
+        }
+        current.swap(resealed);
+    }
+    blocks->store(0, current.data(), number_of_blocks);
+    return 0;
+}
+
+/**
+ * Loads the blocks of a file restored lazily from the checkpoint, the first time they are needed.
+ * The caller holds a lock of the file, and the read lock of NAMESPACE_LOCK unless no other thread runs yet.
+ * @return 0 on success, -EIO if the blocks could not be read, the file being left to restore
+ */
+static int restore_file(const string &filename, EncryptedFile* blocks) {
+    if (PENDING_FILES == 0) {
+        return 0;
+    }
+    ScopedLock lock(get_restore_lock(filename));
+    {
+        ScopedLock pending_lock(PENDING_LOCK);
+        if (PENDING.find(blocks) == PENDING.end()) {
+            return 0;
+        }
+    }
+    auto content = PACK.get_files().find(filename);
+    if (content == PACK.get_files().end() ||
+        load_blocks(filename, content->second.first, content->second.second, false, false, blocks) < 0) {
+        LOGGER.error("Could not restore " + filename + " from " + string(DUMP_PATH));
+        return -EIO;
+    }
+    ScopedLock pending_lock(PENDING_LOCK);
+    PENDING.erase(blocks);
+    PENDING_FILES--;
+    return 0;
+}
+
+/**
+ * Restores a file ahead of its first access, called from the preloader thread
+ */
+static void preload_file(const string &filename) {
+    ReadLock lock(NAMESPACE_LOCK);
+    auto entry = FILES->find(filename);
+    if (entry == FILES->end()) {
+        return;
+    }
+    ReadLock file_lock(get_file_lock(filename));
+    restore_file(filename, entry->second);
 }
 
 int ramfs_read(const char *path, char *buf, size_t size, off_t offset,
@@ -192,104 +907,143 @@ int ramfs_read(const char *path, char *buf, size_t size, off_t offset,
     string log_line_header = "ramfs_read(" + filename + \
                               ", offset=" + to_string(offset) + \
                               ", size=" + to_string(size) + ")";
+    ReadLock lock(NAMESPACE_LOCK);
     auto entry = FILES->find(filename);
     if (entry == FILES->end()) {
         //LOGGER.error(log_line_header + "): Not found");
         return -ENOENT;
     }
     auto blocks = entry->second;
-    auto block_index = size_t(floor(offset / BLOCK_SIZE));
-    if (blocks->size() <= block_index) {
-        //LOGGER.error(log_line_header + \
-                     ") Exiting because block_index is higher than blocks");
+    ReadLock file_lock(get_file_lock(filename));
+    if (restore_file(filename, blocks) < 0) {
+        return -EIO;
+    }
+    size_t file_size = get_file_size(blocks);
+    if ((size_t) offset >= file_size || size == 0) {
         return 0;
     }
-    auto read = read_data(blocks, buf, block_index, offset, size);
+    if (fi != NULL && fi->fh != 0) {
+        READ_AHEAD.on_read(reinterpret_cast<ReadAheadState*>(fi->fh), filename, offset, size, file_size);
+    }
+    auto first_block = size_t(offset / SEALING_UNIT);
+    auto last_block = (min(offset + size, file_size) + SEALING_UNIT - 1) / SEALING_UNIT;
+    vector<uint8_t> plaintext((last_block - first_block) * SEALING_UNIT);
+    int payload = read_blocks(filename, blocks, first_block, last_block, plaintext);
+    if (payload < 0) {
+        //LOGGER.error(log_line_header + ") Could not unseal blocks");
+        return -EIO;
+    }
+    size_t offset_in_block = offset % SEALING_UNIT;
+    if ((size_t) payload <= offset_in_block) {
+        return 0;
+    }
+    size_t read = min(size, payload - offset_in_block);
+    memcpy(buf, plaintext.data() + offset_in_block, read);
     return read;
 }
 
-int ramfs_write(const char *path, const char *data, size_t size, off_t offset,
-                struct fuse_file_info *) {
+static int write_file(const char *path, const char *data, size_t size, off_t offset) {
     string filename = clean_path(path);
+    ReadLock lock(NAMESPACE_LOCK);
     auto entry = FILES->find(filename);
     if (entry == FILES->end()) {
         return -ENOENT;
     }
     auto blocks = entry->second;
-    auto block_index = size_t(floor(offset / BLOCK_SIZE));
-    auto offset_in_block = offset % BLOCK_SIZE;
-    size_t payload_size = offset_in_block + size;
-    auto max_block = blocks->size() + 1;
-    if (block_index < blocks->size()) {
-        // FIXME(dburihabwa) Proper memory management
-        sgx_sealed_data_t *block = blocks->data()[block_index];
-        auto current_payload_size = block->aes_data.payload_size;
-        auto current_sealed_size = sizeof(sgx_sealed_data_t) + block->aes_data.payload_size;
-        auto new_payload_size = (payload_size > current_payload_size) ? payload_size : current_payload_size;
-        uint8_t *plaintext = new uint8_t[new_payload_size];
-        auto new_sealed_size = sizeof(sgx_sealed_data_t) + new_payload_size;
-        sgx_status_t ret;
-        ramfs_decrypt(ENCLAVE_ID,
-                      &ret,
-                      filename.c_str(),
-                      block, current_sealed_size,
-                      plaintext, block->aes_data.payload_size);
-        memcpy(plaintext + offset_in_block, data, payload_size);
-        auto new_block = (sgx_sealed_data_t*) calloc(new_sealed_size, sizeof(char));
-        ramfs_encrypt(ENCLAVE_ID,
-                      &ret,
-                      filename.c_str(),
-                      plaintext, new_payload_size,
-                      new_block, new_sealed_size);
-        (*(*FILES)[filename])[block_index] = new_block;
-        return size;
-    }
-    uint8_t *plaintext = new uint8_t[payload_size];
-    size_t sealed_size = sizeof(sgx_sealed_data_t) + payload_size;
-    auto *block = (sgx_sealed_data_t *) calloc(sealed_size, sizeof(char));
-    memcpy(plaintext + offset_in_block, data, payload_size);
-    sgx_status_t ret;
-    sgx_status_t status = ramfs_encrypt(ENCLAVE_ID,
-                                        &ret,
-                                        filename.c_str(),
-                                        plaintext, payload_size,
-                                        block, sealed_size);
-    blocks->push_back(block);
-    delete[] plaintext;
-    return payload_size;
+    WriteLock file_lock(get_file_lock(filename));
+    if (size == 0) {
+        return 0;
+    }
+    if (restore_file(filename, blocks) < 0) {
+        return -EIO;
+    }
+    touch(filename, get_current_time());
+    if (CACHE_CAPACITY > 0) {
+        int ret = cache_write(filename, blocks, offset, data, size);
+        if (ret == -ENOSPC) {
+            // Writing back the dirty blocks of the file lets the enclave evict them
+            if (write_back(filename, blocks, false) < 0) {
+                return -EIO;
+            }
+            ret = cache_write(filename, blocks, offset, data, size);
+        }
+        if (ret == 0) {
+            return size;
+        }
+        if (ret == -EIO) {
+            return ret;
+        }
+        // The write does not fit in the cache, it is sealed right away once the cached blocks of the file
+        // are sealed back and dropped
+        if (write_back(filename, blocks, true) < 0) {
+            return -EIO;
+        }
+    }
+    if (seal_write(filename, blocks, offset, data, size) < 0) {
+        //LOGGER.error("ramfs_write(" + filename + ") Could not seal blocks");
+        return -EIO;
+    }
+    return size;
+}
+
+static void maybe_checkpoint();
+
+int ramfs_write(const char *path, const char *data, size_t size, off_t offset,
+                struct fuse_file_info *) {
+    int ret = write_file(path, data, size, offset);
+    maybe_checkpoint();
+    return ret;
 }
 
 int ramfs_unlink(const char *pathname) {
     string filename = clean_path(pathname);
+    WriteLock lock(NAMESPACE_LOCK);
     auto entry = FILES->find(filename);
     if (entry == FILES->end()) {
         return -ENOENT;
     }
     auto blocks = entry->second;
-    for (auto it = blocks->begin(); it != blocks->end(); it++) {
-        auto block = (*it);
-        free(block);
+    // The address of the blocks identifies the file in the cache, and may be reused by another file
+    int ret;
+    ramfs_cache_discard(ENCLAVE_ID, &ret, get_file_id(blocks));
+    clear_dirty_blocks(blocks);
+    if (PENDING_FILES > 0) {
+        ScopedLock pending_lock(PENDING_LOCK);
+        PENDING_FILES -= PENDING.erase(blocks);
     }
-    blocks->clear();
     delete blocks;
     FILES->erase(filename);
+    DIRECTORIES[get_parent(filename)].erase(get_name(filename));
+    remove_metadata(filename, false, get_current_time());
+    journal_change(JOURNAL_UNLINK, filename, 0);
     return 0;
 }
 
-int ramfs_create(const char *path, mode_t mode, struct fuse_file_info *) {
+int ramfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     string filename = clean_path(path);
     //LOGGER.info("ramfs_create(" + filename + ") Entering");
+    WriteLock lock(NAMESPACE_LOCK);
 
     if (FILES->find(filename) != FILES->end()) {
         //LOGGER.error("ramfs_create(" + filename + "): Already exists");
         return -EEXIST;
     }
+    auto parent = DIRECTORIES.find(get_parent(filename));
+    if (parent == DIRECTORIES.end()) {
+        return -ENOENT;
+    }
 
     if ((mode & S_IFREG) == 0) {
         //LOGGER.error("ramfs_create(" + filename + "): Only files may be created");
         return -EINVAL;
     }
-    (*FILES)[filename] = new vector<sgx_sealed_data_t *>();
+    (*FILES)[filename] = new EncryptedFile(SEALING_UNIT);
+    parent->second.insert(get_name(filename));
+    add_metadata(filename, mode, false, get_current_time());
+    journal_change(JOURNAL_CREATE, filename, mode);
+    if (fi != NULL) {
+        fi->fh = reinterpret_cast<uint64_t>(new ReadAheadState());
+    }
     //LOGGER.info("ramfs_create(" + filename + ") Added new empty vector at address " + convert_pointer_to_string((*FILES)[filename]));
     //LOGGER.info("ramfs_create(" + filename + ") Exiting");
     return 0;
@@ -308,11 +1062,12 @@ int ramfs_access(const char *path, int) {
     return 0;
 }
 
-int ramfs_truncate(const char *path, off_t length) {
+static int truncate_file(const char *path, off_t length) {
     string filename = clean_path(path);
     //LOGGER.info("[ramfs_truncate]" + filename);
-    auto len = static_cast<unsigned int>(length);
+    auto len = static_cast<size_t>(length);
 
+    ReadLock lock(NAMESPACE_LOCK);
     auto entry = FILES->find(filename);
     if (entry == FILES->end()) {
         //LOGGER.error("ramfs_truncate(" + filename + "): Not found");
@@ -320,92 +1075,73 @@ int ramfs_truncate(const char *path, off_t length) {
     }
 
     auto blocks = entry->second;
-    auto file_size = compute_file_size(blocks);
+    WriteLock file_lock(get_file_lock(filename));
+    if (restore_file(filename, blocks) < 0 || write_back(filename, blocks, true) < 0) {
+        return -EIO;
+    }
+    auto file_size = blocks->get_size();
 
     //LOGGER.info("[ramfs_truncate] file size = " + to_string(file_size) + ", length = " + to_string(len));
 
     if (file_size == len) {
         return 0;
     }
-
-    //LOGGER.info("[ramfs_truncate] POUET");
-
-
-    if (file_size <= len) {
-        auto length_difference = len - blocks->size();
-        auto blocks_to_add = (size_t) floor(length_difference / BLOCK_SIZE);
-        if (blocks_to_add > 0) {
-            uint8_t *dummy_text = new uint8_t[BLOCK_SIZE];
-            size_t sealed_size = sizeof(sgx_sealed_data_t) + BLOCK_SIZE;
-            sgx_sealed_data_t *dummy_block = (sgx_sealed_data_t *) malloc(sealed_size);
-            sgx_status_t ret;
-            ramfs_encrypt(ENCLAVE_ID,
-                          &ret,
-                          filename.c_str(),
-                          dummy_text, BLOCK_SIZE,
-                          dummy_block, sealed_size);
-            for (size_t i = 0; i < blocks_to_add; i++) {
-                sgx_sealed_data_t *block_copy = (sgx_sealed_data_t *) malloc(sealed_size);
-                memcpy(block_copy, dummy_block, sealed_size);
-                blocks->push_back(block_copy);
+    touch(filename, get_current_time());
+
+    if (file_size < len) {
+        // Growing the file seals zeros past its end, a chunk at a time
+        vector<char> zeros(min<size_t>(len - file_size, 1 << 20), 0);
+        for (size_t offset = file_size; offset < len; offset += zeros.size()) {
+            if (seal_write(filename, blocks, offset, zeros.data(), min(zeros.size(), len - offset)) < 0) {
+                return -EIO;
             }
-            free(dummy_block);
-            delete[] dummy_text;
-        }
-        auto length_of_last_block = len % BLOCK_SIZE;
-        if (length_of_last_block > 0) {
-            uint8_t *dummy_text = new uint8_t[length_of_last_block];
-            size_t sealed_size = sizeof(sgx_sealed_data_t) + length_of_last_block;
-            sgx_sealed_data_t *dummy_block = (sgx_sealed_data_t *) malloc(sealed_size);
-            sgx_status_t ret;
-            ramfs_encrypt(ENCLAVE_ID,
-                          &ret,
-                          filename.c_str(),
-                          dummy_text, BLOCK_SIZE,
-                          dummy_block, sealed_size);
-            blocks->push_back(dummy_block);
-            delete[] dummy_text;
         }
-
-        //LOGGER.info("[ramfs_truncate] exiting");
         return 0;
     }
 
-
-    auto blocks_to_keep = static_cast<unsigned int>(int(ceil(len / BLOCK_SIZE)));
-    //LOGGER.info("[ramfs_truncate] Keeping " + to_string(blocks_to_keep) + " blocks");
-    while (blocks_to_keep < blocks->size()) {
-        free(blocks->back());
-        blocks->pop_back();
-    }
-    //blocks.erase(blocks.begin() + blocks_to_keep, blocks.end());
-    //LOGGER.info("[ramfs_truncate] " + to_string(blocks->size()) + " blocks left");
-    if (blocks->empty()) {
+    size_t number_of_blocks = (len + SEALING_UNIT - 1) / SEALING_UNIT;
+    blocks->truncate(number_of_blocks);
+    journal_change(JOURNAL_TRUNCATE, filename, number_of_blocks);
+    auto bytes_to_keep = len % SEALING_UNIT;
+    if (bytes_to_keep == 0) {
         return 0;
     }
-
-    auto block_to_trim = blocks->back();
-    auto bytes_to_keep = len % BLOCK_SIZE;
-    auto payload_size = block_to_trim->aes_data.payload_size;
-    auto sealed_size = sizeof(sgx_sealed_data_t) + payload_size;
-    uint8_t *plaintext = new uint8_t[payload_size];
+    // The last block kept is partially cut, it is encrypted again with the bytes left
+    size_t last_block = blocks->get_number_of_blocks() - 1;
+    vector<uint8_t> block;
+    vector<size_t> sizes;
+    auto payload_size = blocks->gather(last_block, last_block + 1, block, sizes);
+    vector<uint8_t> plaintext(payload_size);
     sgx_status_t ret;
-    ramfs_decrypt(ENCLAVE_ID,
-                  &ret,
-                  filename.c_str(),
-                  block_to_trim, sealed_size,
-                  plaintext, payload_size);
-    ramfs_encrypt(ENCLAVE_ID,
-                  &ret,
-                  filename.c_str(),
-                  plaintext, bytes_to_keep,
-                  block_to_trim, sizeof(sgx_sealed_data_t) + bytes_to_keep);
-    delete[] plaintext;
+    sgx_status_t status = ramfs_decrypt(ENCLAVE_ID,
+                                        &ret,
+                                        filename.c_str(), last_block,
+                                        block.data(), block.size(),
+                                        plaintext.data(), payload_size);
+    if (status != SGX_SUCCESS || ret != SGX_SUCCESS) {
+        return -EIO;
+    }
+    block.resize(sizeof(encrypted_block_t) + bytes_to_keep);
+    status = ramfs_encrypt(ENCLAVE_ID,
+                           &ret,
+                           filename.c_str(), last_block,
+                           plaintext.data(), bytes_to_keep,
+                           block.data(), block.size());
+    if (status != SGX_SUCCESS || ret != SGX_SUCCESS) {
+        return -EIO;
+    }
+    store_blocks(filename, blocks, last_block, block.data(), 1);
     //LOGGER.info("[ramfs_truncate] exiting");
 
     return 0;
 }
 
+int ramfs_truncate(const char *path, off_t length) {
+    int ret = truncate_file(path, length);
+    maybe_checkpoint();
+    return ret;
+}
+
 int ramfs_mknod(const char *path, mode_t mode, dev_t dev) {
     cout << "ramfs_mknod not implemented" << endl;
     return -EINVAL;
@@ -414,8 +1150,9 @@ int ramfs_mknod(const char *path, mode_t mode, dev_t dev) {
 int ramfs_mkdir(const char *dir_path, mode_t mode) {
     string path = clean_path(dir_path);
     if (path.length() == 0) {
-        return -1;
+        return -EEXIST;
     }
+    WriteLock lock(NAMESPACE_LOCK);
     auto existing_directory = DIRECTORIES.find(path);
     if (existing_directory != DIRECTORIES.end()) {
         return 0;
@@ -423,31 +1160,39 @@ int ramfs_mkdir(const char *dir_path, mode_t mode) {
     auto existing_file = FILES->find(path);
     if (existing_file != FILES->end()) {
         //LOGGER.error("A file with the name " + path + " already exists!");
-        return -1;
+        return -EEXIST;
     }
-    if (path[path.length() - 1] == '/') {
-        path = path.substr(0, path.length() - 1);
+    auto parent = DIRECTORIES.find(get_parent(path));
+    if (parent == DIRECTORIES.end()) {
+        return -ENOENT;
     }
-    DIRECTORIES[path] = true;
+    parent->second.insert(get_name(path));
+    DIRECTORIES[path];
+    add_metadata(path, mode, true, get_current_time());
+    journal_change(JOURNAL_MKDIR, path, mode);
     return 0;
 }
 
 int ramfs_rmdir(const char *path) {
     string directory = clean_path(path);
+    WriteLock lock(NAMESPACE_LOCK);
     if (FILES->find(directory) != FILES->end()) {
-        errno = ENOTDIR;
-        return -1;
-    }
-    if (FILES->lower_bound(directory) != FILES->end()) {
-        errno = ENOTEMPTY;
-        return -1;
+        return -ENOTDIR;
     }
     auto entry = DIRECTORIES.find(directory);
     if (entry == DIRECTORIES.end()) {
-        errno = ENOENT;
-        return -1;
+        return -ENOENT;
+    }
+    if (directory.empty()) {
+        return -EBUSY;
+    }
+    if (!entry->second.empty()) {
+        return -ENOTEMPTY;
     }
     DIRECTORIES.erase(entry);
+    DIRECTORIES[get_parent(directory)].erase(get_name(directory));
+    remove_metadata(directory, true, get_current_time());
+    journal_change(JOURNAL_RMDIR, directory, 0);
     return 0;
 }
 
@@ -496,18 +1241,248 @@ int ramfs_setxattr(const char *, const char *, const char *, size_t, int) {
     return -EINVAL;
 }
 
+/**
+ * Seals the dirty blocks of a file cached in the enclave
+ */
+static int flush_file(const char *path) {
+    string filename = clean_path(path);
+    int ret = -ENOENT;
+    {
+        ReadLock lock(NAMESPACE_LOCK);
+        auto entry = FILES->find(filename);
+        if (entry != FILES->end()) {
+            WriteLock file_lock(get_file_lock(filename));
+            ret = write_back(filename, entry->second, false);
+        }
+    }
+    maybe_checkpoint();
+    return ret;
+}
+
 int ramfs_flush(const char *path, struct fuse_file_info *fi) {
-    return 0;
+    return flush_file(path);
 }
 
 int ramfs_release(const char *path, struct fuse_file_info *fi) {
-    return 0;
+    delete reinterpret_cast<ReadAheadState*>(fi->fh);
+    fi->fh = 0;
+    return flush_file(path);
 }
 
 int ramfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    int ret = flush_file(path);
+    // The changes of the file are only durable once the journal holding them is synced
+    return ret < 0 ? ret : JOURNAL.commit();
+}
+
+/**
+ * Seals records, a batch of the journal or the index of a pack, with the key of the enclave
+ * @return 0 on success, -EIO if the records could not be sealed
+ */
+static int seal_records(const vector<char> &records, vector<char>* sealed) {
+    sealed->resize(sizeof(sgx_sealed_data_t) + records.size());
+    int ret;
+    sgx_status_t status = journal_seal(ENCLAVE_ID, &ret,
+                                       reinterpret_cast<const uint8_t*>(records.data()), records.size(),
+                                       reinterpret_cast<uint8_t*>(sealed->data()), sealed->size());
+    return status != SGX_SUCCESS || ret < 0 ? -EIO : 0;
+}
+
+/**
+ * Unseals records sealed by seal_records
+ * @return 0 on success, -EIO if the records could not be unsealed
+ */
+static int unseal_records(const vector<char> &sealed, vector<char>* records) {
+    if (sealed.size() < sizeof(sgx_sealed_data_t)) {
+        return -EIO;
+    }
+    size_t size = reinterpret_cast<const sgx_sealed_data_t*>(sealed.data())->aes_data.payload_size;
+    if (size > sealed.size()) {
+        return -EIO;
+    }
+    records->resize(size);
+    int ret;
+    sgx_status_t status = journal_unseal(ENCLAVE_ID, &ret,
+                                         reinterpret_cast<const uint8_t*>(sealed.data()), sealed.size(),
+                                         reinterpret_cast<uint8_t*>(records->data()), records->size());
+    return status != SGX_SUCCESS || ret < 0 ? -EIO : 0;
+}
+
+/**
+ * Seals the changes recorded since the previous batch of the journal, called from its background thread
+ */
+static int collect_changes(vector<char>* batch) {
+    vector<char> records;
+    {
+        ScopedLock lock(JOURNAL_RECORDS_LOCK);
+        records.swap(JOURNAL_RECORDS);
+    }
+    if (records.empty()) {
+        return 0;
+    }
+    return seal_records(records, batch);
+}
+
+/**
+ * Applies a change read back from the journal to the files restored from the checkpoint
+ */
+static void apply_change(const JournalRecord &record) {
+    const char* path = record.path.c_str();
+    if (record.type == JOURNAL_CREATE) {
+        ramfs_create(path, record.value, NULL);
+        return;
+    } else if (record.type == JOURNAL_UNLINK) {
+        ramfs_unlink(path);
+        return;
+    } else if (record.type == JOURNAL_MKDIR) {
+        ramfs_mkdir(path, record.value);
+        return;
+    } else if (record.type == JOURNAL_RMDIR) {
+        ramfs_rmdir(path);
+        return;
+    }
+    auto entry = FILES->find(record.path);
+    if (entry == FILES->end()) {
+        return;
+    }
+    auto blocks = entry->second;
+    if (restore_file(record.path, blocks) < 0) {
+        return;
+    }
+    if (record.type == JOURNAL_TRUNCATE) {
+        blocks->truncate(record.value);
+        return;
+    }
+    if (record.type != JOURNAL_STORE || record.value > blocks->get_number_of_blocks()) {
+        return;
+    }
+    size_t count = 0;
+    for (size_t position = 0; record.size - position >= sizeof(encrypted_block_t); count++) {
+        auto block = reinterpret_cast<const encrypted_block_t*>(record.data + position);
+        if (block->payload_size > record.size - position - sizeof(encrypted_block_t)) {
+            break;
+        }
+        position += sizeof(encrypted_block_t) + block->payload_size;
+    }
+    blocks->store(record.value, reinterpret_cast<const uint8_t*>(record.data), count);
+}
+
+/**
+ * Unseals a batch of the journal and applies its changes in order
+ * @return 0 on success, -EIO if the batch could not be unsealed
+ */
+static int replay_changes(const vector<char> &batch) {
+    vector<char> records;
+    if (unseal_records(batch, &records) < 0) {
+        return -EIO;
+    }
+    size_t position = 0;
+    JournalRecord record;
+    while (read_journal_record(records, &position, &record)) {
+        apply_change(record);
+    }
     return 0;
 }
 
+/**
+ * Writes the encrypted blocks of every file to a new checkpoint and starts an empty journal.
+ * Blocks left dirty in the cache are not written back: like the changes made after the checkpoint, they
+ * reach the journal once they are. Files cannot change until the checkpoint is installed.
+ * Runs on the background thread of the journal, which it rotates.
+ * @return 0 on success, a negative error code otherwise
+ */
+static int checkpoint() {
+    WriteLock lock(NAMESPACE_LOCK);
+    // Files restored lazily are read from the pack this checkpoint replaces
+    for (auto it = FILES->begin(); it != FILES->end() && PENDING_FILES > 0; it++) {
+        if (restore_file(it->first, it->second) < 0) {
+            return -EIO;
+        }
+    }
+    PACK.close();
+    // The journal is rotated first: until the checkpoint is installed, both journals are replayed on top
+    // of the previous one
+    int ret = JOURNAL.rotate(OLD_JOURNAL_PATH, SEALING_UNIT);
+    if (ret < 0) {
+        return ret;
+    }
+    // The names of the files are only written in the index of the pack, which is sealed
+    PackWriter pack(prepare_checkpoint(DUMP_PATH) + "/" + PACK_NAME, OPTIONS.direct_checkpoint);
+    vector<string> names;
+    for (auto it = FILES->begin(); it != FILES->end(); it++) {
+        names.push_back(it->first);
+    }
+    // The blocks of the next files are gathered on the pool while the previous ones are written
+    atomic<size_t> size(0);
+    ret = pack.add_parallel(names, [&size](const string &filename, PackAppend* append) {
+        EncryptedFile* blocks = FILES->at(filename);
+        vector<uint8_t> sealed_data;
+        vector<size_t> sizes;
+        blocks->gather(0, blocks->get_number_of_blocks(), sealed_data, sizes);
+        size += sealed_data.size();
+        return (*append)(reinterpret_cast<const char*>(sealed_data.data()), sealed_data.size());
+    }, CRYPTO_POOL);
+    if (ret < 0 || pack.close(seal_records) < 0) {
+        return -EIO;
+    }
+    ret = install_checkpoint(DUMP_PATH, OLD_JOURNAL_PATH);
+    if (ret == 0) {
+        CHECKPOINT_SIZE = size.load();
+    }
+    return ret;
+}
+
+static bool checkpoint_needed() {
+    return JOURNAL.get_size() > max((size_t) OPTIONS.checkpoint_size << 20, CHECKPOINT_SIZE.load());
+}
+
+/**
+ * Has the journal checkpoint the files once it outgrows both the checkpoint_size option and the last
+ * checkpoint, which bounds the time spent replaying it at mount, and the data written by checkpoints to the
+ * data changed. The caller goes on while the checkpoint is written.
+ */
+static void maybe_checkpoint() {
+    if (checkpoint_needed()) {
+        JOURNAL.request_checkpoint();
+    }
+}
+
+/**
+ * Reseals every file in units of sealing_unit bytes, which also binds blocks encrypted before blocks were
+ * authenticated along with their file and index
+ */
+static int reseal_files(size_t sealing_unit, Logger &log) {
+    SEALING_UNIT = sealing_unit;
+    int ret = 0;
+    for (auto it = FILES->begin(); it != FILES->end(); it++) {
+        vector<uint8_t> sealed_data;
+        vector<size_t> sizes;
+        it->second->gather(0, it->second->get_number_of_blocks(), sealed_data, sizes);
+        auto blocks = new EncryptedFile(SEALING_UNIT);
+        if (load_blocks(it->first, reinterpret_cast<const char*>(sealed_data.data()), sealed_data.size(), false, true,
+                        blocks) < 0) {
+            log.error("Could not reseal " + it->first + " in units of " + to_string(SEALING_UNIT) + " bytes");
+            ret = -EIO;
+        }
+        delete it->second;
+        it->second = blocks;
+    }
+    return ret;
+}
+
+/**
+ * Stops a mount that could not restore every file, before a checkpoint replaces the dump without them
+ * @param sealed Whether the volume key was generated by this mount
+ */
+static void abort_restore(bool sealed, Logger &log) {
+    // The dump is still sealed with sgx_seal_data, and the next mount must not read it with this key
+    if (sealed) {
+        unlink(KEY_PATH);
+    }
+    log.error("Could not restore every file of " + string(DUMP_PATH) + ", which is left unchanged");
+    exit(1);
+}
+
 void* init(struct fuse_conn_info *conn) {
   Logger init_log("sgx-ramfs-mount.log");
   chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
@@ -520,53 +1495,551 @@ void* init(struct fuse_conn_info *conn) {
       // LOGGER.error("Fail to initialize enclave.");
       exit(1);
   }
-  FILES = restore_sgx_map("sgx_ramfs_dump");
-  for (auto it = FILES->begin(); it != FILES->end(); it++) {
+  int ret;
+  sgx_status_t status = ramfs_cache_init(ENCLAVE_ID, &ret, (size_t) OPTIONS.cache_size << 20, SEALING_UNIT);
+  if (status != SGX_SUCCESS || ret < 0) {
+      init_log.error("Could not create a block cache of " + to_string(OPTIONS.cache_size) + " MiB");
+      exit(1);
+  }
+  CACHE_CAPACITY = ((size_t) OPTIONS.cache_size << 20) / SEALING_UNIT;
+  CRYPTO_POOL.resize(OPTIONS.crypto_threads - 1);
+  // Blocks are read ahead into the cache, and a window larger than a quarter of it would evict itself
+  READ_AHEAD.start(min((size_t) OPTIONS.read_ahead << 10, CACHE_CAPACITY * SEALING_UNIT / 4), SEALING_UNIT);
+  ifstream key_stream(KEY_PATH, ios::binary);
+  vector<uint8_t> sealed_key((istreambuf_iterator<char>(key_stream)), istreambuf_iterator<char>());
+  key_stream.close();
+  status = ramfs_key_init(ENCLAVE_ID, &ret, sealed_key.data(), sealed_key.size());
+  if (status != SGX_SUCCESS || ret < 0) {
+      init_log.error("Could not load the volume key from " + string(KEY_PATH));
+      exit(1);
+  }
+  // A key sealed without its tag predates blocks bound to their file and index, which are encrypted again
+  // below
+  bool bound = ret > 0;
+  // A dump without a sealed key predates the volume key, its blocks are sealed with sgx_seal_data
+  bool sealed = sealed_key.empty();
+  if (sealed) {
+    // The key is sealed before any block encrypted with it reaches the disk, and synced by the checkpoint
+    // written below, before the first batch of the journal
+    sealed_key.resize(SEALED_KEY_SIZE);
+    status = ramfs_key_seal(ENCLAVE_ID, &ret, sealed_key.data(), sealed_key.size());
+    if (status != SGX_SUCCESS || ret < 0) {
+      init_log.error("Could not seal the volume key to " + string(KEY_PATH));
+      exit(1);
+    }
+    dump(reinterpret_cast<char*>(sealed_key.data()), KEY_PATH, sealed_key.size());
+  }
+  recover_checkpoint(DUMP_PATH, OLD_JOURNAL_PATH);
+  // The checkpoint and the journals hold blocks of the unit the journals were started with, the files are
+  // restored and the changes replayed in that unit before they are resealed in the requested one
+  size_t sealing_unit = SEALING_UNIT;
+  uint64_t journal_unit;
+  bool old_journal = Journal::get_parameter(OLD_JOURNAL_PATH, &journal_unit) == 0;
+  bool journal = old_journal || Journal::get_parameter(JOURNAL_PATH, &journal_unit) == 0;
+  if (journal && journal_unit > 0 && journal_unit <= MAX_SEALING_UNIT) {
+    SEALING_UNIT = journal_unit;
+  }
+  FILES = new map<string, EncryptedFile*>();
+  DIRECTORIES[""];
+  // Dumps only hold the content of the files, which are restored as if they were created at mount time
+  uint64_t mount_time = get_current_time();
+  add_metadata("", 0777, true, mount_time);
+  ret = PACK.open(string(DUMP_PATH) + "/" + PACK_NAME, unseal_records);
+  if (ret < 0 && ret != -ENOENT) {
+    init_log.error("Could not read the pack of " + string(DUMP_PATH));
+    exit(1);
+  }
+  // Dumps from before packs hold a host file per file, they are read whole and packed by the checkpoint
+  // written below
+  bool legacy = ret == -ENOENT;
+  map<string, vector<char>*>* legacy_files = legacy ? restore_map(DUMP_PATH, &CRYPTO_POOL) : NULL;
+  map<string, pair<const char*, size_t>> dumped_files;
+  if (legacy) {
+    for (auto it = legacy_files->begin(); it != legacy_files->end(); it++) {
+      dumped_files[it->first] = make_pair(it->second->data(), it->second->size());
+    }
+  } else {
+    dumped_files = PACK.get_files();
+  }
+  vector<int> resealed(dumped_files.size());
+  vector<string> pending_files;
+  // Blocks packed in the unit of the journal and already encrypted with the volume key are loaded as they
+  // are, so they can wait for their first access. Otherwise, the checkpoint written below needs every file.
+  if (OPTIONS.lazy_restore && journal && !old_journal && !sealed && !legacy && bound &&
+      SEALING_UNIT == sealing_unit) {
+    for (auto it = dumped_files.begin(); it != dumped_files.end(); it++) {
+      auto blocks = new EncryptedFile(SEALING_UNIT);
+      (*FILES)[it->first] = blocks;
+      if (it->second.second > 0) {
+        PENDING[blocks] = it->second.second;
+        pending_files.push_back(it->first);
+      }
+    }
+    PENDING_FILES = PENDING.size();
+  } else {
+    // Files are resealed in parallel, each one by a single thread
+    vector<function<void()>> tasks;
+    for (auto it = dumped_files.begin(); it != dumped_files.end(); it++) {
+      auto filename = it->first;
+      auto content = it->second;
+      auto blocks = new EncryptedFile(SEALING_UNIT);
+      (*FILES)[it->first] = blocks;
+      int *result = &resealed[tasks.size()];
+      tasks.push_back([filename, content, sealed, blocks, result] {
+        *result = load_blocks(filename, content.first, content.second, sealed, false, blocks);
+      });
+    }
+    CRYPTO_POOL.run(tasks);
+    PACK.close();
+    if (legacy) {
+      for (auto it = legacy_files->begin(); it != legacy_files->end(); it++) {
+        delete it->second;
+      }
+      delete legacy_files;
+    }
+  }
+  size_t index = 0;
+  bool restored = true;
+  for (auto it = FILES->begin(); it != FILES->end(); it++, index++) {
     string filename = it->first;
+    if (resealed[index] < 0) {
+      init_log.error("Could not reseal " + filename + " in units of " + to_string(SEALING_UNIT) + " bytes");
+      restored = false;
+    }
     vector<string>* tokens = split_path(filename);
     string directory_name;
     for (size_t i = 0; i < tokens->size() - 1; i++) {
       directory_name += tokens->at(i) + "/";
       ramfs_mkdir(directory_name.c_str(), 0777);
     }
+    DIRECTORIES[get_parent(filename)].insert(get_name(filename));
+    add_metadata(filename, 0777, false, mount_time);
     delete tokens;
   }
+  // A file left without its blocks would reach the next checkpoint empty, and the dump be deleted
+  if (!restored) {
+    abort_restore(sealed, init_log);
+  }
+  if (old_journal && Journal::replay(OLD_JOURNAL_PATH, replay_changes) < 0) {
+    init_log.error("Could not replay " + string(OLD_JOURNAL_PATH));
+  }
+  JOURNAL.set_checkpoint([] {
+    int ret = checkpoint();
+    if (ret < 0) {
+      LOGGER.error("Could not checkpoint the files to " + string(DUMP_PATH));
+    }
+    return ret;
+  });
+  if (JOURNAL.open(JOURNAL_PATH, SEALING_UNIT, replay_changes) < 0) {
+    init_log.error("Could not open the journal " + string(JOURNAL_PATH));
+    exit(1);
+  }
+  bool resealing = SEALING_UNIT != sealing_unit || !bound;
+  if (resealing && reseal_files(sealing_unit, init_log) < 0) {
+    abort_restore(sealed, init_log);
+  }
+  // The old journal is only dropped by a checkpoint, and converted, resealed or unpacked files are only
+  // written by one
+  if ((old_journal || sealed || resealing || legacy) && JOURNAL.checkpoint() < 0) {
+    init_log.error("Could not checkpoint the files to " + string(DUMP_PATH));
+    exit(1);
+  }
+  // The key is sealed again with its tag once the checkpoint only holds bound blocks, and replaced at once
+  // so that a crash leaves either key
+  if (!bound) {
+    sealed_key.resize(SEALED_KEY_SIZE);
+    status = ramfs_key_seal(ENCLAVE_ID, &ret, sealed_key.data(), sealed_key.size());
+    string key_path = string(KEY_PATH) + ".tmp";
+    if (status == SGX_SUCCESS && ret == 0) {
+      dump(reinterpret_cast<char*>(sealed_key.data()), key_path, sealed_key.size());
+    }
+    if (status != SGX_SUCCESS || ret < 0 || rename(key_path.c_str(), KEY_PATH) < 0) {
+      init_log.error("Could not seal the volume key to " + string(KEY_PATH));
+      exit(1);
+    }
+  }
+  JOURNALING = true;
+  PRELOADER.start(pending_files);
   chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
   auto duration = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+  if (OPTIONS.switchless) {
+    SWITCHLESS.start(OPTIONS.switchless_workers);
+  }
   init_log.info("Mounted in " + to_string(duration) + " nanoseconds");
   return FILES;
 }
 
-static void dump_fs(const string &path) {
-  // TODO(dburihabwa) Support dumping of files and directories in a hierarchy
-  for (auto it = FILES->begin(); it != FILES->end(); it++) {
-    auto pathname = it->first;
-    auto blocks = it->second;
-    auto sealed_size = compute_file_size(blocks) + (blocks->size() * sizeof(sgx_sealed_data_t));
-    auto dump_pathname = path + "/" + pathname;
-    char* sealed_data = new char[sealed_size];
-    size_t offset = 0;
-    for (auto b = blocks->begin(); b != blocks->end(); b++) {
-      sgx_sealed_data_t* block = (*b);
-      auto block_size = sizeof(sgx_sealed_data_t) + block->aes_data.payload_size;
-      memcpy(sealed_data + offset, reinterpret_cast<char*>(block), block_size);
-      offset += block_size;
-    }
-    dump(reinterpret_cast<char*>((sealed_data)), dump_pathname, sealed_size);
-    free(sealed_data);
-  }
-}
-
 void destroy(void* unused_private_data) {
   Logger init_log("sgx-ramfs-mount.log");
   chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-  dump_fs("sgx_ramfs_dump");
+  PRELOADER.stop();
+  READ_AHEAD.stop();
+  // A checkpoint the journal is writing is over once a later round is committed
+  JOURNAL.commit();
+  SWITCHLESS.stop();
+  CRYPTO_POOL.resize(0);
+  // The files are already in the checkpoint and the journal, only the blocks still dirty are left to write.
+  // Files never restored are unchanged since the checkpoint.
+  for (auto it = FILES->begin(); it != FILES->end(); it++) {
+    write_back(it->first, it->second, false);
+  }
+  if (JOURNAL.close() < 0) {
+    init_log.error("Could not commit the journal " + string(JOURNAL_PATH));
+  }
+  PACK.close();
   sgx_destroy_enclave(ENCLAVE_ID);
   chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
   auto duration = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
   init_log.info("Unmounted in " + to_string(duration) + " nanoseconds");
 }
 
+/**
+ * Low-level frontend. Files stay keyed by path, so the inode numbers handed to the kernel are mapped to
+ * the paths they were looked up at, for as long as the kernel references them.
+ */
+struct InodeEntry {
+    string path;
+    uint64_t lookups;
+    // Set once the path is removed, which makes the inode stale until the kernel forgets it
+    bool removed;
+};
+
+static unordered_map<uint64_t, InodeEntry> INODES;
+static unordered_map<string, uint64_t> INODE_NUMBERS;
+static uint64_t NEXT_INODE = FUSE_ROOT_ID + 1;
+static Mutex INODES_LOCK;
+
+/**
+ * Inode number given to the entries of a directory that the kernel has not looked up, as fuse_main does
+ */
+static const uint64_t UNKNOWN_INODE = 0xffffffff;
+
+static int get_inode_path(fuse_ino_t ino, string* path) {
+    if (ino == FUSE_ROOT_ID) {
+        path->clear();
+        return 0;
+    }
+    ScopedLock lock(INODES_LOCK);
+    auto entry = INODES.find(ino);
+    if (entry == INODES.end() || entry->second.removed) {
+        return -ENOENT;
+    }
+    *path = entry->second.path;
+    return 0;
+}
+
+static int get_child_path(fuse_ino_t parent, const char* name, string* path) {
+    int ret = get_inode_path(parent, path);
+    if (ret < 0) {
+        return ret;
+    }
+    *path = path->empty() ? name : *path + "/" + name;
+    return 0;
+}
+
+/**
+ * Gives the inode number of a path to the kernel, which holds a reference on it until it forgets it
+ */
+static uint64_t reference_inode(const string &path) {
+    if (path.empty()) {
+        return FUSE_ROOT_ID;
+    }
+    ScopedLock lock(INODES_LOCK);
+    auto number = INODE_NUMBERS.find(path);
+    if (number == INODE_NUMBERS.end()) {
+        number = INODE_NUMBERS.insert(make_pair(path, NEXT_INODE++)).first;
+        INODES[number->second] = InodeEntry{path, 0, false};
+    }
+    INODES.at(number->second).lookups++;
+    return number->second;
+}
+
+static void forget_inode(fuse_ino_t ino, uint64_t count) {
+    ScopedLock lock(INODES_LOCK);
+    auto entry = INODES.find(ino);
+    if (entry == INODES.end()) {
+        return;
+    }
+    entry->second.lookups -= min(count, entry->second.lookups);
+    if (entry->second.lookups == 0) {
+        if (!entry->second.removed) {
+            INODE_NUMBERS.erase(entry->second.path);
+        }
+        INODES.erase(entry);
+    }
+}
+
+/**
+ * Detaches a removed path from its inode number, so that a new file at the same path gets a new number
+ */
+static void remove_inode(const string &path) {
+    ScopedLock lock(INODES_LOCK);
+    auto number = INODE_NUMBERS.find(path);
+    if (number == INODE_NUMBERS.end()) {
+        return;
+    }
+    INODES.at(number->second).removed = true;
+    INODE_NUMBERS.erase(number);
+}
+
+static void ramfs_ll_init(void* userdata, struct fuse_conn_info* conn) {
+    init(conn);
+}
+
+static void ramfs_ll_destroy(void* userdata) {
+    destroy(userdata);
+}
+
+/**
+ * Replies to a request creating or looking up path with its attributes, after a successful ret
+ */
+static void reply_lookup(fuse_req_t req, int ret, const string &path) {
+    struct stat stbuf;
+    if (ret == 0) {
+        ret = ramfs_getattr(path.c_str(), &stbuf);
+    }
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    stbuf.st_ino = reference_inode(path);
+    reply_entry(req, stbuf);
+}
+
+static void ramfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    string path;
+    int ret = get_child_path(parent, name, &path);
+    reply_lookup(req, ret, path);
+}
+
+static void ramfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    forget_inode(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ramfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        forget_inode(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void ramfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    struct stat stbuf;
+    int ret = get_inode_path(ino, &path);
+    if (ret == 0) {
+        ret = ramfs_getattr(path.c_str(), &stbuf);
+    }
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    stbuf.st_ino = ino;
+    fuse_reply_attr(req, &stbuf, LOWLEVEL_TIMEOUT);
+}
+
+static void ramfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                             struct fuse_file_info *fi) {
+    // Like chmod and chown, changing the owner or the mode is not supported, new times are ignored like utimens
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        string path;
+        int ret = get_inode_path(ino, &path);
+        if (ret == 0) {
+            ret = ramfs_truncate(path.c_str(), attr->st_size);
+        }
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+    }
+    ramfs_ll_getattr(req, ino, fi);
+}
+
+static void ramfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    int ret = get_inode_path(ino, &path);
+    if (ret == 0) {
+        ret = ramfs_open(path.c_str(), fi);
+    }
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_open(req, fi);
+}
+
+static void ramfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    string path;
+    vector<char> buffer(size);
+    int ret = get_inode_path(ino, &path);
+    if (ret == 0) {
+        ret = ramfs_read(path.c_str(), buffer.data(), size, offset, fi);
+    }
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_buf(req, buffer.data(), ret);
+}
+
+static void ramfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *data, size_t size, off_t offset,
+                           struct fuse_file_info *fi) {
+    string path;
+    int ret = get_inode_path(ino, &path);
+    if (ret == 0) {
+        ret = ramfs_write(path.c_str(), data, size, offset, fi);
+    }
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_write(req, ret);
+}
+
+static void ramfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    int ret = get_inode_path(ino, &path);
+    fuse_reply_err(req, ret < 0 ? -ret : -flush_file(path.c_str()));
+}
+
+static void ramfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    int ret = get_inode_path(ino, &path);
+    if (ret < 0) {
+        // The file is gone along with its blocks, only the read-ahead state is left
+        delete reinterpret_cast<ReadAheadState*>(fi->fh);
+        fuse_reply_err(req, 0);
+        return;
+    }
+    fuse_reply_err(req, -ramfs_release(path.c_str(), fi));
+}
+
+static void ramfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    string path;
+    int ret = get_inode_path(ino, &path);
+    fuse_reply_err(req, ret < 0 ? -ret : -ramfs_fsync(path.c_str(), datasync, fi));
+}
+
+static void ramfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                            struct fuse_file_info *fi) {
+    string path;
+    struct stat stbuf;
+    int ret = get_child_path(parent, name, &path);
+    if (ret == 0) {
+        ret = ramfs_create(path.c_str(), mode, fi);
+    }
+    if (ret == 0) {
+        ret = ramfs_getattr(path.c_str(), &stbuf);
+    }
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    stbuf.st_ino = reference_inode(path);
+    struct fuse_entry_param entry = get_entry(stbuf);
+    fuse_reply_create(req, &entry, fi);
+}
+
+static void ramfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    string path;
+    int ret = get_child_path(parent, name, &path);
+    if (ret == 0) {
+        ret = ramfs_mkdir(path.c_str(), mode);
+    }
+    reply_lookup(req, ret, path);
+}
+
+static void ramfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    string path;
+    int ret = get_child_path(parent, name, &path);
+    if (ret == 0) {
+        ret = ramfs_unlink(path.c_str());
+    }
+    if (ret == 0) {
+        remove_inode(path);
+    }
+    fuse_reply_err(req, -ret);
+}
+
+static void ramfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    string path;
+    int ret = get_child_path(parent, name, &path);
+    if (ret == 0) {
+        ret = ramfs_rmdir(path.c_str());
+    }
+    if (ret == 0) {
+        remove_inode(path);
+    }
+    fuse_reply_err(req, -ret);
+}
+
+static void ramfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    struct stat stbuf;
+    int ret = get_inode_path(ino, &path);
+    if (ret == 0) {
+        ret = ramfs_getattr(path.c_str(), &stbuf);
+    }
+    if (ret == 0 && !S_ISDIR(stbuf.st_mode)) {
+        ret = -ENOTDIR;
+    }
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fi->fh = reinterpret_cast<uint64_t>(new DirectoryStream{0, ""});
+    fuse_reply_open(req, fi);
+}
+
+/**
+ * Lists the entries of a directory that follow after, with the inode numbers the kernel knows them by
+ */
+static int list_entries(const string &path, const string &after, vector<DirectoryEntry>* entries, bool* end) {
+    ReadLock lock(NAMESPACE_LOCK);
+    auto directory = DIRECTORIES.find(path);
+    if (directory == DIRECTORIES.end()) {
+        return -ENOENT;
+    }
+    const set<string> &names = directory->second;
+    auto it = after.empty() ? names.begin() : names.upper_bound(after);
+    ScopedLock inodes_lock(INODES_LOCK);
+    for (; it != names.end() && entries->size() < LOWLEVEL_LIST_ENTRIES; it++) {
+        string child = path.empty() ? *it : path + "/" + *it;
+        auto number = INODE_NUMBERS.find(child);
+        entries->push_back(DirectoryEntry{*it,
+                                          number == INODE_NUMBERS.end() ? UNKNOWN_INODE : number->second,
+                                          DIRECTORIES.find(child) != DIRECTORIES.end()});
+    }
+    *end = it == names.end();
+    return 0;
+}
+
+static void ramfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                             struct fuse_file_info *fi) {
+    string path;
+    int ret = get_inode_path(ino, &path);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    reply_directory(req, ino, size, offset, reinterpret_cast<DirectoryStream*>(fi->fh),
+                    [&path](const string &after, vector<DirectoryEntry>* entries, bool* end) {
+        return list_entries(path, after, entries, end);
+    });
+}
+
+static void ramfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    delete reinterpret_cast<DirectoryStream*>(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops sgx_ramfs_ll_oper;
+
 static struct fuse_operations sgx_ramfs_oper;
 int main(int argc, char **argv) {
     BINARY_NAME = argv[0];
@@ -601,5 +2074,56 @@ int main(int argc, char **argv) {
     sgx_ramfs_oper.init = init;
     sgx_ramfs_oper.destroy = destroy;
 
-    return fuse_main(argc, argv, &sgx_ramfs_oper, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &OPTIONS, SGX_RAMFS_OPTIONS, NULL) == -1) {
+        return 1;
+    }
+    if (OPTIONS.sealing_unit == 0 || OPTIONS.sealing_unit > MAX_SEALING_UNIT) {
+        cerr << "sealing_unit must be between 1 and " << MAX_SEALING_UNIT << " bytes" << endl;
+        return 1;
+    }
+    SEALING_UNIT = OPTIONS.sealing_unit;
+    if (OPTIONS.crypto_threads == 0 || OPTIONS.crypto_threads > MAX_CRYPTO_THREADS) {
+        cerr << "crypto_threads must be between 1 and " << MAX_CRYPTO_THREADS << endl;
+        return 1;
+    }
+    // Switchless workers stay in the enclave, and the crypto threads join the FUSE thread they work for
+    unsigned int switchless_workers = OPTIONS.switchless ? OPTIONS.switchless_workers : 0;
+    if (switchless_workers + OPTIONS.crypto_threads - 1 + BACKGROUND_THREADS + FUSE_THREADS > ENCLAVE_THREADS) {
+        cerr << "switchless_workers and crypto_threads must not add up to more than "
+             << ENCLAVE_THREADS + 1 - BACKGROUND_THREADS - FUSE_THREADS << endl;
+        return 1;
+    }
+    if (OPTIONS.cache_size > MAX_CACHE_SIZE) {
+        cerr << "cache_size must not exceed " << MAX_CACHE_SIZE << " MiB" << endl;
+        return 1;
+    }
+    int ret;
+    if (OPTIONS.lowlevel) {
+        sgx_ramfs_ll_oper.init = ramfs_ll_init;
+        sgx_ramfs_ll_oper.destroy = ramfs_ll_destroy;
+        sgx_ramfs_ll_oper.lookup = ramfs_ll_lookup;
+        sgx_ramfs_ll_oper.forget = ramfs_ll_forget;
+        sgx_ramfs_ll_oper.forget_multi = ramfs_ll_forget_multi;
+        sgx_ramfs_ll_oper.getattr = ramfs_ll_getattr;
+        sgx_ramfs_ll_oper.setattr = ramfs_ll_setattr;
+        sgx_ramfs_ll_oper.open = ramfs_ll_open;
+        sgx_ramfs_ll_oper.read = ramfs_ll_read;
+        sgx_ramfs_ll_oper.write = ramfs_ll_write;
+        sgx_ramfs_ll_oper.flush = ramfs_ll_flush;
+        sgx_ramfs_ll_oper.release = ramfs_ll_release;
+        sgx_ramfs_ll_oper.fsync = ramfs_ll_fsync;
+        sgx_ramfs_ll_oper.create = ramfs_ll_create;
+        sgx_ramfs_ll_oper.mkdir = ramfs_ll_mkdir;
+        sgx_ramfs_ll_oper.unlink = ramfs_ll_unlink;
+        sgx_ramfs_ll_oper.rmdir = ramfs_ll_rmdir;
+        sgx_ramfs_ll_oper.opendir = ramfs_ll_opendir;
+        sgx_ramfs_ll_oper.readdir = ramfs_ll_readdir;
+        sgx_ramfs_ll_oper.releasedir = ramfs_ll_releasedir;
+        ret = run_lowlevel_session(&args, &sgx_ramfs_ll_oper, sizeof(sgx_ramfs_ll_oper), NULL);
+    } else {
+        ret = fuse_main(args.argc, args.argv, &sgx_ramfs_oper, NULL);
+    }
+    fuse_opt_free_args(&args);
+    return ret;
 }
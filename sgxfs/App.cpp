@@ -7,190 +7,472 @@
 
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_opt.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <cerrno>
+#include <cstddef>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "Enclave_u.h"
 #include "./sgx_urts.h"
 #include "sgx_utils/sgx_utils.h"
 #include "../utils/fs.hpp"
+#include "../utils/journal.hpp"
+#include "../utils/lock.hpp"
 #include "../utils/serialization.hpp"
 #include "../utils/logging.h"
+#include "../utils/lowlevel.hpp"
+#include "../utils/metadata_cache.hpp"
+#include "../utils/switchless.hpp"
+#include "../utils/thread_pool.hpp"
 
 using namespace std;
 
 static sgx_enclave_id_t ENCLAVE_ID;
 static char* BINARY_NAME;
 
+/**
+ * Mount options specific to sgxfs
+ */
+struct sgxfs_options {
+  int switchless;
+  unsigned int switchless_workers;
+  double attr_timeout;
+  int lowlevel;
+  unsigned int checkpoint_size;
+  unsigned int crypto_threads;
+  int direct_checkpoint;
+};
+
+static struct sgxfs_options OPTIONS = {0, 2, 1.0, 0, 64, 4, 0};
+
+enum {
+  KEY_ATTR_TIMEOUT
+};
+
+static const struct fuse_opt SGXFS_OPTIONS[] = {
+  {"switchless", offsetof(struct sgxfs_options, switchless), 1},
+  {"switchless_workers=%u", offsetof(struct sgxfs_options, switchless_workers), 0},
+  FUSE_OPT_KEY("attr_timeout=%lf", KEY_ATTR_TIMEOUT),
+  {"lowlevel", offsetof(struct sgxfs_options, lowlevel), 1},
+  {"checkpoint_size=%u", offsetof(struct sgxfs_options, checkpoint_size), 0},
+  {"crypto_threads=%u", offsetof(struct sgxfs_options, crypto_threads), 0},
+  {"direct_checkpoint", offsetof(struct sgxfs_options, direct_checkpoint), 1},
+  FUSE_OPT_END
+};
+
+/**
+ * Reads the options shared with FUSE, which main hands back to the high-level API only
+ */
+static int process_option(void* data, const char* arg, int key, struct fuse_args* unused_args) {
+  if (key == KEY_ATTR_TIMEOUT) {
+    static_cast<struct sgxfs_options*>(data)->attr_timeout = atof(strchr(arg, '=') + 1);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Attributes and directory listings cached for as long as FUSE caches attributes
+ */
+static MetadataCache METADATA_CACHE(OPTIONS.attr_timeout);
+
+static void switchless_worker(SwitchlessRing* ring) {
+  int ret;
+  enclave_switchless_worker(ENCLAVE_ID, &ret, ring);
+}
+
+static SwitchlessClient SWITCHLESS(switchless_worker);
+
+/**
+ * Largest number of threads accepted by the crypto_threads option, which must leave thread control
+ * structures of the enclave to the FUSE threads
+ */
+static const unsigned int MAX_CRYPTO_THREADS = 8;
+/**
+ * Thread control structures of the enclave (TCSNum in Enclave.config.xml), each one letting a single thread
+ * in at a time; calls finding none left fail with SGX_ERROR_OUT_OF_TCS
+ */
+static const unsigned int ENCLAVE_THREADS = 24;
+// Threads entering the enclave besides the FUSE, switchless and crypto threads: the journal thread
+static const unsigned int BACKGROUND_THREADS = 1;
+// Thread control structures left to the FUSE threads, as many as the workers of fuse_loop_mt in libfuse 2.9,
+// each one keeping its own for as long as it lives
+static const unsigned int FUSE_THREADS = 10;
+// Seals and unseals files with concurrent ECALLs during checkpoints and at mount
+static ThreadPool CRYPTO_POOL;
+
+// The files are checkpointed to DUMP_PATH, and the changes made since are appended to JOURNAL_PATH
+static const char* DUMP_PATH = "sgxfs_dump";
+static const char* JOURNAL_PATH = "sgxfs_journal";
+// Journal superseded by the checkpoint being written, replayed as well until the checkpoint is installed
+static const char* OLD_JOURNAL_PATH = "sgxfs_journal.old";
+
+/**
+ * Seals the changes the enclave recorded since the previous batch, called from the background thread of
+ * the journal
+ */
+static int collect_changes(vector<char>* batch) {
+  size_t needed = batch->capacity();
+  while (true) {
+    batch->resize(needed);
+    int ret;
+    sgx_status_t status = enclave_journal_collect(ENCLAVE_ID, &ret,
+                                                  reinterpret_cast<uint8_t*>(batch->data()), batch->size(),
+                                                  &needed);
+    if (status != SGX_SUCCESS) {
+      return -EIO;
+    }
+    // The changes outgrew the buffer, it is grown to the size the enclave asks for
+    if (ret != -E2BIG) {
+      batch->resize(ret < 0 ? 0 : ret);
+      return ret < 0 ? ret : 0;
+    }
+  }
+}
+
+static Journal JOURNAL(collect_changes);
+
+// Changes are made under the shared lock, and checkpoints under the exclusive one
+static RWLock CHANGES_LOCK;
+// Size of the files written by the last checkpoint
+static atomic<size_t> CHECKPOINT_SIZE(0);
+
+static void account_change(int written);
+
 void ocall_print(const char* str) {
   printf("[ocall_print] %s\n", str);
 }
 
-static int sgxfs_getattr(const char *path, struct stat *stbuf) {
-  string filename = path;
-  string stripped_slash = strip_leading_slash(filename);
-  int res = 0;
-  memset(stbuf, 0, sizeof(struct stat));
+static int call_enclave_stat(const char* pathname, struct enclave_stat_t* attributes) {
+  SwitchlessArguments arguments = {};
+  arguments.call = SWITCHLESS_STAT;
+  arguments.inputs[0] = pathname;
+  arguments.input_sizes[0] = strlen(pathname) + 1;
+  arguments.output = attributes;
+  arguments.output_size = sizeof(struct enclave_stat_t);
+  int64_t result;
+  if (SWITCHLESS.call(arguments, &result)) {
+    return result;
+  }
+  int ret;
+  sgx_status_t status = enclave_stat(ENCLAVE_ID, &ret, pathname, attributes);
+  return status != SGX_SUCCESS ? -EIO : ret;
+}
+
+static int call_enclave_fstat(uint64_t inode, struct enclave_stat_t* attributes) {
+  SwitchlessArguments arguments = {};
+  arguments.call = SWITCHLESS_FSTAT;
+  arguments.arguments[0] = inode;
+  arguments.output = attributes;
+  arguments.output_size = sizeof(struct enclave_stat_t);
+  int64_t result;
+  if (SWITCHLESS.call(arguments, &result)) {
+    return result;
+  }
+  int ret;
+  sgx_status_t status = enclave_fstat(ENCLAVE_ID, &ret, inode, attributes);
+  return status != SGX_SUCCESS ? -EIO : ret;
+}
 
+static int call_ramfs_get_inode(uint64_t inode, long offset, size_t size, char* data) {
+  SwitchlessArguments arguments = {};
+  arguments.call = SWITCHLESS_GET_INODE;
+  arguments.arguments[0] = inode;
+  arguments.arguments[1] = offset;
+  arguments.output = data;
+  arguments.output_size = size;
+  int64_t result;
+  if (SWITCHLESS.call(arguments, &result)) {
+    return result;
+  }
+  int ret;
+  sgx_status_t status = ramfs_get_inode(ENCLAVE_ID, &ret, inode, offset, size, data);
+  return status != SGX_SUCCESS ? -EIO : ret;
+}
+
+static int call_ramfs_put_inode(uint64_t inode, long offset, size_t size, const char* data, uint64_t* generation) {
+  uint64_t time = get_current_time();
+  SwitchlessArguments arguments = {};
+  arguments.call = SWITCHLESS_PUT_INODE;
+  arguments.arguments[0] = inode;
+  arguments.arguments[1] = offset;
+  arguments.arguments[2] = time;
+  arguments.inputs[0] = data;
+  arguments.input_sizes[0] = size;
+  arguments.output = generation;
+  arguments.output_size = sizeof(uint64_t);
+  int64_t result;
+  if (SWITCHLESS.call(arguments, &result)) {
+    return result;
+  }
+  int ret;
+  sgx_status_t status = ramfs_put_inode(ENCLAVE_ID, &ret, inode, offset, size, data, time, generation);
+  return status != SGX_SUCCESS ? -EIO : ret;
+}
+
+static void fill_stat(const struct enclave_stat_t &attributes, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = attributes.inode;
   stbuf->st_uid = getuid();
   stbuf->st_gid = getgid();
-  stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
-
-  int found;
-  sgx_status_t status = enclave_is_file(ENCLAVE_ID, &found, stripped_slash.c_str());
-
-  if (found == EEXIST) {
-    stbuf->st_mode = S_IFREG | 0777;
-    stbuf->st_nlink = 1;
-    int file_size;
-    sgx_status_t status = ramfs_get_size(ENCLAVE_ID, &file_size, stripped_slash.c_str());
-    stbuf->st_size = file_size;
-  } else if (found == -EISDIR) {
-    stbuf->st_mode = S_IFDIR | 0777;
-    stbuf->st_nlink = 2;
-  } else {
-    res = -ENOENT;
+  // Reads do not update the access time, which follows the modification time
+  stbuf->st_atim = stbuf->st_mtim = to_timespec(attributes.mtime);
+  stbuf->st_ctim = to_timespec(attributes.ctime);
+  stbuf->st_mode = (attributes.directory ? S_IFDIR : S_IFREG) | attributes.mode;
+  stbuf->st_nlink = attributes.nlink;
+  stbuf->st_size = attributes.size;
+}
+
+static int sgxfs_getattr(const char *path, struct stat *stbuf) {
+  if (METADATA_CACHE.get_attributes(path, stbuf)) {
+    return 0;
+  }
+  struct enclave_stat_t attributes;
+  int ret = call_enclave_stat(path, &attributes);
+  if (ret < 0) {
+    return ret;
   }
-  return res;
+  fill_stat(attributes, stbuf);
+  METADATA_CACHE.put_attributes(path, *stbuf, attributes.generation);
+  return 0;
 }
 
-static std::vector<std::string> tokenize(const string &list_of_entries, const char separator) {
-  string entries(list_of_entries);
-  std::vector<std::string> filenames;
-  size_t pos = 0;
-  size_t found = string::npos;
-  while (true) {
-    found = entries.find(separator, pos);
-    if (found == string::npos) {
-      break;
+/**
+ * Size of the buffer the enclave fills with directory entries on every call
+ */
+static const size_t READDIR_BUFFER_SIZE = 4096;
+
+/**
+ * Position of an open directory stream: FUSE offset of the last entry handed over and its name.
+ * Offsets 1 and 2 are "." and "..", the entries of the directory follow from 3.
+ */
+struct DirectoryHandle {
+  off_t offset;
+  string name;
+};
+
+/**
+ * Reads the entries of a directory that follow after, from the metadata cache or from the enclave.
+ * @param path Path to the directory
+ * @param after Name of the last entry already read, empty to start from the first entry
+ * @param names Filled with the names of the following entries
+ * @param end Set to true if there are no entries past the returned ones
+ * @return 0 on success, a negative error code otherwise
+ */
+static int read_entries(const char* path, const string &after, vector<string>* names, bool* end) {
+  vector<string> cached;
+  if (METADATA_CACHE.get_entries(path, &cached)) {
+    auto first = after.empty() ? cached.begin() : upper_bound(cached.begin(), cached.end(), after);
+    names->assign(first, cached.end());
+    *end = true;
+    return 0;
+  }
+  char entries[READDIR_BUFFER_SIZE];
+  int ret;
+  int complete;
+  uint64_t generation;
+  sgx_status_t status = enclave_readdir(ENCLAVE_ID, &ret, path, after.c_str(), entries, READDIR_BUFFER_SIZE,
+                                        &complete, &generation);
+  if (status != SGX_SUCCESS) {
+    return -EIO;
+  }
+  if (ret < 0) {
+    return ret;
+  }
+  names->clear();
+  names->reserve(ret);
+  for (size_t position = 0; names->size() < (size_t) ret; position += names->back().length() + 1) {
+    names->push_back(string(entries + position));
+  }
+  *end = complete != 0;
+  // Only listings read in a single call are cached, larger directories are streamed
+  if (after.empty() && *end) {
+    METADATA_CACHE.put_entries(path, *names, generation);
+  }
+  return 0;
+}
+
+/**
+ * Moves a directory stream to a FUSE offset that does not follow its last entry
+ */
+static int seek_directory(const char* path, DirectoryHandle* handle, const off_t offset) {
+  handle->offset = min(offset, (off_t) 2);
+  handle->name.clear();
+  while (handle->offset < offset) {
+    vector<string> names;
+    bool end;
+    int ret = read_entries(path, handle->name, &names, &end);
+    if (ret < 0) {
+      return ret;
     }
-    size_t length = found - pos;
-    if (length == 0) {
-      pos = found + 1;
-      continue;
+    for (auto it = names.begin(); it != names.end() && handle->offset < offset; it++) {
+      handle->offset++;
+      handle->name = *it;
+    }
+    if (end) {
+      break;
     }
-    string filename = entries.substr(pos, length);
-    filenames.push_back(filename);
-    pos = found + 1;
   }
-  return filenames;
+  return 0;
 }
 
 static int sgxfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi) {
-  int ret;
-  enclave_is_file(ENCLAVE_ID, &ret, path);
-  if (ret == -ENOENT) {
-    return -ENOENT;
+  DirectoryHandle* handle = reinterpret_cast<DirectoryHandle*>(fi->fh);
+  if (offset != handle->offset) {
+    int ret = seek_directory(path, handle, offset);
+    if (ret < 0) {
+      return ret;
+    }
   }
-  if (ret == EEXIST) {
-    return -ENOTDIR;
+  if (handle->offset == 0) {
+    if (filler(buf, ".", NULL, 1)) {
+      return 0;
+    }
+    handle->offset = 1;
   }
-
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
-
-  int number_of_entries;
-  ramfs_get_number_of_entries(ENCLAVE_ID, &number_of_entries);
-  const size_t step = 256;
-  const size_t buffer_length = number_of_entries * step;
-  char *entries = new char[buffer_length];
-  int size;
-  enclave_readdir(ENCLAVE_ID, &size, path, entries, buffer_length);
-  vector<string> filenames = tokenize(string(entries), 0x1C);
-  for (auto it = filenames.begin(); it != filenames.end(); it++) {
-    filler(buf, it->c_str(), NULL, 0);
+  if (handle->offset == 1) {
+    if (filler(buf, "..", NULL, 2)) {
+      return 0;
+    }
+    handle->offset = 2;
   }
-  if (entries != NULL) {
-    delete [] entries;
+  bool end = false;
+  while (!end) {
+    vector<string> names;
+    int ret = read_entries(path, handle->name, &names, &end);
+    if (ret < 0) {
+      return ret;
+    }
+    for (auto it = names.begin(); it != names.end(); it++) {
+      if (filler(buf, it->c_str(), NULL, handle->offset + 1)) {
+        return 0;
+      }
+      handle->offset++;
+      handle->name = *it;
+    }
   }
   return 0;
 }
 
 static int sgxfs_open(const char *path, struct fuse_file_info *fi) {
   string filename = strip_leading_slash(path);
-  int found;
-  sgx_status_t status = enclave_is_file(ENCLAVE_ID, &found, filename.c_str());
-
-  if (found == -ENOENT) {
+  int ret;
+  uint64_t inode;
+  if (enclave_open(ENCLAVE_ID, &ret, filename.c_str(), &inode) != SGX_SUCCESS) {
+    return -EIO;
+  }
+  if (ret < 0) {
     cerr << "sgxfs_open(" << filename << "): Not found" << endl;
-    return -ENOENT;
+    return ret;
   }
-
+  fi->fh = inode;
   return 0;
 }
 
 static int sgxfs_read(const char *path, char *buf, size_t size, off_t offset,
                       struct fuse_file_info *fi) {
-  string filename = strip_leading_slash(path);
-
-  int found;
-  enclave_is_file(ENCLAVE_ID, &found, filename.c_str());
-
-  if (found == -ENOENT) {
-    cerr << "[sgxfs_read] " << filename << ": Not found" << endl;
-    return -ENOENT;
-  }
-
-  int read;
-  ramfs_get(ENCLAVE_ID, &read, filename.c_str(), (long) offset, size, buf);
-  return read;
+  return call_ramfs_get_inode(fi->fh, (long) offset, size, buf);
 }
 
 int sgxfs_write(const char *path, const char *data, size_t size, off_t offset,
-                struct fuse_file_info *) {
-  string filename = strip_leading_slash(path);
-
-  int found;
-  enclave_is_file(ENCLAVE_ID, &found, filename.c_str());
-  if (found == -ENOENT) {
-    cerr << "[sgxfs_write] " << filename << ": Not found" << endl;
-    return -ENOENT;
-  }
-
+                struct fuse_file_info *fi) {
+  // Left at 0 by a failed call, which does not move the generation of the cache
+  uint64_t generation = 0;
   int written;
-  ramfs_put(ENCLAVE_ID, &written, filename.c_str(), (long) offset, size, data);
+  {
+    ReadLock lock(CHANGES_LOCK);
+    written = call_ramfs_put_inode(fi->fh, (long) offset, size, data, &generation);
+  }
+  METADATA_CACHE.invalidate_attributes(path, generation);
+  account_change(written);
   return written;
 }
 
 int sgxfs_unlink(const char *pathname) {
   string filename = strip_leading_slash(pathname);
   int retval;
-  sgx_status_t status = ramfs_delete_file(ENCLAVE_ID, &retval, filename.c_str());
+  uint64_t generation = 0;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    if (ramfs_delete_file(ENCLAVE_ID, &retval, filename.c_str(), get_current_time(), &generation) != SGX_SUCCESS) {
+      retval = -EIO;
+    }
+  }
+  METADATA_CACHE.invalidate_entry(pathname, generation);
+  account_change(0);
   return retval;
 }
 
-int sgxfs_create(const char *path, mode_t mode, struct fuse_file_info *) {
+int sgxfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
   string filename = strip_leading_slash(path);
 
-  int found;
-  sgx_status_t status = enclave_is_file(ENCLAVE_ID, &found, filename.c_str());
-  if (found == EEXIST) {
+  int retval;
+  uint64_t generation = 0;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    if (ramfs_create_file(ENCLAVE_ID, &retval, filename.c_str(), mode, get_current_time(),
+                          &generation) != SGX_SUCCESS) {
+      retval = -EIO;
+    }
+  }
+  METADATA_CACHE.invalidate_entry(path, generation);
+  account_change(0);
+  if (retval == -EEXIST) {
     cerr << "sgxfs_create(" << filename << "): Already exists" << endl;
-    return -EEXIST;
   }
-
-  int retval;
-  ramfs_create_file(ENCLAVE_ID, &retval, filename.c_str());
+  if (retval < 0) {
+    return retval;
+  }
+  uint64_t inode;
+  if (enclave_open(ENCLAVE_ID, &retval, filename.c_str(), &inode) != SGX_SUCCESS) {
+    return -EIO;
+  }
+  fi->fh = inode;
   return retval;
 }
 
 int sgxfs_fgetattr(const char *path, struct stat *stbuf,
-                   struct fuse_file_info *) {
-  return sgxfs_getattr(path, stbuf);
+                   struct fuse_file_info *fi) {
+  struct enclave_stat_t attributes;
+  int ret = call_enclave_fstat(fi->fh, &attributes);
+  if (ret < 0) {
+    return ret;
+  }
+  fill_stat(attributes, stbuf);
+  return 0;
 }
 
-int sgxfs_opendir(const char *path, struct fuse_file_info *) {
+int sgxfs_opendir(const char *path, struct fuse_file_info *fi) {
+  struct stat attributes;
+  int ret = sgxfs_getattr(path, &attributes);
+  if (ret < 0) {
+    return ret;
+  }
+  if (!S_ISDIR(attributes.st_mode)) {
+    return -ENOTDIR;
+  }
+  fi->fh = reinterpret_cast<uint64_t>(new DirectoryHandle{0, ""});
+  return 0;
+}
+
+int sgxfs_releasedir(const char *path, struct fuse_file_info *fi) {
+  delete reinterpret_cast<DirectoryHandle*>(fi->fh);
   return 0;
 }
 
@@ -201,16 +483,33 @@ int sgxfs_access(const char *path, int) {
 int sgxfs_truncate(const char *path, off_t length) {
   string filename = strip_leading_slash(path);
 
-  int found;
-  sgx_status_t status = enclave_is_file(ENCLAVE_ID, &found, filename.c_str());
-  if (found == -ENOENT) {
+  int retval;
+  uint64_t generation = 0;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    if (ramfs_trunkate(ENCLAVE_ID, &retval, filename.c_str(), length, get_current_time(), &generation) != SGX_SUCCESS) {
+      retval = -EIO;
+    }
+  }
+  METADATA_CACHE.invalidate_attributes(path, generation);
+  account_change(0);
+  if (retval == -ENOENT) {
     cerr << "sgxfs_truncate(" << filename << "): Not found" << endl;
-    return -ENOENT;
   }
+  return retval;
+}
 
+int sgxfs_ftruncate(const char *path, off_t length, struct fuse_file_info *fi) {
   int retval;
-  sgx_status_t stattus = ramfs_trunkate(ENCLAVE_ID, &retval,  filename.c_str(), length);
-
+  uint64_t generation = 0;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    if (ramfs_truncate_inode(ENCLAVE_ID, &retval, fi->fh, length, get_current_time(), &generation) != SGX_SUCCESS) {
+      retval = -EIO;
+    }
+  }
+  METADATA_CACHE.invalidate_attributes(path, generation);
+  account_change(0);
   return retval;
 }
 
@@ -218,9 +517,17 @@ int sgxfs_mknod(const char *path, mode_t mode, dev_t dev) {
   cout << "sgxfs_mknod not implemented" << endl;
   return -EINVAL;
 }
-int sgxfs_mkdir(const char* pathname, mode_t unused_mode) {
+int sgxfs_mkdir(const char* pathname, mode_t mode) {
   int retval;
-  enclave_mkdir(ENCLAVE_ID, &retval, pathname);
+  uint64_t generation = 0;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    if (enclave_mkdir(ENCLAVE_ID, &retval, pathname, mode, get_current_time(), &generation) != SGX_SUCCESS) {
+      retval = -EIO;
+    }
+  }
+  METADATA_CACHE.invalidate_entry(pathname, generation);
+  account_change(0);
   return retval;
 }
 int sgxfs_rmdir(const char *) {
@@ -264,18 +571,170 @@ int sgxfs_setxattr(const char *, const char *, const char *, size_t, int) {
   return -EINVAL;
 }
 
-static void restore_fs(const int enclave_id, const string &directory) {
-  map<string, sgx_sealed_data_t*>* restored_files = restore_sgxfs_from_disk("sgxfs_dump");
-  for (auto it = restored_files->begin(); it != restored_files->end();) {
-    const char* filename = it->first.c_str();
-    sgx_sealed_data_t* sealed_file = it->second;
-    size_t sealed_size = sizeof(sgx_sealed_data_t) + sealed_file->aes_data.payload_size;
-    int ret;
-    sgx_status_t status = sgxfs_restore(enclave_id, &ret, filename, sealed_file, sealed_size);
-    restored_files->erase(it++);
-    free(sealed_file);
+int sgxfs_fsync(const char *, int, struct fuse_file_info *) {
+  // Changes are durable once the journal holding them is synced
+  return JOURNAL.commit();
+}
+
+/**
+ * Seals the index of a pack with the key of the enclave
+ */
+static int seal_index(const vector<char> &index, vector<char>* sealed) {
+  sealed->resize(sizeof(sgx_sealed_data_t) + index.size());
+  int ret;
+  sgx_status_t status = journal_seal(ENCLAVE_ID, &ret,
+                                     reinterpret_cast<const uint8_t*>(index.data()), index.size(),
+                                     reinterpret_cast<uint8_t*>(sealed->data()), sealed->size());
+  return status != SGX_SUCCESS || ret < 0 ? -EIO : 0;
+}
+
+/**
+ * Unseals the index of a pack sealed by seal_index
+ */
+static int unseal_index(const vector<char> &sealed, vector<char>* index) {
+  if (sealed.size() < sizeof(sgx_sealed_data_t)) {
+    return -EIO;
+  }
+  size_t size = reinterpret_cast<const sgx_sealed_data_t*>(sealed.data())->aes_data.payload_size;
+  if (size > sealed.size()) {
+    return -EIO;
+  }
+  index->resize(size);
+  int ret;
+  sgx_status_t status = journal_unseal(ENCLAVE_ID, &ret,
+                                       reinterpret_cast<const uint8_t*>(sealed.data()), sealed.size(),
+                                       reinterpret_cast<uint8_t*>(index->data()), index->size());
+  return status != SGX_SUCCESS || ret < 0 ? -EIO : 0;
+}
+
+/**
+ * Restores the sealed files of the pack of a directory, or of its host files if it predates packs
+ * @return 1 if the files were restored from host files, 0 if they were restored from the pack, a negative
+ *         error code if the pack could not be read
+ */
+static int restore_fs(const int enclave_id, const string &directory) {
+  Pack pack;
+  int ret = pack.open(directory + "/" + PACK_NAME, unseal_index);
+  if (ret == -ENOENT) {
+    map<string, sgx_sealed_data_t*>* restored_files = restore_sgxfs_from_disk(directory, &CRYPTO_POOL);
+    for (auto it = restored_files->begin(); it != restored_files->end();) {
+      const char* filename = it->first.c_str();
+      sgx_sealed_data_t* sealed_file = it->second;
+      size_t sealed_size = sizeof(sgx_sealed_data_t) + sealed_file->aes_data.payload_size;
+      sgxfs_restore(enclave_id, &ret, filename, reinterpret_cast<const uint8_t*>(sealed_file), sealed_size,
+                    get_current_time());
+      restored_files->erase(it++);
+      free(sealed_file);
+    }
+    delete restored_files;
+    return 1;
+  } else if (ret < 0) {
+    return ret;
+  }
+  // The enclave reads the sealed files from the mapping of the pack, one chunk at a time, on every thread
+  // of the pool
+  vector<function<void()>> tasks;
+  const auto &files = pack.get_files();
+  for (auto it = files.begin(); it != files.end(); it++) {
+    const string &filename = it->first;
+    const pair<const char*, size_t> &content = it->second;
+    tasks.push_back([enclave_id, &filename, &content, &directory] {
+      int ret;
+      sgx_status_t status = sgxfs_restore(enclave_id, &ret, filename.c_str(),
+                                          reinterpret_cast<const uint8_t*>(content.first), content.second,
+                                          get_current_time());
+      if (status != SGX_SUCCESS || ret < 0) {
+        cerr << "Could not restore " << filename << " from " << directory << endl;
+      }
+    });
+  }
+  CRYPTO_POOL.run(tasks);
+  return 0;
+}
+
+/**
+ * Lists every file found under a directory
+ * @param path Path to the directory, with a leading slash
+ * @param files Filled with the names of the files, without a leading slash
+ * @param size Increased by the size of the files
+ */
+static void list_directory(const string &path, vector<string>* files, size_t* size) {
+  vector<string> entries;
+  bool end = false;
+  while (!end) {
+    vector<string> names;
+    if (read_entries(path.c_str(), entries.empty() ? "" : entries.back(), &names, &end) < 0) {
+      break;
+    }
+    entries.insert(entries.end(), names.begin(), names.end());
+  }
+
+  for (auto it = entries.begin(); it != entries.end(); it++) {
+    string pathname = (path == "/" ? path : path + "/") + *it;
+    struct enclave_stat_t attributes;
+    if (call_enclave_stat(pathname.c_str(), &attributes) < 0) {
+      continue;
+    }
+    if (attributes.directory) {
+      list_directory(pathname, files, size);
+      continue;
+    }
+    files->push_back(strip_leading_slash(pathname));
+    *size += attributes.size;
+  }
+}
+
+/**
+ * Seals a file into the pack of a checkpoint, the enclave appending it chunk by chunk as it seals it
+ */
+static int dump_file(const string &filename, PackAppend* append) {
+  int ret;
+  sgx_status_t status = sgxfs_dump(ENCLAVE_ID, &ret, filename.c_str(), append);
+  return status != SGX_SUCCESS ? -EIO : ret;
+}
+
+/**
+ * Seals every file to a new checkpoint and starts an empty journal. Files cannot change until the
+ * checkpoint is installed. Runs on the background thread of the journal, which it rotates.
+ * @return 0 on success, a negative error code otherwise
+ */
+static int checkpoint() {
+  WriteLock lock(CHANGES_LOCK);
+  // The journal is rotated first: until the checkpoint is installed, both journals are replayed on top
+  // of the previous one
+  int ret = JOURNAL.rotate(OLD_JOURNAL_PATH, 0);
+  if (ret < 0) {
+    return ret;
+  }
+  // The names of the files are only written in the index of the pack, which is sealed
+  PackWriter pack(prepare_checkpoint(DUMP_PATH) + "/" + PACK_NAME, OPTIONS.direct_checkpoint);
+  vector<string> files;
+  size_t size = 0;
+  list_directory("/", &files, &size);
+  // Files are sealed in parallel and written to the pack in order
+  if (pack.add_parallel(files, dump_file, CRYPTO_POOL) < 0 || pack.close(seal_index) < 0) {
+    return -EIO;
+  }
+  ret = install_checkpoint(DUMP_PATH, OLD_JOURNAL_PATH);
+  if (ret == 0) {
+    CHECKPOINT_SIZE = size;
+  }
+  return ret;
+}
+
+static bool checkpoint_needed() {
+  return JOURNAL.get_size() > max((size_t) OPTIONS.checkpoint_size << 20, CHECKPOINT_SIZE.load());
+}
+
+/**
+ * Accounts for the data written by a change, which the enclave records for the journal, and has the journal
+ * checkpoint the files once it outgrows both the checkpoint_size option and the last checkpoint
+ */
+static void account_change(int written) {
+  JOURNAL.add_pending(written > 0 ? written : 0);
+  if (checkpoint_needed()) {
+    JOURNAL.request_checkpoint();
   }
-  delete restored_files;
 }
 
 void* sgxfs_init(struct fuse_conn_info *conn) {
@@ -291,46 +750,70 @@ void* sgxfs_init(struct fuse_conn_info *conn) {
       exit(1);
   }
   int ret;
-  init_filesystem(ENCLAVE_ID, &ret);
-  restore_fs(ENCLAVE_ID, "sgxfs_dump");
+  uint64_t mount_time = get_current_time();
+  init_filesystem(ENCLAVE_ID, &ret, mount_time);
+  CRYPTO_POOL.resize(OPTIONS.crypto_threads - 1);
+  recover_checkpoint(DUMP_PATH, OLD_JOURNAL_PATH);
+  int legacy = restore_fs(ENCLAVE_ID, DUMP_PATH);
+  if (legacy < 0) {
+    init_log.error("Could not read the pack of " + string(DUMP_PATH));
+    exit(1);
+  }
+  Journal::Apply replay_changes = [mount_time](const vector<char> &batch) {
+    int ret;
+    sgx_status_t status = enclave_journal_replay(ENCLAVE_ID, &ret,
+                                                 reinterpret_cast<const uint8_t*>(batch.data()), batch.size(),
+                                                 mount_time);
+    return status != SGX_SUCCESS ? -EIO : ret;
+  };
+  bool old_journal = Journal::replay(OLD_JOURNAL_PATH, replay_changes) == 0;
+  JOURNAL.set_checkpoint([] {
+    int ret = checkpoint();
+    if (ret < 0) {
+      cerr << "Could not checkpoint the files to " << DUMP_PATH << endl;
+    }
+    return ret;
+  });
+  if (JOURNAL.open(JOURNAL_PATH, 0, replay_changes) < 0) {
+    init_log.error("Could not open the journal " + string(JOURNAL_PATH));
+    exit(1);
+  }
+  // Changes replayed are already in the journals, only the following ones are recorded
+  enclave_journal_start(ENCLAVE_ID, &ret);
+  // The old journal is only dropped by a checkpoint, and files restored from host files are only packed by one
+  if ((old_journal || legacy) && JOURNAL.checkpoint() < 0) {
+    init_log.error("Could not checkpoint the files to " + string(DUMP_PATH));
+    exit(1);
+  }
+  if (OPTIONS.switchless) {
+    SWITCHLESS.start(OPTIONS.switchless_workers);
+  }
   chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
   auto duration = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
   init_log.info("Mounted in " + to_string(duration) + " nanoseconds");
   return &ENCLAVE_ID;
 }
 
-static void dump_fs(const string &path) {
-  // TODO(dburihabwa) Support dumping of files and directories in a hierarchy
-  int number_of_entries;
-  ramfs_get_number_of_entries(ENCLAVE_ID, &number_of_entries);
-  const size_t step = 256;
-  const size_t buffer_length = number_of_entries * step;
-  char* raw_entries = new char[buffer_length];
-  int size;
-  enclave_readdir(ENCLAVE_ID, &size, "/", raw_entries, buffer_length);
-  auto entries = tokenize(string(raw_entries), 0x1C);
-  delete [] raw_entries;
-
-  for (auto it = entries.begin(); it != entries.end(); it++) {
-    string pathname = (*it);
-    int file_size;
-    ramfs_get_size(ENCLAVE_ID, &file_size, pathname.c_str());
-    size_t sealed_size = sizeof(sgx_sealed_data_t) + file_size;
-    sgx_sealed_data_t* sealed_data = reinterpret_cast<sgx_sealed_data_t*>(malloc(sealed_size));
-    int ret;
-    sgxfs_dump(ENCLAVE_ID, &ret, pathname.c_str(), sealed_data, sealed_size);
-    string dump_pathname = path + "/" + pathname;
-    dump(reinterpret_cast<char*>((sealed_data)), dump_pathname, sealed_size);
-    free(sealed_data);
-  }
-}
-
 void sgxfs_destroy(void* private_data) {
   // FIXME(dburihabwa) segmentation fault on call to destroy
   Logger init_log("sgxfs-mount.log");
   chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-  dump_fs("sgxfs_dump");
+  // A checkpoint the journal is writing is over once a later round is committed
+  JOURNAL.commit();
+  SWITCHLESS.stop();
+  CRYPTO_POOL.resize(0);
+  // The files are already in the checkpoint and the journal, only the last changes are left to commit
+  if (JOURNAL.close() < 0) {
+    init_log.error("Could not commit the journal " + string(JOURNAL_PATH));
+  }
   int ret;
+  size_t block_size;
+  uint64_t blocks_in_use, blocks_free, high_water_mark;
+  enclave_get_pool_statistics(ENCLAVE_ID, &ret, &block_size, &blocks_in_use, &blocks_free, &high_water_mark);
+  init_log.info("Block pool of " + to_string(block_size) + " bytes blocks: " +
+                to_string(blocks_in_use) + " in use, " +
+                to_string(blocks_free) + " free, " +
+                to_string(high_water_mark) + " at most");
   destroy_filesystem(ENCLAVE_ID, &ret);
   sgx_destroy_enclave(ENCLAVE_ID);
   chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
@@ -338,6 +821,256 @@ void sgxfs_destroy(void* private_data) {
   init_log.info("Unmounted in " + to_string(duration) + " nanoseconds");
 }
 
+/**
+ * Low-level frontend: requests carry inode numbers, which the enclave resolves without paths.
+ * The kernel caches entries and attributes for attr_timeout seconds, so the metadata cache is not used.
+ */
+
+static void reply_attributes(fuse_req_t req, const struct enclave_stat_t &attributes) {
+  struct stat stbuf;
+  fill_stat(attributes, &stbuf);
+  fuse_reply_attr(req, &stbuf, OPTIONS.attr_timeout);
+}
+
+static void sgxfs_ll_init(void* userdata, struct fuse_conn_info* conn) {
+  sgxfs_init(conn);
+}
+
+static void sgxfs_ll_destroy(void* userdata) {
+  sgxfs_destroy(userdata);
+}
+
+static void sgxfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+  struct enclave_stat_t attributes;
+  int ret;
+  if (enclave_lookup(ENCLAVE_ID, &ret, parent, name, &attributes) != SGX_SUCCESS) {
+    ret = -EIO;
+  }
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  struct stat stbuf;
+  fill_stat(attributes, &stbuf);
+  reply_entry(req, stbuf, OPTIONS.attr_timeout);
+}
+
+/**
+ * Drops lookups of an inode. Forgets get no reply, so a call that finds every thread control structure of the
+ * enclave taken is retried rather than leaving the inode referenced
+ */
+static void forget_inode(fuse_ino_t ino, uint64_t nlookup) {
+  int ret;
+  while (enclave_forget(ENCLAVE_ID, &ret, ino, nlookup) == SGX_ERROR_OUT_OF_TCS) {
+    this_thread::yield();
+  }
+}
+
+static void sgxfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  forget_inode(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void sgxfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets) {
+  for (size_t i = 0; i < count; i++) {
+    forget_inode(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void sgxfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  struct enclave_stat_t attributes;
+  int ret = call_enclave_fstat(ino, &attributes);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  reply_attributes(req, attributes);
+}
+
+static void sgxfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi) {
+  // Like chmod and chown, changing the owner or the mode is not supported, new times are ignored like utimens
+  if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  int ret;
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    uint64_t generation;
+    {
+      ReadLock lock(CHANGES_LOCK);
+      if (ramfs_truncate_inode(ENCLAVE_ID, &ret, ino, attr->st_size, get_current_time(),
+                               &generation) != SGX_SUCCESS) {
+        ret = -EIO;
+      }
+    }
+    account_change(0);
+    if (ret < 0) {
+      fuse_reply_err(req, -ret);
+      return;
+    }
+  }
+  sgxfs_ll_getattr(req, ino, fi);
+}
+
+static void sgxfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  struct enclave_stat_t attributes;
+  int ret = call_enclave_fstat(ino, &attributes);
+  if (ret == 0 && attributes.directory) {
+    ret = -EISDIR;
+  }
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_open(req, fi);
+}
+
+static void sgxfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+  vector<char> buffer(size);
+  int ret = call_ramfs_get_inode(ino, (long) offset, size, buffer.data());
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_buf(req, buffer.data(), ret);
+}
+
+static void sgxfs_ll_write(fuse_req_t req,
+                           fuse_ino_t ino,
+                           const char* data,
+                           size_t size,
+                           off_t offset,
+                           struct fuse_file_info* fi) {
+  uint64_t generation;
+  int ret;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    ret = call_ramfs_put_inode(ino, (long) offset, size, data, &generation);
+  }
+  account_change(ret);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_write(req, ret);
+}
+
+static void sgxfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
+  fuse_reply_err(req, -sgxfs_fsync(NULL, datasync, fi));
+}
+
+static void sgxfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi) {
+  struct enclave_stat_t attributes;
+  int ret;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    if (enclave_create_at(ENCLAVE_ID, &ret, parent, name, mode, get_current_time(), &attributes) != SGX_SUCCESS) {
+      ret = -EIO;
+    }
+  }
+  account_change(0);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  struct stat stbuf;
+  fill_stat(attributes, &stbuf);
+  struct fuse_entry_param entry = get_entry(stbuf, OPTIONS.attr_timeout);
+  fuse_reply_create(req, &entry, fi);
+}
+
+static void sgxfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+  struct enclave_stat_t attributes;
+  int ret;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    if (enclave_mkdir_at(ENCLAVE_ID, &ret, parent, name, mode, get_current_time(), &attributes) != SGX_SUCCESS) {
+      ret = -EIO;
+    }
+  }
+  account_change(0);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  struct stat stbuf;
+  fill_stat(attributes, &stbuf);
+  reply_entry(req, stbuf, OPTIONS.attr_timeout);
+}
+
+static void sgxfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+  int ret;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    if (enclave_unlink_at(ENCLAVE_ID, &ret, parent, name, get_current_time()) != SGX_SUCCESS) {
+      ret = -EIO;
+    }
+  }
+  account_change(0);
+  fuse_reply_err(req, -ret);
+}
+
+static void sgxfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+  int ret;
+  {
+    ReadLock lock(CHANGES_LOCK);
+    if (enclave_rmdir_at(ENCLAVE_ID, &ret, parent, name, get_current_time()) != SGX_SUCCESS) {
+      ret = -EIO;
+    }
+  }
+  account_change(0);
+  fuse_reply_err(req, -ret);
+}
+
+/**
+ * Lists the entries of a directory that follow after, straight from the enclave
+ */
+static int list_entries(fuse_ino_t ino, const string &after, vector<DirectoryEntry>* entries, bool* end) {
+  vector<struct enclave_dirent_t> listed(LOWLEVEL_LIST_ENTRIES);
+  int ret;
+  int complete;
+  if (enclave_list(ENCLAVE_ID, &ret, ino, after.c_str(), listed.data(), listed.size(), &complete) != SGX_SUCCESS) {
+    return -EIO;
+  }
+  if (ret < 0) {
+    return ret;
+  }
+  for (int i = 0; i < ret; i++) {
+    entries->push_back(DirectoryEntry{listed[i].name, listed[i].inode, listed[i].directory != 0});
+  }
+  *end = complete != 0;
+  return 0;
+}
+
+static void sgxfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  struct enclave_stat_t attributes;
+  int ret = call_enclave_fstat(ino, &attributes);
+  if (ret == 0 && !attributes.directory) {
+    ret = -ENOTDIR;
+  }
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fi->fh = reinterpret_cast<uint64_t>(new DirectoryStream{0, ""});
+  fuse_reply_open(req, fi);
+}
+
+static void sgxfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+  reply_directory(req, ino, size, offset, reinterpret_cast<DirectoryStream*>(fi->fh),
+                  [ino](const string &after, vector<DirectoryEntry>* entries, bool* end) {
+    return list_entries(ino, after, entries, end);
+  });
+}
+
+static void sgxfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  delete reinterpret_cast<DirectoryStream*>(fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops sgxfs_ll_oper;
+
 static struct fuse_operations sgxfs_oper;
 
 int main(int argc, char **argv) {
@@ -359,16 +1092,64 @@ int main(int argc, char **argv) {
   sgxfs_oper.chmod = sgxfs_chmod;
   sgxfs_oper.chown = sgxfs_chown;
   sgxfs_oper.truncate = sgxfs_truncate;
+  sgxfs_oper.ftruncate = sgxfs_ftruncate;
   sgxfs_oper.utime = sgxfs_utime;
   sgxfs_oper.opendir = sgxfs_opendir;
+  sgxfs_oper.releasedir = sgxfs_releasedir;
   sgxfs_oper.access = sgxfs_access;
   sgxfs_oper.create = sgxfs_create;
   sgxfs_oper.fgetattr = sgxfs_fgetattr;
   sgxfs_oper.utimens = sgxfs_utimens;
   sgxfs_oper.bmap = sgxfs_bmap;
+  sgxfs_oper.fsync = sgxfs_fsync;
 
   sgxfs_oper.init = sgxfs_init;
   sgxfs_oper.destroy = sgxfs_destroy;
 
-  return fuse_main(argc, argv, &sgxfs_oper, NULL);
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &OPTIONS, SGXFS_OPTIONS, process_option) == -1) {
+    return 1;
+  }
+  if (OPTIONS.crypto_threads == 0 || OPTIONS.crypto_threads > MAX_CRYPTO_THREADS) {
+    cerr << "crypto_threads must be between 1 and " << MAX_CRYPTO_THREADS << endl;
+    return 1;
+  }
+  // Switchless workers stay in the enclave, and the crypto threads join the FUSE thread they work for
+  unsigned int switchless_workers = OPTIONS.switchless ? OPTIONS.switchless_workers : 0;
+  if (switchless_workers + OPTIONS.crypto_threads - 1 + BACKGROUND_THREADS + FUSE_THREADS > ENCLAVE_THREADS) {
+    cerr << "switchless_workers and crypto_threads must not add up to more than "
+         << ENCLAVE_THREADS + 1 - BACKGROUND_THREADS - FUSE_THREADS << endl;
+    return 1;
+  }
+  int ret;
+  if (OPTIONS.lowlevel) {
+    sgxfs_ll_oper.init = sgxfs_ll_init;
+    sgxfs_ll_oper.destroy = sgxfs_ll_destroy;
+    sgxfs_ll_oper.lookup = sgxfs_ll_lookup;
+    sgxfs_ll_oper.forget = sgxfs_ll_forget;
+    sgxfs_ll_oper.forget_multi = sgxfs_ll_forget_multi;
+    sgxfs_ll_oper.getattr = sgxfs_ll_getattr;
+    sgxfs_ll_oper.setattr = sgxfs_ll_setattr;
+    sgxfs_ll_oper.open = sgxfs_ll_open;
+    sgxfs_ll_oper.read = sgxfs_ll_read;
+    sgxfs_ll_oper.write = sgxfs_ll_write;
+    sgxfs_ll_oper.fsync = sgxfs_ll_fsync;
+    sgxfs_ll_oper.create = sgxfs_ll_create;
+    sgxfs_ll_oper.mkdir = sgxfs_ll_mkdir;
+    sgxfs_ll_oper.unlink = sgxfs_ll_unlink;
+    sgxfs_ll_oper.rmdir = sgxfs_ll_rmdir;
+    sgxfs_ll_oper.opendir = sgxfs_ll_opendir;
+    sgxfs_ll_oper.readdir = sgxfs_ll_readdir;
+    sgxfs_ll_oper.releasedir = sgxfs_ll_releasedir;
+    // Changes made through inodes do not invalidate the listings cached by path, which checkpoints read
+    METADATA_CACHE.set_timeout(0);
+    ret = run_lowlevel_session(&args, &sgxfs_ll_oper, sizeof(sgxfs_ll_oper), NULL);
+  } else {
+    METADATA_CACHE.set_timeout(OPTIONS.attr_timeout);
+    string timeout = "-oattr_timeout=" + to_string(OPTIONS.attr_timeout);
+    fuse_opt_add_arg(&args, timeout.c_str());
+    ret = fuse_main(args.argc, args.argv, &sgxfs_oper, NULL);
+  }
+  fuse_opt_free_args(&args);
+  return ret;
 }
@@ -0,0 +1,93 @@
+#include "block_cache.hpp"
+
+#include <cstring>
+#include <iterator>
+
+BlockCache::BlockCache(const size_t capacity, const size_t block_size):
+  capacity(capacity), block_size(block_size), dirty_blocks(0), pool(block_size) {
+}
+
+BlockCache::~BlockCache() {
+  for (auto it = this->blocks.begin(); it != this->blocks.end(); it++) {
+    this->pool.release(it->data, this->block_size);
+  }
+}
+
+size_t BlockCache::get_block_size() const {
+  return this->block_size;
+}
+
+size_t BlockCache::get_capacity() const {
+  return this->capacity;
+}
+
+Mutex &BlockCache::get_lock() {
+  return this->lock;
+}
+
+CachedBlock* BlockCache::find(const uint64_t file, const uint64_t index) {
+  auto entry = this->entries.find(Key(file, index));
+  if (entry == this->entries.end()) {
+    return NULL;
+  }
+  this->blocks.splice(this->blocks.begin(), this->blocks, entry->second);
+  return &(*entry->second);
+}
+
+void BlockCache::erase(std::list<CachedBlock>::iterator block) {
+  this->entries.erase(Key(block->file, block->index));
+  this->dirty_blocks -= block->dirty;
+  this->pool.release(block->data, this->block_size);
+  this->blocks.erase(block);
+}
+
+bool BlockCache::evict_one() {
+  for (auto it = this->blocks.rbegin(); it != this->blocks.rend(); it++) {
+    if (!it->dirty) {
+      this->erase(std::next(it).base());
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BlockCache::reserve(const size_t count) {
+  if (count > this->capacity - this->dirty_blocks) {
+    return false;
+  }
+  while (this->capacity - this->blocks.size() < count) {
+    this->evict_one();
+  }
+  return true;
+}
+
+CachedBlock* BlockCache::insert(const uint64_t file, const uint64_t index) {
+  CachedBlock* cached = this->find(file, index);
+  if (cached != NULL) {
+    return cached;
+  }
+  if (this->capacity == 0 || (this->blocks.size() >= this->capacity && !this->evict_one())) {
+    return NULL;
+  }
+  char* data = this->pool.allocate(this->block_size);
+  memset(data, 0, this->block_size);
+  this->blocks.push_front(CachedBlock{file, index, 0, false, data});
+  this->entries[Key(file, index)] = this->blocks.begin();
+  return &this->blocks.front();
+}
+
+void BlockCache::set_dirty(CachedBlock* block, const bool dirty) {
+  if (block->dirty != dirty) {
+    this->dirty_blocks += dirty ? 1 : -1;
+    block->dirty = dirty;
+  }
+}
+
+void BlockCache::remove(const uint64_t file) {
+  auto it = this->entries.lower_bound(Key(file, 0));
+  while (it != this->entries.end() && it->first.first == file) {
+    auto block = it->second;
+    it++;
+    this->erase(block);
+  }
+}
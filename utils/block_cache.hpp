@@ -0,0 +1,88 @@
+#ifndef __BLOCK_CACHE_HPP__
+#define __BLOCK_CACHE_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <utility>
+
+#include "block_pool.hpp"
+#include "lock.hpp"
+
+/**
+ * Plaintext of a block of a file held by a BlockCache
+ */
+struct CachedBlock {
+  uint64_t file;
+  uint64_t index;
+  size_t length;
+  bool dirty;
+  char* data;
+};
+
+/**
+ * A least recently used cache of plaintext blocks keyed by file and block index.
+ * Only clean blocks are evicted: a dirty block stays in the cache until its owner writes it back and
+ * marks it clean, or removes it.
+ * The cache does not lock itself, its users hold get_lock() across every sequence of calls that must
+ * see a consistent cache.
+ */
+class BlockCache {
+  public:
+    /**
+     * @param capacity Maximum number of blocks held by the cache
+     * @param block_size Size of every block in bytes
+     */
+    BlockCache(const size_t capacity, const size_t block_size);
+    ~BlockCache();
+
+    size_t get_block_size() const;
+    size_t get_capacity() const;
+    Mutex &get_lock();
+
+    /**
+     * Looks up a block and marks it as the most recently used one
+     * @return The block, NULL if it is not cached
+     */
+    CachedBlock* find(const uint64_t file, const uint64_t index);
+
+    /**
+     * Evicts clean blocks until count blocks can be inserted
+     * @return false if too many blocks are dirty to make room for count blocks
+     */
+    bool reserve(const size_t count);
+
+    /**
+     * Inserts an empty, clean block, evicting the least recently used clean block if the cache is full
+     * @return The new block, or the cached one if it is already present, NULL if no block could be evicted
+     */
+    CachedBlock* insert(const uint64_t file, const uint64_t index);
+
+    /**
+     * Marks a block as dirty, which keeps it in the cache, or as clean, which makes it evictable
+     */
+    void set_dirty(CachedBlock* block, const bool dirty);
+
+    /**
+     * Drops every block of a file, dirty or not
+     */
+    void remove(const uint64_t file);
+
+  private:
+    typedef std::pair<uint64_t, uint64_t> Key;
+
+    bool evict_one();
+    void erase(std::list<CachedBlock>::iterator block);
+
+    const size_t capacity;
+    const size_t block_size;
+    size_t dirty_blocks;
+    BlockPool pool;
+    Mutex lock;
+    // Most recently used blocks first
+    std::list<CachedBlock> blocks;
+    std::map<Key, std::list<CachedBlock>::iterator> entries;
+};
+
+#endif /*__BLOCK_CACHE_HPP__*/
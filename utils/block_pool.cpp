@@ -0,0 +1,231 @@
+#include "block_pool.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+struct ThreadCache {
+  const BlockPool* owner;
+  // Next cache owned by the same pool
+  ThreadCache* next;
+  FreeBlock* heads[BlockPool::NUMBER_OF_CLASSES];
+  size_t counts[BlockPool::NUMBER_OF_CLASSES];
+};
+
+namespace {
+
+thread_local ThreadCache THREAD_CACHE;
+
+}  // namespace
+
+const size_t BlockPool::NUMBER_OF_CLASSES;
+const size_t BlockPool::THREAD_CACHE_SIZE;
+const size_t BlockPool::MAX_FREE_BLOCKS;
+
+BlockPool::BlockPool(const size_t block_size): block_size(block_size), thread_caches(NULL) {
+  for (size_t i = 0; i < NUMBER_OF_CLASSES; i++) {
+    this->free_lists[i] = NULL;
+  }
+  this->blocks_in_use = 0;
+  this->blocks_free = 0;
+  this->high_water_mark = 0;
+#ifndef FUSEGX_ENCLAVE
+  pthread_key_create(&this->thread_cache_key, release_thread_cache);
+#endif
+}
+
+BlockPool::~BlockPool() {
+#ifndef FUSEGX_ENCLAVE
+  // Threads exiting from now on leave their cache to the loop below
+  pthread_key_delete(this->thread_cache_key);
+#endif
+  // The caches of every thread that used the pool, not only the calling one, hold blocks to free
+  ScopedLock lock(this->mutex);
+  while (this->thread_caches != NULL) {
+    ThreadCache* cache = this->thread_caches;
+    this->thread_caches = cache->next;
+    this->drain_locked(cache);
+    cache->owner = NULL;
+  }
+  for (size_t i = 0; i < NUMBER_OF_CLASSES; i++) {
+    while (this->free_lists[i] != NULL) {
+      FreeBlock* block = this->free_lists[i];
+      this->free_lists[i] = block->next;
+      delete [] reinterpret_cast<char*>(block);
+    }
+  }
+}
+
+int BlockPool::get_size_class(const size_t size) const {
+  if (size == 0 || size % this->block_size != 0) {
+    return -1;
+  }
+  size_t blocks = size / this->block_size;
+  if ((blocks & (blocks - 1)) != 0) {
+    return -1;
+  }
+  int size_class = 0;
+  while (blocks > 1) {
+    blocks >>= 1;
+    size_class++;
+  }
+  return size_class < static_cast<int>(NUMBER_OF_CLASSES) ? size_class : -1;
+}
+
+bool BlockPool::owns_thread_cache() {
+  if (THREAD_CACHE.owner == this) {
+    return true;
+  }
+  if (THREAD_CACHE.owner != NULL) {
+    return false;
+  }
+  ScopedLock lock(this->mutex);
+  THREAD_CACHE.owner = this;
+  THREAD_CACHE.next = this->thread_caches;
+  this->thread_caches = &THREAD_CACHE;
+#ifndef FUSEGX_ENCLAVE
+  pthread_setspecific(this->thread_cache_key, this);
+#endif
+  return true;
+}
+
+void BlockPool::drain_locked(ThreadCache* cache) {
+  for (size_t size_class = 0; size_class < NUMBER_OF_CLASSES; size_class++) {
+    while (cache->heads[size_class] != NULL) {
+      FreeBlock* block = cache->heads[size_class];
+      cache->heads[size_class] = block->next;
+      this->push_locked(size_class, block);
+    }
+    cache->counts[size_class] = 0;
+  }
+}
+
+#ifndef FUSEGX_ENCLAVE
+void BlockPool::release_thread_cache(void* pool) {
+  // The cache of the exiting thread is freed with it, and must not be reached from the pool anymore
+  BlockPool* self = static_cast<BlockPool*>(pool);
+  ScopedLock lock(self->mutex);
+  if (THREAD_CACHE.owner != self) {
+    return;
+  }
+  self->drain_locked(&THREAD_CACHE);
+  for (ThreadCache** cache = &self->thread_caches; *cache != NULL; cache = &(*cache)->next) {
+    if (*cache == &THREAD_CACHE) {
+      *cache = THREAD_CACHE.next;
+      break;
+    }
+  }
+  THREAD_CACHE.owner = NULL;
+}
+#endif
+
+FreeBlock* BlockPool::pop_locked(const int size_class) {
+  FreeBlock* block = this->free_lists[size_class];
+  if (block != NULL) {
+    this->free_lists[size_class] = block->next;
+  }
+  return block;
+}
+
+void BlockPool::push_locked(const int size_class, FreeBlock* block) {
+  uint64_t blocks = static_cast<uint64_t>(1) << size_class;
+  if (this->blocks_free > MAX_FREE_BLOCKS) {
+    this->blocks_free -= blocks;
+    delete [] reinterpret_cast<char*>(block);
+    return;
+  }
+  block->next = this->free_lists[size_class];
+  this->free_lists[size_class] = block;
+}
+
+char* BlockPool::allocate(const size_t size) {
+  int size_class = this->get_size_class(size);
+  if (size_class < 0) {
+    return new char[size];
+  }
+  uint64_t blocks = static_cast<uint64_t>(1) << size_class;
+  uint64_t in_use = this->blocks_in_use.fetch_add(blocks) + blocks;
+  uint64_t high_water_mark = this->high_water_mark.load();
+  while (in_use > high_water_mark &&
+         !this->high_water_mark.compare_exchange_weak(high_water_mark, in_use)) {
+  }
+
+  FreeBlock* block = NULL;
+  if (this->owns_thread_cache()) {
+    if (THREAD_CACHE.heads[size_class] == NULL) {
+      // Refill half of the thread cache from the shared free list
+      ScopedLock lock(this->mutex);
+      FreeBlock* refill;
+      while (THREAD_CACHE.counts[size_class] < THREAD_CACHE_SIZE / 2 &&
+             (refill = this->pop_locked(size_class)) != NULL) {
+        refill->next = THREAD_CACHE.heads[size_class];
+        THREAD_CACHE.heads[size_class] = refill;
+        THREAD_CACHE.counts[size_class]++;
+      }
+    }
+    block = THREAD_CACHE.heads[size_class];
+    if (block != NULL) {
+      THREAD_CACHE.heads[size_class] = block->next;
+      THREAD_CACHE.counts[size_class]--;
+    }
+  } else {
+    ScopedLock lock(this->mutex);
+    block = this->pop_locked(size_class);
+  }
+  if (block == NULL) {
+    return new char[size];
+  }
+  this->blocks_free -= blocks;
+  return reinterpret_cast<char*>(block);
+}
+
+void BlockPool::release(char* data, const size_t size) {
+  int size_class = this->get_size_class(size);
+  if (size_class < 0) {
+    delete [] data;
+    return;
+  }
+  uint64_t blocks = static_cast<uint64_t>(1) << size_class;
+  this->blocks_in_use -= blocks;
+  this->blocks_free += blocks;
+  FreeBlock* block = reinterpret_cast<FreeBlock*>(data);
+  if (!this->owns_thread_cache()) {
+    ScopedLock lock(this->mutex);
+    this->push_locked(size_class, block);
+    return;
+  }
+  if (THREAD_CACHE.counts[size_class] >= THREAD_CACHE_SIZE) {
+    // Spill half of the thread cache to the shared free list
+    ScopedLock lock(this->mutex);
+    while (THREAD_CACHE.counts[size_class] > THREAD_CACHE_SIZE / 2) {
+      FreeBlock* spilled = THREAD_CACHE.heads[size_class];
+      THREAD_CACHE.heads[size_class] = spilled->next;
+      THREAD_CACHE.counts[size_class]--;
+      this->push_locked(size_class, spilled);
+    }
+  }
+  block->next = THREAD_CACHE.heads[size_class];
+  THREAD_CACHE.heads[size_class] = block;
+  THREAD_CACHE.counts[size_class]++;
+}
+
+void BlockPool::flush_thread_cache() {
+  if (THREAD_CACHE.owner != this) {
+    return;
+  }
+  ScopedLock lock(this->mutex);
+  this->drain_locked(&THREAD_CACHE);
+}
+
+BlockPoolStatistics BlockPool::get_statistics() const {
+  BlockPoolStatistics statistics;
+  statistics.block_size = this->block_size;
+  statistics.blocks_in_use = this->blocks_in_use.load();
+  statistics.blocks_free = this->blocks_free.load();
+  statistics.high_water_mark = this->high_water_mark.load();
+  return statistics;
+}
@@ -0,0 +1,90 @@
+#ifndef __BLOCK_POOL_HPP__
+#define __BLOCK_POOL_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "lock.hpp"
+
+struct FreeBlock;
+struct ThreadCache;
+
+/**
+ * Counters describing the memory held by a BlockPool, in units of block_size bytes
+ */
+struct BlockPoolStatistics {
+  size_t block_size;
+  uint64_t blocks_in_use;
+  uint64_t blocks_free;
+  uint64_t high_water_mark;
+};
+
+/**
+ * A pool of fixed-size memory blocks.
+ * Memory is handed out in size classes of block_size * 2^k bytes, k < NUMBER_OF_CLASSES.
+ * Released blocks are kept on per-class free lists rather than returned to the heap,
+ * and every thread caches a few free blocks of each class so that most allocations
+ * and releases do not take the pool lock. The pool keeps track of the caches it owns,
+ * and takes their blocks back when it is destroyed.
+ */
+class BlockPool {
+  public:
+    static const size_t NUMBER_OF_CLASSES = 6;
+    /**
+     * Maximum number of free blocks of each class cached by a thread
+     */
+    static const size_t THREAD_CACHE_SIZE = 16;
+    /**
+     * Free memory kept by the pool beyond which released blocks go back to the heap, in blocks
+     */
+    static const size_t MAX_FREE_BLOCKS = 4096;
+
+    explicit BlockPool(const size_t block_size);
+    ~BlockPool();
+
+    /**
+     * Allocates size bytes.
+     * Sizes that do not match a size class are served by the heap.
+     * @param size Number of bytes to allocate
+     * @return A pointer to the allocated memory
+     */
+    char* allocate(const size_t size);
+
+    /**
+     * Gives back memory obtained from allocate
+     * @param data Pointer returned by allocate
+     * @param size Size given to allocate
+     */
+    void release(char* data, const size_t size);
+
+    /**
+     * Moves the free blocks cached by the calling thread back to the pool
+     */
+    void flush_thread_cache();
+
+    BlockPoolStatistics get_statistics() const;
+
+  private:
+    int get_size_class(const size_t size) const;
+    bool owns_thread_cache();
+    void drain_locked(ThreadCache* cache);
+#ifndef FUSEGX_ENCLAVE
+    static void release_thread_cache(void* pool);
+#endif
+    FreeBlock* pop_locked(const int size_class);
+    void push_locked(const int size_class, FreeBlock* block);
+
+    const size_t block_size;
+    Mutex mutex;
+    FreeBlock* free_lists[NUMBER_OF_CLASSES];
+    ThreadCache* thread_caches;
+    std::atomic<uint64_t> blocks_in_use;
+    std::atomic<uint64_t> blocks_free;
+    std::atomic<uint64_t> high_water_mark;
+#ifndef FUSEGX_ENCLAVE
+    pthread_key_t thread_cache_key;
+#endif
+};
+
+#endif /*__BLOCK_POOL_HPP__*/
@@ -0,0 +1,36 @@
+#ifndef __ENCRYPTED_BLOCK_HPP__
+#define __ENCRYPTED_BLOCK_HPP__
+
+#include <cstdint>
+
+#include "sgx_tcrypto.h"
+#include "sgx_tseal.h"
+
+/**
+ * A block of a file encrypted by the enclave with AES-GCM under the volume key, followed by its ciphertext.
+ * The header takes 32 bytes where a sealed block takes sizeof(sgx_sealed_data_t), 560 bytes.
+ */
+struct encrypted_block_t {
+  uint32_t payload_size;
+  uint8_t iv[SGX_AESGCM_IV_SIZE];
+  sgx_aes_gcm_128bit_tag_t mac;
+  uint8_t payload[];
+};
+
+/**
+ * Additional MAC text of the sealed volume key, which tells that the blocks of the volume are authenticated
+ * along with the name of their file and their index
+ */
+static const uint8_t BOUND_KEY_TAG[8] = {'R', 'A', 'M', 'F', 'S', 'B', 'K', '1'};
+
+/**
+ * Size of the volume key once sealed with sgx_seal_data
+ */
+static const size_t SEALED_KEY_SIZE = sizeof(sgx_sealed_data_t) + sizeof(BOUND_KEY_TAG) + SGX_AESGCM_KEY_SIZE;
+
+/**
+ * Size of the volume key sealed before blocks were bound to their file and index
+ */
+static const size_t UNBOUND_SEALED_KEY_SIZE = sizeof(sgx_sealed_data_t) + SGX_AESGCM_KEY_SIZE;
+
+#endif
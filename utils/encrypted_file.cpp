@@ -0,0 +1,107 @@
+#include "encrypted_file.hpp"
+
+#include <cassert>
+#include <cstring>
+
+#include <algorithm>
+
+const size_t EncryptedFile::CHUNK_SIZE;
+
+EncryptedFile::EncryptedFile(const size_t block_size):
+  block_size(block_size), blocks_per_chunk(std::max<size_t>(1, CHUNK_SIZE / block_size)), size(0) {
+}
+
+size_t EncryptedFile::get_size() const {
+  return this->size;
+}
+
+size_t EncryptedFile::get_number_of_blocks() const {
+  return this->tags.size();
+}
+
+void EncryptedFile::resize(const size_t size) {
+  size_t chunk_size = this->blocks_per_chunk * this->block_size;
+  size_t number_of_chunks = (size + chunk_size - 1) / chunk_size;
+  if (this->chunks.size() > number_of_chunks) {
+    this->chunks.resize(number_of_chunks);
+  }
+  while (this->chunks.size() < number_of_chunks) {
+    if (!this->chunks.empty()) {
+      this->chunks.back().resize(chunk_size);
+      this->chunks.back().shrink_to_fit();
+    }
+    this->chunks.push_back(std::vector<uint8_t>());
+  }
+  if (number_of_chunks > 0) {
+    std::vector<uint8_t> &last = this->chunks.back();
+    size_t last_size = size - (number_of_chunks - 1) * chunk_size;
+    if (last_size > last.capacity()) {
+      // Files mostly grow by appending, a smaller growth factor than the default one wastes less memory
+      last.reserve(std::min(chunk_size, std::max(last_size, last.capacity() + last.capacity() / 8)));
+    }
+    last.resize(last_size);
+    if (last.capacity() / 2 > last.size()) {
+      last.shrink_to_fit();
+    }
+  }
+  this->size = size;
+}
+
+size_t EncryptedFile::gather(const size_t first,
+                             const size_t last,
+                             std::vector<uint8_t> &buffer,
+                             std::vector<size_t> &sizes) const {
+  size_t start = std::min(first * this->block_size, this->size);
+  size_t end = std::min(last * this->block_size, this->size);
+  buffer.resize((last - first) * sizeof(encrypted_block_t) + end - start);
+  sizes.reserve(sizes.size() + last - first);
+  size_t position = 0;
+  for (size_t index = first; index < last; index++) {
+    uint32_t payload = std::min(this->block_size, this->size - index * this->block_size);
+    const std::vector<uint8_t> &chunk = this->chunks[index / this->blocks_per_chunk];
+    auto block = reinterpret_cast<encrypted_block_t*>(buffer.data() + position);
+    block->payload_size = payload;
+    memcpy(block->iv, this->tags[index].iv, sizeof(block->iv));
+    memcpy(block->mac, this->tags[index].mac, sizeof(block->mac));
+    memcpy(block->payload, chunk.data() + (index % this->blocks_per_chunk) * this->block_size, payload);
+    sizes.push_back(sizeof(encrypted_block_t) + payload);
+    position += sizeof(encrypted_block_t) + payload;
+  }
+  return end - start;
+}
+
+size_t EncryptedFile::store(const size_t first, const uint8_t* blocks, const size_t count) {
+  assert(first <= this->tags.size());
+  size_t position = 0;
+  for (size_t index = first; index < first + count; index++) {
+    auto block = reinterpret_cast<const encrypted_block_t*>(blocks + position);
+    size_t offset = index * this->block_size;
+    // Blocks are only appended after a full block, and only the last block may be partial
+    assert(index < this->tags.size() || offset == this->size);
+    if (index + 1 >= this->tags.size()) {
+      this->resize(offset + block->payload_size);
+    } else {
+      assert(block->payload_size == this->block_size);
+    }
+    if (index == this->tags.size()) {
+      this->tags.push_back(Tag());
+    }
+    memcpy(this->tags[index].iv, block->iv, sizeof(block->iv));
+    memcpy(this->tags[index].mac, block->mac, sizeof(block->mac));
+    std::vector<uint8_t> &chunk = this->chunks[index / this->blocks_per_chunk];
+    memcpy(chunk.data() + (index % this->blocks_per_chunk) * this->block_size, block->payload, block->payload_size);
+    position += sizeof(encrypted_block_t) + block->payload_size;
+  }
+  return position;
+}
+
+void EncryptedFile::truncate(const size_t number_of_blocks) {
+  if (number_of_blocks >= this->tags.size()) {
+    return;
+  }
+  this->tags.resize(number_of_blocks);
+  this->resize(std::min(this->size, number_of_blocks * this->block_size));
+  if (this->tags.capacity() / 2 > this->tags.size()) {
+    this->tags.shrink_to_fit();
+  }
+}
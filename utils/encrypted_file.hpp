@@ -0,0 +1,87 @@
+#ifndef __ENCRYPTED_FILE_HPP__
+#define __ENCRYPTED_FILE_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "encrypted_block.hpp"
+
+/**
+ * The encrypted blocks of a file, stored outside the enclave without a header per block.
+ * Every block but the last one is full, so the ciphertext of the blocks is kept back to back in an arena
+ * where block i starts at i * block_size, and only the IV and MAC of every block are kept on the side.
+ * The arena is split in chunks of CHUNK_SIZE bytes so that growing a file never copies its content.
+ * Blocks are exchanged with the enclave as encrypted_block_t, rebuilt on the fly.
+ * The file does not lock itself, its users hold the lock of the file.
+ */
+class EncryptedFile {
+  public:
+    /**
+     * Size of the chunks of the arena, rounded down to a multiple of the block size
+     */
+    static const size_t CHUNK_SIZE = 1 << 20;
+
+    /**
+     * @param block_size Size of the plaintext held by every full block
+     */
+    explicit EncryptedFile(const size_t block_size);
+
+    /**
+     * @return The size of the plaintext held by the blocks, in constant time
+     */
+    size_t get_size() const;
+    size_t get_number_of_blocks() const;
+
+    /**
+     * Copies a range of blocks one after the other in a single buffer, as encrypted_block_t
+     * @param first Index of the first block to copy
+     * @param last Index following the last block to copy
+     * @param buffer Receives the blocks
+     * @param sizes Receives the size of every block copied
+     * @return The total size of the plaintext held by the copied blocks
+     */
+    size_t gather(const size_t first,
+                  const size_t last,
+                  std::vector<uint8_t> &buffer,
+                  std::vector<size_t> &sizes) const;
+
+    /**
+     * Stores blocks given one after the other as encrypted_block_t, replacing the blocks at their indices
+     * or appending them. Only the last block of the file may be partial.
+     * @param first Index of the first block, at most the number of blocks of the file
+     * @param blocks Buffer holding the blocks
+     * @param count Number of blocks in the buffer
+     * @return The number of bytes read from the buffer
+     */
+    size_t store(const size_t first, const uint8_t* blocks, const size_t count);
+
+    /**
+     * Drops the blocks following the first number_of_blocks ones
+     */
+    void truncate(const size_t number_of_blocks);
+
+  private:
+    /**
+     * IV and MAC of a block
+     */
+    struct Tag {
+      uint8_t iv[SGX_AESGCM_IV_SIZE];
+      sgx_aes_gcm_128bit_tag_t mac;
+    };
+
+    /**
+     * Grows or shrinks the arena to hold size bytes
+     */
+    void resize(const size_t size);
+
+    const size_t block_size;
+    const size_t blocks_per_chunk;
+    // Size of the plaintext, which is also the size of the ciphertext
+    size_t size;
+    // Ciphertext of the blocks, every chunk but the last one is full
+    std::vector<std::vector<uint8_t>> chunks;
+    std::vector<Tag> tags;
+};
+
+#endif
@@ -2,289 +2,885 @@
 
 #include <cerrno>
 #include <climits>
-#include <cmath>
 #include <cstring>
 
+#include <algorithm>
 #include <map>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "journal_record.hpp"
+
+const size_t FileSystem::DEFAULT_BLOCK_SIZE;
+const size_t FileSystem::MAX_EXTENT_BLOCKS;
+const uint64_t FileSystem::INVALID_INODE;
+const uint64_t FileSystem::ROOT_INODE;
+const uint32_t FileSystem::DEFAULT_MODE;
+
 FileSystem::FileSystem(): FileSystem(DEFAULT_BLOCK_SIZE) {
 }
 
-FileSystem::FileSystem(const size_t block_size) {
+FileSystem::FileSystem(const size_t block_size, const uint64_t time) {
   this->block_size = block_size;
-  this->files = new std::map<std::string, std::vector<std::vector<char>*>*>();
-  this->directories = new std::map<std::string, bool>();
-  (*this->directories)[""] = true;
-}
-
-FileSystem::FileSystem(std::map<std::string, std::vector<std::vector<char>*>*>* files): FileSystem(DEFAULT_BLOCK_SIZE) {
-  this->files = files;
-  for (auto it = this->files->begin(); it != this->files->end(); it++) {
-    std::string filename = it->first;
-    std::vector<std::string>* tokens = split_path(filename);
-    std::string directory_name;
-    for (size_t i = 0; i < tokens->size() - 1; i++) {
-      directory_name += tokens->at(i) + "/";
-      this->mkdir(directory_name);
+  this->pool = new BlockPool(block_size);
+  this->next_inode = ROOT_INODE;
+  this->generation = 0;
+  this->inodes = new std::unordered_map<uint64_t, Inode*>();
+  this->dentries = new std::unordered_map<DentryKey, uint64_t, DentryKeyHash>();
+  this->add_inode(INVALID_INODE, "", true, DEFAULT_MODE, time);
+}
+
+FileSystem::FileSystem(std::map<std::string, std::vector<char>*>* files, const uint64_t time):
+  FileSystem(DEFAULT_BLOCK_SIZE, time) {
+  for (auto it = files->begin(); it != files->end(); it++) {
+    Inode* inode = this->add_restored_file(it->first, time);
+    std::vector<char>* content = it->second;
+    if (inode != NULL) {
+      this->write_inode(inode, content->data(), 0, content->size(), time);
+    }
+    delete content;
+  }
+  delete files;
+}
+
+FileSystem::FileSystem(const std::map<std::string, size_t> &files, const Loader &loader, const uint64_t time):
+  FileSystem(DEFAULT_BLOCK_SIZE, time) {
+  this->loader = loader;
+  for (auto it = files.begin(); it != files.end(); it++) {
+    Inode* inode = this->add_restored_file(it->first, time);
+    if (inode != NULL && it->second > 0) {
+      inode->size = it->second;
+      inode->pending = true;
+      this->restored_paths[inode->number] = it->first;
     }
+  }
+}
+
+/**
+ * Adds a file restored from a dump along with the directories leading to it
+ * @return The inode of the file, NULL if the path is empty or already exists
+ */
+Inode* FileSystem::add_restored_file(const std::string &path, const uint64_t time) {
+  std::vector<std::string>* tokens = split_path(path);
+  if (tokens->empty()) {
     delete tokens;
+    return NULL;
+  }
+  std::string directory_name;
+  for (size_t i = 0; i < tokens->size() - 1; i++) {
+    directory_name += tokens->at(i) + "/";
+    this->mkdir(directory_name, DEFAULT_MODE, time);
   }
+  Inode* parent = this->get_inode(this->resolve(directory_name));
+  Inode* inode = NULL;
+  if (parent != NULL && parent->directory && this->resolve(parent->number, tokens->back()) == INVALID_INODE) {
+    inode = this->add_inode(parent->number, tokens->back(), false, DEFAULT_MODE, time);
+  }
+  delete tokens;
+  return inode;
 }
 
 FileSystem::~FileSystem() {
-  auto it = this->files->begin();
-  while (it != this->files->end()) {
-    auto blocks = it->second;
-    auto block = blocks->begin();
-    while (block != blocks->end()) {
-      block = blocks->erase(block);
+  for (auto it = this->inodes->begin(); it != this->inodes->end(); it++) {
+    Inode* inode = it->second;
+    if (inode->extents != NULL) {
+      this->release_extents(inode, 0);
+      delete inode->extents;
     }
-    it = this->files->erase(it);
+    delete inode->children;
+    delete inode;
+  }
+  delete this->inodes;
+  delete this->dentries;
+  delete this->pool;
+}
+
+Inode* FileSystem::get_inode(const uint64_t inode) const {
+  auto entry = this->inodes->find(inode);
+  if (entry == this->inodes->end()) {
+    return NULL;
+  }
+  return entry->second;
+}
+
+Inode* FileSystem::get_directory_inode(const uint64_t inode) const {
+  Inode* entry = this->get_inode(inode);
+  if (entry == NULL || !entry->directory || entry->nlink == 0) {
+    return NULL;
   }
-  delete this->files;
-  delete this->directories;
+  return entry;
 }
 
-int FileSystem::create(const std::string &path) {
+Inode* FileSystem::add_inode(const uint64_t parent,
+                             const std::string &name,
+                             const bool directory,
+                             const uint32_t mode,
+                             const uint64_t time) {
+  Inode* inode = new Inode();
+  inode->number = this->next_inode++;
+  inode->parent = parent;
+  inode->name = name;
+  inode->directory = directory;
+  inode->mode = mode & 07777;
+  // A directory is linked from its parent and from its own ".", then from the ".." of every subdirectory
+  inode->nlink = directory ? 2 : 1;
+  inode->size = 0;
+  inode->mtime = time;
+  inode->ctime = time;
+  inode->lookups = 0;
+  inode->pending = false;
+  inode->extents = directory ? NULL : new std::vector<Extent>();
+  inode->children = directory ? new std::map<std::string, uint64_t>() : NULL;
+  (*this->inodes)[inode->number] = inode;
+  if (inode->number != ROOT_INODE) {
+    Inode* directory_inode = this->get_inode(parent);
+    (*this->dentries)[DentryKey{parent, name}] = inode->number;
+    (*directory_inode->children)[name] = inode->number;
+    directory_inode->nlink += directory ? 1 : 0;
+    directory_inode->mtime = time;
+    directory_inode->ctime = time;
+  }
+  return inode;
+}
+
+void FileSystem::remove_inode(Inode* inode, const uint64_t time) {
+  Inode* parent = this->get_inode(inode->parent);
+  this->dentries->erase(DentryKey{inode->parent, inode->name});
+  parent->children->erase(inode->name);
+  parent->nlink -= inode->directory ? 1 : 0;
+  parent->mtime = time;
+  parent->ctime = time;
+  if (inode->lookups > 0) {
+    // The content stays reachable by inode number until the kernel forgets it
+    inode->parent = INVALID_INODE;
+    inode->nlink = 0;
+    inode->ctime = time;
+    return;
+  }
+  this->inodes->erase(inode->number);
+  if (inode->extents != NULL) {
+    this->release_extents(inode, 0);
+    delete inode->extents;
+  }
+  delete inode->children;
+  delete inode;
+}
+
+std::string FileSystem::get_path(const Inode* inode) const {
+  std::string path = inode->name;
+  const Inode* current = this->get_inode(inode->parent);
+  while (current != NULL && current->number != ROOT_INODE) {
+    path = current->name + "/" + path;
+    current = this->get_inode(current->parent);
+  }
+  return path;
+}
+
+uint64_t FileSystem::resolve(const uint64_t parent, const std::string &name) const {
+  auto entry = this->dentries->find(DentryKey{parent, name});
+  if (entry == this->dentries->end()) {
+    return INVALID_INODE;
+  }
+  return entry->second;
+}
+
+uint64_t FileSystem::resolve(const std::string &path) const {
+  uint64_t inode = ROOT_INODE;
+  size_t start = 0;
+  while (start < path.length()) {
+    size_t end = path.find('/', start);
+    if (end == std::string::npos) {
+      end = path.length();
+    }
+    if (end > start) {
+      inode = this->resolve(inode, path.substr(start, end - start));
+      if (inode == INVALID_INODE) {
+        return INVALID_INODE;
+      }
+    }
+    start = end + 1;
+  }
+  return inode;
+}
+
+uint64_t FileSystem::lookup(const uint64_t parent, const std::string &name) const {
+  ReadLock lock(this->namespace_lock);
+  return this->resolve(parent, name);
+}
+
+uint64_t FileSystem::lookup(const std::string &path) const {
+  ReadLock lock(this->namespace_lock);
+  return this->resolve(path);
+}
+
+int FileSystem::lookup(const uint64_t parent, const std::string &name, FileAttributes* attributes) {
+  ReadLock lock(this->namespace_lock);
+  attributes->generation = this->generation;
+  Inode* inode = this->get_inode(this->resolve(parent, name));
+  int ret = this->fill_attributes(inode, attributes);
+  if (ret == 0) {
+    inode->lookups++;
+  }
+  return ret;
+}
+
+void FileSystem::forget(const uint64_t inode, const uint64_t count) {
+  WriteLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(inode);
+  if (entry == NULL) {
+    return;
+  }
+  entry->lookups -= std::min<uint64_t>(count, entry->lookups);
+  if (entry->lookups == 0 && entry->nlink == 0) {
+    this->inodes->erase(entry->number);
+    if (entry->extents != NULL) {
+      this->release_extents(entry, 0);
+      delete entry->extents;
+    }
+    delete entry->children;
+    delete entry;
+  }
+}
+
+int FileSystem::create(const std::string &path, const uint32_t mode, const uint64_t time) {
   std::string cleaned_path = FileSystem::clean_path(path);
-  std::string directory_path = get_directory(cleaned_path);
-  if (this->directories->find(directory_path) == this->directories->end()) {
+  WriteLock lock(this->namespace_lock);
+  Inode* parent = this->get_inode(this->resolve(get_directory(cleaned_path)));
+  if (parent == NULL || !parent->directory) {
     return -ENOTDIR;
   }
-  if (this->directories->find(cleaned_path) != this->directories->end()) {
+  std::string name = cleaned_path.substr(cleaned_path.rfind("/") + 1);
+  Inode* existing = this->get_inode(this->resolve(parent->number, name));
+  if (existing != NULL && existing->directory) {
     return -EISDIR;
   }
-  if (this->files->find(cleaned_path) != this->files->end()) {
+  if (existing != NULL) {
     return -EEXIST;
   }
-  (*this->files)[cleaned_path] = new std::vector<std::vector<char>*>();
+  this->notify(JOURNAL_CREATE, this->add_inode(parent->number, name, false, mode, time), mode);
+  this->generation++;
   return 0;
 }
 
-int FileSystem::unlink(const std::string &path) {
-  std::string directory_path = get_directory(path);
-  if (this->directories->find(directory_path) != this->directories->end()) {
-    return -ENOTDIR;
+int FileSystem::unlink(const std::string &path, const uint64_t time) {
+  WriteLock lock(this->namespace_lock);
+  Inode* inode = this->get_inode(this->resolve(path));
+  if (inode == NULL) {
+    return -ENOENT;
   }
-  if (this->directories->find(path) == this->directories->end()) {
+  if (inode->directory) {
     return -EISDIR;
   }
-  if (this->files->find(path) == this->files->end()) {
-    return -ENOENT;
-  }
-  this->files->erase(path);
+  this->notify(JOURNAL_UNLINK, inode, 0);
+  this->remove_inode(inode, time);
+  this->generation++;
   return 0;
 }
 
-int FileSystem::write(const std::string &path, const char *data, const size_t offset, const size_t length) {
-  std::string filename = clean_path(path);
-  auto entry = this->files->find(filename);
-  if (entry == this->files->end()) {
-      return -ENOENT;
+size_t FileSystem::get_capacity(const Inode* inode) const {
+  if (inode->extents->empty()) {
+    return 0;
   }
-  auto blocks = entry->second;
-  size_t block_index = static_cast<size_t>(floor(static_cast<long double>(offset) / this->block_size));
-  auto offset_in_block = offset % this->block_size;
-  size_t written = 0;
-  if (block_index < blocks->size()) {
-      std::vector<char> *block = (*blocks)[block_index];
-      size_t bytes_to_write = length;
-      if (this->block_size < (offset_in_block + length)) {
-        bytes_to_write = this->block_size - offset_in_block;
-        block->resize(this->block_size);
-      } else {
-        block->resize(offset_in_block + length);
-      }
-      memcpy(block->data() + offset_in_block, data, bytes_to_write);
-      written += bytes_to_write;
-  }
-  // Create new blocks from scratch
-  while (written < length) {
-    size_t bytes_to_write = length - written;
-    if (this->block_size < bytes_to_write) {
-      bytes_to_write = this->block_size;
+  const Extent &last = inode->extents->back();
+  return last.offset + last.capacity;
+}
+
+size_t FileSystem::find_extent(const Inode* inode, const size_t offset) const {
+  auto extent = std::upper_bound(inode->extents->begin(), inode->extents->end(), offset,
+                                 [](const size_t value, const Extent &e) { return value < e.offset; });
+  return (extent - inode->extents->begin()) - 1;
+}
+
+void FileSystem::reserve(Inode* inode, const size_t length) {
+  // Extents are capped at MAX_EXTENT_BLOCKS, the largest size class of the block pool, so a large write
+  // takes as many extents of that size as it needs rather than a single one
+  size_t capacity = this->get_capacity(inode);
+  while (capacity < length) {
+    size_t blocks = static_cast<size_t>(1) << std::min(inode->extents->size(), static_cast<size_t>(16));
+    size_t missing_blocks = (length - capacity + this->block_size - 1) / this->block_size;
+    while (blocks < missing_blocks && blocks < MAX_EXTENT_BLOCKS) {
+      blocks <<= 1;
     }
-    std::vector<char> *block = new std::vector<char>(bytes_to_write);
-    memcpy(block->data(), data + written, bytes_to_write);
-    blocks->push_back(block);
-    written += bytes_to_write;
+    blocks = std::min(blocks, MAX_EXTENT_BLOCKS);
+    Extent extent;
+    extent.offset = capacity;
+    extent.capacity = blocks * this->block_size;
+    extent.data = this->pool->allocate(extent.capacity);
+    inode->extents->push_back(extent);
+    capacity += extent.capacity;
   }
-  return written;
 }
 
-size_t FileSystem::get_file_size(const std::string &path) const {
-  std::string cleaned_path = clean_path(path);
-  auto entry = this->files->find(cleaned_path);
-  if (entry == this->files->end()) {
-    return -1;
-  }
-  auto blocks = entry->second;
-  if (blocks->empty()) {
-    return 0;
+void FileSystem::release_extents(Inode* inode, const size_t length) {
+  while (!inode->extents->empty() && inode->extents->back().offset >= length) {
+    this->pool->release(inode->extents->back().data, inode->extents->back().capacity);
+    inode->extents->pop_back();
   }
-  size_t size = (blocks->size() - 1) * this->block_size;
-  size += blocks->back()->size();
-  return size;
 }
 
-int FileSystem::truncate(const std::string &path, const size_t length) {
-  std::string filename = clean_path(path);
-  auto len = static_cast<unsigned int>(length);
-  auto entry = this->files->find(filename);
-  if (entry == this->files->end()) {
-    return -ENOENT;
+void FileSystem::copy_in(Inode* inode, const char *data, const size_t offset, const size_t length) {
+  size_t copied = 0;
+  for (size_t index = this->find_extent(inode, offset); copied < length; index++) {
+    Extent &extent = (*inode->extents)[index];
+    size_t offset_in_extent = offset + copied - extent.offset;
+    size_t size_to_copy = std::min(extent.capacity - offset_in_extent, length - copied);
+    if (data == NULL) {
+      memset(extent.data + offset_in_extent, 0, size_to_copy);
+    } else {
+      memcpy(extent.data + offset_in_extent, data + copied, size_to_copy);
+    }
+    copied += size_to_copy;
   }
+}
 
-  auto blocks = entry->second;
-  auto file_size = this->get_file_size(filename);
-  if (file_size == len) {
-    return 0;
+int FileSystem::write(const std::string &path,
+                      const char *data,
+                      const size_t offset,
+                      const size_t length,
+                      const uint64_t time) {
+  ReadLock lock(this->namespace_lock);
+  return this->write_inode(this->get_inode(this->resolve(path)), data, offset, length, time);
+}
+
+int FileSystem::write(const uint64_t inode,
+                      const char *data,
+                      const size_t offset,
+                      const size_t length,
+                      const uint64_t time) {
+  ReadLock lock(this->namespace_lock);
+  return this->write_inode(this->get_inode(inode), data, offset, length, time);
+}
+
+int FileSystem::write_inode(Inode* entry,
+                            const char *data,
+                            const size_t offset,
+                            const size_t length,
+                            const uint64_t time) {
+  if (entry == NULL || entry->directory) {
+      return -ENOENT;
   }
-  if (file_size < len) {
-    auto length_difference = len - blocks->size();
-    auto blocks_to_add = static_cast<size_t>(floor(length_difference / this->block_size));
-    if (blocks_to_add > 0) {
-      for (size_t i = 0; i < blocks_to_add; i++) {
-        blocks->push_back(new std::vector<char>(this->block_size));
-      }
-    }
-    auto length_of_last_block = len % this->block_size;
-    if (length_of_last_block > 0) {
-      blocks->push_back(new std::vector<char>(length_of_last_block));
-    }
+  // An empty write past the end of the file must not grow it
+  if (length == 0) {
     return 0;
   }
-  auto blocks_to_keep = static_cast<unsigned int>(ceil(len / this->block_size));
-  while (blocks_to_keep < blocks->size()) {
-    delete blocks->back();
-    blocks->pop_back();
+  WriteLock lock(entry->lock);
+  if (this->load_inode(entry) < 0) {
+    return -EIO;
+  }
+  size_t size = entry->size;
+  size_t end = offset + length;
+  this->reserve(entry, end);
+  // Fill the hole left between the end of the file and the offset
+  if (offset > size) {
+    this->copy_in(entry, NULL, size, offset - size);
+  }
+  this->copy_in(entry, data, offset, length);
+  if (end > size) {
+    entry->size = end;
+  }
+  entry->mtime = time;
+  entry->ctime = time;
+  this->notify(JOURNAL_WRITE, entry, offset, Segments{std::make_pair(data, length)});
+  this->generation++;
+  return static_cast<int>(length);
+}
+
+size_t FileSystem::get_file_size(const std::string &path) const {
+  ReadLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(this->resolve(path));
+  if (entry == NULL || entry->directory) {
+    return -1;
   }
-  if (blocks->empty()) {
-    return 0;
+  return entry->size;
+}
+
+size_t FileSystem::get_file_size(const uint64_t inode) const {
+  ReadLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(inode);
+  if (entry == NULL || entry->directory) {
+    return -1;
   }
+  return entry->size;
+}
 
-  auto block_to_trim = blocks->back();
-  auto bytes_to_keep = len % this->block_size;
-  block_to_trim->resize(bytes_to_keep);
+int FileSystem::truncate(const std::string &path, const size_t length, const uint64_t time) {
+  ReadLock lock(this->namespace_lock);
+  return this->truncate_inode(this->get_inode(this->resolve(path)), length, time);
+}
 
+int FileSystem::truncate(const uint64_t inode, const size_t length, const uint64_t time) {
+  ReadLock lock(this->namespace_lock);
+  return this->truncate_inode(this->get_inode(inode), length, time);
+}
+
+int FileSystem::truncate_inode(Inode* entry, const size_t length, const uint64_t time) {
+  if (entry == NULL || entry->directory) {
+    return -ENOENT;
+  }
+  WriteLock lock(entry->lock);
+  if (this->load_inode(entry) < 0) {
+    return -EIO;
+  }
+  size_t size = entry->size;
+  if (size == length) {
+    return 0;
+  }
+  if (size < length) {
+    this->reserve(entry, length);
+    this->copy_in(entry, NULL, size, length - size);
+  } else {
+    this->release_extents(entry, length);
+  }
+  entry->size = length;
+  entry->mtime = time;
+  entry->ctime = time;
+  this->notify(JOURNAL_TRUNCATE, entry, length);
+  this->generation++;
   return 0;
 }
 
-int FileSystem::read_data(const std::vector<std::vector< char>*>* blocks,
+int FileSystem::read_data(const Inode* inode,
                           char *buffer,
-                          const size_t block_index,
                           const size_t offset,
-                          const size_t size) {
+                          const size_t size) const {
   size_t read = 0;
-  size_t offset_in_block = offset % this->block_size;
-  for (size_t index = block_index;
-       index < blocks->size() && read < size;
-       index++, offset_in_block = 0) {
-    std::vector<char> *block = blocks->at(index);
-    auto size_to_copy = size - read;
-    if (size_to_copy > block->size()) {
-      size_to_copy = block->size();
-    }
-    memcpy(buffer + read, block->data() + offset_in_block, size_to_copy);
+  for (size_t index = this->find_extent(inode, offset); read < size; index++) {
+    const Extent &extent = (*inode->extents)[index];
+    size_t offset_in_extent = offset + read - extent.offset;
+    size_t size_to_copy = std::min(extent.capacity - offset_in_extent, size - read);
+    memcpy(buffer + read, extent.data + offset_in_extent, size_to_copy);
     read += size_to_copy;
   }
   return static_cast<int>(read);
 }
 
 int FileSystem::read(const std::string &path, char *data, const size_t offset, const size_t length) {
-  std::string filename = clean_path(path);
-  auto entry = this->files->find(filename);
-  if (entry == this->files->end()) {
+  ReadLock lock(this->namespace_lock);
+  return this->read_inode(this->get_inode(this->resolve(path)), data, offset, length);
+}
+
+int FileSystem::read(const uint64_t inode, char *data, const size_t offset, const size_t length) {
+  ReadLock lock(this->namespace_lock);
+  return this->read_inode(this->get_inode(inode), data, offset, length);
+}
+
+int FileSystem::read_inode(Inode* entry, char *data, const size_t offset, const size_t length) {
+  if (entry == NULL || entry->directory) {
+    return -ENOENT;
+  }
+  if (this->load_shared(entry) < 0) {
+    return -EIO;
+  }
+  ReadLock lock(entry->lock);
+  size_t file_size = entry->size;
+  if (file_size <= offset) {
+    return 0;
+  }
+  size_t size = std::min(length, file_size - offset);
+  return this->read_data(entry, data, offset, size);
+}
+
+template <typename T>
+void FileSystem::get_segments(const Inode* inode,
+                              const size_t offset,
+                              const size_t size,
+                              std::vector<std::pair<T*, size_t>>* segments) const {
+  size_t collected = 0;
+  for (size_t index = this->find_extent(inode, offset); collected < size; index++) {
+    const Extent &extent = (*inode->extents)[index];
+    size_t offset_in_extent = offset + collected - extent.offset;
+    size_t segment_size = std::min(extent.capacity - offset_in_extent, size - collected);
+    segments->push_back(std::make_pair(extent.data + offset_in_extent, segment_size));
+    collected += segment_size;
+  }
+}
+
+int FileSystem::read_in_place(const uint64_t inode,
+                              const size_t offset,
+                              const size_t length,
+                              const std::function<int(const Segments&)> &reader) {
+  ReadLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(inode);
+  if (entry == NULL || entry->directory) {
+    return -ENOENT;
+  }
+  if (this->load_shared(entry) < 0) {
+    return -EIO;
+  }
+  ReadLock inode_lock(entry->lock);
+  size_t file_size = entry->size;
+  Segments segments;
+  if (offset < file_size) {
+    this->get_segments(entry, offset, std::min(length, file_size - offset), &segments);
+  }
+  return reader(segments);
+}
+
+int FileSystem::write_in_place(const uint64_t inode,
+                               const size_t offset,
+                               const size_t length,
+                               const uint64_t time,
+                               const std::function<int(const WritableSegments&)> &writer) {
+  ReadLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(inode);
+  if (entry == NULL || entry->directory) {
     return -ENOENT;
   }
-  auto blocks = entry->second;
-  size_t block_index = offset / this->block_size;
-  if (blocks->size() <= block_index) {
+  if (length == 0) {
     return 0;
   }
-  int read = this->read_data(blocks, data, block_index, offset, length);
-  return read;
+  WriteLock inode_lock(entry->lock);
+  if (this->load_inode(entry) < 0) {
+    return -EIO;
+  }
+  size_t size = entry->size;
+  this->reserve(entry, offset + length);
+  if (offset > size) {
+    this->copy_in(entry, NULL, size, offset - size);
+  }
+  WritableSegments segments;
+  this->get_segments(entry, offset, length, &segments);
+  int written = writer(segments);
+  if (written <= 0) {
+    return written;
+  }
+  // Bytes reserved but not written stay past the end of the file
+  if (offset + written > size) {
+    entry->size = offset + written;
+  }
+  entry->mtime = time;
+  entry->ctime = time;
+  if (this->listener) {
+    Segments data;
+    for (size_t i = 0, left = written; i < segments.size() && left > 0; left -= data.back().second, i++) {
+      data.push_back(std::make_pair(segments[i].first, std::min(segments[i].second, left)));
+    }
+    this->notify(JOURNAL_WRITE, entry, offset, data);
+  }
+  this->generation++;
+  return written;
 }
 
-int FileSystem::mkdir(const std::string &path) {
+int FileSystem::mkdir(const std::string &path, const uint32_t mode, const uint64_t time) {
   std::string directory = FileSystem::clean_path(path);
-  std::string parent_directory = get_directory(directory);
-  if (this->is_directory(directory)) {
+  WriteLock lock(this->namespace_lock);
+  Inode* existing = this->get_inode(this->resolve(directory));
+  if (existing != NULL && existing->directory) {
     return -EISDIR;
   }
-  if (this->is_file(directory)) {
+  if (existing != NULL) {
     return -ENOTDIR;
   }
-  if (!this->is_directory(parent_directory)) {
+  Inode* parent = this->get_inode(this->resolve(get_directory(directory)));
+  if (parent == NULL || !parent->directory) {
     return -ENOTDIR;
   }
-  (*this->directories)[directory] = true;
+  Inode* inode = this->add_inode(parent->number, directory.substr(directory.rfind("/") + 1), true, mode, time);
+  this->notify(JOURNAL_MKDIR, inode, mode);
+  this->generation++;
   return 0;
 }
 
-int FileSystem::rmdir(const std::string &directory) {
-  if (this->directories->find(directory) == this->directories->end()) {
+int FileSystem::rmdir(const std::string &directory, const uint64_t time) {
+  WriteLock lock(this->namespace_lock);
+  Inode* inode = this->get_inode(this->resolve(directory));
+  if (inode == NULL) {
     return -ENOENT;
   }
-  this->directories->erase(directory);
+  if (!inode->directory) {
+    return -ENOTDIR;
+  }
+  if (inode->number == ROOT_INODE) {
+    return -EBUSY;
+  }
+  if (!inode->children->empty()) {
+    return -ENOTEMPTY;
+  }
+  this->notify(JOURNAL_RMDIR, inode, 0);
+  this->remove_inode(inode, time);
+  this->generation++;
+  return 0;
+}
+
+int FileSystem::create(const uint64_t parent,
+                       const std::string &name,
+                       const uint32_t mode,
+                       const uint64_t time,
+                       FileAttributes* attributes) {
+  WriteLock lock(this->namespace_lock);
+  Inode* directory = this->get_directory_inode(parent);
+  if (directory == NULL) {
+    return -ENOTDIR;
+  }
+  if (this->resolve(parent, name) != INVALID_INODE) {
+    return -EEXIST;
+  }
+  Inode* inode = this->add_inode(parent, name, false, mode, time);
+  inode->lookups++;
+  this->notify(JOURNAL_CREATE, inode, mode);
+  attributes->generation = ++this->generation;
+  return this->fill_attributes(inode, attributes);
+}
+
+int FileSystem::mkdir(const uint64_t parent,
+                      const std::string &name,
+                      const uint32_t mode,
+                      const uint64_t time,
+                      FileAttributes* attributes) {
+  WriteLock lock(this->namespace_lock);
+  Inode* directory = this->get_directory_inode(parent);
+  if (directory == NULL) {
+    return -ENOTDIR;
+  }
+  if (this->resolve(parent, name) != INVALID_INODE) {
+    return -EEXIST;
+  }
+  Inode* inode = this->add_inode(parent, name, true, mode, time);
+  inode->lookups++;
+  this->notify(JOURNAL_MKDIR, inode, mode);
+  attributes->generation = ++this->generation;
+  return this->fill_attributes(inode, attributes);
+}
+
+int FileSystem::unlink(const uint64_t parent, const std::string &name, const uint64_t time) {
+  WriteLock lock(this->namespace_lock);
+  Inode* inode = this->get_inode(this->resolve(parent, name));
+  if (inode == NULL) {
+    return -ENOENT;
+  }
+  if (inode->directory) {
+    return -EISDIR;
+  }
+  this->notify(JOURNAL_UNLINK, inode, 0);
+  this->remove_inode(inode, time);
+  this->generation++;
+  return 0;
+}
+
+int FileSystem::rmdir(const uint64_t parent, const std::string &name, const uint64_t time) {
+  WriteLock lock(this->namespace_lock);
+  Inode* inode = this->get_inode(this->resolve(parent, name));
+  if (inode == NULL) {
+    return -ENOENT;
+  }
+  if (!inode->directory) {
+    return -ENOTDIR;
+  }
+  if (!inode->children->empty()) {
+    return -ENOTEMPTY;
+  }
+  this->notify(JOURNAL_RMDIR, inode, 0);
+  this->remove_inode(inode, time);
+  this->generation++;
   return 0;
 }
 
 std::vector<std::string> FileSystem::readdir(const std::string &path) const {
-  std::string pathname = clean_path(path);
-  std::vector<std::string> entries;
-  if (this->directories->find(pathname) == this->directories->end()) {
-    std::string error_message = pathname + " is not a directory";
+  ReadLock lock(this->namespace_lock);
+  Inode* directory = this->get_inode(this->resolve(path));
+  if (directory == NULL || !directory->directory) {
+    std::string error_message = clean_path(path) + " is not a directory";
     throw std::runtime_error(error_message);
   }
-  for (auto it = this->directories->begin(); it != this->directories->end(); it++) {
-    if (is_in_directory(pathname, it->first)) {
-      entries.push_back(get_relative_path(pathname, it->first));
-    }
+  std::vector<std::string> entries;
+  entries.reserve(directory->children->size());
+  for (auto it = directory->children->begin(); it != directory->children->end(); it++) {
+    entries.push_back(it->first);
   }
-  for (auto it = this->files->begin(); it != this->files->end(); it++) {
-    if (is_in_directory(pathname, it->first)) {
-      entries.push_back(get_relative_path(pathname, it->first));
-    }
+  return entries;
+}
+
+std::vector<std::string> FileSystem::readdir(const std::string &path,
+                                             const std::string &after,
+                                             const size_t max_entries) const {
+  ReadLock lock(this->namespace_lock);
+  Inode* directory = this->get_inode(this->resolve(path));
+  if (directory == NULL || !directory->directory) {
+    std::string error_message = clean_path(path) + " is not a directory";
+    throw std::runtime_error(error_message);
+  }
+  std::vector<std::string> entries;
+  auto it = after.empty() ? directory->children->begin() : directory->children->upper_bound(after);
+  for (; it != directory->children->end() && entries.size() < max_entries; it++) {
+    entries.push_back(it->first);
   }
   return entries;
 }
 
+int FileSystem::readdir(const uint64_t inode,
+                        const std::string &after,
+                        const size_t max_entries,
+                        std::vector<DirectoryEntry>* entries) const {
+  ReadLock lock(this->namespace_lock);
+  Inode* directory = this->get_inode(inode);
+  if (directory == NULL) {
+    return -ENOENT;
+  }
+  if (!directory->directory) {
+    return -ENOTDIR;
+  }
+  auto it = after.empty() ? directory->children->begin() : directory->children->upper_bound(after);
+  for (; it != directory->children->end() && entries->size() < max_entries; it++) {
+    entries->push_back(DirectoryEntry{it->first, it->second, this->get_inode(it->second)->directory});
+  }
+  return 0;
+}
+
 size_t FileSystem::get_block_size() const {
   return this->block_size;
 }
 
+BlockPoolStatistics FileSystem::get_pool_statistics() const {
+  return this->pool->get_statistics();
+}
+
 int FileSystem::get_number_of_entries(const std::string &directory) const {
-  std::string pathname = clean_path(directory);
-  if (!this->is_directory(pathname)) {
-    return -ENOENT;
-  }
-  try {
-    auto entries = this->readdir(pathname);
-    return entries.size();
-  } catch (const std::runtime_error&) {
+  ReadLock lock(this->namespace_lock);
+  Inode* inode = this->get_inode(this->resolve(directory));
+  if (inode == NULL || !inode->directory) {
     return -ENOENT;
   }
+  return inode->children->size();
 }
 
 bool FileSystem::is_file(const std::string &path) const {
-  std::string cleaned_path = clean_path(path);
-  return this->files->find(cleaned_path) != this->files->end();
+  ReadLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(this->resolve(path));
+  return entry != NULL && !entry->directory;
+}
+
+bool FileSystem::is_file(const uint64_t inode) const {
+  ReadLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(inode);
+  return entry != NULL && !entry->directory;
 }
 
 bool FileSystem::is_directory(const std::string &path) const {
-  std::string cleaned_path = clean_path(path);
-  return this->directories->find(cleaned_path) != this->directories->end();
+  ReadLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(this->resolve(path));
+  return entry != NULL && entry->directory;
+}
+
+bool FileSystem::is_directory(const uint64_t inode) const {
+  ReadLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(inode);
+  return entry != NULL && entry->directory;
 }
 
 bool FileSystem::exists(const std::string &path) const {
-  return this->is_directory(path) || this->is_file(path);
+  return this->lookup(path) != INVALID_INODE;
+}
+
+int FileSystem::fill_attributes(const Inode* inode, FileAttributes* attributes) const {
+  if (inode == NULL) {
+    return -ENOENT;
+  }
+  attributes->number = inode->number;
+  attributes->directory = inode->directory;
+  attributes->size = inode->directory ? this->block_size : inode->size.load();
+  attributes->mode = inode->mode;
+  attributes->nlink = inode->nlink;
+  attributes->mtime = inode->mtime;
+  attributes->ctime = inode->ctime;
+  return 0;
+}
+
+int FileSystem::stat(const std::string &path, FileAttributes* attributes) const {
+  ReadLock lock(this->namespace_lock);
+  // Read before the size so that a concurrent write always leaves a newer generation behind
+  attributes->generation = this->generation;
+  return this->fill_attributes(this->get_inode(this->resolve(path)), attributes);
+}
+
+int FileSystem::stat(const uint64_t inode, FileAttributes* attributes) const {
+  ReadLock lock(this->namespace_lock);
+  attributes->generation = this->generation;
+  return this->fill_attributes(this->get_inode(inode), attributes);
+}
+
+uint64_t FileSystem::get_generation() const {
+  return this->generation;
+}
+
+std::map<std::string, std::vector<std::pair<const char*, size_t>>>* FileSystem::get_files() const {
+  ReadLock lock(this->namespace_lock);
+  auto files = new std::map<std::string, std::vector<std::pair<const char*, size_t>>>();
+  for (auto it = this->inodes->begin(); it != this->inodes->end(); it++) {
+    Inode* inode = it->second;
+    // Files removed but still referenced by the kernel are not part of the namespace anymore, and files
+    // restored lazily have no content until it is loaded
+    if (inode->directory || inode->nlink == 0 || inode->pending) {
+      continue;
+    }
+    ReadLock inode_lock(inode->lock);
+    size_t size = inode->size;
+    std::vector<std::pair<const char*, size_t>> &segments = (*files)[this->get_path(inode)];
+    for (auto extent = inode->extents->begin();
+         extent != inode->extents->end() && extent->offset < size;
+         extent++) {
+      segments.push_back(std::make_pair(extent->data, std::min(extent->capacity, size - extent->offset)));
+    }
+  }
+  return files;
+}
+
+void FileSystem::set_listener(const ChangeListener &listener) {
+  this->listener = listener;
+}
+
+int FileSystem::load(const std::string &path) {
+  ReadLock lock(this->namespace_lock);
+  Inode* entry = this->get_inode(this->resolve(path));
+  if (entry == NULL || entry->directory) {
+    return -ENOENT;
+  }
+  return this->load_shared(entry);
+}
+
+int FileSystem::load_all() {
+  ReadLock lock(this->namespace_lock);
+  int ret = 0;
+  for (auto it = this->inodes->begin(); it != this->inodes->end(); it++) {
+    if (!it->second->directory && this->load_shared(it->second) < 0) {
+      ret = -EIO;
+    }
+  }
+  return ret;
 }
 
-std::map<std::string, std::vector<std::vector<char>*>*>* FileSystem::get_files() const {
-  return this->files;
+int FileSystem::load_inode(Inode* inode) {
+  if (!inode->pending) {
+    return 0;
+  }
+  size_t size = inode->size;
+  this->reserve(inode, size);
+  WritableSegments segments;
+  this->get_segments(inode, 0, size, &segments);
+  int ret = this->loader(this->restored_paths.at(inode->number), segments);
+  if (ret < 0) {
+    // The file stays on disk until it can be read
+    this->release_extents(inode, 0);
+    return ret;
+  }
+  inode->pending = false;
+  return 0;
+}
+
+int FileSystem::load_shared(Inode* inode) {
+  if (!inode->pending) {
+    return 0;
+  }
+  // The content never goes back to disk, so the shared lock taken after loading it finds it in memory
+  WriteLock lock(inode->lock);
+  return this->load_inode(inode);
+}
+
+void FileSystem::notify(const uint8_t type, const Inode* inode, const uint64_t value, const Segments &data) const {
+  if (this->listener && inode->nlink > 0) {
+    this->listener(type, this->get_path(inode), value, data);
+  }
 }
 
 // Path static util functions
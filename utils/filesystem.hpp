@@ -1,40 +1,279 @@
 #ifndef __FILESYSTEM_HPP__
 #define __FILESYSTEM_HPP__
 
+#include <atomic>
+#include <cstdint>
+
+#include <functional>
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "block_pool.hpp"
+#include "lock.hpp"
+
+/**
+ * A contiguous run of blocks holding the bytes [offset, offset + capacity) of a file
+ */
+struct Extent {
+  size_t offset;
+  size_t capacity;
+  char* data;
+};
+
+/**
+ * An entry of the inode table, either a regular file or a directory.
+ * The namespace fields and the number of links are protected by the file system's namespace lock,
+ * the extents by the lock of the inode. The size and the timestamps can be read without any lock.
+ * Timestamps are in nanoseconds since the epoch, as given by the caller of the change.
+ * An inode removed from the namespace while the kernel still references it stays in the table,
+ * without a parent nor links, until the kernel forgets it.
+ */
+struct Inode {
+  uint64_t number;
+  uint64_t parent;
+  std::string name;
+  bool directory;
+  uint32_t mode;
+  uint32_t nlink;
+  std::atomic<size_t> size;
+  std::atomic<uint64_t> mtime;
+  std::atomic<uint64_t> ctime;
+  std::atomic<uint64_t> lookups;
+  // Set while the content of a file restored lazily is still on disk, size already holds its size
+  std::atomic<bool> pending;
+  std::vector<Extent>* extents;
+  std::map<std::string, uint64_t>* children;
+  RWLock lock;
+};
+
+/**
+ * Attributes of an inode, gathered under a single lock
+ */
+struct FileAttributes {
+  uint64_t generation;
+  uint64_t number;
+  bool directory;
+  size_t size;
+  uint32_t mode;
+  uint32_t nlink;
+  uint64_t mtime;
+  uint64_t ctime;
+};
+
+/**
+ * Key of the dentry cache: the name of an entry within its parent directory
+ */
+struct DentryKey {
+  uint64_t parent;
+  std::string name;
+
+  bool operator==(const DentryKey &other) const {
+    return this->parent == other.parent && this->name == other.name;
+  }
+};
+
+/**
+ * An entry of a directory listed by inode number
+ */
+struct DirectoryEntry {
+  std::string name;
+  uint64_t number;
+  bool directory;
+};
+
+struct DentryKeyHash {
+  size_t operator()(const DentryKey &key) const {
+    return std::hash<std::string>()(key.name) ^ (std::hash<uint64_t>()(key.parent) << 1);
+  }
+};
 
 /**
- * An in-memory file system
+ * An in-memory file system.
+ * All the public methods are thread-safe: operations on the namespace take a
+ * reader-writer lock over the whole tree, and operations on the content of a file
+ * share that lock and take the lock of the file's inode. Reads and writes to
+ * different files therefore run in parallel.
  */
 class FileSystem {
   public:
     static const size_t DEFAULT_BLOCK_SIZE = 4096;
+    /**
+     * Extents double in size as a file grows, up to this number of blocks.
+     * Extent sizes are powers of two so that they map onto the size classes of the block pool.
+     */
+    static const size_t MAX_EXTENT_BLOCKS = 32;
+    static const uint64_t INVALID_INODE = 0;
+    static const uint64_t ROOT_INODE = 1;
+    /**
+     * Permissions of the root directory and of the files and directories restored from a dump
+     */
+    static const uint32_t DEFAULT_MODE = 0777;
+
+    /**
+     * Pieces of the extents of a file, in the order of the bytes they hold
+     */
+    typedef std::vector<std::pair<const char*, size_t>> Segments;
+    typedef std::vector<std::pair<char*, size_t>> WritableSegments;
+    /**
+     * Receives a change made to the file system: its JournalRecordType, the path it applies to, the value of
+     * its record and the data it writes. Called under the locks that order the change with the other ones.
+     */
+    typedef std::function<void(const uint8_t type,
+                               const std::string &path,
+                               const uint64_t value,
+                               const Segments &data)> ChangeListener;
+    /**
+     * Fills the segments of the extents of a file restored lazily with its content, in order
+     * @return 0 on success, a negative error code otherwise
+     */
+    typedef std::function<int(const std::string &path, const WritableSegments &segments)> Loader;
 
     FileSystem();
-    explicit FileSystem(const size_t block_size);
-    explicit FileSystem(std::map<std::string, std::vector<std::vector<char>*>*>* restored_files);
+    /**
+     * @param block_size Size of the blocks extents are made of
+     * @param time Creation time of the root directory
+     */
+    explicit FileSystem(const size_t block_size, const uint64_t time = 0);
+    FileSystem(std::map<std::string, std::vector<char>*>* restored_files, const uint64_t time);
+    /**
+     * Restores files lazily: only their paths and sizes are known at first, and loader reads the content
+     * of a file when it is first accessed
+     * @param restored_files Size of every file
+     */
+    FileSystem(const std::map<std::string, size_t> &restored_files, const Loader &loader, const uint64_t time);
     ~FileSystem();
 
-    int create(const std::string &path);
-    int unlink(const std::string &path);
-    int write(const std::string &path, const char *data, size_t offset, const size_t length);
+    /**
+     * Resolves a path to its inode number by walking the dentry cache.
+     * @param path Path to resolve
+     * @return The inode number or INVALID_INODE if the path does not exist
+     */
+    uint64_t lookup(const std::string &path) const;
+
+    /**
+     * Resolves a name within a directory to its inode number.
+     * @param parent Inode number of the directory
+     * @param name Name of the entry in the directory
+     * @return The inode number or INVALID_INODE if the entry does not exist
+     */
+    uint64_t lookup(const uint64_t parent, const std::string &name) const;
+
+    /**
+     * Resolves a name within a directory on behalf of the kernel, which then holds a reference on the inode
+     * until it forgets it. The inodes the kernel references outlive their removal from the namespace.
+     * @param parent Inode number of the directory
+     * @param name Name of the entry in the directory
+     * @param attributes Filled with the attributes of the entry
+     * @return 0 on success, -ENOENT if the entry does not exist
+     */
+    int lookup(const uint64_t parent, const std::string &name, FileAttributes* attributes);
+
+    /**
+     * Drops references taken by the kernel, releasing the inode once it is removed and no longer referenced
+     * @param inode Inode number
+     * @param count Number of references to drop
+     */
+    void forget(const uint64_t inode, const uint64_t count);
+
+    // Changes take the time they happen at, which stamps the inodes they modify
+    int create(const std::string &path, const uint32_t mode, const uint64_t time);
+    int unlink(const std::string &path, const uint64_t time);
+    int write(const std::string &path, const char *data, size_t offset, const size_t length, const uint64_t time);
+    int write(const uint64_t inode, const char *data, size_t offset, const size_t length, const uint64_t time);
     size_t get_file_size(const std::string &path) const;
-    int truncate(const std::string &path, const size_t length);
-    int read_data(const std::vector <std::vector<char>*>* blocks,
-                  char *buffer,
-                  const size_t block_index,
-                  const size_t offset,
-                  const size_t size);
+    size_t get_file_size(const uint64_t inode) const;
+    int truncate(const std::string &path, const size_t length, const uint64_t time);
+    int truncate(const uint64_t inode, const size_t length, const uint64_t time);
     int read(const std::string &path, char *data, const size_t offset, const size_t length);
-    int mkdir(const std::string &directory);
-    int rmdir(const std::string &directory);
+    int read(const uint64_t inode, char *data, const size_t offset, const size_t length);
+    /**
+     * Reads a file without copying its content: the segments of the extents holding the bytes to read
+     * are handed to reader under the lock of the inode, and are only valid until reader returns.
+     * @param inode Inode number of the file
+     * @param offset Offset of the first byte to read
+     * @param length Number of bytes to read, cut at the end of the file
+     * @param reader Consumes the segments, returns the number of bytes read or a negative error code
+     * @return The value returned by reader, -ENOENT if the inode is not a file
+     */
+    int read_in_place(const uint64_t inode,
+                      const size_t offset,
+                      const size_t length,
+                      const std::function<int(const Segments&)> &reader);
+    /**
+     * Writes a file without an intermediate buffer: the file is extended to hold the bytes to write,
+     * and the segments of the extents that must receive them are handed to writer under the lock of the inode.
+     * @param inode Inode number of the file
+     * @param offset Offset of the first byte to write
+     * @param length Number of bytes to write
+     * @param time Time of the write
+     * @param writer Fills the segments in order, returns the number of bytes written or a negative error code
+     * @return The value returned by writer, -ENOENT if the inode is not a file
+     */
+    int write_in_place(const uint64_t inode,
+                       const size_t offset,
+                       const size_t length,
+                       const uint64_t time,
+                       const std::function<int(const WritableSegments&)> &writer);
+    int mkdir(const std::string &directory, const uint32_t mode, const uint64_t time);
+    int rmdir(const std::string &directory, const uint64_t time);
+    // Namespace operations on a name within a directory. Creations hand a reference to the kernel, like lookup.
+    int create(const uint64_t parent,
+               const std::string &name,
+               const uint32_t mode,
+               const uint64_t time,
+               FileAttributes* attributes);
+    int mkdir(const uint64_t parent,
+              const std::string &name,
+              const uint32_t mode,
+              const uint64_t time,
+              FileAttributes* attributes);
+    int unlink(const uint64_t parent, const std::string &name, const uint64_t time);
+    int rmdir(const uint64_t parent, const std::string &name, const uint64_t time);
     std::vector<std::string> readdir(const std::string &directory) const;
+    /**
+     * Lists a directory one chunk at a time, in the order of the names of its entries.
+     * Throws a runtime_error if the path is not a directory.
+     * @param directory Path to the directory
+     * @param after Name of the last entry of the previous chunk, empty to start from the first entry
+     * @param max_entries Maximum number of names to return
+     * @return The names that follow after in the directory
+     */
+    std::vector<std::string> readdir(const std::string &directory,
+                                     const std::string &after,
+                                     const size_t max_entries) const;
+    /**
+     * Lists a directory by inode number, one chunk at a time, in the order of the names of its entries
+     * @param directory Inode number of the directory
+     * @param after Name of the last entry of the previous chunk, empty to start from the first entry
+     * @param max_entries Maximum number of entries to return
+     * @param entries Filled with the entries that follow after in the directory
+     * @return 0 on success, -ENOTDIR or -ENOENT if the inode is not a directory
+     */
+    int readdir(const uint64_t directory,
+                const std::string &after,
+                const size_t max_entries,
+                std::vector<DirectoryEntry>* entries) const;
     bool is_file(const std::string &path) const;
+    bool is_file(const uint64_t inode) const;
     bool is_directory(const std::string &path) const;
+    bool is_directory(const uint64_t inode) const;
     bool exists(const std::string &path) const;
+    /**
+     * Resolves a path and reads the attributes of its inode in one pass
+     * @param path Path to the file or directory
+     * @param attributes Filled with the attributes of the inode
+     * @return 0 on success, -ENOENT if the path does not exist
+     */
+    int stat(const std::string &path, FileAttributes* attributes) const;
+    int stat(const uint64_t inode, FileAttributes* attributes) const;
+    /**
+     * Gives a counter incremented after every change to the namespace or to the content of a file.
+     * Attributes read with a given generation are stale as soon as the counter moves past it.
+     * @return The current generation
+     */
+    uint64_t get_generation() const;
     /**
      * Gives the number of entries, files and directories, at the first level of a directory
      * @param directory Directory where the entries must be counted
@@ -42,8 +281,33 @@ class FileSystem {
      */
     int get_number_of_entries(const std::string &directory) const;
     size_t get_block_size() const;
-    void set_files();
-    std::map<std::string, std::vector<std::vector<char>*>*>* get_files() const;
+    /**
+     * Gives the usage of the pool the extents are allocated from
+     * @return Statistics of the block pool
+     */
+    BlockPoolStatistics get_pool_statistics() const;
+    /**
+     * Builds a map from the path of every file to the (pointer, length) segments holding its content.
+     * The map must be deleted by the caller, the segments remain owned by the file system.
+     * @return A map of the files in the file system
+     */
+    std::map<std::string, std::vector<std::pair<const char*, size_t>>>* get_files() const;
+    /**
+     * Hands every change made from now on to listener, which journals them. Not thread-safe, it is set
+     * before the file system is used. Changes to files removed from the namespace are left out.
+     */
+    void set_listener(const ChangeListener &listener);
+    /**
+     * Loads the content of a file restored lazily ahead of its first access
+     * @return 0 on success or if the content is already loaded, -ENOENT if the path is not a file,
+     * the error of the loader otherwise
+     */
+    int load(const std::string &path);
+    /**
+     * Loads the content of every file restored lazily and not loaded yet
+     * @return 0 on success, -EIO if the content of a file could not be loaded
+     */
+    int load_all();
 // Path static util functions
     /**
      * Returns a copy of filename without the leading slash
@@ -115,9 +379,51 @@ class FileSystem {
     static std::vector<std::string>* split_path(const std::string &path);
 
   private:
+    // The following helpers expect the caller to hold namespace_lock
+    uint64_t resolve(const std::string &path) const;
+    uint64_t resolve(const uint64_t parent, const std::string &name) const;
+    Inode* get_inode(const uint64_t inode) const;
+    Inode* get_directory_inode(const uint64_t inode) const;
+    Inode* add_inode(const uint64_t parent,
+                     const std::string &name,
+                     const bool directory,
+                     const uint32_t mode,
+                     const uint64_t time);
+    void remove_inode(Inode* inode, const uint64_t time);
+    Inode* add_restored_file(const std::string &path, const uint64_t time);
+    // Loads the content of a file restored lazily, the caller holds the lock of the inode
+    int load_inode(Inode* inode);
+    // Loads the content of a file restored lazily before it is read under the shared lock of the inode
+    int load_shared(Inode* inode);
+    size_t get_capacity(const Inode* inode) const;
+    size_t find_extent(const Inode* inode, const size_t offset) const;
+    void reserve(Inode* inode, const size_t length);
+    void release_extents(Inode* inode, const size_t length);
+    void copy_in(Inode* inode, const char *data, const size_t offset, const size_t length);
+    int read_data(const Inode* inode, char *buffer, const size_t offset, const size_t size) const;
+    template <typename T>
+    void get_segments(const Inode* inode,
+                      const size_t offset,
+                      const size_t size,
+                      std::vector<std::pair<T*, size_t>>* segments) const;
+    int write_inode(Inode* inode, const char *data, const size_t offset, const size_t length, const uint64_t time);
+    int truncate_inode(Inode* inode, const size_t length, const uint64_t time);
+    int read_inode(Inode* inode, char *data, const size_t offset, const size_t length);
+    std::string get_path(const Inode* inode) const;
+    int fill_attributes(const Inode* inode, FileAttributes* attributes) const;
+    void notify(const uint8_t type, const Inode* inode, const uint64_t value, const Segments &data = Segments()) const;
+
     size_t block_size;
-    std::map<std::string, std::vector<std::vector<char>*>*>* files;
-    std::map<std::string, bool>* directories;
+    BlockPool* pool;
+    uint64_t next_inode;
+    std::unordered_map<uint64_t, Inode*>* inodes;
+    std::unordered_map<DentryKey, uint64_t, DentryKeyHash>* dentries;
+    mutable RWLock namespace_lock;
+    std::atomic<uint64_t> generation;
+    ChangeListener listener;
+    Loader loader;
+    // Path every file restored lazily was dumped under, kept for files removed while open
+    std::map<uint64_t, std::string> restored_paths;
 };
 
 #endif /*__FILESYSTEM_HPP__*/
@@ -1,4 +1,5 @@
 #include <climits>
+#include <ctime>
 #include <string>
 #include <vector>
 
@@ -105,3 +106,16 @@ vector<string>* split_path(const string &path) {
   }
   return tokens;
 }
+
+uint64_t get_current_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+struct timespec to_timespec(const uint64_t time) {
+    struct timespec converted;
+    converted.tv_sec = time / 1000000000;
+    converted.tv_nsec = time % 1000000000;
+    return converted;
+}
@@ -5,6 +5,8 @@
 #ifndef FUSEGX_FS_H
 #define FUSEGX_FS_H
 
+#include <cstdint>
+#include <ctime>
 #include <string>
 #include <stdexcept>
 #include <vector>
@@ -80,5 +82,17 @@ bool is_in_directory(const string &directory, const string &path);
  */
 vector<string>* split_path(const string &path);
 
+/**
+ * Reads the wall clock, used to timestamp the changes made to files and directories
+ * @return The number of nanoseconds elapsed since the epoch
+ */
+uint64_t get_current_time();
+
+/**
+ * Converts a timestamp given by get_current_time to the fields of a struct stat
+ * @param time Number of nanoseconds elapsed since the epoch
+ * @return The timestamp as a timespec
+ */
+struct timespec to_timespec(const uint64_t time);
 
 #endif //FUSEGX_FS_H
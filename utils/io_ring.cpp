@@ -0,0 +1,312 @@
+#include "io_ring.hpp"
+
+#include <cerrno>
+
+#ifdef FUSEGX_IO_URING
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+/**
+ * The queues shared with the kernel
+ */
+struct IoRing::Rings {
+  void* submission;
+  size_t submission_size;
+  void* completion;
+  size_t completion_size;
+  struct io_uring_sqe* entries;
+  size_t entries_size;
+
+  unsigned* submission_head;
+  unsigned* submission_tail;
+  unsigned submission_mask;
+  unsigned submission_entries;
+  unsigned* submission_array;
+  // Tail of the requests queued, published to the kernel by submit
+  unsigned tail;
+
+  unsigned* completion_head;
+  unsigned* completion_tail;
+  unsigned completion_mask;
+  unsigned completion_entries;
+  struct io_uring_cqe* completions;
+};
+
+template<typename T>
+static T* at(void* base, const uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+IoRing::IoRing(const unsigned entries): descriptor(-1), rings(NULL), queued(0), in_flight(0) {
+  struct io_uring_params parameters;
+  memset(&parameters, 0, sizeof(parameters));
+  int descriptor = syscall(__NR_io_uring_setup, entries, &parameters);
+  if (descriptor < 0) {
+    return;
+  }
+  Rings* rings = new Rings();
+  rings->submission_size = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned);
+  rings->completion_size = parameters.cq_off.cqes + parameters.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = parameters.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    rings->submission_size = std::max(rings->submission_size, rings->completion_size);
+  }
+  rings->submission = mmap(NULL, rings->submission_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           descriptor, IORING_OFF_SQ_RING);
+  rings->completion = MAP_FAILED;
+  rings->entries = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+  if (rings->submission != MAP_FAILED) {
+    rings->completion = single ? rings->submission :
+                        mmap(NULL, rings->completion_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             descriptor, IORING_OFF_CQ_RING);
+  }
+  if (rings->completion != MAP_FAILED) {
+    rings->entries_size = parameters.sq_entries * sizeof(struct io_uring_sqe);
+    rings->entries = static_cast<struct io_uring_sqe*>(mmap(NULL, rings->entries_size, PROT_READ | PROT_WRITE,
+                                                            MAP_SHARED | MAP_POPULATE, descriptor,
+                                                            IORING_OFF_SQES));
+  }
+  if (rings->entries == MAP_FAILED) {
+    if (rings->completion != MAP_FAILED && rings->completion != rings->submission) {
+      munmap(rings->completion, rings->completion_size);
+    }
+    if (rings->submission != MAP_FAILED) {
+      munmap(rings->submission, rings->submission_size);
+    }
+    delete rings;
+    close(descriptor);
+    return;
+  }
+  rings->submission_head = at<unsigned>(rings->submission, parameters.sq_off.head);
+  rings->submission_tail = at<unsigned>(rings->submission, parameters.sq_off.tail);
+  rings->submission_mask = *at<unsigned>(rings->submission, parameters.sq_off.ring_mask);
+  rings->submission_entries = *at<unsigned>(rings->submission, parameters.sq_off.ring_entries);
+  rings->submission_array = at<unsigned>(rings->submission, parameters.sq_off.array);
+  rings->tail = *rings->submission_tail;
+  rings->completion_head = at<unsigned>(rings->completion, parameters.cq_off.head);
+  rings->completion_tail = at<unsigned>(rings->completion, parameters.cq_off.tail);
+  rings->completion_mask = *at<unsigned>(rings->completion, parameters.cq_off.ring_mask);
+  rings->completion_entries = *at<unsigned>(rings->completion, parameters.cq_off.ring_entries);
+  rings->completions = at<struct io_uring_cqe>(rings->completion, parameters.cq_off.cqes);
+  this->descriptor = descriptor;
+  this->rings = rings;
+
+  // Kernels older than 5.6 cannot be probed, and the operations used are then considered unsupported
+  const size_t probed = 256;
+  std::vector<char> buffer(sizeof(struct io_uring_probe) + probed * sizeof(struct io_uring_probe_op), 0);
+  struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(buffer.data());
+  if (syscall(__NR_io_uring_register, descriptor, IORING_REGISTER_PROBE, probe, probed) == 0) {
+    this->operations.resize(probe->ops_len, false);
+    for (unsigned operation = 0; operation < probe->ops_len; operation++) {
+      this->operations[operation] = probe->ops[operation].flags & IO_URING_OP_SUPPORTED;
+    }
+  }
+}
+
+IoRing::~IoRing() {
+  if (this->rings == NULL) {
+    return;
+  }
+  munmap(this->rings->entries, this->rings->entries_size);
+  if (this->rings->completion != this->rings->submission) {
+    munmap(this->rings->completion, this->rings->completion_size);
+  }
+  munmap(this->rings->submission, this->rings->submission_size);
+  delete this->rings;
+  close(this->descriptor);
+}
+
+bool IoRing::is_available() const {
+  return this->rings != NULL;
+}
+
+bool IoRing::supports(const std::vector<Operation> &operations) const {
+  static const uint8_t OPERATIONS[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITEV,
+                                       IORING_OP_WRITE_FIXED, IORING_OP_CLOSE};
+  for (auto operation = operations.begin(); operation != operations.end(); operation++) {
+    uint8_t code = OPERATIONS[*operation];
+    if (code >= this->operations.size() || !this->operations[code]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int IoRing::register_buffers(const std::vector<struct iovec> &buffers) {
+  if (this->rings == NULL) {
+    return -ENOSYS;
+  }
+  if (syscall(__NR_io_uring_register, this->descriptor, IORING_REGISTER_BUFFERS, buffers.data(),
+              buffers.size()) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+void* IoRing::prepare(const uint8_t operation, const int descriptor, const void* address, const uint32_t length,
+                      const uint64_t offset, const uint64_t tag) {
+  if (this->rings == NULL || this->queued == this->rings->submission_entries ||
+      this->in_flight + this->queued == this->rings->completion_entries) {
+    return NULL;
+  }
+  unsigned index = this->rings->tail & this->rings->submission_mask;
+  struct io_uring_sqe* entry = &this->rings->entries[index];
+  memset(entry, 0, sizeof(*entry));
+  entry->opcode = operation;
+  entry->fd = descriptor;
+  entry->addr = reinterpret_cast<uint64_t>(address);
+  entry->len = length;
+  entry->off = offset;
+  entry->user_data = tag;
+  this->rings->submission_array[index] = index;
+  this->rings->tail++;
+  this->queued++;
+  return entry;
+}
+
+bool IoRing::prepare_openat(const int directory, const char* path, const int flags, const mode_t mode,
+                            const uint64_t tag) {
+  void* entry = this->prepare(IORING_OP_OPENAT, directory, path, mode, 0, tag);
+  if (entry != NULL) {
+    static_cast<struct io_uring_sqe*>(entry)->open_flags = flags;
+  }
+  return entry != NULL;
+}
+
+bool IoRing::prepare_statx(const int descriptor, const unsigned mask, struct statx* attributes,
+                           const uint64_t tag) {
+  void* entry = this->prepare(IORING_OP_STATX, descriptor, "", mask, reinterpret_cast<uint64_t>(attributes), tag);
+  if (entry != NULL) {
+    static_cast<struct io_uring_sqe*>(entry)->statx_flags = AT_EMPTY_PATH;
+  }
+  return entry != NULL;
+}
+
+bool IoRing::prepare_read(const int descriptor, char* buffer, const size_t size, const uint64_t offset,
+                          const uint64_t tag) {
+  return this->prepare(IORING_OP_READ, descriptor, buffer, size, offset, tag) != NULL;
+}
+
+bool IoRing::prepare_writev(const int descriptor, const struct iovec* vector, const uint64_t offset,
+                            const uint64_t tag) {
+  return this->prepare(IORING_OP_WRITEV, descriptor, vector, 1, offset, tag) != NULL;
+}
+
+bool IoRing::prepare_write_fixed(const int descriptor, const char* buffer, const size_t size,
+                                 const uint64_t offset, const unsigned buffer_index, const uint64_t tag) {
+  void* entry = this->prepare(IORING_OP_WRITE_FIXED, descriptor, buffer, size, offset, tag);
+  if (entry != NULL) {
+    static_cast<struct io_uring_sqe*>(entry)->buf_index = buffer_index;
+  }
+  return entry != NULL;
+}
+
+bool IoRing::prepare_close(const int descriptor, const uint64_t tag) {
+  return this->prepare(IORING_OP_CLOSE, descriptor, NULL, 0, 0, tag) != NULL;
+}
+
+int IoRing::submit(const unsigned wait) {
+  if (this->rings == NULL) {
+    return -ENOSYS;
+  }
+  __atomic_store_n(this->rings->submission_tail, this->rings->tail, __ATOMIC_RELEASE);
+  this->in_flight += this->queued;
+  this->queued = 0;
+  while (true) {
+    unsigned pending = this->rings->tail - __atomic_load_n(this->rings->submission_head, __ATOMIC_ACQUIRE);
+    int submitted = syscall(__NR_io_uring_enter, this->descriptor, pending, wait,
+                            wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted < 0 && errno != EINTR && errno != EAGAIN) {
+      return -errno;
+    }
+    if (submitted >= 0 && (unsigned) submitted == pending) {
+      return 0;
+    }
+  }
+}
+
+bool IoRing::complete(uint64_t* tag, int* result) {
+  if (this->rings == NULL) {
+    return false;
+  }
+  unsigned head = *this->rings->completion_head;
+  if (head == __atomic_load_n(this->rings->completion_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  struct io_uring_cqe* completion = &this->rings->completions[head & this->rings->completion_mask];
+  *tag = completion->user_data;
+  *result = completion->res;
+  __atomic_store_n(this->rings->completion_head, head + 1, __ATOMIC_RELEASE);
+  this->in_flight--;
+  return true;
+}
+
+#else
+
+IoRing::IoRing(const unsigned): descriptor(-1), rings(NULL), queued(0), in_flight(0) {
+}
+
+IoRing::~IoRing() {
+}
+
+bool IoRing::is_available() const {
+  return false;
+}
+
+bool IoRing::supports(const std::vector<Operation> &) const {
+  return false;
+}
+
+int IoRing::register_buffers(const std::vector<struct iovec> &) {
+  return -ENOSYS;
+}
+
+void* IoRing::prepare(const uint8_t, const int, const void*, const uint32_t, const uint64_t, const uint64_t) {
+  return NULL;
+}
+
+bool IoRing::prepare_openat(const int, const char*, const int, const mode_t, const uint64_t) {
+  return false;
+}
+
+bool IoRing::prepare_statx(const int, const unsigned, struct statx*, const uint64_t) {
+  return false;
+}
+
+bool IoRing::prepare_read(const int, char*, const size_t, const uint64_t, const uint64_t) {
+  return false;
+}
+
+bool IoRing::prepare_writev(const int, const struct iovec*, const uint64_t, const uint64_t) {
+  return false;
+}
+
+bool IoRing::prepare_write_fixed(const int, const char*, const size_t, const uint64_t, const unsigned,
+                                 const uint64_t) {
+  return false;
+}
+
+bool IoRing::prepare_close(const int, const uint64_t) {
+  return false;
+}
+
+int IoRing::submit(const unsigned) {
+  return -ENOSYS;
+}
+
+bool IoRing::complete(uint64_t*, int*) {
+  return false;
+}
+
+#endif
+
+unsigned IoRing::get_in_flight() const {
+  return this->in_flight;
+}
@@ -0,0 +1,101 @@
+#ifndef __IO_RING_HPP__
+#define __IO_RING_HPP__
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * An io_uring instance driven by a single thread, through the system calls of the kernel rather than
+ * liburing. Requests are queued with the prepare functions, then submitted together by submit, so that
+ * a batch of I/O costs a single system call. The ring is unavailable when the binary is built without
+ * FUSEGX_IO_URING, or when the kernel does not support io_uring, and callers then fall back to
+ * synchronous I/O.
+ */
+class IoRing {
+  public:
+    /**
+     * Operations whose support depends on the version of the kernel
+     */
+    enum Operation {
+      OPENAT,
+      STATX,
+      READ,
+      WRITEV,
+      WRITE_FIXED,
+      CLOSE
+    };
+
+    /**
+     * @param entries Number of requests that can be queued, rounded up to a power of 2 by the kernel
+     */
+    explicit IoRing(const unsigned entries);
+    ~IoRing();
+
+    /**
+     * @return Whether the ring was set up
+     */
+    bool is_available() const;
+
+    /**
+     * @return Whether the kernel supports every operation
+     */
+    bool supports(const std::vector<Operation> &operations) const;
+
+    /**
+     * Registers buffers for prepare_write_fixed, which the kernel then maps once rather than per request
+     * @return 0 on success, a negative error code otherwise
+     */
+    int register_buffers(const std::vector<struct iovec> &buffers);
+
+    /**
+     * Queue requests completing with the result of the matching system call, or a negative error code
+     * @param tag Returned along with the result of the request
+     * @return false if the submission queue is full
+     */
+    bool prepare_openat(const int directory, const char* path, const int flags, const mode_t mode,
+                        const uint64_t tag);
+    bool prepare_statx(const int descriptor, const unsigned mask, struct statx* attributes, const uint64_t tag);
+    bool prepare_read(const int descriptor, char* buffer, const size_t size, const uint64_t offset,
+                      const uint64_t tag);
+    bool prepare_writev(const int descriptor, const struct iovec* vector, const uint64_t offset,
+                        const uint64_t tag);
+    bool prepare_write_fixed(const int descriptor, const char* buffer, const size_t size, const uint64_t offset,
+                             const unsigned buffer_index, const uint64_t tag);
+    bool prepare_close(const int descriptor, const uint64_t tag);
+
+    /**
+     * Submits the queued requests and waits until at least wait of them complete
+     * @return 0 on success, a negative error code otherwise
+     */
+    int submit(const unsigned wait);
+
+    /**
+     * Takes the oldest completion of a request
+     * @return false if no request completed
+     */
+    bool complete(uint64_t* tag, int* result);
+
+    /**
+     * @return The number of requests submitted and not yet taken by complete
+     */
+    unsigned get_in_flight() const;
+
+  private:
+    struct Rings;
+
+    void* prepare(const uint8_t operation, const int descriptor, const void* address, const uint32_t length,
+                  const uint64_t offset, const uint64_t tag);
+
+    int descriptor;
+    Rings* rings;
+    std::vector<bool> operations;
+    unsigned queued;
+    unsigned in_flight;
+};
+
+#endif
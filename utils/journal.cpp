@@ -0,0 +1,440 @@
+#include "journal.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+const size_t Journal::MAX_PENDING;
+const unsigned int Journal::COMMIT_INTERVAL;
+
+/**
+ * Header of a journal file, followed by its batches
+ */
+struct journal_header_t {
+  char magic[8];
+  uint64_t parameter;
+};
+
+static const char JOURNAL_MAGIC[8] = {'F', 'G', 'X', 'J', 'R', 'N', 'L', '1'};
+
+static int write_all(int descriptor, const void* data, size_t size) {
+  const char* position = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t written = write(descriptor, position, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return -EIO;
+    }
+    position += written;
+    size -= written;
+  }
+  return 0;
+}
+
+static int read_all(int descriptor, void* data, size_t size) {
+  char* position = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t read_size = read(descriptor, position, size);
+    if (read_size < 0 && errno == EINTR) {
+      continue;
+    }
+    if (read_size <= 0) {
+      return -EIO;
+    }
+    position += read_size;
+    size -= read_size;
+  }
+  return 0;
+}
+
+/**
+ * Syncs the directory holding path, which makes the creation, renaming or removal of path durable
+ */
+static void sync_parent(const std::string &path) {
+  size_t slash = path.rfind('/');
+  std::string parent = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+  int descriptor = ::open(parent.c_str(), O_RDONLY | O_DIRECTORY);
+  if (descriptor >= 0) {
+    fsync(descriptor);
+    ::close(descriptor);
+  }
+}
+
+static int read_header(int descriptor, uint64_t* parameter) {
+  journal_header_t header;
+  if (read_all(descriptor, &header, sizeof(header)) < 0 ||
+      memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+    return -EINVAL;
+  }
+  *parameter = header.parameter;
+  return 0;
+}
+
+Journal::Journal(const Collect &collect):
+  collect(collect), descriptor(-1), size(0), running(false), error(0), pending(0), requested(0), completed(0),
+  checkpoints_requested(0), checkpoints_completed(0), checkpoint_error(0), checkpointing(false) {
+}
+
+Journal::~Journal() {
+  this->close();
+}
+
+int Journal::get_parameter(const std::string &path, uint64_t* parameter) {
+  int descriptor = ::open(path.c_str(), O_RDONLY);
+  if (descriptor < 0) {
+    return -errno;
+  }
+  int ret = read_header(descriptor, parameter);
+  ::close(descriptor);
+  return ret;
+}
+
+int Journal::replay(const std::string &path, const Apply &apply, off_t* end) {
+  int descriptor = ::open(path.c_str(), O_RDONLY);
+  if (descriptor < 0) {
+    return -errno;
+  }
+  struct stat attributes;
+  uint64_t parameter;
+  if (fstat(descriptor, &attributes) < 0 || read_header(descriptor, &parameter) < 0) {
+    ::close(descriptor);
+    return -EINVAL;
+  }
+  off_t position = sizeof(journal_header_t);
+  std::vector<char> batch;
+  uint64_t batch_size;
+  while (read_all(descriptor, &batch_size, sizeof(batch_size)) == 0 &&
+         batch_size <= (uint64_t) (attributes.st_size - position - sizeof(batch_size))) {
+    batch.resize(batch_size);
+    if (read_all(descriptor, batch.data(), batch_size) < 0 || apply(batch) < 0) {
+      break;
+    }
+    position += sizeof(batch_size) + batch_size;
+  }
+  ::close(descriptor);
+  if (end != NULL) {
+    *end = position;
+  }
+  return 0;
+}
+
+int Journal::create(const uint64_t parameter) {
+  this->descriptor = ::open(this->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (this->descriptor < 0) {
+    return -errno;
+  }
+  journal_header_t header;
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+  header.parameter = parameter;
+  if (write_all(this->descriptor, &header, sizeof(header)) < 0 || fdatasync(this->descriptor) < 0) {
+    ::close(this->descriptor);
+    this->descriptor = -1;
+    return -EIO;
+  }
+  sync_parent(this->path);
+  this->size = sizeof(header);
+  return 0;
+}
+
+int Journal::open(const std::string &path, const uint64_t parameter, const Apply &apply) {
+  if (this->running) {
+    return -EBUSY;
+  }
+  this->path = path;
+  off_t end;
+  int ret = replay(path, apply, &end);
+  if (ret == 0) {
+    // Whatever follows the last batch applied was torn by a crash
+    this->descriptor = ::open(path.c_str(), O_WRONLY);
+    if (this->descriptor < 0 || ftruncate(this->descriptor, end) < 0 || lseek(this->descriptor, end, SEEK_SET) < 0) {
+      return -EIO;
+    }
+    this->size = end;
+  } else if (ret == -ENOENT || ret == -EINVAL) {
+    ret = this->create(parameter);
+    if (ret < 0) {
+      return ret;
+    }
+  } else {
+    return ret;
+  }
+  this->error = 0;
+  this->pending = 0;
+  this->running = true;
+  this->worker = std::thread(&Journal::run, this);
+  return 0;
+}
+
+int Journal::close() {
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (!this->running) {
+      return this->error;
+    }
+    this->running = false;
+  }
+  // The background thread commits a last round before it stops
+  this->wake_up.notify_one();
+  this->worker.join();
+  ::close(this->descriptor);
+  this->descriptor = -1;
+  return this->error;
+}
+
+void Journal::set_checkpoint(const Checkpoint &checkpoint) {
+  this->write_checkpoint = checkpoint;
+}
+
+void Journal::add_pending(const size_t size) {
+  std::unique_lock<std::mutex> guard(this->lock);
+  this->pending += size;
+  if (this->pending < MAX_PENDING || !this->running || this->checkpointing) {
+    return;
+  }
+  uint64_t round = ++this->requested;
+  this->wake_up.notify_one();
+  // The rotation of a checkpoint collects the pending changes as well
+  this->committed.wait(guard, [this, round] { return this->completed >= round || this->checkpointing; });
+}
+
+int Journal::commit() {
+  std::unique_lock<std::mutex> guard(this->lock);
+  if (!this->running) {
+    return this->error;
+  }
+  // Only a round starting after this point is sure to collect the changes made so far
+  uint64_t round = ++this->requested;
+  this->wake_up.notify_one();
+  this->committed.wait(guard, [this, round] { return this->completed >= round; });
+  return this->error;
+}
+
+void Journal::request_checkpoint() {
+  std::lock_guard<std::mutex> guard(this->lock);
+  if (!this->running || this->checkpoints_requested > this->checkpoints_completed) {
+    return;
+  }
+  this->checkpoints_requested++;
+  this->wake_up.notify_one();
+}
+
+int Journal::checkpoint() {
+  std::unique_lock<std::mutex> guard(this->lock);
+  if (!this->running) {
+    return -EIO;
+  }
+  uint64_t round = ++this->checkpoints_requested;
+  this->wake_up.notify_one();
+  this->committed.wait(guard, [this, round] { return this->checkpoints_completed >= round; });
+  return this->checkpoint_error;
+}
+
+/**
+ * Appends the batches of the journal at path, which ends at size, to the journal at old_path
+ * @return 0 on success, -EIO otherwise
+ */
+static int append_batches(const std::string &path, const size_t size, const std::string &old_path) {
+  off_t end;
+  if (Journal::replay(old_path, [](const std::vector<char> &) { return 0; }, &end) < 0) {
+    // A journal torn before its header was synced holds no batch
+    return rename(path.c_str(), old_path.c_str()) < 0 ? -EIO : 0;
+  }
+  int source = ::open(path.c_str(), O_RDONLY);
+  int target = ::open(old_path.c_str(), O_WRONLY);
+  int ret = source < 0 || target < 0 || lseek(source, sizeof(journal_header_t), SEEK_SET) < 0 ||
+            ftruncate(target, end) < 0 || lseek(target, end, SEEK_SET) < 0 ? -EIO : 0;
+  std::vector<char> buffer(1 << 20);
+  for (size_t left = size - sizeof(journal_header_t); ret == 0 && left > 0; left -= std::min(left, buffer.size())) {
+    size_t length = std::min(left, buffer.size());
+    ret = read_all(source, buffer.data(), length) < 0 || write_all(target, buffer.data(), length) < 0 ? -EIO : 0;
+  }
+  if (ret == 0 && fdatasync(target) < 0) {
+    ret = -EIO;
+  }
+  if (source >= 0) {
+    ::close(source);
+  }
+  if (target >= 0) {
+    ::close(target);
+  }
+  return ret;
+}
+
+static bool exists(const std::string &path);
+
+int Journal::rotate(const std::string &old_path, const uint64_t parameter) {
+  // The background thread is the one rotating, it commits the changes left itself
+  this->write_batch();
+  ::close(this->descriptor);
+  this->descriptor = -1;
+  // An old journal left by a checkpoint that was not installed holds changes of its own, the batches are
+  // added to them. A crash before the new journal is created replays these batches twice, which stores the
+  // same blocks again.
+  int ret = exists(old_path) ? append_batches(this->path, this->size, old_path)
+                             : rename(this->path.c_str(), old_path.c_str()) < 0 ? -errno : 0;
+  if (ret == 0) {
+    ret = this->create(parameter);
+  }
+  std::lock_guard<std::mutex> guard(this->lock);
+  if (ret < 0) {
+    // Commits fail from now on rather than leaving changes out of the journal
+    this->error = -EIO;
+    return ret;
+  }
+  // The changes lost by a failed batch are in the checkpoint that follows the rotation
+  this->error = 0;
+  this->pending = 0;
+  return 0;
+}
+
+size_t Journal::get_size() const {
+  return this->size;
+}
+
+int Journal::write_batch() {
+  this->batch.clear();
+  int ret = this->collect(&this->batch);
+  if (ret < 0 || this->batch.empty()) {
+    return ret;
+  }
+  uint64_t batch_size = this->batch.size();
+  if (write_all(this->descriptor, &batch_size, sizeof(batch_size)) < 0 ||
+      write_all(this->descriptor, this->batch.data(), batch_size) < 0 ||
+      fdatasync(this->descriptor) < 0) {
+    // A partial batch would hide the batches that follow it from the replay
+    if (ftruncate(this->descriptor, this->size) == 0) {
+      lseek(this->descriptor, this->size, SEEK_SET);
+    }
+    return -EIO;
+  }
+  this->size += sizeof(batch_size) + batch_size;
+  return 0;
+}
+
+void Journal::run() {
+  std::unique_lock<std::mutex> guard(this->lock);
+  while (true) {
+    this->wake_up.wait_for(guard, std::chrono::milliseconds(COMMIT_INTERVAL), [this] {
+      return !this->running || this->requested > this->completed ||
+             this->checkpoints_requested > this->checkpoints_completed;
+    });
+    bool stopping = !this->running;
+    uint64_t round = this->requested;
+    this->pending = 0;
+    guard.unlock();
+    int ret = this->write_batch();
+    guard.lock();
+    if (ret < 0) {
+      this->error = -EIO;
+    }
+    this->completed = round;
+    uint64_t checkpoint = this->checkpoints_requested;
+    if (checkpoint > this->checkpoints_completed && !stopping) {
+      // Changes made meanwhile no longer wait for their batch, the checkpoint may need the locks of their callers
+      this->checkpointing = true;
+      this->committed.notify_all();
+      guard.unlock();
+      ret = this->write_checkpoint();
+      guard.lock();
+      this->checkpointing = false;
+      this->checkpoint_error = ret;
+      this->checkpoints_completed = checkpoint;
+    } else if (stopping) {
+      // Checkpoints asked for while the journal closes are not written
+      this->checkpoint_error = -ECANCELED;
+      this->checkpoints_completed = checkpoint;
+    }
+    this->committed.notify_all();
+    if (stopping) {
+      return;
+    }
+  }
+}
+
+/**
+ * Deletes a directory and everything it holds
+ */
+static void remove_tree(const std::string &path) {
+  DIR* directory = opendir(path.c_str());
+  if (directory == NULL) {
+    unlink(path.c_str());
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    std::string name(entry->d_name);
+    if (name == "." || name == "..") {
+      continue;
+    }
+    if (entry->d_type == DT_DIR) {
+      remove_tree(path + "/" + name);
+    } else {
+      unlink((path + "/" + name).c_str());
+    }
+  }
+  closedir(directory);
+  rmdir(path.c_str());
+}
+
+static bool exists(const std::string &path) {
+  struct stat attributes;
+  return stat(path.c_str(), &attributes) == 0;
+}
+
+std::string prepare_checkpoint(const std::string &directory) {
+  std::string pending = directory + ".tmp";
+  remove_tree(pending);
+  mkdir(pending.c_str(), S_IRWXU);
+  return pending;
+}
+
+int install_checkpoint(const std::string &directory, const std::string &old_journal) {
+  std::string pending = directory + ".tmp";
+  std::string previous = directory + ".old";
+  int descriptor = ::open(pending.c_str(), O_RDONLY | O_DIRECTORY);
+  if (descriptor < 0) {
+    return -errno;
+  }
+  // Syncs the whole file system holding the checkpoint rather than every file and directory it wrote
+  int ret = syncfs(descriptor);
+  ::close(descriptor);
+  if (ret < 0) {
+    return -EIO;
+  }
+  if (rename(directory.c_str(), previous.c_str()) < 0 && errno != ENOENT) {
+    return -errno;
+  }
+  if (rename(pending.c_str(), directory.c_str()) < 0) {
+    return -errno;
+  }
+  sync_parent(directory);
+  // From here on, recover_checkpoint keeps the new checkpoint
+  unlink(old_journal.c_str());
+  sync_parent(old_journal);
+  remove_tree(previous);
+  return 0;
+}
+
+void recover_checkpoint(const std::string &directory, const std::string &old_journal) {
+  std::string previous = directory + ".old";
+  if (exists(previous)) {
+    if (exists(directory)) {
+      // The new checkpoint was in place, only the journal it supersedes was left to delete
+      unlink(old_journal.c_str());
+      remove_tree(previous);
+    } else {
+      rename(previous.c_str(), directory.c_str());
+    }
+    sync_parent(directory);
+  }
+  remove_tree(directory + ".tmp");
+}
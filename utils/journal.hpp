@@ -0,0 +1,173 @@
+#ifndef __JOURNAL_HPP__
+#define __JOURNAL_HPP__
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * An append-only log of the changes made to a file system since its last checkpoint.
+ * A background thread collects the changes made since its previous round as one sealed batch, appends it
+ * to the journal and syncs it, so that every caller waiting for its changes to be durable shares a single
+ * write and a single fdatasync. Each batch is preceded by its size: a batch torn by a crash, or one that
+ * cannot be unsealed, ends the replay. The same thread writes the checkpoints that let the journal start over,
+ * so that the change crossing the threshold of a checkpoint does not wait for it.
+ */
+class Journal {
+  public:
+    /**
+     * Bytes of changes waiting to be collected beyond which a change waits for them to be committed
+     */
+    static const size_t MAX_PENDING = 4 << 20;
+    /**
+     * Milliseconds after which changes are committed even if nobody waits for them
+     */
+    static const unsigned int COMMIT_INTERVAL = 1000;
+
+    /**
+     * Seals the changes made since the previous call into batch, left empty if there are none
+     * @return 0 on success, a negative error code otherwise
+     */
+    typedef std::function<int(std::vector<char>* batch)> Collect;
+    /**
+     * Unseals and applies a batch read back from the journal
+     * @return 0 on success, a negative error code if the batch cannot be unsealed
+     */
+    typedef std::function<int(const std::vector<char> &batch)> Apply;
+    /**
+     * Writes a checkpoint of the files and rotates the journal, called from the background thread
+     * @return 0 on success, a negative error code otherwise
+     */
+    typedef std::function<int()> Checkpoint;
+
+    /**
+     * @param collect Collects the changes, called from the background thread
+     */
+    explicit Journal(const Collect &collect);
+    ~Journal();
+
+    /**
+     * Reads the value stored in the header of a journal
+     * @return 0 on success, -ENOENT if there is no journal at path, -EINVAL if its header is invalid
+     */
+    static int get_parameter(const std::string &path, uint64_t* parameter);
+
+    /**
+     * Applies the batches of a journal in order, up to the first one that is torn or cannot be applied
+     * @param end Set to the offset following the last batch applied
+     * @return 0 on success, -ENOENT if there is no journal at path, -EINVAL if its header is invalid
+     */
+    static int replay(const std::string &path, const Apply &apply, off_t* end = NULL);
+
+    /**
+     * Replays the journal at path and starts appending to it, after its last batch applied.
+     * A new journal is created if there is none, or if the previous one was torn before its header was synced.
+     * @param parameter Value stored in the header of a new journal, such as the unit its changes are made in
+     * @return 0 on success, a negative error code otherwise
+     */
+    int open(const std::string &path, const uint64_t parameter, const Apply &apply);
+
+    /**
+     * Sets the function writing checkpoints, before the journal is opened
+     */
+    void set_checkpoint(const Checkpoint &checkpoint);
+
+    /**
+     * Commits the changes left and stops the background thread
+     * @return 0 on success, -EIO if a batch could not be written since the journal was opened
+     */
+    int close();
+
+    /**
+     * Accounts for a change of size bytes, and waits for the changes to be committed if too many are pending.
+     * The caller may hold locks that a checkpoint takes: it does not wait while one is written.
+     */
+    void add_pending(const size_t size);
+
+    /**
+     * Waits until the changes made before the call are durable
+     * @return 0 on success, -EIO if a batch could not be written since the journal was opened
+     */
+    int commit();
+
+    /**
+     * Has the background thread write a checkpoint, unless one is already due, without waiting for it
+     */
+    void request_checkpoint();
+
+    /**
+     * Has the background thread write a checkpoint and waits for it
+     * @return 0 on success, a negative error code otherwise
+     */
+    int checkpoint();
+
+    /**
+     * Commits the changes made so far, moves the journal to old_path and starts an empty one.
+     * If a journal is left at old_path, the batches are appended to it instead.
+     * Only called by the checkpoint function, on the background thread.
+     * Changes made meanwhile may end up in either journal, so the caller must prevent them.
+     * @param parameter Value stored in the header of the new journal
+     * @return 0 on success, a negative error code if the new journal could not be created
+     */
+    int rotate(const std::string &old_path, const uint64_t parameter);
+
+    /**
+     * @return The size of the journal in bytes
+     */
+    size_t get_size() const;
+
+  private:
+    int create(const uint64_t parameter);
+    int write_batch();
+    void run();
+
+    Collect collect;
+    Checkpoint write_checkpoint;
+    std::string path;
+    int descriptor;
+    std::atomic<size_t> size;
+    std::vector<char> batch;
+    bool running;
+    int error;
+    size_t pending;
+    // Rounds asked for by callers of commit, and the last round completed by the background thread
+    uint64_t requested;
+    uint64_t completed;
+    // Same for checkpoints, along with the outcome of the last one
+    uint64_t checkpoints_requested;
+    uint64_t checkpoints_completed;
+    int checkpoint_error;
+    bool checkpointing;
+    std::mutex lock;
+    std::condition_variable wake_up;
+    std::condition_variable committed;
+    std::thread worker;
+};
+
+/**
+ * Gives the directory a checkpoint of directory is written to, emptied of the files of an earlier attempt
+ */
+std::string prepare_checkpoint(const std::string &directory);
+
+/**
+ * Syncs the checkpoint written to the directory given by prepare_checkpoint and swaps it with directory,
+ * then deletes the journal it supersedes
+ * @return 0 on success, a negative error code if the checkpoint could not be installed
+ */
+int install_checkpoint(const std::string &directory, const std::string &old_journal);
+
+/**
+ * Completes or rolls back a checkpoint interrupted by a crash, before the files of directory are restored.
+ * If old_journal is left, the checkpoint in directory predates it.
+ */
+void recover_checkpoint(const std::string &directory, const std::string &old_journal);
+
+#endif
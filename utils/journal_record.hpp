@@ -0,0 +1,91 @@
+#ifndef __JOURNAL_RECORD_HPP__
+#define __JOURNAL_RECORD_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+/**
+ * Changes recorded in a journal. The meaning of the value and of the data of a record depends on its type.
+ */
+enum JournalRecordType {
+  // value is the mode of the new file or directory
+  JOURNAL_CREATE = 1,
+  JOURNAL_MKDIR = 2,
+  JOURNAL_UNLINK = 3,
+  JOURNAL_RMDIR = 4,
+  // value is the offset the data is written at
+  JOURNAL_WRITE = 5,
+  // value is the new length of the file, in bytes for sgxfs and in blocks for sgx-ramfs
+  JOURNAL_TRUNCATE = 6,
+  // value is the index of the first encrypted block held by the data
+  JOURNAL_STORE = 7
+};
+
+/**
+ * A record read back from a batch of records, pointing into the batch
+ */
+struct JournalRecord {
+  uint8_t type;
+  std::string path;
+  uint64_t value;
+  const char* data;
+  size_t size;
+};
+
+/**
+ * Header of a record, followed by the path and the data
+ */
+struct journal_record_header_t {
+  uint8_t type;
+  uint32_t path_length;
+  uint64_t value;
+  uint64_t size;
+};
+
+/**
+ * Appends a record to a batch, leaving room for its data
+ * @param size Size of the data of the record
+ * @return The room left for the data, to be filled by the caller
+ */
+inline char* append_journal_record(std::vector<char>* records,
+                                   const uint8_t type,
+                                   const std::string &path,
+                                   const uint64_t value,
+                                   const size_t size) {
+  journal_record_header_t header = {type, static_cast<uint32_t>(path.length()), value, size};
+  size_t position = records->size();
+  records->resize(position + sizeof(header) + path.length() + size);
+  memcpy(records->data() + position, &header, sizeof(header));
+  memcpy(records->data() + position + sizeof(header), path.data(), path.length());
+  return records->data() + position + sizeof(header) + path.length();
+}
+
+/**
+ * Reads the record of a batch found at position and moves position past it
+ * @return false once the batch has no complete record left
+ */
+inline bool read_journal_record(const std::vector<char> &records, size_t* position, JournalRecord* record) {
+  journal_record_header_t header;
+  if (records.size() - *position < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, records.data() + *position, sizeof(header));
+  size_t left = records.size() - *position - sizeof(header);
+  if (header.path_length > left || header.size > left - header.path_length) {
+    return false;
+  }
+  const char* path = records.data() + *position + sizeof(header);
+  record->type = header.type;
+  record->path.assign(path, header.path_length);
+  record->value = header.value;
+  record->data = path + header.path_length;
+  record->size = header.size;
+  *position += sizeof(header) + header.path_length + header.size;
+  return true;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef __LOCK_HPP__
+#define __LOCK_HPP__
+
+#ifdef FUSEGX_ENCLAVE
+#include "sgx_thread.h"
+#else
+#include <pthread.h>
+#endif
+
+/**
+ * A mutual exclusion lock backed by sgx_thread inside the enclave and by pthread outside of it
+ */
+class Mutex {
+  public:
+#ifdef FUSEGX_ENCLAVE
+    Mutex() { sgx_thread_mutex_init(&this->mutex, NULL); }
+    ~Mutex() { sgx_thread_mutex_destroy(&this->mutex); }
+    void lock() { sgx_thread_mutex_lock(&this->mutex); }
+    void unlock() { sgx_thread_mutex_unlock(&this->mutex); }
+#else
+    Mutex() { pthread_mutex_init(&this->mutex, NULL); }
+    ~Mutex() { pthread_mutex_destroy(&this->mutex); }
+    void lock() { pthread_mutex_lock(&this->mutex); }
+    void unlock() { pthread_mutex_unlock(&this->mutex); }
+#endif
+    Mutex(const Mutex&) = delete;
+    Mutex& operator=(const Mutex&) = delete;
+
+  private:
+#ifdef FUSEGX_ENCLAVE
+    sgx_thread_mutex_t mutex;
+#else
+    pthread_mutex_t mutex;
+#endif
+};
+
+/**
+ * Holds a mutex for the lifetime of the object
+ */
+class ScopedLock {
+  public:
+    explicit ScopedLock(Mutex &mutex): mutex(mutex) { this->mutex.lock(); }
+    ~ScopedLock() { this->mutex.unlock(); }
+    ScopedLock(const ScopedLock&) = delete;
+    ScopedLock& operator=(const ScopedLock&) = delete;
+
+  private:
+    Mutex &mutex;
+};
+
+/**
+ * A reader-writer lock.
+ * Outside of the enclave it is a pthread_rwlock_t. Inside the enclave, where the
+ * trusted runtime only provides mutexes and condition variables, it is built on top
+ * of them and gives precedence to writers. In both cases the lock is not recursive.
+ */
+class RWLock {
+  public:
+#ifdef FUSEGX_ENCLAVE
+    RWLock(): readers(0), waiting_writers(0), writer(false) {
+      sgx_thread_mutex_init(&this->mutex, NULL);
+      sgx_thread_cond_init(&this->condition, NULL);
+    }
+    ~RWLock() {
+      sgx_thread_cond_destroy(&this->condition);
+      sgx_thread_mutex_destroy(&this->mutex);
+    }
+    void lock_shared() {
+      sgx_thread_mutex_lock(&this->mutex);
+      while (this->writer || this->waiting_writers > 0) {
+        sgx_thread_cond_wait(&this->condition, &this->mutex);
+      }
+      this->readers++;
+      sgx_thread_mutex_unlock(&this->mutex);
+    }
+    void unlock_shared() {
+      sgx_thread_mutex_lock(&this->mutex);
+      this->readers--;
+      if (this->readers == 0) {
+        sgx_thread_cond_broadcast(&this->condition);
+      }
+      sgx_thread_mutex_unlock(&this->mutex);
+    }
+    void lock() {
+      sgx_thread_mutex_lock(&this->mutex);
+      this->waiting_writers++;
+      while (this->writer || this->readers > 0) {
+        sgx_thread_cond_wait(&this->condition, &this->mutex);
+      }
+      this->waiting_writers--;
+      this->writer = true;
+      sgx_thread_mutex_unlock(&this->mutex);
+    }
+    void unlock() {
+      sgx_thread_mutex_lock(&this->mutex);
+      this->writer = false;
+      sgx_thread_cond_broadcast(&this->condition);
+      sgx_thread_mutex_unlock(&this->mutex);
+    }
+#else
+    RWLock() { pthread_rwlock_init(&this->rwlock, NULL); }
+    ~RWLock() { pthread_rwlock_destroy(&this->rwlock); }
+    void lock_shared() { pthread_rwlock_rdlock(&this->rwlock); }
+    void unlock_shared() { pthread_rwlock_unlock(&this->rwlock); }
+    void lock() { pthread_rwlock_wrlock(&this->rwlock); }
+    void unlock() { pthread_rwlock_unlock(&this->rwlock); }
+#endif
+    RWLock(const RWLock&) = delete;
+    RWLock& operator=(const RWLock&) = delete;
+
+  private:
+#ifdef FUSEGX_ENCLAVE
+    sgx_thread_mutex_t mutex;
+    sgx_thread_cond_t condition;
+    unsigned int readers;
+    unsigned int waiting_writers;
+    bool writer;
+#else
+    pthread_rwlock_t rwlock;
+#endif
+};
+
+/**
+ * Holds a reader-writer lock in shared mode for the lifetime of the object
+ */
+class ReadLock {
+  public:
+    explicit ReadLock(RWLock &rwlock): rwlock(rwlock) { this->rwlock.lock_shared(); }
+    ~ReadLock() { this->rwlock.unlock_shared(); }
+    ReadLock(const ReadLock&) = delete;
+    ReadLock& operator=(const ReadLock&) = delete;
+
+  private:
+    RWLock &rwlock;
+};
+
+/**
+ * Holds a reader-writer lock in exclusive mode for the lifetime of the object
+ */
+class WriteLock {
+  public:
+    explicit WriteLock(RWLock &rwlock): rwlock(rwlock) { this->rwlock.lock(); }
+    ~WriteLock() { this->rwlock.unlock(); }
+    WriteLock(const WriteLock&) = delete;
+    WriteLock& operator=(const WriteLock&) = delete;
+
+  private:
+    RWLock &rwlock;
+};
+
+#endif /*__LOCK_HPP__*/
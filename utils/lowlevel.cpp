@@ -0,0 +1,153 @@
+#include "lowlevel.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+
+int run_lowlevel_session(struct fuse_args* args,
+                         const struct fuse_lowlevel_ops* operations,
+                         const size_t size,
+                         void* user_data) {
+  char* mountpoint;
+  int multithreaded;
+  int foreground;
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1 || mountpoint == NULL) {
+    return 1;
+  }
+  int ret = 1;
+  struct fuse_chan* channel = fuse_mount(mountpoint, args);
+  if (channel != NULL) {
+    struct fuse_session* session = fuse_lowlevel_new(args, operations, size, user_data);
+    if (session != NULL) {
+      if (fuse_set_signal_handlers(session) != -1) {
+        fuse_session_add_chan(session, channel);
+        if (fuse_daemonize(foreground) != -1) {
+          ret = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+          ret = ret == -1 ? 1 : 0;
+        }
+        fuse_remove_signal_handlers(session);
+        fuse_session_remove_chan(channel);
+      }
+      fuse_session_destroy(session);
+    }
+    fuse_unmount(mountpoint, channel);
+  }
+  free(mountpoint);
+  return ret;
+}
+
+struct fuse_entry_param get_entry(const struct stat &attributes, const double timeout) {
+  struct fuse_entry_param entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.ino = attributes.st_ino;
+  entry.attr = attributes;
+  entry.attr_timeout = timeout;
+  entry.entry_timeout = timeout;
+  return entry;
+}
+
+void reply_entry(fuse_req_t request, const struct stat &attributes, const double timeout) {
+  struct fuse_entry_param entry = get_entry(attributes, timeout);
+  fuse_reply_entry(request, &entry);
+}
+
+/**
+ * Fills the buffer of a readdir reply entry by entry
+ */
+class DirectoryReply {
+  public:
+    DirectoryReply(fuse_req_t request, const size_t size): request(request), buffer(size), used(0) {
+    }
+
+    /**
+     * @return false if the entry does not fit in the reply, which then holds the entries added before it
+     */
+    bool add(const std::string &name, const uint64_t inode, const bool directory, const off_t next_offset) {
+      struct stat attributes;
+      memset(&attributes, 0, sizeof(attributes));
+      attributes.st_ino = inode;
+      attributes.st_mode = directory ? S_IFDIR : S_IFREG;
+      size_t needed = fuse_add_direntry(this->request,
+                                        this->buffer.data() + this->used,
+                                        this->buffer.size() - this->used,
+                                        name.c_str(),
+                                        &attributes,
+                                        next_offset);
+      if (needed > this->buffer.size() - this->used) {
+        return false;
+      }
+      this->used += needed;
+      return true;
+    }
+
+    void send() {
+      fuse_reply_buf(this->request, this->buffer.data(), this->used);
+    }
+
+  private:
+    fuse_req_t request;
+    std::vector<char> buffer;
+    size_t used;
+};
+
+void reply_directory(fuse_req_t request,
+                     const uint64_t inode,
+                     const size_t size,
+                     const off_t offset,
+                     DirectoryStream* stream,
+                     const ListEntries &list) {
+  std::vector<DirectoryEntry> entries;
+  bool end = false;
+  if (offset != stream->offset) {
+    // Walks the directory from its first entry up to offset
+    stream->offset = std::min(offset, (off_t) 2);
+    stream->name.clear();
+    while (stream->offset < offset && !end) {
+      entries.clear();
+      int ret = list(stream->name, &entries, &end);
+      if (ret < 0) {
+        fuse_reply_err(request, -ret);
+        return;
+      }
+      for (auto it = entries.begin(); it != entries.end() && stream->offset < offset; it++) {
+        stream->offset++;
+        stream->name = it->name;
+      }
+    }
+    end = false;
+  }
+  DirectoryReply reply(request, size);
+  if (stream->offset == 0) {
+    if (!reply.add(".", inode, true, 1)) {
+      reply.send();
+      return;
+    }
+    stream->offset = 1;
+  }
+  if (stream->offset == 1) {
+    // The kernel does not rely on the inode number of ".."
+    if (!reply.add("..", inode, true, 2)) {
+      reply.send();
+      return;
+    }
+    stream->offset = 2;
+  }
+  while (!end) {
+    entries.clear();
+    int ret = list(stream->name, &entries, &end);
+    if (ret < 0) {
+      fuse_reply_err(request, -ret);
+      return;
+    }
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+      if (!reply.add(it->name, it->number, it->directory, stream->offset + 1)) {
+        reply.send();
+        return;
+      }
+      stream->offset++;
+      stream->name = it->name;
+    }
+  }
+  reply.send();
+}
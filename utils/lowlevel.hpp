@@ -0,0 +1,89 @@
+#ifndef __LOWLEVEL_HPP__
+#define __LOWLEVEL_HPP__
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse_lowlevel.h>
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "filesystem.hpp"
+
+/**
+ * Time in seconds the kernel keeps the attributes and entries replied by the low-level frontends
+ */
+static const double LOWLEVEL_TIMEOUT = 1.0;
+
+/**
+ * Number of entries a low-level frontend lists at a time to fill a readdir reply
+ */
+static const size_t LOWLEVEL_LIST_ENTRIES = 64;
+
+/**
+ * Mounts a file system served through the low-level FUSE API and runs its session until it is unmounted.
+ * Takes the same arguments as fuse_main: a mount point, -f, -s, -d and mount options.
+ * @param args Arguments left once the options of the file system are parsed
+ * @param operations Operations of the file system
+ * @param size Size of operations
+ * @param user_data Data handed to the operations
+ * @return 0 once unmounted, 1 if the file system could not be mounted
+ */
+int run_lowlevel_session(struct fuse_args* args,
+                         const struct fuse_lowlevel_ops* operations,
+                         const size_t size,
+                         void* user_data);
+
+/**
+ * Describes an entry to the kernel, which caches it and its attributes for timeout seconds
+ * @param attributes Attributes of the entry, st_ino being its inode number
+ * @param timeout Time in seconds the kernel keeps the entry and its attributes
+ */
+struct fuse_entry_param get_entry(const struct stat &attributes, const double timeout = LOWLEVEL_TIMEOUT);
+
+/**
+ * Replies to a request looking up an entry, which hands a reference on the inode to the kernel
+ * @param request Request to reply to
+ * @param attributes Attributes of the entry, st_ino being its inode number
+ * @param timeout Time in seconds the kernel keeps the entry and its attributes
+ */
+void reply_entry(fuse_req_t request, const struct stat &attributes, const double timeout = LOWLEVEL_TIMEOUT);
+
+/**
+ * Position of an open directory stream: offset of the last entry handed to the kernel and its name.
+ * Offsets 1 and 2 are "." and "..", the entries of the directory follow from 3.
+ */
+struct DirectoryStream {
+  off_t offset;
+  std::string name;
+};
+
+/**
+ * Lists the entries of a directory that follow after, setting end when there are none past them
+ * @return 0 on success, a negative error code otherwise
+ */
+typedef std::function<int(const std::string &after, std::vector<DirectoryEntry>* entries, bool* end)> ListEntries;
+
+/**
+ * Replies to a readdir request with as many entries as fit in size bytes, resuming the stream at offset
+ * @param request Request to reply to
+ * @param inode Inode number of the directory
+ * @param size Size of the reply
+ * @param offset Offset the kernel resumes reading from
+ * @param stream Stream opened on the directory, moved past the entries replied
+ * @param list Lists the entries of the directory
+ */
+void reply_directory(fuse_req_t request,
+                     const uint64_t inode,
+                     const size_t size,
+                     const off_t offset,
+                     DirectoryStream* stream,
+                     const ListEntries &list);
+
+#endif /*__LOWLEVEL_HPP__*/
@@ -0,0 +1,100 @@
+#include "metadata_cache.hpp"
+
+const size_t MetadataCache::MAX_ENTRIES;
+
+static std::string get_parent(const std::string &path) {
+  size_t position = path.rfind('/');
+  if (position == std::string::npos || position == 0) {
+    return "/";
+  }
+  return path.substr(0, position);
+}
+
+MetadataCache::MetadataCache(const double timeout): generation(0) {
+  this->set_timeout(timeout);
+}
+
+void MetadataCache::set_timeout(const double timeout) {
+  ScopedLock lock(this->mutex);
+  this->timeout = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeout));
+  this->attributes.clear();
+  this->listings.clear();
+}
+
+bool MetadataCache::is_enabled() const {
+  return this->timeout > Clock::duration::zero();
+}
+
+void MetadataCache::advance(const uint64_t generation) {
+  if (generation > this->generation) {
+    this->generation = generation;
+  }
+}
+
+bool MetadataCache::get_attributes(const std::string &path, struct stat* attributes) {
+  ScopedLock lock(this->mutex);
+  auto entry = this->attributes.find(path);
+  if (entry == this->attributes.end()) {
+    return false;
+  }
+  if (entry->second.expiration < Clock::now()) {
+    this->attributes.erase(entry);
+    return false;
+  }
+  *attributes = entry->second.value;
+  return true;
+}
+
+void MetadataCache::put_attributes(const std::string &path, const struct stat &attributes, const uint64_t generation) {
+  ScopedLock lock(this->mutex);
+  if (!this->is_enabled() || generation < this->generation) {
+    return;
+  }
+  if (this->attributes.size() >= MAX_ENTRIES) {
+    this->attributes.clear();
+  }
+  this->attributes[path] = Entry<struct stat>{attributes, Clock::now() + this->timeout};
+}
+
+bool MetadataCache::get_entries(const std::string &directory, std::vector<std::string>* entries) {
+  ScopedLock lock(this->mutex);
+  auto entry = this->listings.find(directory);
+  if (entry == this->listings.end()) {
+    return false;
+  }
+  if (entry->second.expiration < Clock::now()) {
+    this->listings.erase(entry);
+    return false;
+  }
+  *entries = entry->second.value;
+  return true;
+}
+
+void MetadataCache::put_entries(const std::string &directory,
+                                const std::vector<std::string> &entries,
+                                const uint64_t generation) {
+  ScopedLock lock(this->mutex);
+  if (!this->is_enabled() || generation < this->generation) {
+    return;
+  }
+  if (this->listings.size() >= MAX_ENTRIES) {
+    this->listings.clear();
+  }
+  this->listings[directory] = Entry<std::vector<std::string>>{entries, Clock::now() + this->timeout};
+}
+
+void MetadataCache::invalidate_attributes(const std::string &path, const uint64_t generation) {
+  ScopedLock lock(this->mutex);
+  this->advance(generation);
+  this->attributes.erase(path);
+}
+
+void MetadataCache::invalidate_entry(const std::string &path, const uint64_t generation) {
+  ScopedLock lock(this->mutex);
+  this->advance(generation);
+  this->attributes.erase(path);
+  this->listings.erase(path);
+  std::string parent = get_parent(path);
+  this->attributes.erase(parent);
+  this->listings.erase(parent);
+}
@@ -0,0 +1,97 @@
+#ifndef __METADATA_CACHE_HPP__
+#define __METADATA_CACHE_HPP__
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lock.hpp"
+
+/**
+ * A cache of file attributes and directory listings kept outside of the enclave.
+ * Entries are tagged with the generation of the file system they were read at. Mutations
+ * report the generation they produced: the entries they affect are dropped, and entries
+ * read before that generation are no longer accepted, so that a lookup racing with a
+ * mutation cannot put stale data back in the cache.
+ */
+class MetadataCache {
+  public:
+    /**
+     * Number of cached attributes or listings beyond which the cache is emptied
+     */
+    static const size_t MAX_ENTRIES = 65536;
+
+    /**
+     * @param timeout Time in seconds an entry stays valid, 0 disables the cache
+     */
+    explicit MetadataCache(const double timeout);
+
+    void set_timeout(const double timeout);
+
+    /**
+     * @param path Path to the file or directory
+     * @param attributes Filled with the cached attributes if they are found
+     * @return true if valid attributes were found
+     */
+    bool get_attributes(const std::string &path, struct stat* attributes);
+
+    /**
+     * @param path Path to the file or directory
+     * @param attributes Attributes to cache
+     * @param generation Generation the attributes were read at
+     */
+    void put_attributes(const std::string &path, const struct stat &attributes, const uint64_t generation);
+
+    /**
+     * @param directory Path to the directory
+     * @param entries Filled with the names of the entries of the directory if they are found
+     * @return true if a valid listing was found
+     */
+    bool get_entries(const std::string &directory, std::vector<std::string>* entries);
+
+    /**
+     * @param directory Path to the directory
+     * @param entries Names of the entries of the directory
+     * @param generation Generation the listing was read at
+     */
+    void put_entries(const std::string &directory, const std::vector<std::string> &entries, const uint64_t generation);
+
+    /**
+     * Drops the attributes of a file whose content changed
+     * @param path Path to the file
+     * @param generation Generation returned by the mutation
+     */
+    void invalidate_attributes(const std::string &path, const uint64_t generation);
+
+    /**
+     * Drops the attributes and listing of an entry that was created or removed, and the attributes and listing
+     * of its parent, whose link count and times change with it
+     * @param path Path to the file or directory
+     * @param generation Generation returned by the mutation
+     */
+    void invalidate_entry(const std::string &path, const uint64_t generation);
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    template <typename T>
+    struct Entry {
+      T value;
+      Clock::time_point expiration;
+    };
+
+    bool is_enabled() const;
+    void advance(const uint64_t generation);
+
+    Clock::duration timeout;
+    uint64_t generation;
+    std::unordered_map<std::string, Entry<struct stat>> attributes;
+    std::unordered_map<std::string, Entry<std::vector<std::string>>> listings;
+    Mutex mutex;
+};
+
+#endif /*__METADATA_CACHE_HPP__*/
@@ -0,0 +1,34 @@
+#include "preloader.hpp"
+
+Preloader::Preloader(const Load &load): load(load), running(false) {
+}
+
+Preloader::~Preloader() {
+  this->stop();
+}
+
+void Preloader::start(const std::vector<std::string> &paths) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  if (this->running || paths.empty()) {
+    return;
+  }
+  this->paths = paths;
+  this->running = true;
+  this->worker = std::thread(&Preloader::run, this);
+}
+
+void Preloader::stop() {
+  std::lock_guard<std::mutex> guard(this->lock);
+  if (!this->worker.joinable()) {
+    return;
+  }
+  this->running = false;
+  this->worker.join();
+  this->paths.clear();
+}
+
+void Preloader::run() {
+  for (auto it = this->paths.begin(); it != this->paths.end() && this->running; it++) {
+    this->load(*it);
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef __PRELOADER_HPP__
+#define __PRELOADER_HPP__
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Loads the files of a file system restored lazily on a background thread, so that they are in memory
+ * before they are first accessed. Files accessed first are loaded on demand by the file system, which
+ * the preloader then finds already loaded.
+ */
+class Preloader {
+  public:
+    /**
+     * Loads a file, called from the background thread
+     */
+    typedef std::function<void(const std::string &path)> Load;
+
+    explicit Preloader(const Load &load);
+    ~Preloader();
+
+    /**
+     * Starts loading files in order on the background thread
+     */
+    void start(const std::vector<std::string> &paths);
+
+    /**
+     * Stops the background thread, leaving the files that were not loaded yet
+     */
+    void stop();
+
+  private:
+    void run();
+
+    Load load;
+    std::vector<std::string> paths;
+    std::atomic<bool> running;
+    std::mutex lock;
+    std::thread worker;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include "read_ahead.hpp"
+
+#include <algorithm>
+
+const size_t ReadAhead::MAX_PENDING_RANGES;
+const size_t ReadAhead::INITIAL_WINDOW;
+
+ReadAhead::ReadAhead(void (*fetch)(const std::string &path, size_t first, size_t count)):
+  fetch(fetch), max_window(0), block_size(0), running(false) {
+}
+
+ReadAhead::~ReadAhead() {
+  this->stop();
+}
+
+void ReadAhead::start(const size_t max_window, const size_t block_size) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  if (this->running || max_window == 0 || block_size == 0) {
+    return;
+  }
+  this->max_window = max_window;
+  this->block_size = block_size;
+  this->running = true;
+  this->worker = std::thread(&ReadAhead::run, this);
+}
+
+void ReadAhead::stop() {
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (!this->running) {
+      return;
+    }
+    this->running = false;
+    this->ranges.clear();
+  }
+  this->pending.notify_all();
+  this->worker.join();
+}
+
+void ReadAhead::on_read(ReadAheadState* state,
+                        const std::string &path,
+                        const size_t offset,
+                        const size_t size,
+                        const size_t file_size) {
+  if (!this->running || size == 0) {
+    return;
+  }
+  size_t first = 0;
+  size_t last = 0;
+  std::lock_guard<std::mutex> guard(state->lock);
+  bool match = false;
+  if (state->started && offset > state->last_offset) {
+    size_t stride = offset - state->last_offset;
+    match = stride == state->last_size || stride == state->stride;
+    state->stride = stride;
+  }
+  state->started = true;
+  state->last_offset = offset;
+  state->last_size = size;
+  if (!match) {
+    state->window = 0;
+    state->scheduled = offset;
+    return;
+  }
+  size_t max_reads = std::max<size_t>(1, this->max_window / size);
+  state->window = state->window == 0 ? INITIAL_WINDOW : state->window * 2;
+  state->window = std::min(state->window, max_reads);
+  // Reads already scheduled are skipped, and adjacent ranges of blocks are fetched together
+  for (size_t k = 1; k <= state->window; k++) {
+    size_t next = offset + k * state->stride;
+    if (next >= file_size) {
+      break;
+    }
+    if (next <= state->scheduled) {
+      continue;
+    }
+    state->scheduled = next;
+    size_t next_first = next / this->block_size;
+    size_t next_last = (std::min(next + size, file_size) + this->block_size - 1) / this->block_size;
+    if (last > first && next_first <= last) {
+      last = std::max(last, next_last);
+      continue;
+    }
+    if (last > first) {
+      this->schedule(path, first, last - first);
+    }
+    first = next_first;
+    last = next_last;
+  }
+  if (last > first) {
+    this->schedule(path, first, last - first);
+  }
+}
+
+void ReadAhead::schedule(const std::string &path, const size_t first, const size_t count) {
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (!this->running || this->ranges.size() >= MAX_PENDING_RANGES) {
+      return;
+    }
+    this->ranges.push_back(Range{path, first, count});
+  }
+  this->pending.notify_one();
+}
+
+void ReadAhead::run() {
+  std::unique_lock<std::mutex> guard(this->lock);
+  while (true) {
+    this->pending.wait(guard, [this] { return !this->running || !this->ranges.empty(); });
+    if (!this->running) {
+      return;
+    }
+    Range range = this->ranges.front();
+    this->ranges.pop_front();
+    guard.unlock();
+    this->fetch(range.path, range.first, range.count);
+    guard.lock();
+  }
+}
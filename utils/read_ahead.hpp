@@ -0,0 +1,95 @@
+#ifndef __READ_AHEAD_HPP__
+#define __READ_AHEAD_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Access pattern of an open file, as observed by ReadAhead
+ */
+struct ReadAheadState {
+  std::mutex lock;
+  bool started = false;
+  size_t last_offset = 0;
+  size_t last_size = 0;
+  size_t stride = 0;
+  // Number of reads fetched ahead of the reader, 0 until a pattern is detected
+  size_t window = 0;
+  // Offset of the furthest read already scheduled
+  size_t scheduled = 0;
+};
+
+/**
+ * Fetches the blocks of a file that a reader is about to need on a background thread.
+ * Reads that follow each other, or that are separated by a constant stride, form a pattern. Every
+ * read matching the pattern doubles the number of reads fetched ahead, up to a maximum window, and
+ * a read breaking it stops the read-ahead until a new pattern emerges.
+ */
+class ReadAhead {
+  public:
+    /**
+     * Number of ranges waiting to be fetched beyond which new ones are dropped
+     */
+    static const size_t MAX_PENDING_RANGES = 64;
+    /**
+     * Number of reads fetched ahead as soon as a pattern is detected
+     */
+    static const size_t INITIAL_WINDOW = 2;
+
+    /**
+     * @param fetch Function loading a range of blocks of a file, called from the background thread
+     */
+    explicit ReadAhead(void (*fetch)(const std::string &path, size_t first, size_t count));
+    ~ReadAhead();
+
+    /**
+     * Starts the background thread
+     * @param max_window Maximum number of bytes fetched ahead of a reader
+     * @param block_size Size of the blocks the files are fetched in
+     */
+    void start(const size_t max_window, const size_t block_size);
+
+    /**
+     * Stops the background thread, dropping the ranges that were not fetched yet
+     */
+    void stop();
+
+    /**
+     * Records a read of an open file and schedules the blocks that the next reads of its pattern need
+     * @param file_size Size of the file, nothing is fetched past it
+     */
+    void on_read(ReadAheadState* state,
+                 const std::string &path,
+                 const size_t offset,
+                 const size_t size,
+                 const size_t file_size);
+
+  private:
+    /**
+     * A range of blocks of a file to fetch
+     */
+    struct Range {
+      std::string path;
+      size_t first;
+      size_t count;
+    };
+
+    void schedule(const std::string &path, const size_t first, const size_t count);
+    void run();
+
+    void (*fetch)(const std::string &path, size_t first, size_t count);
+    size_t max_window;
+    size_t block_size;
+    std::atomic<bool> running;
+    std::mutex lock;
+    std::condition_variable pending;
+    std::deque<Range> ranges;
+    std::thread worker;
+};
+
+#endif
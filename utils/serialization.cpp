@@ -1,14 +1,24 @@
 #include "serialization.hpp"
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
 
-#include <fstream>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <stdexcept>
 #include <vector>
@@ -17,11 +27,28 @@
 #include "fs.hpp"
 
 
+static int write_all(int descriptor, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = ::write(descriptor, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return -EIO;
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
 void dump(const char *data, const std::string &path, size_t bytes) {
-  std::ofstream stream;
-  stream.open(path, std::ios::out | std::ios::binary);
-  stream.write(data, bytes);
-  stream.close();
+  int descriptor = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (descriptor < 0) {
+    return;
+  }
+  write_all(descriptor, data, bytes);
+  ::close(descriptor);
 }
 
 static bool is_a_directory(const std::string &path) {
@@ -52,52 +79,210 @@ static void make_directory(const std::string &path) {
   make_parent_directory(new_path);
 }
 
-void dump_map(const std::map<std::string, std::vector < std::vector < char>*>*> *files, const std::string &directory_path) {
+static void remove_unpacked_files(const std::string &path, const bool root = true);
+
+int dump_map(const std::map<std::string, std::vector<std::pair<const char*, size_t>>>* files,
+             const std::string &directory_path, const bool direct) {
   if (!is_a_directory(directory_path)) {
     make_directory(directory_path);
   }
+  PackWriter pack(directory_path + "/" + PACK_NAME, direct);
   for (auto it = files->begin(); it != files->end(); it++) {
-    std::vector<std::vector<char>*>* blocks = it->second;
-    std::vector<char> buffer;
-    for (auto b = blocks->begin(); b != blocks->end(); b++) {
-      std::vector<char>* block = (*b);
-      buffer.insert(buffer.end(), block->begin(), block->end());
+    if (pack.add(it->first, it->second) < 0) {
+      return -EIO;
     }
-    const std::string dump_path = directory_path + "/" + it->first;
-    make_parent_directory(dump_path);
+  }
+  int ret = pack.close();
+  if (ret == 0) {
+    remove_unpacked_files(directory_path);
+  }
+  return ret;
+}
 
-    dump(buffer.data(), dump_path, buffer.size());
+/**
+ * Runs task for every index below count, in parallel on pool if given
+ */
+static void run_indexed(size_t count, const std::function<void(size_t)> &task, ThreadPool* pool) {
+  if (pool == NULL) {
+    for (size_t index = 0; index < count; index++) {
+      task(index);
+    }
+    return;
+  }
+  std::vector<std::function<void()>> tasks;
+  for (size_t index = 0; index < count; index++) {
+    tasks.push_back([&task, index] { task(index); });
   }
+  pool->run(tasks);
 }
 
-size_t restore(const std::string &path, char* buffer) {
-  std::ifstream stream;
-  stream.open(path, std::ios::binary);
-  stream.seekg(0, std::ios::end);
-  size_t size = stream.tellg();
-  stream.seekg(stream.beg);
-  if (buffer != NULL) {
-    delete[] buffer;
+/**
+ * Gives the buffer the file of an index is read into, given its size. It may be called again for a file
+ * whose first read failed, and then replaces the previous buffer.
+ */
+typedef std::function<char*(size_t index, size_t size)> Allocate;
+
+// Number of files opened, sized, read and closed together through an io_uring
+static const size_t READ_BATCH = 64;
+
+// Largest read of a single request, whose length io_uring takes on 32 bits
+static const size_t MAX_READ = 1 << 30;
+
+/**
+ * Submits the requests queued on ring and takes all of their completions
+ * @return 0 on success, a negative error code if the requests could not be submitted
+ */
+static int complete_all(IoRing &ring, const std::function<void(uint64_t tag, int result)> &completed) {
+  int ret = ring.submit(0);
+  while (ret == 0 && ring.get_in_flight() > 0) {
+    uint64_t tag;
+    int result;
+    if (ring.complete(&tag, &result)) {
+      completed(tag, result);
+    } else {
+      ret = ring.submit(1);
+    }
   }
-  buffer = new char[size];
-  stream.read(buffer, size);
-  stream.close();
-  return size;
+  return ret;
+}
+
+/**
+ * Reads count files from first through ring, each step of which is a single system call for the whole
+ * batch. The files read are marked in read.
+ * @return 0 on success, a negative error code if the ring failed
+ */
+static int read_batch(IoRing &ring, const std::vector<std::string> &paths, size_t first, size_t count,
+                      const Allocate &allocate, std::vector<char>* read) {
+  std::vector<int> descriptors(count, -1);
+  std::vector<struct statx> attributes(count);
+  std::vector<char> sized(count, false);
+  std::vector<char*> buffers(count, NULL);
+  std::vector<size_t> sizes(count, 0), done(count, 0);
+  for (size_t index = 0; index < count; index++) {
+    ring.prepare_openat(AT_FDCWD, paths[first + index].c_str(), O_RDONLY, 0, index);
+  }
+  int ret = complete_all(ring, [&descriptors](uint64_t tag, int result) { descriptors[tag] = result; });
+  for (size_t index = 0; ret == 0 && index < count; index++) {
+    if (descriptors[index] >= 0) {
+      ring.prepare_statx(descriptors[index], STATX_SIZE, &attributes[index], index);
+    }
+  }
+  if (ret == 0) {
+    ret = complete_all(ring, [&sized](uint64_t tag, int result) { sized[tag] = result == 0; });
+  }
+  for (size_t index = 0; index < count; index++) {
+    if (sized[index]) {
+      sizes[index] = attributes[index].stx_size;
+      buffers[index] = allocate(first + index, sizes[index]);
+    }
+  }
+  // Reads may be short, what is left of the files is then read by the next round
+  while (ret == 0) {
+    bool pending = false;
+    for (size_t index = 0; index < count; index++) {
+      if (sized[index] && done[index] < sizes[index]) {
+        ring.prepare_read(descriptors[index], buffers[index] + done[index],
+                          std::min(sizes[index] - done[index], MAX_READ), done[index], index);
+        pending = true;
+      }
+    }
+    if (!pending) {
+      break;
+    }
+    ret = complete_all(ring, [&sized, &done](uint64_t tag, int result) {
+      if (result > 0) {
+        done[tag] += result;
+      } else {
+        sized[tag] = false;
+      }
+    });
+  }
+  for (size_t index = 0; index < count; index++) {
+    (*read)[first + index] = sized[index] && done[index] == sizes[index];
+    if (descriptors[index] >= 0 && (ret < 0 || !ring.prepare_close(descriptors[index], index))) {
+      ::close(descriptors[index]);
+    }
+  }
+  return ret < 0 ? ret : complete_all(ring, [](uint64_t, int) {});
+}
+
+/**
+ * Reads a whole file with blocking calls
+ * @return Whether the file could be read
+ */
+static bool read_file(const std::string &path, size_t index, const Allocate &allocate) {
+  int descriptor = open(path.c_str(), O_RDONLY);
+  if (descriptor < 0) {
+    return false;
+  }
+  struct stat attributes;
+  bool ok = fstat(descriptor, &attributes) == 0;
+  size_t size = ok ? attributes.st_size : 0;
+  char* buffer = ok ? allocate(index, size) : NULL;
+  for (size_t done = 0; ok && done < size;) {
+    ssize_t result = pread(descriptor, buffer + done, size - done, done);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    ok = result > 0;
+    done += ok ? result : 0;
+  }
+  ::close(descriptor);
+  return ok;
+}
+
+/**
+ * Reads whole files, through batches of io_uring requests when the kernel supports them. The files the ring
+ * could not read are read with blocking calls, in parallel on pool if given.
+ * @return Whether each file could be read
+ */
+static std::vector<char> read_files(const std::vector<std::string> &paths, const Allocate &allocate,
+                                    ThreadPool* pool) {
+  // Flags are chars rather than bools, so that the threads of pool can set them concurrently
+  std::vector<char> read(paths.size(), false);
+  IoRing ring(READ_BATCH);
+  if (ring.is_available() && ring.supports({IoRing::OPENAT, IoRing::STATX, IoRing::READ, IoRing::CLOSE})) {
+    for (size_t first = 0; first < paths.size(); first += READ_BATCH) {
+      if (read_batch(ring, paths, first, std::min(READ_BATCH, paths.size() - first), allocate, &read) < 0) {
+        break;
+      }
+    }
+  }
+  std::vector<size_t> remaining;
+  for (size_t index = 0; index < paths.size(); index++) {
+    if (!read[index]) {
+      remaining.push_back(index);
+    }
+  }
+  run_indexed(remaining.size(), [&paths, &allocate, &read, &remaining](size_t index) {
+    read[remaining[index]] = read_file(paths[remaining[index]], remaining[index], allocate);
+  }, pool);
+  return read;
+}
+
+/**
+ * @return Whether an entry at the root of a dump is its pack, or a pack left by an interrupted dump
+ */
+static bool is_pack(const std::string &entry_name) {
+  return entry_name.compare(0, strlen(PACK_NAME), PACK_NAME) == 0;
 }
 
 // TODO(dburihabwa) Return a vector rather than a pointer
-static vector<string>* list_files(const std::string &path) {
+static vector<string>* list_files(const std::string &path, const bool root = true) {
   std::vector<string>* files = new std::vector<string>();
   DIR* directory = opendir(path.c_str());
+  if (directory == NULL) {
+    return files;
+  }
   struct dirent* entry;
   while ((entry = readdir(directory)) != NULL) {
     string entry_name(entry->d_name);
-    if (entry_name.compare(".") == 0 || entry_name.compare("..") == 0) {
+    if (entry_name.compare(".") == 0 || entry_name.compare("..") == 0 || (root && is_pack(entry_name))) {
       continue;
     }
     if (entry->d_type == DT_DIR) {
       std::string directory_name = path + "/" + entry_name;
-      std::vector<string>* files_in_dir = list_files(directory_name);
+      std::vector<string>* files_in_dir = list_files(directory_name, false);
       files->insert(files->end(), files_in_dir->begin(), files_in_dir->end());
       delete files_in_dir;
     } else {
@@ -105,42 +290,465 @@ static vector<string>* list_files(const std::string &path) {
       files->push_back(filename);
     }
   }
+  closedir(directory);
   return files;
 }
 
-std::map<std::string, vector<vector<char>*>*>* restore_map(const std::string &path) {
+/**
+ * Deletes the files of a dump from before packs, along with their directories, once the pack holding
+ * them is in place
+ */
+static void remove_unpacked_files(const std::string &path, const bool root) {
+  DIR* directory = opendir(path.c_str());
+  if (directory == NULL) {
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    string entry_name(entry->d_name);
+    if (entry_name.compare(".") == 0 || entry_name.compare("..") == 0 || (root && is_pack(entry_name))) {
+      continue;
+    }
+    std::string entry_path = path + "/" + entry_name;
+    if (entry->d_type == DT_DIR) {
+      remove_unpacked_files(entry_path, false);
+      rmdir(entry_path.c_str());
+    } else {
+      unlink(entry_path.c_str());
+    }
+  }
+  closedir(directory);
+}
+
+std::map<std::string, vector<char>*>* restore_map(const std::string &path, ThreadPool* pool) {
   if (!is_a_directory(path)) {
     make_directory(path);
   }
-  const size_t BLOCK_SIZE = 4096;
-  auto files = new std::map<std::string, vector<vector<char>*>*>();
   auto filenames = list_files(path);
-  for (auto it = filenames->begin(); it != filenames->end(); it++) {
-    string filename = (*it);
-    std::ifstream stream;
-    stream.open(filename, std::ios::binary);
-    stream.seekg(0, std::ios::end);
-    size_t restored = stream.tellg();
-    stream.seekg(stream.beg);
-    char* buffer = new char[restored];
-    stream.read(buffer, restored);
-    stream.close();
-    auto blocks = new vector<vector<char>*>();
-    for (size_t offset = 0; offset < restored; offset += BLOCK_SIZE) {
-      size_t bytes_to_copy = restored - offset;
-      if (bytes_to_copy > BLOCK_SIZE) {
-        bytes_to_copy = BLOCK_SIZE;
-      }
-      auto block = new std::vector<char>(buffer + offset, buffer + offset + bytes_to_copy);
-      blocks->push_back(block);
+  vector<vector<char>*> contents(filenames->size(), NULL);
+  auto read = read_files(*filenames, [&contents](size_t index, size_t size) {
+    delete contents[index];
+    contents[index] = new vector<char>(size);
+    return contents[index]->data();
+  }, pool);
+  auto files = new std::map<std::string, vector<char>*>();
+  for (size_t index = 0; index < filenames->size(); index++) {
+    if (!read[index]) {
+      delete contents[index];
+      continue;
     }
-    delete [] buffer;
-    filename = clean_path(filename.substr(path.length(), string::npos));
-    (*files)[filename] = blocks;
+    (*files)[clean_path(filenames->at(index).substr(path.length(), string::npos))] = contents[index];
   }
+  delete filenames;
   return files;
 }
 
+const char* const PACK_NAME = ".pack";
+
+const size_t PackWriter::BUFFER_SIZE;
+
+/**
+ * Footer ending a pack, preceded by the index
+ */
+struct pack_footer_t {
+  char magic[8];
+  uint64_t index_size;
+};
+
+static const char PACK_MAGIC[8] = {'F', 'G', 'X', 'P', 'A', 'C', 'K', '1'};
+
+// Files start at multiples of PACK_ALIGNMENT, so that the headers they begin with can be used in place
+static const size_t PACK_ALIGNMENT = 8;
+
+// An entry of the index: the offset and size of a file, then the length of its name and the name itself
+static const size_t INDEX_ENTRY_SIZE = 2 * sizeof(uint64_t) + sizeof(uint32_t);
+
+// O_DIRECT writes must be aligned on the logical block size of the device, which is at most 4 KiB
+static const size_t DIRECT_ALIGNMENT = 4096;
+
+PackWriter::PackWriter(const std::string &path, const bool direct): path(path), direct(false), ring(2),
+    asynchronous(false), fixed(false), current(0), filled(0), written(0), offset(0), start_offset(0), error(0) {
+  std::string pending = path + ".tmp";
+  this->descriptor = -1;
+  if (direct) {
+    this->descriptor = open(pending.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0600);
+    this->direct = this->descriptor >= 0;
+  }
+  // File systems such as tmpfs reject O_DIRECT, the pack then goes through the page cache
+  if (this->descriptor < 0) {
+    this->descriptor = open(pending.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  }
+  if (this->descriptor < 0) {
+    this->error = -errno;
+  }
+  for (size_t index = 0; index < 2; index++) {
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, DIRECT_ALIGNMENT, BUFFER_SIZE) != 0) {
+      buffer = NULL;
+      this->error = -ENOMEM;
+    }
+    this->buffers[index] = static_cast<char*>(buffer);
+    this->vectors[index].iov_base = buffer;
+    this->vectors[index].iov_len = BUFFER_SIZE;
+    this->writing[index] = false;
+    this->write_offsets[index] = 0;
+  }
+  if (this->error == 0 && this->ring.is_available() && this->ring.supports({IoRing::WRITEV})) {
+    this->asynchronous = true;
+    std::vector<struct iovec> vectors(this->vectors, this->vectors + 2);
+    this->fixed = this->ring.supports({IoRing::WRITE_FIXED}) && this->ring.register_buffers(vectors) == 0;
+  }
+}
+
+PackWriter::~PackWriter() {
+  this->wait(0);
+  this->wait(1);
+  if (this->descriptor >= 0) {
+    ::close(this->descriptor);
+    unlink((this->path + ".tmp").c_str());
+  }
+  free(this->buffers[0]);
+  free(this->buffers[1]);
+}
+
+/**
+ * Queues the write of what is left of a buffer, at the offset of the pack it goes to
+ * @return false if the write could not be submitted
+ */
+bool PackWriter::submit(const size_t buffer) {
+  struct iovec* vector = &this->vectors[buffer];
+  bool queued = this->fixed ?
+                this->ring.prepare_write_fixed(this->descriptor, static_cast<char*>(vector->iov_base),
+                                               vector->iov_len, this->write_offsets[buffer], buffer, buffer) :
+                this->ring.prepare_writev(this->descriptor, vector, this->write_offsets[buffer], buffer);
+  return queued && this->ring.submit(0) == 0;
+}
+
+/**
+ * Waits for the write of a buffer to complete
+ */
+void PackWriter::wait(const size_t buffer) {
+  while (this->writing[buffer]) {
+    uint64_t tag;
+    int result;
+    if (!this->ring.complete(&tag, &result)) {
+      if (this->ring.submit(1) < 0) {
+        this->error = -EIO;
+        this->writing[0] = this->writing[1] = false;
+      }
+      continue;
+    }
+    this->writing[tag] = false;
+    if (result > 0 && (size_t) result < this->vectors[tag].iov_len) {
+      // A short write is resumed from the first byte left
+      this->vectors[tag].iov_base = static_cast<char*>(this->vectors[tag].iov_base) + result;
+      this->vectors[tag].iov_len -= result;
+      this->write_offsets[tag] += result;
+      this->writing[tag] = this->submit(tag);
+      if (!this->writing[tag]) {
+        this->error = -EIO;
+      }
+    } else if (result < 0 || (size_t) result != this->vectors[tag].iov_len) {
+      this->error = -EIO;
+    }
+  }
+}
+
+int PackWriter::flush() {
+  if (this->error < 0 || this->filled == 0) {
+    this->filled = 0;
+    return this->error;
+  }
+  if (this->direct && this->filled % DIRECT_ALIGNMENT != 0) {
+    // Only the end of the pack is unaligned, and is written without O_DIRECT once the rest is written
+    this->wait(1 - this->current);
+    int flags = fcntl(this->descriptor, F_GETFL);
+    if (flags < 0 || fcntl(this->descriptor, F_SETFL, flags & ~O_DIRECT) < 0) {
+      this->error = -EIO;
+      return this->error;
+    }
+    this->direct = false;
+  }
+  if (this->asynchronous) {
+    this->vectors[this->current].iov_base = this->buffers[this->current];
+    this->vectors[this->current].iov_len = this->filled;
+    this->write_offsets[this->current] = this->written;
+    if (!this->submit(this->current)) {
+      this->error = -EIO;
+    } else {
+      this->writing[this->current] = true;
+    }
+    // The next buffer fills while this one is written, once the write it was handed to completed
+    this->current = 1 - this->current;
+    this->wait(this->current);
+  } else if (write_all(this->descriptor, this->buffers[this->current], this->filled) < 0) {
+    this->error = -EIO;
+  }
+  this->written += this->filled;
+  this->filled = 0;
+  return this->error;
+}
+
+int PackWriter::write(const char* data, size_t size) {
+  this->offset += size;
+  while (size > 0 && this->error == 0) {
+    size_t length = std::min(size, BUFFER_SIZE - this->filled);
+    memcpy(this->buffers[this->current] + this->filled, data, length);
+    this->filled += length;
+    data += length;
+    size -= length;
+    if (this->filled == BUFFER_SIZE) {
+      this->flush();
+    }
+  }
+  return this->error;
+}
+
+int PackWriter::start(const std::string &name) {
+  static const char padding[PACK_ALIGNMENT] = {0};
+  this->write(padding, (PACK_ALIGNMENT - this->offset % PACK_ALIGNMENT) % PACK_ALIGNMENT);
+  this->name = name;
+  this->start_offset = this->offset;
+  return this->error < 0 ? -EIO : 0;
+}
+
+int PackWriter::append(const char* data, size_t size) {
+  return this->write(data, size) < 0 ? -EIO : 0;
+}
+
+int PackWriter::finish() {
+  uint64_t size = this->offset - this->start_offset;
+  uint32_t name_length = this->name.size();
+  size_t position = this->index.size();
+  this->index.resize(position + INDEX_ENTRY_SIZE + name_length);
+  char* entry = this->index.data() + position;
+  memcpy(entry, &this->start_offset, sizeof(this->start_offset));
+  memcpy(entry + sizeof(this->start_offset), &size, sizeof(size));
+  memcpy(entry + 2 * sizeof(uint64_t), &name_length, sizeof(name_length));
+  memcpy(entry + INDEX_ENTRY_SIZE, this->name.data(), name_length);
+  return this->error < 0 ? -EIO : 0;
+}
+
+int PackWriter::add(const std::string &name, const std::vector<std::pair<const char*, size_t>> &segments) {
+  this->start(name);
+  for (auto segment = segments.begin(); segment != segments.end(); segment++) {
+    this->append(segment->first, segment->second);
+  }
+  return this->finish();
+}
+
+/**
+ * A file of add_parallel: the content produced ahead of the writes, queued until the writer reaches it
+ */
+struct QueuedFile {
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<std::vector<char>> chunks;
+  size_t queued;
+  // Whether a producer took the file, the writer producing it itself if none did
+  std::atomic<bool> claimed;
+  bool done;
+  int result;
+};
+
+int PackWriter::add_parallel(const std::vector<std::string> &names, const PackProducer &produce, ThreadPool &pool) {
+  if (pool.get_parallelism() == 1) {
+    PackAppend append = [this](const char* data, size_t size) { return this->append(data, size); };
+    for (auto name = names.begin(); name != names.end(); name++) {
+      this->start(*name);
+      if (produce(*name, &append) < 0) {
+        this->error = -EIO;
+      }
+      this->finish();
+    }
+    return this->error < 0 ? -EIO : 0;
+  }
+  std::vector<std::unique_ptr<QueuedFile>> files;
+  for (size_t index = 0; index < names.size(); index++) {
+    files.emplace_back(new QueuedFile());
+    files.back()->queued = 0;
+    files.back()->claimed = false;
+    files.back()->done = false;
+    files.back()->result = 0;
+  }
+  std::vector<std::function<void()>> tasks;
+  // The writer drains the files in order. It never waits for a file no producer took, which it produces
+  // itself, so it makes progress whatever the number of threads running the tasks.
+  tasks.push_back([this, &names, &produce, &files] {
+    PackAppend append = [this](const char* data, size_t size) { return this->append(data, size); };
+    for (size_t index = 0; index < names.size(); index++) {
+      QueuedFile &file = *files[index];
+      this->start(names[index]);
+      if (!file.claimed.exchange(true)) {
+        file.result = produce(names[index], &append);
+      } else {
+        std::unique_lock<std::mutex> guard(file.lock);
+        while (true) {
+          file.changed.wait(guard, [&file] { return file.done || !file.chunks.empty(); });
+          if (file.chunks.empty()) {
+            break;
+          }
+          std::vector<char> chunk;
+          chunk.swap(file.chunks.front());
+          file.chunks.pop_front();
+          guard.unlock();
+          this->append(chunk.data(), chunk.size());
+          guard.lock();
+          file.queued -= chunk.size();
+          file.changed.notify_all();
+        }
+      }
+      if (file.result < 0) {
+        this->error = -EIO;
+      }
+      this->finish();
+    }
+  });
+  for (size_t index = 0; index < names.size(); index++) {
+    tasks.push_back([&names, &produce, &files, index] {
+      QueuedFile &file = *files[index];
+      if (file.claimed.exchange(true)) {
+        return;
+      }
+      PackAppend append = [&file](const char* data, size_t size) {
+        std::unique_lock<std::mutex> guard(file.lock);
+        file.changed.wait(guard, [&file, size] { return file.queued == 0 || file.queued + size <= BUFFER_SIZE; });
+        file.chunks.emplace_back(data, data + size);
+        file.queued += size;
+        file.changed.notify_all();
+        return 0;
+      };
+      int result = produce(names[index], &append);
+      std::lock_guard<std::mutex> guard(file.lock);
+      file.result = result;
+      file.done = true;
+      file.changed.notify_all();
+    });
+  }
+  pool.run(tasks);
+  return this->error < 0 ? -EIO : 0;
+}
+
+/**
+ * Appends data to the file being added to a pack, for the enclave to stream the files it seals
+ * @param append PackAppend of the file
+ */
+extern "C" int ocall_pack_append(void* append, const uint8_t* data, size_t size) {
+  return (*static_cast<PackAppend*>(append))(reinterpret_cast<const char*>(data), size);
+}
+
+int PackWriter::close(const IndexCipher &seal) {
+  if (this->descriptor < 0) {
+    return this->error;
+  }
+  std::vector<char> sealed;
+  const std::vector<char>* index = &this->index;
+  if (seal && !this->index.empty()) {
+    if (seal(this->index, &sealed) < 0) {
+      this->error = -EIO;
+    }
+    index = &sealed;
+  }
+  pack_footer_t footer;
+  memcpy(footer.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+  footer.index_size = index->size();
+  this->write(index->data(), index->size());
+  this->write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+  this->flush();
+  this->wait(0);
+  this->wait(1);
+  if (this->error == 0 && fdatasync(this->descriptor) < 0) {
+    this->error = -EIO;
+  }
+  ::close(this->descriptor);
+  this->descriptor = -1;
+  std::string pending = this->path + ".tmp";
+  if (this->error == 0 && rename(pending.c_str(), this->path.c_str()) < 0) {
+    this->error = -errno;
+  }
+  if (this->error < 0) {
+    unlink(pending.c_str());
+  }
+  return this->error;
+}
+
+Pack::Pack(): data(NULL), size(0) {
+}
+
+Pack::~Pack() {
+  this->close();
+}
+
+int Pack::open(const std::string &path, const IndexCipher &unseal) {
+  this->close();
+  int descriptor = ::open(path.c_str(), O_RDONLY);
+  if (descriptor < 0) {
+    return errno == ENOENT ? -ENOENT : -EIO;
+  }
+  struct stat attributes;
+  if (fstat(descriptor, &attributes) < 0 || (size_t) attributes.st_size < sizeof(pack_footer_t)) {
+    ::close(descriptor);
+    return -EINVAL;
+  }
+  void* mapping = mmap(NULL, attributes.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  ::close(descriptor);
+  if (mapping == MAP_FAILED) {
+    return -EIO;
+  }
+  this->data = static_cast<char*>(mapping);
+  this->size = attributes.st_size;
+  pack_footer_t footer;
+  memcpy(&footer, this->data + this->size - sizeof(footer), sizeof(footer));
+  if (memcmp(footer.magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 ||
+      footer.index_size > this->size - sizeof(footer)) {
+    this->close();
+    return -EINVAL;
+  }
+  size_t end = this->size - sizeof(footer) - footer.index_size;
+  std::vector<char> index(this->data + end, this->data + end + footer.index_size);
+  if (unseal && !index.empty()) {
+    std::vector<char> unsealed;
+    if (unseal(index, &unsealed) < 0) {
+      this->close();
+      return -EINVAL;
+    }
+    index.swap(unsealed);
+  }
+  for (size_t position = 0; position < index.size();) {
+    uint64_t offset, file_size;
+    uint32_t name_length;
+    if (index.size() - position < INDEX_ENTRY_SIZE) {
+      this->close();
+      return -EINVAL;
+    }
+    memcpy(&offset, index.data() + position, sizeof(offset));
+    memcpy(&file_size, index.data() + position + sizeof(offset), sizeof(file_size));
+    memcpy(&name_length, index.data() + position + 2 * sizeof(uint64_t), sizeof(name_length));
+    position += INDEX_ENTRY_SIZE;
+    if (index.size() - position < name_length || offset > end || file_size > end - offset) {
+      this->close();
+      return -EINVAL;
+    }
+    std::string name(index.data() + position, name_length);
+    position += name_length;
+    this->files[name] = std::make_pair(this->data + offset, file_size);
+  }
+  return 0;
+}
+
+void Pack::close() {
+  if (this->data != NULL) {
+    munmap(this->data, this->size);
+  }
+  this->data = NULL;
+  this->size = 0;
+  this->files.clear();
+}
+
+const std::map<std::string, std::pair<const char*, size_t>> &Pack::get_files() const {
+  return this->files;
+}
+
 void dump_sgx_map(const std::map<std::string, std::vector<sgx_sealed_data_t*>*> &files,
                   const std::string &directory_path) {
   if (!is_a_directory(directory_path)) {
@@ -166,29 +774,33 @@ std::map<std::string, std::vector<sgx_sealed_data_t*>*>* restore_sgx_map(const s
     make_directory(path);
   }
   auto files_on_disk = list_files(path);
+  vector<vector<char>> contents(files_on_disk->size());
+  auto read = read_files(*files_on_disk, [&contents](size_t index, size_t size) {
+    contents[index].resize(size);
+    return contents[index].data();
+  }, NULL);
   auto files = new std::map<std::string, std::vector<sgx_sealed_data_t*>*>();
-  for (auto it = files_on_disk->begin(); it != files_on_disk->end(); it++) {
-    string filename = (*it);
+  for (size_t index = 0; index < files_on_disk->size(); index++) {
+    if (!read[index]) {
+      continue;
+    }
+    string filename = files_on_disk->at(index);
     auto sealed_blocks = new vector<sgx_sealed_data_t*>();
-    std::ifstream stream;
-    stream.open(filename, std::ios::binary);
-    stream.seekg(0, std::ios::end);
-    size_t restored = stream.tellg();
-    stream.seekg(stream.beg);
-    char* file = new char[restored];
-    stream.read(file, restored);
-    stream.close();
-    auto default_block_size = sizeof(sgx_sealed_data_t) + 4096;
-    for (size_t i = 0; i < restored; i += default_block_size) {
-      auto block_size = default_block_size;
-      if ((i + default_block_size) > restored) {
-        block_size = restored - i;
+    const char* file = contents[index].data();
+    size_t restored = contents[index].size();
+    // Blocks are walked by the payload size in their header since the sealing unit may have changed
+    size_t block_size;
+    for (size_t i = 0; restored - i >= sizeof(sgx_sealed_data_t); i += block_size) {
+      auto header = reinterpret_cast<const sgx_sealed_data_t*>(file + i);
+      block_size = sizeof(sgx_sealed_data_t) + header->aes_data.payload_size;
+      if (block_size > restored - i) {
+        break;
       }
       sgx_sealed_data_t* block = reinterpret_cast<sgx_sealed_data_t*>(malloc(block_size));
       memcpy(block, file + i, block_size);
       sealed_blocks->push_back(block);
     }
-    delete [] file;
+    vector<char>().swap(contents[index]);
     filename = clean_path(filename.substr(path.length(), string::npos));
     (*files)[filename] = sealed_blocks;
   }
@@ -196,24 +808,24 @@ std::map<std::string, std::vector<sgx_sealed_data_t*>*>* restore_sgx_map(const s
   return files;
 }
 
-std::map<std::string, sgx_sealed_data_t*>* restore_sgxfs_from_disk(const std::string &path) {
+std::map<std::string, sgx_sealed_data_t*>* restore_sgxfs_from_disk(const std::string &path, ThreadPool* pool) {
   if (!is_a_directory(path)) {
     make_directory(path);
   }
   auto files_on_disk = list_files(path);
+  vector<sgx_sealed_data_t*> contents(files_on_disk->size(), NULL);
+  auto read = read_files(*files_on_disk, [&contents](size_t index, size_t size) {
+    free(contents[index]);
+    contents[index] = reinterpret_cast<sgx_sealed_data_t*>(malloc(size));
+    return reinterpret_cast<char*>(contents[index]);
+  }, pool);
   auto files = new std::map<std::string, sgx_sealed_data_t*>();
-  for (auto it = files_on_disk->begin(); it != files_on_disk->end(); it++) {
-    string filename = (*it);
-    std::ifstream stream;
-    stream.open(filename, std::ios::binary);
-    stream.seekg(0, std::ios::end);
-    size_t restored = stream.tellg();
-    stream.seekg(stream.beg);
-    sgx_sealed_data_t* data = reinterpret_cast<sgx_sealed_data_t*>(malloc(restored));
-    stream.read(reinterpret_cast<char*>(data), restored);
-    stream.close();
-    filename = clean_path(filename.substr(path.length(), string::npos));
-    (*files)[filename] = data;
+  for (size_t index = 0; index < files_on_disk->size(); index++) {
+    if (!read[index]) {
+      free(contents[index]);
+      continue;
+    }
+    (*files)[clean_path(files_on_disk->at(index).substr(path.length(), string::npos))] = contents[index];
   }
   delete files_on_disk;
   return files;
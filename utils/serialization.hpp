@@ -1,15 +1,164 @@
 #ifndef __SERIALIZATION_H__
+#include <cstdint>
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
 
 #include "sgx_tseal.h"
+#include "io_ring.hpp"
+#include "thread_pool.hpp"
 
 void dump(const char*, const std::string &path, const size_t bytes);
-void dump_map(const std::map<std::string, std::vector<std::vector<char>*>*>* files,
-              const std::string &directory_path);
-size_t restore(const std::string &path, char *buffer);
-std::map<std::string, std::vector<std::vector< char>*>*>* restore_map(const std::string &path);
+/**
+ * Dumps files, given as the (pointer, length) segments of their content, to the pack of a directory
+ * Files dumped one per host file before packs are deleted once the pack is in place
+ * @param files Files to dump
+ * @param directory_path Path to the directory where the files are to be dumped
+ * @param direct Whether to write the pack with O_DIRECT
+ * @return 0 on success, a negative error code otherwise
+ */
+int dump_map(const std::map<std::string, std::vector<std::pair<const char*, size_t>>>* files,
+             const std::string &directory_path, const bool direct = false);
+/**
+ * Restores files dumped one per host file, before packs
+ * @param path Path to the directory where the files were dumped
+ * @param pool Pool reading the files in parallel, if given
+ * @return The content of every file
+ */
+std::map<std::string, std::vector<char>*>* restore_map(const std::string &path, ThreadPool* pool = NULL);
+
+/**
+ * Name of the pack within the directory of a dump
+ */
+extern const char* const PACK_NAME;
+
+/**
+ * Seals the index of a pack into output, or unseals it
+ * @return 0 on success, a negative error code otherwise
+ */
+typedef std::function<int(const std::vector<char> &input, std::vector<char>* output)> IndexCipher;
+
+/**
+ * Appends data to the file being added to a pack
+ * @return 0 on success, -EIO if the data could not be written
+ */
+typedef std::function<int(const char* data, size_t size)> PackAppend;
+
+/**
+ * Produces the content of a file added to a pack through append, which the enclave may be handed
+ * @return 0 on success, a negative error code otherwise
+ */
+typedef std::function<int(const std::string &name, PackAppend* append)> PackProducer;
+
+/**
+ * Writes the files of a dump back to back into a single pack, followed by their index and a footer giving
+ * the size of the index. The pack is written to a temporary file with large sequential writes, and only
+ * replaces the previous one once it is complete and synced.
+ * Writes are double buffered through an io_uring when the kernel supports it, so that a buffer fills while
+ * the previous one is written, and are blocking otherwise.
+ */
+class PackWriter {
+  public:
+    /**
+     * Size of the writes the files are buffered into
+     */
+    static const size_t BUFFER_SIZE = 4 << 20;
+
+    /**
+     * @param direct Whether to write the pack with O_DIRECT, bypassing the page cache, if the file system
+     *               supports it
+     */
+    explicit PackWriter(const std::string &path, const bool direct = false);
+    ~PackWriter();
+
+    /**
+     * Appends a file given as the segments of its content
+     * @return 0 on success, -EIO if the pack could not be written
+     */
+    int add(const std::string &name, const std::vector<std::pair<const char*, size_t>> &segments);
+
+    /**
+     * Starts a file whose content is appended piece by piece, up to finish
+     * @return 0 on success, -EIO if the pack could not be written
+     */
+    int start(const std::string &name);
+    int append(const char* data, size_t size);
+    int finish();
+
+    /**
+     * Appends files in order while their content is produced in parallel on pool. The content produced
+     * ahead of the writes is queued, up to BUFFER_SIZE bytes per file.
+     * @return 0 on success, -EIO if a file could not be produced or written
+     */
+    int add_parallel(const std::vector<std::string> &names, const PackProducer &produce, ThreadPool &pool);
+
+    /**
+     * Appends the index, sealed by seal if given, then syncs the pack and moves it in place
+     * @return 0 on success, a negative error code otherwise
+     */
+    int close(const IndexCipher &seal = IndexCipher());
+
+  private:
+    int write(const char* data, size_t size);
+    int flush();
+    bool submit(const size_t buffer);
+    void wait(const size_t buffer);
+
+    std::string path;
+    int descriptor;
+    bool direct;
+    IoRing ring;
+    bool asynchronous;
+    // Whether the buffers are registered with the ring
+    bool fixed;
+    // The buffer being filled is current, the other one may be being written
+    char* buffers[2];
+    // Part of each buffer left to write, and the offset in the pack it goes to
+    struct iovec vectors[2];
+    uint64_t write_offsets[2];
+    bool writing[2];
+    size_t current;
+    size_t filled;
+    uint64_t written;
+    std::vector<char> index;
+    uint64_t offset;
+    // Name and offset of the file started last
+    std::string name;
+    uint64_t start_offset;
+    int error;
+};
+
+/**
+ * A pack mapped in memory
+ */
+class Pack {
+  public:
+    Pack();
+    ~Pack();
+
+    /**
+     * Maps the pack at path and reads its index, unsealed by unseal if given
+     * @return 0 on success, -ENOENT if there is no pack at path, -EINVAL if the pack is torn or its index
+     *         cannot be unsealed
+     */
+    int open(const std::string &path, const IndexCipher &unseal = IndexCipher());
+
+    /**
+     * Unmaps the pack, the content of its files becomes invalid
+     */
+    void close();
+
+    /**
+     * @return The content of every file of the pack, by name
+     */
+    const std::map<std::string, std::pair<const char*, size_t>> &get_files() const;
+
+  private:
+    char* data;
+    size_t size;
+    std::map<std::string, std::pair<const char*, size_t>> files;
+};
 
 // SGX related functions
 /**
@@ -29,9 +178,10 @@ std::map<std::string, std::vector<sgx_sealed_data_t*>*>* restore_sgx_map(const s
 /**
  * Restores files for an sgxfs instance
  * @param path Path to the directory to explore to recover the data
+ * @param pool Pool reading the files in parallel, if given
  * @return The recovered sealed files
  */
-std::map<std::string, sgx_sealed_data_t*>* restore_sgxfs_from_disk(const std::string &path);
+std::map<std::string, sgx_sealed_data_t*>* restore_sgxfs_from_disk(const std::string &path, ThreadPool* pool = NULL);
 
 #define __SERIALIZATION_H__
 #endif /* __SERIALIZATION_H__*/
@@ -0,0 +1,103 @@
+#include "switchless.hpp"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <functional>
+#include <new>
+
+const size_t SwitchlessClient::FALLBACK_SPINS;
+
+/**
+ * Time spent outside of the enclave by a worker that found the ring empty for a while, in microseconds
+ */
+static const useconds_t IDLE_SLEEP = 100;
+
+extern "C" void ocall_switchless_idle() {
+  usleep(IDLE_SLEEP);
+}
+
+SwitchlessClient::SwitchlessClient(void (*worker)(SwitchlessRing*)): worker(worker) {
+  void* memory = NULL;
+  if (posix_memalign(&memory, alignof(SwitchlessRing), sizeof(SwitchlessRing)) != 0) {
+    throw std::bad_alloc();
+  }
+  this->ring = new (memory) SwitchlessRing();
+  this->ring->running = false;
+  this->ring->pending = 0;
+  for (size_t i = 0; i < SWITCHLESS_RING_SIZE; i++) {
+    this->ring->requests[i].state = SWITCHLESS_FREE;
+  }
+  this->workers = new std::vector<std::thread>();
+}
+
+SwitchlessClient::~SwitchlessClient() {
+  this->stop();
+  delete this->workers;
+  this->ring->~SwitchlessRing();
+  free(this->ring);
+}
+
+void SwitchlessClient::start(const size_t number_of_workers) {
+  if (this->is_running() || number_of_workers == 0) {
+    return;
+  }
+  this->ring->running.store(true, std::memory_order_release);
+  for (size_t i = 0; i < number_of_workers; i++) {
+    this->workers->push_back(std::thread(this->worker, this->ring));
+  }
+}
+
+void SwitchlessClient::stop() {
+  this->ring->running.store(false, std::memory_order_release);
+  for (auto it = this->workers->begin(); it != this->workers->end(); it++) {
+    it->join();
+  }
+  this->workers->clear();
+}
+
+bool SwitchlessClient::is_running() const {
+  return !this->workers->empty() && this->ring->running.load(std::memory_order_acquire);
+}
+
+bool SwitchlessClient::call(const SwitchlessArguments &arguments, int64_t *result) {
+  if (!this->is_running()) {
+    return false;
+  }
+  size_t first = std::hash<std::thread::id>()(std::this_thread::get_id()) % SWITCHLESS_RING_SIZE;
+  SwitchlessRequest* request = NULL;
+  for (size_t i = 0; i < SWITCHLESS_RING_SIZE && request == NULL; i++) {
+    SwitchlessRequest* candidate = &this->ring->requests[(first + i) % SWITCHLESS_RING_SIZE];
+    uint32_t expected = SWITCHLESS_FREE;
+    if (candidate->state.compare_exchange_strong(expected, SWITCHLESS_CLAIMED, std::memory_order_acquire)) {
+      request = candidate;
+    }
+  }
+  if (request == NULL) {
+    return false;
+  }
+  request->arguments = arguments;
+  this->ring->pending.fetch_add(1, std::memory_order_relaxed);
+  request->state.store(SWITCHLESS_PENDING, std::memory_order_release);
+
+  for (size_t spins = 0; request->state.load(std::memory_order_acquire) == SWITCHLESS_PENDING; spins++) {
+    if (spins < FALLBACK_SPINS) {
+      __builtin_ia32_pause();
+      continue;
+    }
+    // No worker picked the request up, take it back unless one just did
+    uint32_t expected = SWITCHLESS_PENDING;
+    if (request->state.compare_exchange_strong(expected, SWITCHLESS_CLAIMED, std::memory_order_acquire)) {
+      this->ring->pending.fetch_sub(1, std::memory_order_relaxed);
+      request->state.store(SWITCHLESS_FREE, std::memory_order_release);
+      return false;
+    }
+  }
+  while (request->state.load(std::memory_order_acquire) != SWITCHLESS_DONE) {
+    sched_yield();
+  }
+  *result = request->result;
+  request->state.store(SWITCHLESS_FREE, std::memory_order_release);
+  return true;
+}
@@ -0,0 +1,126 @@
+#ifndef __SWITCHLESS_HPP__
+#define __SWITCHLESS_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Calls that can be served by the enclave workers without an enclave transition
+ */
+enum SwitchlessCall {
+  SWITCHLESS_STAT,
+  SWITCHLESS_FSTAT,
+  SWITCHLESS_GET_INODE,
+  SWITCHLESS_PUT_INODE,
+  SWITCHLESS_SEAL_BLOCKS,
+  SWITCHLESS_CACHE_READ,
+  SWITCHLESS_CACHE_WRITE
+};
+
+/**
+ * States of a slot of the ring.
+ * A caller claims a FREE slot, fills it and marks it PENDING. A worker moves it to RUNNING, executes
+ * the call and marks it DONE. The caller then reads the result and frees the slot.
+ */
+enum SwitchlessState {
+  SWITCHLESS_FREE,
+  SWITCHLESS_CLAIMED,
+  SWITCHLESS_PENDING,
+  SWITCHLESS_RUNNING,
+  SWITCHLESS_DONE
+};
+
+static const size_t SWITCHLESS_RING_SIZE = 64;
+static const size_t SWITCHLESS_ARGUMENTS = 5;
+static const size_t SWITCHLESS_INPUTS = 5;
+
+/**
+ * The arguments of a call.
+ * Inputs are copied into the enclave before the call is executed and the output is copied back
+ * once it returns. A path is passed as an input that includes its terminating null byte.
+ */
+struct SwitchlessArguments {
+  uint32_t call;
+  uint64_t arguments[SWITCHLESS_ARGUMENTS];
+  const void* inputs[SWITCHLESS_INPUTS];
+  size_t input_sizes[SWITCHLESS_INPUTS];
+  void* output;
+  size_t output_size;
+};
+
+/**
+ * A slot of the ring, aligned on a cache line so that callers and workers do not share lines
+ */
+struct alignas(64) SwitchlessRequest {
+  std::atomic<uint32_t> state;
+  SwitchlessArguments arguments;
+  int64_t result;
+};
+
+/**
+ * Requests shared by the untrusted callers and the enclave workers
+ */
+struct SwitchlessRing {
+  std::atomic<bool> running;
+  std::atomic<uint32_t> pending;
+  SwitchlessRequest requests[SWITCHLESS_RING_SIZE];
+};
+
+#ifndef FUSEGX_ENCLAVE
+
+#include <thread>
+#include <vector>
+
+/**
+ * Untrusted side of the switchless interface.
+ * Worker threads enter the enclave once and serve the requests posted in the ring until stop is
+ * called. Calls that are not picked up quickly enough, or that find the ring full, are left to the
+ * caller, which then falls back to a regular ECALL.
+ */
+class SwitchlessClient {
+  public:
+    /**
+     * Number of polls of a pending request before the caller takes it back
+     */
+    static const size_t FALLBACK_SPINS = 20000;
+
+    /**
+     * @param worker Function entering the enclave and serving the ring until it is stopped
+     */
+    explicit SwitchlessClient(void (*worker)(SwitchlessRing*));
+    ~SwitchlessClient();
+
+    /**
+     * Starts the enclave workers
+     * @param number_of_workers Number of threads to dedicate to the ring
+     */
+    void start(const size_t number_of_workers);
+
+    /**
+     * Stops the enclave workers and waits for them to leave the enclave
+     */
+    void stop();
+
+    /**
+     * @return true if workers are serving the ring
+     */
+    bool is_running() const;
+
+    /**
+     * Posts a call to the ring and waits for its completion
+     * @param arguments Arguments of the call
+     * @param result Receives the value returned by the call
+     * @return true if the call was served by a worker, false if the caller must issue the ECALL itself
+     */
+    bool call(const SwitchlessArguments &arguments, int64_t *result);
+
+  private:
+    void (*worker)(SwitchlessRing*);
+    SwitchlessRing* ring;
+    std::vector<std::thread>* workers;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,99 @@
+#include "thread_pool.hpp"
+
+#include <atomic>
+
+/**
+ * Tasks submitted together. Threads claim them by index until none is left.
+ */
+struct ThreadPool::Batch {
+  // Only dereferenced by a thread holding a claimed index, while the submitter waits for the batch
+  const std::vector<std::function<void()>>* tasks;
+  size_t count;
+  std::atomic<size_t> next;
+  std::atomic<size_t> completed;
+  std::mutex lock;
+  std::condition_variable done;
+};
+
+ThreadPool::ThreadPool(const size_t number_of_threads): running(true) {
+  this->resize(number_of_threads);
+}
+
+ThreadPool::~ThreadPool() {
+  this->stop();
+}
+
+void ThreadPool::stop() {
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->running = false;
+  }
+  this->pending.notify_all();
+  for (auto it = this->threads.begin(); it != this->threads.end(); it++) {
+    it->join();
+  }
+  this->threads.clear();
+}
+
+void ThreadPool::resize(const size_t number_of_threads) {
+  this->stop();
+  this->running = true;
+  for (size_t i = 0; i < number_of_threads; i++) {
+    this->threads.push_back(std::thread(&ThreadPool::work, this));
+  }
+}
+
+size_t ThreadPool::get_parallelism() const {
+  return this->threads.size() + 1;
+}
+
+void ThreadPool::run_tasks(Batch* batch) {
+  size_t index;
+  while ((index = batch->next.fetch_add(1)) < batch->count) {
+    (*batch->tasks)[index]();
+    if (batch->completed.fetch_add(1) + 1 == batch->count) {
+      std::lock_guard<std::mutex> guard(batch->lock);
+      batch->done.notify_all();
+    }
+  }
+}
+
+void ThreadPool::run(const std::vector<std::function<void()>> &tasks) {
+  if (tasks.empty()) {
+    return;
+  }
+  auto batch = std::make_shared<Batch>();
+  batch->tasks = &tasks;
+  batch->count = tasks.size();
+  batch->next = 0;
+  batch->completed = 0;
+  if (tasks.size() > 1 && !this->threads.empty()) {
+    {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->batches.push_back(batch);
+    }
+    this->pending.notify_all();
+  }
+  run_tasks(batch.get());
+  std::unique_lock<std::mutex> guard(batch->lock);
+  batch->done.wait(guard, [&] { return batch->completed.load() == tasks.size(); });
+}
+
+void ThreadPool::work() {
+  std::unique_lock<std::mutex> guard(this->lock);
+  while (true) {
+    this->pending.wait(guard, [this] { return !this->running || !this->batches.empty(); });
+    if (!this->running) {
+      return;
+    }
+    std::shared_ptr<Batch> batch = this->batches.front();
+    // A batch leaves the queue once all of its tasks are claimed
+    if (batch->next.load() >= batch->count) {
+      this->batches.pop_front();
+      continue;
+    }
+    guard.unlock();
+    run_tasks(batch.get());
+    guard.lock();
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef __THREAD_POOL_HPP__
+#define __THREAD_POOL_HPP__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of threads running batches of independent tasks.
+ * The thread submitting a batch takes part in running it, so a pool of n threads runs a batch on
+ * n + 1 threads, and batches submitted concurrently, or from a task, always make progress.
+ */
+class ThreadPool {
+  public:
+    /**
+     * @param number_of_threads Number of threads besides the callers, 0 runs every batch on its caller
+     */
+    explicit ThreadPool(const size_t number_of_threads = 0);
+    ~ThreadPool();
+
+    /**
+     * Replaces the threads of the pool, which must not be running a batch
+     */
+    void resize(const size_t number_of_threads);
+
+    /**
+     * @return The number of threads that can run a batch at the same time, including the caller
+     */
+    size_t get_parallelism() const;
+
+    /**
+     * Runs tasks on the pool and waits for all of them to complete
+     */
+    void run(const std::vector<std::function<void()>> &tasks);
+
+  private:
+    struct Batch;
+
+    static void run_tasks(Batch* batch);
+    void work();
+    void stop();
+
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable pending;
+    std::deque<std::shared_ptr<Batch>> batches;
+    bool running;
+};
+
+#endif